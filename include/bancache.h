@@ -21,7 +21,7 @@
 #pragma once
 
 /** Stores a cached ban entry.
- * Each ban has one of these hashed in a hash_map to make for faster removal
+ * Each ban has one of these stored in the ban cache to make for faster removal
  * of already-banned users in the case that they try to reconnect. As no wildcard
  * matching is done on these IPs, the speed of the system is improved. These cache
  * entries expire every few hours, which is a reasonable expiry for any reasonable
@@ -40,6 +40,10 @@ class CoreExport BanCacheHit
 	 */
 	time_t Expiry;
 
+	BanCacheHit() : Expiry(0)
+	{
+	}
+
 	BanCacheHit(const std::string &type, const std::string &reason, time_t seconds)
 		: Type(type), Reason(reason), Expiry(ServerInstance->Time() + seconds)
 	{
@@ -48,28 +52,91 @@ class CoreExport BanCacheHit
 	bool IsPositive() const { return (!Reason.empty()); }
 };
 
-/* A container of ban cache items.
- * must be defined after class BanCacheHit.
- */
-typedef TR1NS::unordered_map<std::string, BanCacheHit*, TR1NS::hash<std::string> > BanCacheHash;
-
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
+ * Entries are kept in a pool and found through an open addressed hash table keyed
+ * on the binary address. The number of entries is limited by <performance:bancachesize>,
+ * the least recently used entry is dropped when the cache is full. Negative hits may
+ * cover a whole CIDR range as configured by <cidr:ipv4bancache> and <cidr:ipv6bancache>
+ * if no Z-line could apply to any address in the range.
  */
 class CoreExport BanCacheManager
 {
-	BanCacheHash* BanHash;
-	bool RemoveIfExpired(BanCacheHash::iterator& it);
+	static const unsigned int NONE = UINT_MAX;
+	static const unsigned int DELETED = UINT_MAX - 1;
+
+	struct Entry
+	{
+		/** The address or range this entry is for */
+		irc::sockets::cidr_mask key;
+		BanCacheHit hit;
+		/** Slot in the hash table refering to this entry, NONE if the entry is free */
+		unsigned int slot;
+		/** Neighbours in the LRU list, the next free entry if the entry is free */
+		unsigned int prev, next;
+		/** Position in the expiry heap */
+		unsigned int heappos;
+
+		Entry() : slot(NONE), prev(NONE), next(NONE), heappos(0)
+		{
+			key.type = 0;
+			key.length = 0;
+			memset(key.bits, 0, sizeof(key.bits));
+		}
+	};
+
+	/** Entry pool, grows up to the configured maximum size */
+	std::vector<Entry> entries;
+	/** Hash table of entry indexes, NONE for never used and DELETED for removed slots */
+	std::vector<unsigned int> slots;
+	/** Entry indexes ordered by expiry time as a binary heap */
+	std::vector<unsigned int> expiry;
+
+	unsigned int freelist;
+	unsigned int lruhead;
+	unsigned int lrutail;
+	unsigned int used;
+	unsigned int deleted;
+
+	unsigned int FindSlot(const irc::sockets::cidr_mask& key) const;
+	void Rehash(size_t size);
+	unsigned int Insert(const irc::sockets::cidr_mask& key);
+	void Remove(unsigned int index);
+	void Touch(unsigned int index);
+	void LinkFront(unsigned int index);
+	void Unlink(unsigned int index);
+	void HeapSwap(unsigned int a, unsigned int b);
+	void HeapUp(unsigned int pos);
+	void HeapDown(unsigned int pos);
+	void HeapRemove(unsigned int pos);
+	void RemoveExpired();
+	bool RangeHasZLine(const irc::sockets::cidr_mask& range);
 
  public:
+	/** Number of lookups which found an entry */
+	unsigned long Hits;
+	/** Number of lookups which found nothing */
+	unsigned long Misses;
+	/** Number of hits which were answered by a negative entry for a CIDR range */
+	unsigned long RangeHits;
+	/** Number of entries dropped to make room for new ones */
+	unsigned long Evictions;
 
 	/** Creates and adds a Ban Cache item.
-	 * @param ip The IP the item is for.
+	 * @param addr The address the item is for.
 	 * @param type The type of ban cache item. std::string. .empty() means it's a negative match (user is allowed freely).
 	 * @param reason The reason for the ban. Left .empty() if it's a negative match.
 	 * @param seconds Number of seconds before nuking the bancache entry, the default is a day. This might seem long, but entries will be removed as glines/etc expire.
+	 * @return The new item, or NULL if there already is an item for the address.
+	 * The item is only valid until the next call to a method of the BanCacheManager.
+	 */
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs& addr, const std::string &type, const std::string &reason, time_t seconds = 0);
+
+	/** Looks up the item for an address.
+	 * @param addr The address to look up.
+	 * @return The item for the address or the range containing it, or NULL if there is none.
+	 * The item is only valid until the next call to a method of the BanCacheManager.
 	 */
-	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds = 0);
-	BanCacheHit *GetHit(const std::string &ip);
+	BanCacheHit *GetHit(const irc::sockets::sockaddrs& addr);
 
 	/** Removes all entries of a given type, either positive or negative. Returns the number of hits removed.
 	 * @param type The type of bancache entries to remove (e.g. 'G')
@@ -77,9 +144,8 @@ class CoreExport BanCacheManager
 	 */
 	void RemoveEntries(const std::string& type, bool positive);
 
-	BanCacheManager()
-	{
-		this->BanHash = new BanCacheHash();
-	}
-	~BanCacheManager();
+	/** Get the number of entries in the cache */
+	size_t size() const { return used; }
+
+	BanCacheManager();
 };
@@ -138,6 +138,7 @@ class ModeUserInvisible : public SimpleUserModeHandler
 	ModeUserInvisible() : SimpleUserModeHandler(NULL, "invisible", 'i')
 	{
 	}
+	ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string &parameter, bool adding);
 };
 
 /** User mode +s
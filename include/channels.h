@@ -25,6 +25,8 @@
 #include "membership.h"
 #include "mode.h"
 
+class NamesCache;
+
 /** Holds an entry for a ban list, exemption list, or invite list.
  * This class contains a single element in a channel list, such as a banlist.
  */
@@ -61,6 +63,10 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void DelUser(const UserMembIter& membiter);
 
+	/** Cached NAMES lists of the channel, NULL until the first NAMES list is sent
+	 */
+	NamesCache* namescache;
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -69,6 +75,14 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	Channel(const std::string &name, time_t ts);
 
+	/** Destroys the channel record and its cached NAMES lists
+	 */
+	~Channel();
+
+	/** Objects of this class are allocated from a SlabAllocator */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	/** Checks whether the channel should be destroyed, and if yes, begins
 	 * the teardown procedure.
 	 *
@@ -169,6 +183,14 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void DelUser(User* user);
 
+	/** Delete several users from the channel at once, used when many users quit together.
+	 * The cached NAMES lists are dropped instead of being updated for each user and the
+	 * channel is destroyed if it becomes empty.
+	 * This function does not remove the channel from User::chans.
+	 * @param users The users to delete, users who are not on the channel are ignored
+	 */
+	void DelUsers(const std::vector<User*>& users);
+
 	/** Obtain the internal reference list
 	 * The internal reference list contains a list of User*.
 	 * These are used for rapid comparison to determine
@@ -222,6 +244,16 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void ForceJoin(User* user, const std::string* privs = NULL, bool bursting = false, bool created_by_local = false);
 
+	/** Join several users to an existing channel at once, without doing any permission checks, used when
+	 * a server sends many joins together. Everyone is added first, the cached NAMES lists are dropped
+	 * once instead of being updated for each user and the JOIN of each user is only sent to the local members.
+	 * Modules see the joins one by one as with ForceJoin(). Server users are ignored and local users
+	 * are joined with ForceJoin() after the remote ones.
+	 * @param users The users to join, users who are already on the channel are ignored
+	 * @param bursting True if these joins are the result of a netburst (passed to modules in the OnUserJoin hook)
+	 */
+	void ForceJoinUsers(const std::vector<User*>& users, bool bursting);
+
 	/** Write to a channel, from a user, using va_args for text
 	 * @param user User whos details to prefix the line with
 	 * @param text A printf-style format string which builds the output line without prefix
@@ -304,6 +336,12 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void UserList(User *user);
 
+	/** Update the cached NAMES lists after the entry of a user changed. Must be called
+	 * when a user joins or leaves, or when anything shown in their entry changes.
+	 * @param user The user whose entry changed
+	 */
+	void UpdateNamesCache(User* user);
+
 	/** Get a users prefix on this channel in a string.
 	 * @param user The user to look up
 	 * @return A character array containing the prefix string.
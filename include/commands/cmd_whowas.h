@@ -32,11 +32,11 @@ typedef std::deque<WhoWasGroup*> whowas_set;
 
 /** Sets of users in the whowas system
  */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+typedef std::map<std::string, whowas_set*, irc::insensitive_swo> whowas_users;
 
 /** Sets of time and users in whowas list
  */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+typedef std::deque<std::pair<time_t, std::string> > whowas_users_fifo;
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
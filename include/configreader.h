@@ -282,6 +282,20 @@ class CoreExport ServerConfig
 	 */
 	int c_ipv6_range;
 
+	/** CIDR range for ipv4 (0-32) covered by a negative ban cache entry
+	 * Defaults to 32 (caches every IP seperately)
+	 */
+	int c_ipv4_bancache_range;
+
+	/** CIDR range for ipv6 (0-128) covered by a negative ban cache entry
+	 * Defaults to 128 (caches every IP seperately)
+	 */
+	int c_ipv6_bancache_range;
+
+	/** Maximum number of entries in the ban cache
+	 */
+	unsigned int BanCacheSize;
+
 	/** Holds the server name of the local server
 	 * as defined by the administrator.
 	 */
@@ -399,6 +413,11 @@ class CoreExport ServerConfig
 	 */
 	int NetBufferSize;
 
+	/** The number of threads reading and writing
+	 * client connections, 0 to do it on the main thread.
+	 */
+	unsigned int IOThreadCount;
+
 	/** The value to be used for listen() backlogs
 	 * as default.
 	 */
@@ -125,6 +125,10 @@ class CoreExport CommandBase : public ServiceProvider
 	 */
 	unsigned long use_count;
 
+	/** Time taken to process the command for local users including module hooks, used by /stats M
+	 */
+	LatencyHistogram latency;
+
 	/** True if the command is disabled to non-opers
 	 */
 	bool disabled;
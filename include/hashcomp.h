@@ -30,6 +30,9 @@
 #include <deque>
 #include <map>
 #include <set>
+#if __cplusplus >= 201103L
+# include <unordered_map>
+#endif
 #include "inspircd.h"
 
 /*******************************************************
@@ -119,6 +122,21 @@ namespace irc
 		bool CoreExport operator()(const std::string& a, const std::string& b) const;
 	};
 
+	/** A case insensitive hash map with string keys, the type of the nick, channel and server maps.
+	 * The C++11 unordered_map keeps the hash of every key in its node when the hash function may
+	 * throw, so lookups only compare the keys which have the same hash and growing the map does not
+	 * fold the keys again. The TR1 one is only used when the compiler does not support C++11.
+	 */
+	template<typename T>
+	struct insensitive_map
+	{
+#if __cplusplus >= 201103L
+		typedef std::unordered_map<std::string, T, insensitive, StrHashComp> type;
+#else
+		typedef TR1NS::unordered_map<std::string, T, insensitive, StrHashComp> type;
+#endif
+	};
+
 	/** The irc_char_traits class is used for RFC-style comparison of strings.
 	 * This class is used to implement irc::string, a case-insensitive, RFC-
 	 * comparing string class.
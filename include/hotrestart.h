@@ -0,0 +1,57 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Restarts the server without dropping client connections.
+ *
+ * The running process writes its local users, channels, memberships, modes, X-lines
+ * and extension data to an unlinked temporary file, then execs the binary again.
+ * The descriptors of the listeners, the clients and the state file are left open
+ * across the exec so the new process inherits them. The new process takes over the
+ * listeners when binding its ports and rebuilds the state once its modules are loaded.
+ *
+ * Clients using an IOHook (such as SSL) can't be handed over and are disconnected by
+ * the exec, as are unregistered clients and server links. The other clients are sent
+ * the quits of the clients who are left behind. Remote users are not part of the state,
+ * they come back when the links are reestablished. Nothing is changed before the exec,
+ * so if it fails the server carries on as before.
+ */
+class CoreExport HotRestart
+{
+ public:
+	/** Hand the state over to a new process
+	 * @return Only returns if the new process could not be started, with the reason
+	 */
+	static std::string Restart();
+
+	/** Read the state passed by the previous process, if any. Called during startup
+	 * before the ports are bound.
+	 */
+	static void Load();
+
+	/** Take over an inherited listener
+	 * @param bind_desc Description of the address to bind to, as in ListenSocket::bind_desc
+	 * @return The descriptor of the listener, or -1 if there is no such inherited listener
+	 */
+	static int TakeListener(const std::string& bind_desc);
+
+	/** Rebuild the state read by Load(). Called during startup once all modules are loaded.
+	 */
+	static void Resume();
+};
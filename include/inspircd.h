@@ -57,7 +57,9 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "fileutils.h"
 #include "numerics.h"
 #include "uid.h"
+#include "intrusive_list.h"
 #include "server.h"
+#include "latency.h"
 #include "users.h"
 #include "channels.h"
 #include "timer.h"
@@ -73,6 +75,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "filelogger.h"
 #include "modules.h"
 #include "threadengine.h"
+#include "iothread.h"
 #include "configreader.h"
 #include "inspstring.h"
 #include "protocol.h"
@@ -195,6 +198,32 @@ class serverstats
 	/** Total bytes of data received
 	 */
 	unsigned long statsRecv;
+
+	/** Phases of the main loop which are timed separately
+	 */
+	enum LoopPhase
+	{
+		LOOP_TIMERS,
+		LOOP_BACKGROUND,
+		LOOP_WRITES,
+		LOOP_DISPATCH,
+		LOOP_CULLS,
+		LOOP_ACTIONS,
+		LOOP_PHASES
+	};
+	/** Time spent in each phase of the main loop, dispatching does not include waiting for events
+	 */
+	LatencyHistogram LoopPhases[LOOP_PHASES];
+	/** Time each iteration of the main loop was busy rather than waiting for events
+	 */
+	LatencyHistogram LoopBusy;
+	/** Longest busy time of an iteration during the last complete second, the most an event had
+	 * to wait before it was noticed
+	 */
+	unsigned long LoopLag;
+	/** Longest busy time of an iteration during the current second
+	 */
+	unsigned long LoopLagCurrent;
 #ifdef _WIN32
 	/** Cpu usage at last sample
 	*/
@@ -217,9 +246,17 @@ class serverstats
 	 */
 	serverstats()
 		: statsAccept(0), statsRefused(0), statsUnknown(0), statsCollisions(0), statsDns(0),
-		statsDnsGood(0), statsDnsBad(0), statsConnects(0), statsSent(0), statsRecv(0)
+		statsDnsGood(0), statsDnsBad(0), statsConnects(0), statsSent(0), statsRecv(0), LoopLag(0), LoopLagCurrent(0)
 	{
 	}
+
+	/** Get the name of a phase of the main loop as shown in /STATS J
+	 */
+	static const char* GetLoopPhaseName(unsigned int phase)
+	{
+		static const char* const names[LOOP_PHASES] = { "timers", "background", "writes", "dispatch", "culls", "actions" };
+		return names[phase];
+	}
 };
 
 /** This class manages the generation and transmission of ISUPPORT. */
@@ -341,6 +378,10 @@ class CoreExport InspIRCd
 	 */
 	ThreadEngine* Threads;
 
+	/** I/O threads, read and write client connections when enabled
+	 */
+	IOThreadManager IOThreads;
+
 	/** The thread/class used to read config files in REHASH and on startup
 	 */
 	ConfigReaderThread* ConfigThread;
@@ -26,6 +26,7 @@
 #include "timer.h"
 
 class IOHook;
+class IOThread;
 
 /**
  * States which a socket may be in
@@ -113,11 +114,20 @@ class CoreExport StreamSocket : public EventHandler
 	size_t sendq_len;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+
+	/** The I/O thread reading and writing this socket, or NULL if the socket engine handles it */
+	IOThread* iothread;
+
+	/** Identifier of this socket in the IOThreadManager */
+	unsigned long iothreadid;
+
+	friend class IOThreadManager;
  protected:
 	std::string recvq;
  public:
-	StreamSocket() : iohook(NULL), sendq_len(0) {}
+	StreamSocket() : iohook(NULL), sendq_len(0), iothread(NULL), iothreadid(0) {}
 	IOHook* GetIOHook() const;
+	IOThread* GetIOThread() const { return iothread; }
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
 	/** Handle event from socket engine.
@@ -137,6 +147,8 @@ class CoreExport StreamSocket : public EventHandler
 
 	/** Called when new data is present in recvq */
 	virtual void OnDataReady() = 0;
+	/** Called when some of the sendq was sent */
+	virtual void OnDataSent() { }
 	/** Called when the socket gets an error from socket engine or IO hook */
 	virtual void OnError(BufferedSocketError e) = 0;
 
@@ -152,6 +164,12 @@ class CoreExport StreamSocket : public EventHandler
 	/** Useful for implementing sendq exceeded */
 	inline size_t getSendQSize() const { return sendq_len; }
 
+	/** Get the data waiting to be sent, used when handing the socket over to a new process */
+	const std::deque<std::string>& GetSendQ() const { return sendq; }
+
+	/** Get the data received but not processed yet */
+	std::string& GetRecvQ() { return recvq; }
+
 	/**
 	 * Close the socket, remove from socket engine, etc
 	 */
@@ -232,5 +250,4 @@ class CoreExport BufferedSocket : public StreamSocket
 };
 
 inline IOHook* StreamSocket::GetIOHook() const { return iohook; }
-inline void StreamSocket::AddIOHook(IOHook* hook) { iohook = hook; }
 inline void StreamSocket::DelIOHook() { iohook = NULL; }
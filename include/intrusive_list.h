@@ -0,0 +1,111 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+template <typename T> class intrusive_list;
+
+/** The links of an object in an intrusive_list, classes which can be put in
+ * an intrusive_list<T> derive from intrusive_list_node<T>.
+ * An object can be in at most one list of a given type at a time.
+ */
+template <typename T>
+class intrusive_list_node
+{
+	T* ilist_prev;
+	T* ilist_next;
+
+	friend class intrusive_list<T>;
+
+ public:
+	intrusive_list_node() : ilist_prev(NULL), ilist_next(NULL) { }
+};
+
+/** A doubly linked list whose elements carry their own links. Adding and removing
+ * an element never allocates and removing it needs no search, so an element can
+ * take itself off the list in constant time.
+ * Erasing the element an iterator points to invalidates that iterator only.
+ */
+template <typename T>
+class intrusive_list
+{
+	T* head;
+	size_t listsize;
+
+	static intrusive_list_node<T>* node(T* x) { return static_cast<intrusive_list_node<T>*>(x); }
+
+ public:
+	class iterator
+	{
+		T* curr;
+
+	 public:
+		iterator(T* x = NULL) : curr(x) { }
+
+		iterator& operator++()
+		{
+			curr = node(curr)->ilist_next;
+			return *this;
+		}
+
+		iterator operator++(int)
+		{
+			iterator ret(*this);
+			operator++();
+			return ret;
+		}
+
+		bool operator==(const iterator& other) const { return curr == other.curr; }
+		bool operator!=(const iterator& other) const { return curr != other.curr; }
+		T* operator*() const { return curr; }
+	};
+
+	typedef iterator const_iterator;
+
+	intrusive_list() : head(NULL), listsize(0) { }
+
+	iterator begin() const { return iterator(head); }
+	iterator end() const { return iterator(); }
+	size_t size() const { return listsize; }
+	bool empty() const { return (head == NULL); }
+
+	/** Add an element to the front of the list, it must not be in a list of this type already */
+	void push_front(T* x)
+	{
+		node(x)->ilist_prev = NULL;
+		node(x)->ilist_next = head;
+		if (head)
+			node(head)->ilist_prev = x;
+		head = x;
+		listsize++;
+	}
+
+	/** Remove an element from the list, it must be in this list */
+	void erase(T* x)
+	{
+		intrusive_list_node<T>* n = node(x);
+		if (n->ilist_prev)
+			node(n->ilist_prev)->ilist_next = n->ilist_next;
+		else
+			head = n->ilist_next;
+		if (n->ilist_next)
+			node(n->ilist_next)->ilist_prev = n->ilist_prev;
+		n->ilist_prev = n->ilist_next = NULL;
+		listsize--;
+	}
+};
@@ -27,7 +27,8 @@ class IOHook : public ServiceProvider
 	enum Type
 	{
 		IOH_UNKNOWN,
-		IOH_SSL
+		IOH_SSL,
+		IOH_COMPRESS
 	};
 
 	const Type type;
@@ -0,0 +1,102 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+class IOThread;
+class StreamSocket;
+
+/** Moves the reading, line splitting and writing of client connections off the main thread.
+ *
+ * When <performance:iothreads> is set, client connections without an IOHook are spread over
+ * that many I/O threads instead of being added to the socket engine. Each thread polls its own
+ * sockets, receives data and splits it into lines, which are passed to the main thread in
+ * batches. Data written to a socket is queued on the main thread and handed to the I/O thread
+ * when the main loop is about to wait for events, the I/O thread then sends it and reports how
+ * much was sent so the sendq size seen by the main thread stays accurate.
+ *
+ * Commands are still processed on the main thread, only the socket I/O is threaded.
+ */
+class CoreExport IOThreadManager
+{
+	/** The running I/O threads, empty if they are disabled */
+	std::vector<IOThread*> threads;
+
+	/** Sockets handled by the I/O threads, by their identifier */
+	std::map<unsigned long, StreamSocket*> sockets;
+
+	/** Threads which were stopped, they are deleted by the next Flush() as Stop() may be
+	 * called while one of them is notifying the main thread
+	 */
+	std::vector<IOThread*> stopped;
+
+	/** Identifier given to the next socket */
+	unsigned long nextid;
+
+	/** Index of the thread which gets the next socket */
+	size_t nextthread;
+
+	/** Take the state of a socket back from its thread after it stopped handling it
+	 * and give the socket to the socket engine
+	 * @param sock The socket
+	 * @param sendq Data the thread did not send yet
+	 * @param recvq Data received by the thread which was not processed yet
+	 * @param error The error reported by the thread, if any
+	 */
+	void Reclaim(StreamSocket* sock, std::deque<std::string>& sendq, const std::string& recvq, const std::string& error);
+
+ public:
+	IOThreadManager();
+
+	/** Start the number of threads set in the configuration, does nothing if they are running */
+	void Start();
+
+	/** Stop the threads, the sockets they handle are moved to the socket engine */
+	void Stop();
+
+	/** Check whether the I/O threads are running */
+	bool IsEnabled() const { return !threads.empty(); }
+
+	/** Hand a connected socket to one of the threads instead of the socket engine
+	 * @param sock The socket, must not have an IOHook
+	 * @return True if the socket was added
+	 */
+	bool Add(StreamSocket* sock);
+
+	/** Queue data to be sent on a socket handled by a thread
+	 * @param sock The socket
+	 * @param data The data to send
+	 */
+	void Write(StreamSocket* sock, const std::string& data);
+
+	/** Close a socket handled by a thread, data queued for it is sent first if possible */
+	void Remove(StreamSocket* sock);
+
+	/** Move a socket from its thread to the socket engine, for example because an IOHook
+	 * is added to it. Waits until the thread has let go of the socket.
+	 */
+	void Detach(StreamSocket* sock);
+
+	/** Pass the data written since the last call to the threads, called by the main loop
+	 * before waiting for events. Also frees the threads stopped by Stop().
+	 */
+	void Flush();
+
+	/** Process the data and errors reported by a thread, called on the main thread */
+	void Process(IOThread* thread);
+};
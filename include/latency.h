@@ -0,0 +1,108 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Counts how long something took in buckets of logarithmic size, like a HDR histogram.
+ * Every power of two is split into SUB_BUCKETS buckets, so a value is known to within
+ * 1/SUB_BUCKETS of itself. Values are in microseconds and up to a bit over an hour,
+ * longer durations are counted in the last bucket.
+ *
+ * The buckets are only allocated once the first value is recorded, histograms of
+ * things which never happen cost almost nothing.
+ */
+class CoreExport LatencyHistogram
+{
+ public:
+	/** Number of bits of a value which select the bucket within its power of two */
+	static const unsigned int SUB_BUCKET_BITS = 3;
+
+	/** Number of buckets for every power of two */
+	static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+	/** Largest value which has its own bucket */
+	static const unsigned long MAX_VALUE = 0xFFFFFFFFUL;
+
+	/** Total number of buckets */
+	static const unsigned int BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+ private:
+	/** Number of values in each bucket, NULL until a value is recorded */
+	unsigned long* counts;
+
+	/** Number of values recorded */
+	unsigned long count;
+
+	/** Sum of the values recorded */
+	unsigned long long total;
+
+	/** Largest value recorded */
+	unsigned long max;
+
+	/** Get the bucket a value is counted in */
+	static unsigned int GetBucket(unsigned long value);
+
+	/** Get the largest value counted in a bucket */
+	static unsigned long GetBucketLimit(unsigned int bucket);
+
+ public:
+	LatencyHistogram();
+	~LatencyHistogram();
+
+	/** Record a value
+	 * @param value The duration in microseconds
+	 */
+	void Record(unsigned long value);
+
+	/** Forget all recorded values */
+	void Reset();
+
+	/** Get the number of values recorded */
+	unsigned long GetCount() const { return count; }
+
+	/** Get the sum of all values recorded, in microseconds */
+	unsigned long long GetTotal() const { return total; }
+
+	/** Get the largest value recorded, in microseconds */
+	unsigned long GetMax() const { return max; }
+
+	/** Get the average of the values recorded, in microseconds */
+	unsigned long GetMean() const { return count ? total / count : 0; }
+
+	/** Get the value below which the given percentage of the recorded values are
+	 * @param percent The percentage, from 0 to 100
+	 * @return The upper bound of the bucket the value is in, in microseconds
+	 */
+	unsigned long GetPercentile(double percent) const;
+
+	/** Get the number of recorded values which are not larger than a given value.
+	 * The result is exact when limit + 1 is a power of two.
+	 * @param limit The value in microseconds
+	 */
+	unsigned long GetCountUpTo(unsigned long limit) const;
+
+	/** Format the count, mean, percentiles and maximum for /STATS output */
+	std::string ToString() const;
+
+	/** Get a monotonic timestamp in microseconds to measure durations with */
+	static unsigned long long GetTimestamp();
+
+ private:
+	LatencyHistogram(const LatencyHistogram&);
+	LatencyHistogram& operator=(const LatencyHistogram&);
+};
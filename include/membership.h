@@ -27,6 +27,11 @@ class CoreExport Membership : public Extensible
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
 	Membership(User* u, Channel* c) : user(u), chan(c) {}
+
+	/** Objects of this class are allocated from a SlabAllocator */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
@@ -67,4 +72,8 @@ class CoreExport Invitation : public classbase
 	~Invitation();
 	static void Create(Channel* c, LocalUser* u, time_t timeout);
 	static Invitation* Find(Channel* c, LocalUser* u, bool check_expired = true);
+
+	/** Objects of this class are allocated from a SlabAllocator */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
 };
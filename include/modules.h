@@ -266,6 +266,7 @@ enum Implementation
 	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnRunTestSuite, I_OnNamesListItem, I_OnNumeric, I_OnHookIO,
 	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnSetUserIP,
+	I_OnNamesListVariant,
 	I_END
 };
 
@@ -1051,6 +1052,19 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick);
 
+	/** Called before a NAMES list is sent to pick the cached NAMES list the user is sent.
+	 * Users with the same variant are sent the same list. A module whose OnNamesListItem depends on a
+	 * property of the issuer (e.g. a capability) appends a character for that property to the variant.
+	 * A module whose OnNamesListItem depends on the issuer and the member together must return
+	 * MOD_RES_DENY, the list is then built for this user only. Modules which implement OnNamesListItem
+	 * but not this event disable the cache.
+	 * @param issuer The user the NAMES list is sent to
+	 * @param chan The channel
+	 * @param variant The variant, modules may append to it
+	 * @return MOD_RES_DENY to build the list without the cache, MOD_RES_PASSTHRU otherwise
+	 */
+	virtual ModResult OnNamesListVariant(User* issuer, Channel* chan, std::string& variant);
+
 	virtual ModResult OnNumeric(User* user, unsigned int numeric, const std::string &text);
 
 	/** Called whenever a result from /WHO is about to be returned
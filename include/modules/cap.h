@@ -38,12 +38,51 @@ class CapEvent : public Event
 	CapEvent(Module* sender, User* u, CapEventType capevtype) : Event(sender, "cap_request"), type(capevtype), user(u) {}
 };
 
+/** Stores whether local users have enabled a capability, in a bit of LocalUser::caps
+ * which is reserved for the capability while it exists
+ */
+class CapBit
+{
+	const unsigned int bit;
+
+ public:
+	CapBit() : bit(ServerInstance->Users->AllocateCapBit())
+	{
+	}
+
+	~CapBit()
+	{
+		ServerInstance->Users->FreeCapBit(bit);
+	}
+
+	/** Get the index of the bit in LocalUser::caps */
+	unsigned int GetBit() const { return bit; }
+
+	bool get(LocalUser* user) const
+	{
+		return user->caps[bit];
+	}
+
+	bool get(User* user) const
+	{
+		LocalUser* localuser = IS_LOCAL(user);
+		return ((localuser) && (localuser->caps[bit]));
+	}
+
+	void set(User* user, bool value)
+	{
+		LocalUser* localuser = IS_LOCAL(user);
+		if (localuser)
+			localuser->caps.set(bit, value);
+	}
+};
+
 class GenericCap
 {
  public:
-	LocalIntExt ext;
+	CapBit ext;
 	const std::string cap;
-	GenericCap(Module* parent, const std::string &Cap) : ext("cap_" + Cap, parent), cap(Cap)
+	GenericCap(Module* parent, const std::string &Cap) : cap(Cap)
 	{
 	}
 
@@ -65,7 +104,7 @@ class GenericCap
 					// we can handle this, so ACK it, and remove it from the wanted list
 					data->ack.push_back(*it);
 					data->wanted.erase(it);
-					ext.set(data->user, enablecap ? 1 : 0);
+					ext.set(data->user, enablecap);
 					break;
 				}
 			}
@@ -82,7 +121,7 @@ class GenericCap
 		else if (data->type == CapEvent::CAPEVENT_CLEAR)
 		{
 			data->ack.push_back("-" + cap);
-			ext.set(data->user, 0);
+			ext.set(data->user, false);
 		}
 	}
 };
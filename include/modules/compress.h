@@ -0,0 +1,101 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+#include "iohook.h"
+
+/** Traffic counters of a compressed stream, as returned by CompressIOHook::GetStats()
+ */
+struct CompressStats
+{
+	/** True if outgoing data is being compressed */
+	bool compressing;
+	/** True if incoming data is being decompressed */
+	bool decompressing;
+	/** Bytes handed to the compressor */
+	unsigned long long plain_out;
+	/** Bytes produced by the compressor */
+	unsigned long long compressed_out;
+	/** Bytes produced by the decompressor */
+	unsigned long long plain_in;
+	/** Bytes handed to the decompressor */
+	unsigned long long compressed_in;
+	/** CPU time spent compressing and decompressing, in microseconds */
+	unsigned long long cpu_usec;
+
+	CompressStats()
+		: compressing(false), decompressing(false), plain_out(0), compressed_out(0), plain_in(0), compressed_in(0), cpu_usec(0)
+	{
+	}
+
+	/** Get the ratio of compressed to uncompressed outgoing bytes
+	 * @return The outgoing compression ratio, 1.0 if nothing was compressed yet
+	 */
+	double GetOutRatio() const
+	{
+		return (plain_out ? (double)compressed_out / plain_out : 1.0);
+	}
+
+	/** Get the ratio of compressed to uncompressed incoming bytes
+	 * @return The incoming compression ratio, 1.0 if nothing was decompressed yet
+	 */
+	double GetInRatio() const
+	{
+		return (plain_in ? (double)compressed_in / plain_in : 1.0);
+	}
+};
+
+/** An IOHook which transparently compresses a stream once both ends agreed on it.
+ * Sockets using such a hook start out in plaintext mode, the owner of the socket
+ * is responsible for negotiating compression and then switching each direction
+ * on at a well defined point in the stream.
+ */
+class CompressIOHook : public IOHook
+{
+ public:
+	/** Name of the compression algorithm, sent to the remote end during negotiation */
+	const std::string algorithm;
+
+	CompressIOHook(Module* mod, const std::string& Name, const std::string& algo)
+		: IOHook(mod, Name, IOHook::IOH_COMPRESS), algorithm(algo)
+	{
+	}
+
+	/** Start compressing outgoing data. Everything that is queued on the socket when this
+	 * is called is still sent uncompressed, everything queued afterwards is compressed.
+	 * @param sock The socket to compress, must be using this IOHook
+	 * @return True if compression was enabled, false on error
+	 */
+	virtual bool StartCompress(StreamSocket* sock) = 0;
+
+	/** Start decompressing incoming data.
+	 * @param sock The socket to decompress, must be using this IOHook
+	 * @param recvq Data already read from the socket that follows the switch point,
+	 * it is decompressed in place
+	 * @return True if decompression was enabled, false if the data is invalid
+	 */
+	virtual bool StartDecompress(StreamSocket* sock, std::string& recvq) = 0;
+
+	/** Get the traffic counters of a socket
+	 * @param sock The socket to get the counters for, must be using this IOHook
+	 * @param stats Filled with the counters of the socket
+	 */
+	virtual void GetStats(StreamSocket* sock, CompressStats& stats) = 0;
+};
@@ -21,14 +21,77 @@
 
 #include "modules.h"
 
+/** The state of a hash which is computed incrementally, created by HashProvider::init()
+ */
+class HashContext
+{
+ public:
+	virtual ~HashContext() { }
+
+	/** Add data to the hash
+	 * @param data The data to add
+	 * @param len The length of the data
+	 */
+	virtual void update(const void* data, size_t len) = 0;
+
+	/** Finish the hash, the context can not be updated afterwards
+	 * @param out Buffer of at least out_size bytes which receives the binary hash
+	 */
+	virtual void final(unsigned char* out) = 0;
+};
+
 class HashProvider : public DataProvider
 {
+	/** Context used by providers which can not hash incrementally, collects the data for rawsum() */
+	class BufferedContext : public HashContext
+	{
+		HashProvider* const prov;
+		std::string data;
+
+	 public:
+		BufferedContext(HashProvider* provider) : prov(provider) { }
+		void update(const void* buf, size_t len) { data.append(static_cast<const char*>(buf), len); }
+		void final(unsigned char* out) { prov->rawsum(data.data(), data.length(), out); }
+	};
+
  public:
 	const unsigned int out_size;
 	const unsigned int block_size;
 	HashProvider(Module* mod, const std::string& Name, int osiz, int bsiz)
 		: DataProvider(mod, Name), out_size(osiz), block_size(bsiz) {}
 	virtual std::string sum(const std::string& data) = 0;
+
+	/** Hash a buffer without allocating, for callers which hash many small inputs
+	 * @param data The data to hash
+	 * @param len The length of the data
+	 * @param out Buffer of at least out_size bytes which receives the binary hash
+	 */
+	virtual void rawsum(const void* data, size_t len, unsigned char* out)
+	{
+		std::string res = sum(std::string(static_cast<const char*>(data), len));
+		memcpy(out, res.data(), out_size);
+	}
+
+	/** Start hashing data which is not available at once
+	 * @return A new context which must be deleted by the caller after calling final() on it
+	 */
+	virtual HashContext* init()
+	{
+		return new BufferedContext(this);
+	}
+
+	/** Hash several independent messages at once, providers may process them in parallel
+	 * @param count The number of messages
+	 * @param data The messages
+	 * @param lens The lengths of the messages
+	 * @param out Buffer of count * out_size bytes which receives the binary hashes in order
+	 */
+	virtual void batchsum(size_t count, const void* const* data, const size_t* lens, unsigned char* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			rawsum(data[i], lens[i], out + i * out_size);
+	}
+
 	inline std::string hexsum(const std::string& data)
 	{
 		return BinToHex(sum(data));
@@ -42,17 +105,27 @@ class HashProvider : public DataProvider
 	/** HMAC algorithm, RFC 2104 */
 	std::string hmac(const std::string& key, const std::string& msg)
 	{
-		std::string hmac1, hmac2;
 		std::string kbuf = key.length() > block_size ? sum(key) : key;
 		kbuf.resize(block_size);
 
+		std::string pad(block_size, '\0');
+		std::string inner(out_size, '\0');
+		for (size_t n = 0; n < block_size; n++)
+			pad[n] = static_cast<char>(kbuf[n] ^ 0x36);
+		HashContext* ctx = init();
+		ctx->update(pad.data(), block_size);
+		ctx->update(msg.data(), msg.length());
+		ctx->final(reinterpret_cast<unsigned char*>(&inner[0]));
+		delete ctx;
+
+		std::string outer(out_size, '\0');
 		for (size_t n = 0; n < block_size; n++)
-		{
-			hmac1.push_back(static_cast<char>(kbuf[n] ^ 0x5C));
-			hmac2.push_back(static_cast<char>(kbuf[n] ^ 0x36));
-		}
-		hmac2.append(msg);
-		hmac1.append(sum(hmac2));
-		return sum(hmac1);
+			pad[n] = static_cast<char>(kbuf[n] ^ 0x5C);
+		ctx = init();
+		ctx->update(pad.data(), block_size);
+		ctx->update(inner.data(), out_size);
+		ctx->final(reinterpret_cast<unsigned char*>(&outer[0]));
+		delete ctx;
+		return outer;
 	}
 };
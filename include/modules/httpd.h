@@ -177,6 +177,29 @@ class HTTPRequest : public Event
 	}
 };
 
+/** Generates the body of a HTTP response a part at a time.
+ * Large documents should be returned as a stream instead of a stringstream. The httpd module
+ * sends the response with chunked transfer encoding and asks the stream for the next part
+ * only when the data produced so far has mostly been sent, so the document never has to be
+ * held in memory as a whole. The stream is deleted by the httpd module when it is complete or
+ * the connection is closed.
+ */
+class HTTPDocumentStream : public classbase
+{
+ public:
+	/** Module that created the stream, streams of a module are dropped when it is unloaded
+	 */
+	Module* const creator;
+
+	HTTPDocumentStream(Module* mod) : creator(mod) { }
+
+	/** Append the next part of the document
+	 * @param data The string to append the data to
+	 * @return True if there is more data, false if the document is complete
+	 */
+	virtual bool Produce(std::string& data) = 0;
+};
+
 /** If you want to reply to HTTP requests, you must return a HTTPDocumentResponse to
  * the httpd module via the HTTPdAPI.
  * When you initialize this class you initialize it with all components required to
@@ -191,6 +214,11 @@ class HTTPDocumentResponse
 	Module* const module;
 
 	std::stringstream* document;
+
+	/** The stream generating the document if it is not in document, owned by the httpd module
+	 */
+	HTTPDocumentStream* stream;
+
 	unsigned int responsecode;
 
 	/** Any extra headers to include with the defaults
@@ -207,7 +235,18 @@ class HTTPDocumentResponse
 	 * based upon the response code.
 	 */
 	HTTPDocumentResponse(Module* mod, HTTPRequest& req, std::stringstream* doc, unsigned int response)
-		: module(mod), document(doc), responsecode(response), src(req)
+		: module(mod), document(doc), stream(NULL), responsecode(response), src(req)
+	{
+	}
+
+	/** Initialize a HTTPDocumentResponse whose document is generated by a stream.
+	 * @param mod A pointer to the module who responded to the request
+	 * @param req The request you obtained from the HTTPRequest at an earlier time
+	 * @param docstream The stream generating the document, the httpd module takes ownership of it
+	 * @param response A valid HTTP/1.0 or HTTP/1.1 response code
+	 */
+	HTTPDocumentResponse(Module* mod, HTTPRequest& req, HTTPDocumentStream* docstream, unsigned int response)
+		: module(mod), document(NULL), stream(docstream), responsecode(response), src(req)
 	{
 	}
 };
@@ -43,12 +43,37 @@ public:
 	}
 };
 
+/** A set of regular expressions which are matched against a text in a single pass.
+ */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Find the expressions of the set which match a text
+	 * @param text The text to match against
+	 * @param matches Filled with the indexes of the matching expressions, in the
+	 * order they were given to RegexFactory::CreateSet()
+	 */
+	virtual void Matches(const std::string& text, std::vector<size_t>& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Compile several expressions into a RegexSet. An expression matches in the set
+	 * exactly when the Regex created from it by Create() would match.
+	 * @param exprs The expressions to compile
+	 * @return A new RegexSet, or NULL if this engine does not support sets
+	 */
+	virtual RegexSet* CreateSet(const std::vector<std::string>& exprs)
+	{
+		return NULL;
+	}
 };
 
 class RegexException : public ModuleException
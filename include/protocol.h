@@ -50,6 +50,13 @@ class CoreExport ProtocolInterface
 		unsigned int usercount;
 		unsigned int opercount;
 		unsigned int latencyms;
+		/** True if the link to this server is compressed, only set for directly linked servers */
+		bool compressed;
+		/** Ratio of compressed to uncompressed bytes sent and received over the link */
+		double compressratio_out;
+		double compressratio_in;
+		/** CPU time spent compressing the link, in microseconds */
+		unsigned long long compresscpu;
 	};
 
 	typedef std::vector<ServerInfo> ServerList;
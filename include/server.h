@@ -39,6 +39,11 @@ class CoreExport Server : public classbase
 	bool silentuline;
 
  public:
+	/** Users on this server, not including the FakeUser representing the server itself.
+	 * Users are added when they are created and removed when they quit.
+	 */
+	intrusive_list<User> users;
+
 	Server(const std::string& srvname, const std::string& srvdesc)
 		: name(srvname), description(srvdesc), uline(false), silentuline(false) { }
 
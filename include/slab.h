@@ -0,0 +1,105 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Allocates objects of a single size from large blocks of memory called slabs.
+ * Objects of the same type end up next to each other instead of being scattered
+ * over the heap, and a slab is given back as soon as every object in it was freed,
+ * so memory used by a burst of connections or a netjoin is returned once those
+ * objects are gone.
+ *
+ * Classes using an allocator route their operator new and operator delete to it.
+ * Requests of a different size (made for classes derived from the one the allocator
+ * was created for) are passed to the global operator new and delete.
+ *
+ * Not thread safe, objects must only be allocated and freed from the main thread.
+ */
+class CoreExport SlabAllocator
+{
+	struct Slab;
+
+	/** Slabs which have at least one free object, the next allocation is taken from the first one */
+	Slab* partial;
+
+	/** An empty slab which is kept around to avoid freeing and allocating a slab
+	 * repeatedly when the number of objects goes back and forth, or NULL
+	 */
+	Slab* spare;
+
+	/** Size of an object including the header pointing back to its slab */
+	size_t chunksize;
+
+	/** Size of a slab in bytes */
+	size_t slabbytes;
+
+	/** Number of objects in a single slab */
+	unsigned int perslab;
+
+	/** Allocate and initialize a new slab */
+	Slab* NewSlab();
+
+	/** Insert a slab at the front or the back of the partial list */
+	void Link(Slab* slab, bool front);
+
+	/** Remove a slab from the partial list */
+	void Unlink(Slab* slab);
+
+ public:
+	/** Name of the allocator, shown in /STATS z */
+	const char* const name;
+
+	/** Size of the objects handed out by this allocator */
+	const size_t objsize;
+
+	/** Number of objects currently allocated */
+	unsigned long inuse;
+
+	/** Highest number of objects allocated at the same time */
+	unsigned long peak;
+
+	/** Number of allocations done since startup */
+	unsigned long allocations;
+
+	/** Number of slabs currently allocated, including the spare slab */
+	unsigned long slabs;
+
+	/** Create a new allocator
+	 * @param Name Name of the allocator
+	 * @param size Size of the objects to allocate
+	 */
+	SlabAllocator(const char* Name, size_t size);
+
+	/** Allocate an object
+	 * @param size Size of the object, if it's not objsize then the global operator new is used
+	 * @return Memory for the object
+	 */
+	void* Allocate(size_t size);
+
+	/** Free an object allocated by Allocate()
+	 * @param ptr The object to free, may be NULL
+	 * @param size Size of the object as passed to Allocate()
+	 */
+	void Deallocate(void* ptr, size_t size);
+
+	/** Get the number of bytes reserved by the slabs of this allocator */
+	size_t GetReservedBytes() const;
+
+	/** Get all allocators, in the order they were created */
+	static const std::vector<SlabAllocator*>& GetAll();
+};
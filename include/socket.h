@@ -140,6 +140,26 @@ class CoreExport ListenSocket : public EventHandler
 	int bind_port;
 	/** Human-readable bind description */
 	std::string bind_desc;
+	/** Maximum number of connections accepted in a single read event, from <bind:acceptbatch> */
+	unsigned int acceptbatch;
+	/** True if this listener accepts client connections */
+	bool clientport;
+
+	/** Number of connections accepted on this listener */
+	unsigned long accepted;
+	/** Number of connections refused on this listener, including those refused before admission */
+	unsigned long refused;
+	/** Number of connections refused by the admission checks, before a user was created for them */
+	unsigned long rejected;
+	/** Number of connections accepted during the second in ratetime */
+	unsigned int ratecount;
+	/** Connections per second during the last complete second */
+	unsigned int lastrate;
+	/** Highest number of connections per second seen */
+	unsigned int peakrate;
+	/** The second ratecount belongs to */
+	time_t ratetime;
+
 	/** Create a new listening socket
 	 */
 	ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to);
@@ -151,6 +171,16 @@ class CoreExport ListenSocket : public EventHandler
 	~ListenSocket();
 
 	/** Handles sockets internals crap of a connection, convenience wrapper really
+	 * @return True if a connection was accepted (even if it was refused afterwards),
+	 * false if there are no more pending connections
+	 */
+	bool AcceptInternal();
+
+	/** Check whether a new client connection may be admitted. This is done before any
+	 * user is created for the connection and checks the softlimit, the ban cache and Z-lines.
+	 * @param newfd The file descriptor of the new connection
+	 * @param client The address of the client
+	 * @return True if the connection may continue, false if it was refused and closed
 	 */
-	void AcceptInternal();
+	bool CheckAdmission(int newfd, irc::sockets::sockaddrs& client);
 };
@@ -258,6 +258,9 @@ public:
 	unsigned long WriteEvents;
 	unsigned long ErrorEvents;
 
+	/** Time the last DispatchEvents() call spent waiting for events, in microseconds */
+	unsigned long long LastWaitTime;
+
 	/** Constructor.
 	 * The constructor transparently initializes
 	 * the socket engine which the ircd is using.
@@ -357,7 +360,8 @@ public:
 	virtual bool BoundsCheckFd(EventHandler* eh);
 
 	/** Abstraction for BSD sockets accept(2).
-	 * This function should emulate its namesake system call exactly.
+	 * This function should emulate its namesake system call exactly, except that the
+	 * returned socket is already in non-blocking mode.
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
 	 * @param addr The client IP address and port
 	 * @param addrlen The size of the sockaddr parameter.
@@ -29,4 +29,9 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoNetsplitBenchmark();
+	bool DoLookupBenchmark();
+	bool DoThreadPoolTests();
+	bool DoBulkQuitBenchmark();
+	bool DoNetjoinBenchmark();
 };
@@ -23,6 +23,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <deque>
 #include "config.h"
 #include "base.h"
 
@@ -117,7 +118,21 @@ class CoreExport QueuedThread : public Thread
 	}
 };
 
-class CoreExport SocketThread : public Thread
+/** Something which is woken up on the main thread by a ThreadSignalData
+ */
+class CoreExport ThreadSignalTarget
+{
+ public:
+	virtual ~ThreadSignalTarget() { }
+
+	/**
+	 * Called in the context of the parent thread after a notification
+	 * has passed through the socket
+	 */
+	virtual void OnNotify() = 0;
+};
+
+class CoreExport SocketThread : public Thread, public ThreadSignalTarget
 {
 	ThreadQueueData queue;
 	ThreadSignalData signal;
@@ -137,7 +152,6 @@ class CoreExport SocketThread : public Thread
 	 */
 	void NotifyParent();
 	SocketThread();
-	virtual ~SocketThread();
 	/** Lock queue.
 	 */
 	void LockQueue()
@@ -171,3 +185,175 @@ class CoreExport SocketThread : public Thread
 	 */
 	virtual void OnNotify() = 0;
 };
+
+/** Work which was done by another thread and is finished on the main thread.
+ * Add it to a ThreadCompletionQueue when the other thread is done with it.
+ */
+class CoreExport ThreadCompletion
+{
+	/** Next item in the ThreadCompletionQueue this is on
+	 */
+	ThreadCompletion* next;
+
+	friend class ThreadCompletionQueue;
+
+ public:
+	ThreadCompletion() : next(NULL)
+	{
+	}
+
+	virtual ~ThreadCompletion() { }
+
+	/** Called on the main thread, the object is deleted afterwards
+	 */
+	virtual void OnComplete() = 0;
+};
+
+/** Work to be done by one of the threads of a ThreadPool
+ */
+class CoreExport ThreadJob : public ThreadCompletion
+{
+ public:
+	/** Do the work. This is called on a thread of the pool, so it must not touch anything
+	 * the main thread may be using at the same time. Once it returns OnComplete() is called
+	 * on the main thread.
+	 */
+	virtual void Run() = 0;
+};
+
+/** A queue which any number of threads can add completed work to without taking a lock.
+ *
+ * Items are delivered to the main thread in batches: only the item that is added while the
+ * queue is empty wakes up the main loop, which then calls OnComplete() on everything that was
+ * queued until then, in the order in which it was added.
+ */
+class CoreExport ThreadCompletionQueue : public ThreadSignalTarget
+{
+	/** The item added last, each item links to the one added before it
+	 */
+	ThreadAtomicPointer head;
+
+	/** Used to wake up the main thread
+	 */
+	ThreadSignalData signal;
+
+ public:
+	ThreadCompletionQueue();
+
+	/** Items which were not delivered are deleted without calling OnComplete()
+	 */
+	~ThreadCompletionQueue();
+
+	/** Add an item, may be called from any thread
+	 * @param item The item, it is owned by the queue afterwards
+	 */
+	void Add(ThreadCompletion* item);
+
+	/** Call OnComplete() on every item added so far and delete them, called on the main
+	 * thread. This is done automatically when the main loop is woken up, it only has to be
+	 * called to make sure nothing is left before changing state the items depend on.
+	 */
+	void Deliver();
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		Deliver();
+	}
+};
+
+class ThreadPoolWorker;
+
+/** A fixed number of threads which run ThreadJobs submitted by the main thread.
+ *
+ * Idle threads wait on a condition variable for jobs, which are started in the order in
+ * which they were submitted. Finished jobs are passed back through a ThreadCompletionQueue
+ * so that many results cost one wakeup of the main loop.
+ */
+class CoreExport ThreadPool
+{
+	/** Protects pending and exiting, signalled when a job is submitted
+	 */
+	ThreadQueueData queue;
+
+	/** Jobs which were not started yet
+	 */
+	std::deque<ThreadJob*> pending;
+
+	/** True when the threads are asked to exit
+	 */
+	bool exiting;
+
+	/** The running threads
+	 */
+	std::vector<ThreadPoolWorker*> workers;
+
+	/** Called by each thread when it starts and before it exits, may be NULL
+	 */
+	void (*const threadstart)();
+	void (*const threadexit)();
+
+	/** Jobs which are done, waiting for OnComplete()
+	 */
+	ThreadCompletionQueue completed;
+
+	friend class ThreadPoolWorker;
+
+	/** Wait for a job, called by the threads
+	 * @return The job to run, or NULL if the thread has to exit
+	 */
+	ThreadJob* NextJob();
+
+ public:
+	/** Start the threads of the pool
+	 * @param threads Number of threads to start, at least one is started
+	 * @param onstart Function each thread calls before it runs any job, for libraries which
+	 * need per-thread setup, or NULL
+	 * @param onexit Function each thread calls before it exits, or NULL
+	 */
+	ThreadPool(unsigned int threads, void (*onstart)() = NULL, void (*onexit)() = NULL);
+
+	/** Stop the threads, queued jobs and jobs whose OnComplete() was not called yet are
+	 * deleted without calling OnComplete()
+	 */
+	~ThreadPool();
+
+	/** Queue a job to be run by one of the threads
+	 * @param job The job, it is owned by the pool until it is deleted after OnComplete()
+	 */
+	void Submit(ThreadJob* job);
+
+	/** Take a job back if no thread started it yet
+	 * @param job A job which was submitted and whose OnComplete() was not called yet
+	 * @return True if the job was removed from the queue, the caller owns it again. False
+	 * if a thread is running it or has finished it, OnComplete() will be called as usual.
+	 */
+	bool Cancel(ThreadJob* job);
+
+	/** Wait for the jobs being run to finish and stop the threads. Queued jobs which were not
+	 * started stay queued until they are cancelled or the pool is deleted.
+	 */
+	void Stop();
+
+	/** Pass a part of the work of a job to the main thread before the job is done, called
+	 * by the job on its thread. OnComplete() of the item is called before that of the job.
+	 * @param item The item, it is owned by the pool afterwards
+	 */
+	void Complete(ThreadCompletion* item)
+	{
+		completed.Add(item);
+	}
+
+	/** Call OnComplete() on the jobs which are done, see ThreadCompletionQueue::Deliver()
+	 */
+	void Deliver()
+	{
+		completed.Deliver();
+	}
+
+	/** Get the number of running threads
+	 */
+	size_t GetThreadCount() const
+	{
+		return workers.size();
+	}
+};
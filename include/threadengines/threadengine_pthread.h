@@ -146,9 +146,57 @@ class ThreadQueueData
 	}
 };
 
+/** A pointer which several threads can change at the same time without taking a lock
+ */
+class ThreadAtomicPointer
+{
+	void* volatile ptr;
+ public:
+	ThreadAtomicPointer() : ptr(NULL)
+	{
+	}
+
+	void* Get() const
+	{
+		return ptr;
+	}
+
+	/** Replace the pointer if it still has the expected value
+	 * @return True if the pointer was replaced
+	 */
+	bool CompareExchange(void* expected, void* value)
+	{
+		return __sync_bool_compare_and_swap(&ptr, expected, value);
+	}
+
+	/** Replace the pointer
+	 * @return The previous value of the pointer
+	 */
+	void* Exchange(void* value)
+	{
+		return __sync_lock_test_and_set(&ptr, value);
+	}
+};
+
 class ThreadSignalSocket;
-class ThreadSignalData
+class ThreadSignalTarget;
+class CoreExport ThreadSignalData
 {
  public:
 	ThreadSignalSocket* sock;
+
+	ThreadSignalData() : sock(NULL)
+	{
+	}
+
+	~ThreadSignalData();
+
+	/** Create the eventfd or pipe used to wake up the main thread
+	 * @param target Called on the main thread after Notify()
+	 */
+	void Create(ThreadSignalTarget* target);
+
+	/** Wake up the main thread, may be called from any thread
+	 */
+	void Notify();
 };
@@ -142,7 +142,40 @@ class ThreadQueueData
 	}
 };
 
-class ThreadSignalData
+/** A pointer which several threads can change at the same time without taking a lock
+ */
+class ThreadAtomicPointer
+{
+	void* volatile ptr;
+ public:
+	ThreadAtomicPointer() : ptr(NULL)
+	{
+	}
+
+	void* Get() const
+	{
+		return ptr;
+	}
+
+	/** Replace the pointer if it still has the expected value
+	 * @return True if the pointer was replaced
+	 */
+	bool CompareExchange(void* expected, void* value)
+	{
+		return InterlockedCompareExchangePointer(&ptr, value, expected) == expected;
+	}
+
+	/** Replace the pointer
+	 * @return The previous value of the pointer
+	 */
+	void* Exchange(void* value)
+	{
+		return InterlockedExchangePointer(&ptr, value);
+	}
+};
+
+class ThreadSignalTarget;
+class CoreExport ThreadSignalData
 {
  public:
 	int connFD;
@@ -150,4 +183,15 @@ class ThreadSignalData
 	{
 		connFD = -1;
 	}
+
+	~ThreadSignalData();
+
+	/** Create the socket pair used to wake up the main thread
+	 * @param target Called on the main thread after Notify()
+	 */
+	void Create(ThreadSignalTarget* target);
+
+	/** Wake up the main thread, may be called from any thread
+	 */
+	void Notify();
 };
@@ -52,8 +52,8 @@ struct ModResult;
 #include "hashcomp.h"
 #include "base.h"
 
-typedef TR1NS::unordered_map<std::string, User*, irc::insensitive, irc::StrHashComp> user_hash;
-typedef TR1NS::unordered_map<std::string, Channel*, irc::insensitive, irc::StrHashComp> chan_hash;
+typedef irc::insensitive_map<User*>::type user_hash;
+typedef irc::insensitive_map<Channel*>::type chan_hash;
 
 /** A list holding local users, this is the type of UserManager::local_users
  */
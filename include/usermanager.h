@@ -31,6 +31,20 @@ class CoreExport UserManager
 	 */
 	clonemap local_clones;
 
+	/** Bits of LocalUser::caps which are given to a capability
+	 */
+	CapSet usedcapbits;
+
+	/** Remove a user who was just marked as quitting, the part of QuitUser() and QuitUsers()
+	 * which is done for each user. Calls OnUserQuit but does not send the quit message.
+	 * @param user The user to remove
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers, can be NULL if same as quitreason
+	 * @param reason Set to quitreason cropped to <limits:maxquit>
+	 * @return True if the user was registered, the caller then sends the quit message
+	 */
+	bool RemoveQuittingUser(User* user, const std::string& quitreason, const std::string* operreason, std::string& reason);
+
  public:
 	/** Constructor, initializes variables and allocates the hashmaps
 	 */
@@ -72,6 +86,17 @@ class CoreExport UserManager
 	 */
 	clonemap global_clones;
 
+	/** Give a capability a bit of LocalUser::caps to store whether users have it enabled
+	 * @return The index of the bit
+	 * @throw ModuleException if all bits are in use
+	 */
+	unsigned int AllocateCapBit();
+
+	/** Release a bit given by AllocateCapBit(), it is cleared for all local users
+	 * @param bit The index of the bit
+	 */
+	void FreeCapBit(unsigned int bit);
+
 	/**
 	 * Reset the already_sent IDs so we don't wrap it around and drop a message
 	 * Also removes all expired invites
@@ -95,9 +120,11 @@ class CoreExport UserManager
 	 * @param via The socket that this user connected using
 	 * @param client The IP address and client port of the user
 	 * @param server The server IP address and port used by the user
+	 * @param admitted True if ListenSocket::CheckAdmission() admitted the connection, it looked the
+	 * address up in the ban cache and checked the Z-lines already and they are not checked again
 	 * @return This function has no return value, but a call to AddClient may remove the user.
 	 */
-	void AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
+	void AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server, bool admitted = false);
 
 	/** Disconnect a user gracefully
 	 * @param user The user to remove
@@ -107,6 +134,16 @@ class CoreExport UserManager
 	 */
 	void QuitUser(User* user, const std::string& quitreason, const std::string* operreason = NULL);
 
+	/** Disconnect many users at once, for example the users lost in a netsplit.
+	 * This does the same as calling QuitUser() on each user, but every local user is sent
+	 * the quits of all of their neighbours in one write and each channel is updated once.
+	 * The OnUserQuit hooks of all users are called before any quit message is sent.
+	 * @param users The users to remove, users already quitting are skipped
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers, can be NULL if same as quitreason
+	 */
+	void QuitUsers(const std::vector<User*>& users, const std::string& quitreason, const std::string* operreason = NULL);
+
 	/** Add a user to the local clone map
 	 * @param user The user to add
 	 */
@@ -211,12 +211,36 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+/** A long reply which is sent to a user in parts.
+ * Instead of writing all lines of a large reply (e.g. NAMES on a big channel) to the sendq at
+ * once, the reply is generated a part at a time. A local user only asks for the next part when
+ * its sendq is below the soft limit of its connect class, so large replies no longer make
+ * clients exceed their hard sendq limit. Commands sent by the user after the reply are not
+ * processed until the reply is complete.
+ */
+class CoreExport ReplyProducer : public classbase
+{
+ public:
+	/** The module which created this producer, NULL for the core. Unfinished producers
+	 * of a module are completed when it is unloaded.
+	 */
+	Module* const creator;
+
+	ReplyProducer(Module* mod) : creator(mod) { }
+
+	/** Send the next part of the reply to a user
+	 * @param user The user receiving the reply
+	 * @return True if there is more to send, false if the reply is complete
+	 */
+	virtual bool Produce(User* user) = 0;
+};
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
  * user's nickname and hostname.
  */
-class CoreExport User : public Extensible
+class CoreExport User : public Extensible, public intrusive_list_node<User>
 {
  private:
 	/** Cached nick!ident@dhost value using the displayed hostname
@@ -626,6 +650,12 @@ class CoreExport User : public Extensible
 	 */
 	void SendAll(const char* command, const char* text, ...) CUSTOM_PRINTF(3, 4);
 
+	/** Send a long reply to this user. Replies to remote users are sent at once, replies to
+	 * local users are sent while their sendq allows it, after any earlier replies.
+	 * @param producer The producer of the reply, it is deleted when the reply is complete
+	 */
+	virtual void AddReplyProducer(ReplyProducer* producer);
+
 	/** Remove this user from all channels they are on, and delete any that are now empty.
 	 * This is used by QUIT, and will not send part messages!
 	 */
@@ -643,6 +673,7 @@ class CoreExport UserIOHandler : public StreamSocket
 	LocalUser* const user;
 	UserIOHandler(LocalUser* me) : user(me) {}
 	void OnDataReady();
+	void OnDataSent();
 	void OnError(BufferedSocketError error);
 
 	/** Adds to the user's write buffer.
@@ -655,14 +686,25 @@ class CoreExport UserIOHandler : public StreamSocket
 
 typedef unsigned int already_sent_t;
 
+/** The capabilities enabled by a client, one bit for each capability given a bit by UserManager::AllocateCapBit() */
+typedef std::bitset<64> CapSet;
+
 class CoreExport LocalUser : public User, public InviteBase
 {
  public:
 	LocalUser(int fd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 	CullResult cull();
 
+	/** Objects of this class are allocated from a SlabAllocator */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	UserIOHandler eh;
 
+	/** Long replies which are still being sent to this user, in order
+	 */
+	std::deque<ReplyProducer*> replyproducers;
+
 	/** Position in UserManager::local_users
 	 */
 	LocalUserList::iterator localuseriter;
@@ -741,6 +783,22 @@ class CoreExport LocalUser : public User, public InviteBase
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
+	/** Capabilities the client has enabled, see GenericCap
+	 */
+	CapSet caps;
+
+	/** Lines written to this user while a WriteCoalescer exists, not in the sendq yet
+	 */
+	std::string coalesced;
+
+	/** Move the coalesced lines of this user to the sendq
+	 */
+	void FlushCoalesced();
+
+	/** Get the number of bytes waiting to be sent to this user, including the coalesced lines
+	 */
+	size_t GetSendQSize() const { return eh.getSendQSize() + coalesced.length(); }
+
 	/** Check if the user matches a G or K line, and disconnect them if they do.
 	 * @param doZline True if ZLines should be checked (if IP has changed since initial connect)
 	 * Returns true if the user matched a ban, false else.
@@ -766,6 +824,24 @@ class CoreExport LocalUser : public User, public InviteBase
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write several lines to the user with a single write, instead of one write per line.
+	 * Like Write(), lines longer than the line length limit are cropped and every line is logged.
+	 * @param lines The lines to send, each one ending in CR/LF
+	 * @param count The number of lines
+	 */
+	void WriteLines(const std::string& lines, unsigned int count);
+
+	void AddReplyProducer(ReplyProducer* producer);
+
+	/** Send more of the pending long replies while the sendq is below its soft limit
+	 */
+	void SendPendingReplies();
+
+	/** Finish the pending long replies created by a module, called when it is unloaded
+	 * @param mod The module being unloaded
+	 */
+	void FinishReplyProducers(Module* mod);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -815,6 +891,33 @@ class CoreExport LocalUser : public User, public InviteBase
 	bool HasModePermission(unsigned char mode, ModeType type);
 };
 
+/** While an object of this class exists, lines written to local users are collected
+ * per user instead of being added to the sendq one by one, and each user gets all of
+ * its lines in a single write when the object is destroyed. This is used when one event
+ * sends many lines to the same users, e.g. the JOINs of a netburst.
+ * Objects of this class can be nested, the outermost one flushes the lines.
+ */
+class CoreExport WriteCoalescer
+{
+	/** The outermost coalescer, NULL if there is none */
+	static WriteCoalescer* active;
+
+	/** Users with coalesced lines */
+	std::vector<LocalUser*> users;
+
+ public:
+	WriteCoalescer();
+	~WriteCoalescer();
+
+	/** Called before writing to a user. If the user already has as many coalesced lines as
+	 * the soft sendq limit allows, they are moved to the sendq first.
+	 * @param user The user being written to
+	 * @return True if the lines have to be appended to LocalUser::coalesced, false if there
+	 * is no coalescer and they have to be written now
+	 */
+	static bool Queue(LocalUser* user);
+};
+
 class CoreExport RemoteUser : public User
 {
  public:
@@ -822,6 +925,10 @@ class CoreExport RemoteUser : public User
 	{
 	}
 	virtual void SendText(const std::string& line);
+
+	/** Objects of this class are allocated from a SlabAllocator */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
 };
 
 class CoreExport FakeUser : public User
@@ -19,40 +19,313 @@
 
 
 #include "inspircd.h"
+#include "xline.h"
 #include "bancache.h"
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+const unsigned int BanCacheManager::NONE;
+const unsigned int BanCacheManager::DELETED;
+
+static unsigned int FullLength(unsigned char type)
 {
-	BanCacheHit*& b = (*BanHash)[ip];
-	if (b != NULL) // can't have two cache entries on the same IP, sorry..
-		return NULL;
+	return (type == AF_INET6 ? 128 : 32);
+}
+
+static size_t HashKey(const irc::sockets::cidr_mask& key)
+{
+	// FNV-1a over the significant bytes of the key
+	size_t hash = 2166136261U;
+	hash = (hash ^ key.type) * 16777619U;
+	hash = (hash ^ key.length) * 16777619U;
+	for (unsigned int i = 0; i < (key.length + 7U) / 8; i++)
+		hash = (hash ^ key.bits[i]) * 16777619U;
+	return hash;
+}
+
+/** Check whether the first len bits of two addresses are the same */
+static bool PrefixEquals(const unsigned char* a, const unsigned char* b, unsigned int len)
+{
+	if (memcmp(a, b, len / 8))
+		return false;
+	if (!(len & 7))
+		return true;
+	unsigned char mask = (0xFF00 >> (len & 7)) & 0xFF;
+	return ((a[len / 8] & mask) == (b[len / 8] & mask));
+}
+
+BanCacheManager::BanCacheManager()
+	: freelist(NONE), lruhead(NONE), lrutail(NONE), used(0), deleted(0)
+	, Hits(0), Misses(0), RangeHits(0), Evictions(0)
+{
+	slots.resize(64, NONE);
+}
+
+unsigned int BanCacheManager::FindSlot(const irc::sockets::cidr_mask& key) const
+{
+	size_t mask = slots.size() - 1;
+	for (size_t pos = HashKey(key) & mask; ; pos = (pos + 1) & mask)
+	{
+		unsigned int index = slots[pos];
+		if (index == NONE)
+			return NONE;
+		if ((index != DELETED) && (entries[index].key == key))
+			return pos;
+	}
+}
+
+void BanCacheManager::Rehash(size_t size)
+{
+	slots.assign(size, NONE);
+	deleted = 0;
+	size_t mask = size - 1;
+	for (unsigned int index = 0; index < entries.size(); index++)
+	{
+		Entry& entry = entries[index];
+		if (entry.slot == NONE)
+			continue;
+
+		size_t pos = HashKey(entry.key) & mask;
+		while (slots[pos] != NONE)
+			pos = (pos + 1) & mask;
+		slots[pos] = index;
+		entry.slot = pos;
+	}
+}
+
+unsigned int BanCacheManager::Insert(const irc::sockets::cidr_mask& key)
+{
+	size_t maxsize = ServerInstance->Config->BanCacheSize;
+	while ((used) && (used >= maxsize))
+	{
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Ban cache is full, removing the hit on " + entries[lrutail].key.str());
+		Remove(lrutail);
+		Evictions++;
+	}
+
+	// Keep the table at most half full of live entries, and clean out deleted slots when they pile up
+	if ((used + 1) * 2 > slots.size())
+		Rehash(slots.size() * 2);
+	else if ((used + deleted + 1) * 4 > slots.size() * 3)
+		Rehash(slots.size());
+
+	unsigned int index;
+	if (freelist != NONE)
+	{
+		index = freelist;
+		freelist = entries[index].next;
+	}
+	else
+	{
+		index = entries.size();
+		entries.push_back(Entry());
+	}
+
+	size_t mask = slots.size() - 1;
+	size_t pos = HashKey(key) & mask;
+	while ((slots[pos] != NONE) && (slots[pos] != DELETED))
+		pos = (pos + 1) & mask;
+	if (slots[pos] == DELETED)
+		deleted--;
+	slots[pos] = index;
+
+	Entry& entry = entries[index];
+	entry.key = key;
+	entry.slot = pos;
+	LinkFront(index);
+	used++;
+	return index;
+}
+
+void BanCacheManager::Remove(unsigned int index)
+{
+	Entry& entry = entries[index];
+	slots[entry.slot] = DELETED;
+	deleted++;
+	entry.slot = NONE;
+	Unlink(index);
+	HeapRemove(entry.heappos);
+	entry.hit = BanCacheHit();
+	entry.next = freelist;
+	freelist = index;
+	used--;
+}
+
+void BanCacheManager::LinkFront(unsigned int index)
+{
+	Entry& entry = entries[index];
+	entry.prev = NONE;
+	entry.next = lruhead;
+	if (lruhead != NONE)
+		entries[lruhead].prev = index;
+	lruhead = index;
+	if (lrutail == NONE)
+		lrutail = index;
+}
+
+void BanCacheManager::Unlink(unsigned int index)
+{
+	Entry& entry = entries[index];
+	if (entry.prev != NONE)
+		entries[entry.prev].next = entry.next;
+	else
+		lruhead = entry.next;
+	if (entry.next != NONE)
+		entries[entry.next].prev = entry.prev;
+	else
+		lrutail = entry.prev;
+}
 
-	b = new BanCacheHit(type, reason, (seconds ? seconds : 86400));
-	return b;
+void BanCacheManager::Touch(unsigned int index)
+{
+	if (lruhead == index)
+		return;
+	Unlink(index);
+	LinkFront(index);
 }
 
-BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+void BanCacheManager::HeapSwap(unsigned int a, unsigned int b)
 {
-	BanCacheHash::iterator i = this->BanHash->find(ip);
+	std::swap(expiry[a], expiry[b]);
+	entries[expiry[a]].heappos = a;
+	entries[expiry[b]].heappos = b;
+}
 
-	if (i == this->BanHash->end())
-		return NULL; // free and safe
+void BanCacheManager::HeapUp(unsigned int pos)
+{
+	while (pos)
+	{
+		unsigned int parent = (pos - 1) / 2;
+		if (entries[expiry[parent]].hit.Expiry <= entries[expiry[pos]].hit.Expiry)
+			break;
+		HeapSwap(pos, parent);
+		pos = parent;
+	}
+}
 
-	if (RemoveIfExpired(i))
-		return NULL; // expired
+void BanCacheManager::HeapDown(unsigned int pos)
+{
+	while (true)
+	{
+		unsigned int smallest = pos;
+		unsigned int left = pos * 2 + 1;
+		unsigned int right = left + 1;
+		if ((left < expiry.size()) && (entries[expiry[left]].hit.Expiry < entries[expiry[smallest]].hit.Expiry))
+			smallest = left;
+		if ((right < expiry.size()) && (entries[expiry[right]].hit.Expiry < entries[expiry[smallest]].hit.Expiry))
+			smallest = right;
+		if (smallest == pos)
+			break;
+		HeapSwap(pos, smallest);
+		pos = smallest;
+	}
+}
 
-	return i->second; // hit.
+void BanCacheManager::HeapRemove(unsigned int pos)
+{
+	unsigned int last = expiry.size() - 1;
+	if (pos != last)
+	{
+		HeapSwap(pos, last);
+		expiry.pop_back();
+		HeapUp(pos);
+		HeapDown(pos);
+	}
+	else
+		expiry.pop_back();
+}
+
+void BanCacheManager::RemoveExpired()
+{
+	while ((!expiry.empty()) && (entries[expiry[0]].hit.Expiry <= ServerInstance->Time()))
+	{
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + entries[expiry[0]].key.str() + " is out of date, removing!");
+		Remove(expiry[0]);
+	}
 }
 
-bool BanCacheManager::RemoveIfExpired(BanCacheHash::iterator& it)
+bool BanCacheManager::RangeHasZLine(const irc::sockets::cidr_mask& range)
 {
-	if (ServerInstance->Time() < it->second->Expiry)
+	XLineLookup* zlines = ServerInstance->XLines->GetAll("Z");
+	if (!zlines)
 		return false;
 
-	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + it->first + " is out of date, removing!");
-	delete it->second;
-	it = BanHash->erase(it);
-	return true;
+	for (XLineLookup::iterator i = zlines->begin(); i != zlines->end(); ++i)
+	{
+		const std::string& mask = i->second->Displayable();
+
+		// Glob masks are too hard to reason about, assume they might apply
+		if (mask.find_first_of("*?") != std::string::npos)
+			return true;
+
+		std::string::size_type slash = mask.rfind('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(mask.substr(0, slash), 0, sa))
+			return true;
+		if (sa.sa.sa_family != range.type)
+			continue;
+
+		unsigned int len = FullLength(range.type);
+		if (slash != std::string::npos)
+			len = std::min<unsigned int>(len, ConvToInt(mask.substr(slash + 1)));
+
+		irc::sockets::cidr_mask zline(sa, len);
+		if (PrefixEquals(zline.bits, range.bits, std::min<unsigned int>(len, range.length)))
+			return true;
+	}
+	return false;
+}
+
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs& addr, const std::string &type, const std::string &reason, time_t seconds)
+{
+	irc::sockets::cidr_mask key(addr, 128);
+	if (FindSlot(key) != NONE) // can't have two cache entries on the same IP, sorry..
+		return NULL;
+
+	if (reason.empty())
+	{
+		// Negative hits can cover a range as long as no Z-line applies to any part of it
+		int range = (addr.sa.sa_family == AF_INET6) ? ServerInstance->Config->c_ipv6_bancache_range : ServerInstance->Config->c_ipv4_bancache_range;
+		irc::sockets::cidr_mask rangekey(addr, range);
+		if ((rangekey.length < FullLength(rangekey.type)) && (!RangeHasZLine(rangekey)))
+		{
+			if (FindSlot(rangekey) != NONE)
+				return NULL;
+			key = rangekey;
+		}
+	}
+
+	unsigned int index = Insert(key);
+	Entry& entry = entries[index];
+	entry.hit = BanCacheHit(type, reason, (seconds ? seconds : 86400));
+	entry.heappos = expiry.size();
+	expiry.push_back(index);
+	HeapUp(entry.heappos);
+	return &entry.hit;
+}
+
+BanCacheHit *BanCacheManager::GetHit(const irc::sockets::sockaddrs& addr)
+{
+	RemoveExpired();
+
+	irc::sockets::cidr_mask key(addr, 128);
+	unsigned int slot = FindSlot(key);
+	if (slot == NONE)
+	{
+		int range = (addr.sa.sa_family == AF_INET6) ? ServerInstance->Config->c_ipv6_bancache_range : ServerInstance->Config->c_ipv4_bancache_range;
+		irc::sockets::cidr_mask rangekey(addr, range);
+		if (rangekey.length < FullLength(rangekey.type))
+			slot = FindSlot(rangekey);
+		if (slot == NONE)
+		{
+			Misses++;
+			return NULL; // free and safe
+		}
+		RangeHits++;
+	}
+
+	Hits++;
+	unsigned int index = slots[slot];
+	Touch(index);
+	return &entries[index].hit; // hit.
 }
 
 void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
@@ -62,40 +335,33 @@ void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
 	else
 		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing all negative hits");
 
-	for (BanCacheHash::iterator i = BanHash->begin(); i != BanHash->end(); )
+	RemoveExpired();
+
+	for (unsigned int index = 0; index < entries.size(); index++)
 	{
-		if (RemoveIfExpired(i))
-			continue; // updates the iterator if expired
+		Entry& entry = entries[index];
+		if (entry.slot == NONE)
+			continue;
 
-		BanCacheHit* b = i->second;
+		BanCacheHit& b = entry.hit;
 		bool remove = false;
 
 		if (positive)
 		{
 			// when removing positive hits, remove only if the type matches
-			remove = b->IsPositive() && (b->Type == type);
+			remove = b.IsPositive() && (b.Type == type);
 		}
 		else
 		{
 			// when removing negative hits, remove all of them
-			remove = !b->IsPositive();
+			remove = !b.IsPositive();
 		}
 
 		if (remove)
 		{
 			/* we need to remove this one. */
-			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + i->first);
-			delete b;
-			i = BanHash->erase(i);
+			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + entry.key.str());
+			Remove(index);
 		}
-		else
-			++i;
 	}
 }
-
-BanCacheManager::~BanCacheManager()
-{
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); ++n)
-		delete n->second;
-	delete BanHash;
-}
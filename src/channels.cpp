@@ -27,9 +27,14 @@
 #include "listmode.h"
 #include <cstdarg>
 #include "mode.h"
+#include "slab.h"
 
 namespace
 {
+	SlabAllocator channelslab("Channel", sizeof(Channel));
+	SlabAllocator membershipslab("Membership", sizeof(Membership));
+	SlabAllocator invitationslab("Invitation", sizeof(Invitation));
+
 	ChanModeReference ban(NULL, "ban");
 	ChanModeReference inviteonlymode(NULL, "inviteonly");
 	ChanModeReference keymode(NULL, "key");
@@ -39,13 +44,70 @@ namespace
 	UserModeReference invisiblemode(NULL, "invisible");
 }
 
+void* Channel::operator new(size_t size)
+{
+	return channelslab.Allocate(size);
+}
+
+void Channel::operator delete(void* ptr, size_t size)
+{
+	channelslab.Deallocate(ptr, size);
+}
+
+/** A line of a cached NAMES list, shared with the NAMES lists being sent
+ */
+class NamesChunk : public refcountbase
+{
+ public:
+	/** The entries of the line, each one followed by a space */
+	std::string text;
+};
+
+typedef std::vector<reference<NamesChunk> > NamesChunkList;
+
+/** The NAMES list of a channel as it is shown to one group of users
+ */
+struct NamesVariant
+{
+	/** The lines of the list */
+	NamesChunkList chunks;
+
+	/** Entries of the members and the line they are in, hidden members have no entry */
+	std::map<User*, std::pair<size_t, std::string> > entries;
+
+	/** Members whose entries are built when the list is sent next */
+	std::set<User*> pending;
+
+	/** Length of the entries in the lines */
+	size_t used;
+
+	/** Length of the removed entries, the lines are rebuilt when it is large */
+	size_t unused;
+
+	NamesVariant() : used(0), unused(0) { }
+};
+
+/** The cached NAMES lists of a channel, by variant. The first character of a variant is 'i'
+ * if invisible users are shown, '-' otherwise, the rest is added by OnNamesListVariant.
+ */
+class NamesCache
+{
+ public:
+	std::map<std::string, NamesVariant> variants;
+};
+
 Channel::Channel(const std::string &cname, time_t ts)
-	: name(cname), age(ts), topicset(0)
+	: namescache(NULL), name(cname), age(ts), topicset(0)
 {
 	if (!ServerInstance->chanlist->insert(std::make_pair(cname, this)).second)
 		throw CoreException("Cannot create duplicate channel " + cname);
 }
 
+Channel::~Channel()
+{
+	delete namescache;
+}
+
 void Channel::SetMode(ModeHandler* mh, bool on)
 {
 	modes[mh->GetModeChar() - 65] = on;
@@ -91,6 +153,7 @@ Membership* Channel::AddUser(User* user)
 		return NULL;
 
 	memb = new Membership(user, this);
+	UpdateNamesCache(user);
 	return memb;
 }
 
@@ -126,14 +189,37 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const UserMembIter& membiter)
 {
 	Membership* memb = membiter->second;
+	User* user = memb->user;
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
+	UpdateNamesCache(user);
 
 	// If this channel became empty then it should be removed
 	CheckDestroy();
 }
 
+void Channel::DelUsers(const std::vector<User*>& users)
+{
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		UserMembIter it = userlist.find(*i);
+		if (it == userlist.end())
+			continue;
+
+		Membership* memb = it->second;
+		memb->cull();
+		delete memb;
+		userlist.erase(it);
+	}
+
+	// Rebuilding the NAMES lists on the next NAMES is cheaper than updating them for every user
+	delete namescache;
+	namescache = NULL;
+
+	CheckDestroy();
+}
+
 Membership* Channel::GetUser(User* user)
 {
 	UserMembIter i = userlist.find(user);
@@ -379,6 +465,73 @@ void Channel::ForceJoin(User* user, const std::string* privs, bool bursting, boo
 	FOREACH_MOD(OnPostJoin, (memb));
 }
 
+void Channel::ForceJoinUsers(const std::vector<User*>& users, bool bursting)
+{
+	if (users.empty())
+		return;
+
+	// The local members get every JOIN, collect them once instead of going through the whole user list for each join
+	std::vector<LocalUser*> locals;
+	for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+	{
+		if (IS_LOCAL(i->first))
+			locals.push_back(IS_LOCAL(i->first));
+	}
+
+	std::vector<User*> joined;
+	std::vector<User*> localjoins;
+	joined.reserve(users.size());
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		User* user = *i;
+		if (!IS_REMOTE(user))
+		{
+			// Left to ForceJoin(), a local user gets the NAMES list when it joins and it must not have the users joined after it
+			localjoins.push_back(user);
+			continue;
+		}
+
+		Membership*& memb = userlist[user];
+		if (memb)
+			continue; // Already on the channel
+
+		memb = new Membership(user, this);
+		user->chans.insert(this);
+		joined.push_back(user);
+	}
+
+	if (!joined.empty())
+	{
+		// Rebuilding the NAMES lists on the next NAMES is cheaper than updating them for every user
+		delete namescache;
+		namescache = NULL;
+	}
+
+	for (std::vector<User*>::const_iterator i = joined.begin(); i != joined.end(); ++i)
+	{
+		// A module may have removed the user while an earlier join was handled
+		User* user = *i;
+		Membership* memb = (user->quitting ? NULL : GetUser(user));
+		if (!memb)
+			continue;
+
+		CUList except_list;
+		FOREACH_MOD(OnUserJoin, (memb, bursting, false, except_list));
+
+		const std::string line = ":" + user->GetFullHost() + " JOIN :" + this->name;
+		for (std::vector<LocalUser*>::const_iterator j = locals.begin(); j != locals.end(); ++j)
+		{
+			if (!(*j)->quitting && (except_list.find(*j) == except_list.end()))
+				(*j)->Write(line);
+		}
+
+		FOREACH_MOD(OnPostJoin, (memb));
+	}
+
+	for (std::vector<User*>::const_iterator i = localjoins.begin(); i != localjoins.end(); ++i)
+		ForceJoin(*i, NULL, bursting);
+}
+
 bool Channel::IsBanned(User* user)
 {
 	ModResult result;
@@ -652,6 +805,209 @@ const char* Channel::ChanModes(bool showkey)
 /* compile a userlist of a channel into a string, each nick seperated by
  * spaces and op, voice etc status shown as @ and +, and send it to 'user'
  */
+namespace
+{
+	/** Sends the NAMES list of a channel one RPL_NAMREPLY line at a time
+	 */
+	class NamesProducer : public ReplyProducer
+	{
+		/** Name of the channel, used to find it again */
+		const std::string name;
+
+		/** The channel and its creation time, if either changes the list is ended early */
+		Channel* const chan;
+		const time_t age;
+
+		/** The member after which the next line starts, NULL before the first line */
+		User* last;
+
+		/** Constant start of each line, with the channel type and name */
+		std::string header;
+
+		bool has_user;
+		bool has_privs;
+
+	 public:
+		NamesProducer(Channel* c, bool hasuser, bool hasprivs)
+			: ReplyProducer(NULL), name(c->name), chan(c), age(c->age), last(NULL)
+			, has_user(hasuser), has_privs(hasprivs)
+		{
+			header.push_back(c->IsModeSet(secretmode) ? '@' : c->IsModeSet(privatemode) ? '*' : '=');
+			header.push_back(' ');
+			header.append(c->name).append(" :");
+		}
+
+		bool Produce(User* user)
+		{
+			Channel* c = ServerInstance->FindChan(name);
+			if (c != chan || c->age != age)
+			{
+				user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", name.c_str());
+				return false;
+			}
+
+			const UserMembList* users = c->GetUsers();
+			UserMembCIter i = (last ? users->upper_bound(last) : users->begin());
+
+			std::string list(header);
+			bool has_one = false;
+			std::string prefixlist;
+			std::string nick;
+			for (; i != users->end(); ++i)
+			{
+				if (i->first->quitting)
+					continue;
+				if ((!has_user) && (i->first->IsModeSet(invisiblemode)) && (!has_privs))
+				{
+					/*
+					 * user is +i, and source not on the channel, does not show
+					 * nick in NAMES list
+					 */
+					continue;
+				}
+
+				prefixlist = c->GetPrefixChar(i->first);
+				nick = i->first->nick;
+
+				FOREACH_MOD(OnNamesListItem, (user, i->second, prefixlist, nick));
+
+				/* Nick was nuked, a module wants us to skip it */
+				if (nick.empty())
+					continue;
+
+				/* list overflowed into multiple numerics, the rest is sent by the next call */
+				if (has_one && list.size() + prefixlist.length() + nick.length() + 1 > 480)
+					break;
+
+				list.append(prefixlist).append(nick).push_back(' ');
+				last = i->first;
+				has_one = true;
+			}
+
+			/* if whats left in the list isnt empty, send it */
+			if (has_one)
+				user->WriteNumeric(RPL_NAMREPLY, list);
+
+			if (i != users->end())
+				return true;
+
+			user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", name.c_str());
+			return false;
+		}
+	};
+
+	/** Sends the lines of a cached NAMES list, the lines are shared with the cache
+	 */
+	class CachedNamesProducer : public ReplyProducer
+	{
+		const std::string name;
+		const std::string header;
+		NamesChunkList chunks;
+		NamesChunkList::size_type pos;
+
+	 public:
+		CachedNamesProducer(const std::string& chan, const std::string& head, const NamesChunkList& lines)
+			: ReplyProducer(NULL), name(chan), header(head), chunks(lines), pos(0)
+		{
+		}
+
+		bool Produce(User* user)
+		{
+			while (pos < chunks.size())
+			{
+				const std::string& text = chunks[pos++]->text;
+				if (!text.empty())
+				{
+					user->WriteNumeric(RPL_NAMREPLY, header + text);
+					return true;
+				}
+			}
+
+			user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", name.c_str());
+			return false;
+		}
+	};
+
+	/** Check that every module changing NAMES entries also tells which variant of the list a user gets.
+	 * Must be called after OnNamesListVariant was run so modules not implementing it are detached.
+	 */
+	bool CanCacheNames()
+	{
+		const IntModuleList& items = ServerInstance->Modules->EventHandlers[I_OnNamesListItem];
+		const IntModuleList& variants = ServerInstance->Modules->EventHandlers[I_OnNamesListVariant];
+		for (IntModuleList::const_iterator i = items.begin(); i != items.end(); ++i)
+		{
+			if (std::find(variants.begin(), variants.end(), *i) == variants.end())
+				return false;
+		}
+		return true;
+	}
+
+	/** Get a line of a cached NAMES list for changing it, the line is copied if it is being sent
+	 */
+	NamesChunk* GetWritableChunk(NamesVariant& variant, size_t index)
+	{
+		reference<NamesChunk>& chunk = variant.chunks[index];
+		if (chunk->GetReferenceCount() > 1)
+		{
+			NamesChunk* copy = new NamesChunk;
+			copy->text = chunk->text;
+			chunk = copy;
+		}
+		return chunk;
+	}
+
+	/** Add an entry to the last line of a cached NAMES list, or to a new line if it does not fit
+	 */
+	void AddNamesEntry(NamesVariant& variant, User* user, const std::string& entry, size_t maxlen)
+	{
+		if (variant.chunks.empty() || variant.chunks.back()->text.length() + entry.length() + 1 > maxlen)
+			variant.chunks.push_back(new NamesChunk);
+
+		size_t index = variant.chunks.size() - 1;
+		GetWritableChunk(variant, index)->text.append(entry).push_back(' ');
+		variant.entries[user] = std::make_pair(index, entry);
+		variant.used += entry.length() + 1;
+	}
+
+	/** Remove the entry of a user from a cached NAMES list, if there is one
+	 */
+	void RemoveNamesEntry(NamesVariant& variant, User* user)
+	{
+		std::map<User*, std::pair<size_t, std::string> >::iterator it = variant.entries.find(user);
+		if (it == variant.entries.end())
+			return;
+
+		const std::string& entry = it->second.second;
+		std::string& text = GetWritableChunk(variant, it->second.first)->text;
+		for (std::string::size_type pos = text.find(entry); pos != std::string::npos; pos = text.find(entry, pos + 1))
+		{
+			// Only match whole entries, not the end of a longer one
+			if ((pos == 0 || text[pos - 1] == ' ') && text.compare(pos + entry.length(), 1, " ") == 0)
+			{
+				text.erase(pos, entry.length() + 1);
+				break;
+			}
+		}
+
+		variant.used -= entry.length() + 1;
+		variant.unused += entry.length() + 1;
+		variant.entries.erase(it);
+	}
+
+	/** Rebuild the lines of a cached NAMES list without the gaps left by removed entries
+	 */
+	void CompactNames(NamesVariant& variant, size_t maxlen)
+	{
+		std::map<User*, std::pair<size_t, std::string> > entries;
+		entries.swap(variant.entries);
+		variant.chunks.clear();
+		variant.used = variant.unused = 0;
+		for (std::map<User*, std::pair<size_t, std::string> >::const_iterator i = entries.begin(); i != entries.end(); ++i)
+			AddNamesEntry(variant, i->first, i->second.second, maxlen);
+	}
+}
+
 void Channel::UserList(User *user)
 {
 	bool has_privs = user->HasPrivPermission("channels/auspex");
@@ -661,65 +1017,83 @@ void Channel::UserList(User *user)
 		return;
 	}
 
-	std::string list;
-	list.push_back(this->IsModeSet(secretmode) ? '@' : this->IsModeSet(privatemode) ? '*' : '=');
-	list.push_back(' ');
-	list.append(this->name).append(" :");
-	std::string::size_type pos = list.size();
+	bool has_user = this->HasUser(user);
 
-	bool has_one = false;
+	std::string variantname(1, (has_user || has_privs) ? 'i' : '-');
+	ModResult MOD_RESULT;
+	FIRST_MOD_RESULT(OnNamesListVariant, MOD_RESULT, (user, this, variantname));
+	if (MOD_RESULT == MOD_RES_DENY || !CanCacheNames())
+	{
+		/* Large channels are sent a line at a time as the sendq of the user allows */
+		user->AddReplyProducer(new NamesProducer(this, has_user, has_privs));
+		return;
+	}
 
-	/* Improvement by Brain - this doesnt change in value, so why was it inside
-	 * the loop?
-	 */
-	bool has_user = this->HasUser(user);
+	std::string header;
+	header.push_back(this->IsModeSet(secretmode) ? '@' : this->IsModeSet(privatemode) ? '*' : '=');
+	header.push_back(' ');
+	header.append(this->name).append(" :");
+	const size_t maxlen = 480 - header.length();
 
+	if (!namescache)
+		namescache = new NamesCache;
+
+	std::map<std::string, NamesVariant>::iterator it = namescache->variants.find(variantname);
+	if (it == namescache->variants.end())
+	{
+		/* First user to see this variant, build the entries of every member */
+		it = namescache->variants.insert(std::make_pair(variantname, NamesVariant())).first;
+		for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+			it->second.pending.insert(i->first);
+	}
+
+	NamesVariant& variant = it->second;
 	std::string prefixlist;
 	std::string nick;
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+	for (std::set<User*>::const_iterator i = variant.pending.begin(); i != variant.pending.end(); ++i)
 	{
-		if (i->first->quitting)
+		UserMembIter memb = userlist.find(*i);
+		if (memb == userlist.end() || memb->first->quitting)
 			continue;
-		if ((!has_user) && (i->first->IsModeSet(invisiblemode)) && (!has_privs))
-		{
-			/*
-			 * user is +i, and source not on the channel, does not show
-			 * nick in NAMES list
-			 */
+
+		/* +i users are only in the lists of members and users with channels/auspex */
+		if (variantname[0] != 'i' && memb->first->IsModeSet(invisiblemode))
 			continue;
-		}
 
-		prefixlist = this->GetPrefixChar(i->first);
-		nick = i->first->nick;
+		prefixlist = this->GetPrefixChar(memb->first);
+		nick = memb->first->nick;
 
-		FOREACH_MOD(OnNamesListItem, (user, i->second, prefixlist, nick));
+		/* Any user with the same variant gets the same result from this */
+		FOREACH_MOD(OnNamesListItem, (user, memb->second, prefixlist, nick));
 
 		/* Nick was nuked, a module wants us to skip it */
 		if (nick.empty())
 			continue;
 
-		if (list.size() + prefixlist.length() + nick.length() + 1 > 480)
-		{
-			/* list overflowed into multiple numerics */
-			user->WriteNumeric(RPL_NAMREPLY, list);
+		AddNamesEntry(variant, memb->first, prefixlist + nick, maxlen);
+	}
+	variant.pending.clear();
 
-			// Erase all nicks, keep the constant part
-			list.erase(pos);
-			has_one = false;
-		}
+	if (variant.unused > 4096 && variant.unused > variant.used)
+		CompactNames(variant, maxlen);
 
-		list.append(prefixlist).append(nick).push_back(' ');
+	user->AddReplyProducer(new CachedNamesProducer(this->name, header, variant.chunks));
+}
 
-		has_one = true;
-	}
+void Channel::UpdateNamesCache(User* user)
+{
+	if (!namescache)
+		return;
 
-	/* if whats left in the list isnt empty, send it */
-	if (has_one)
+	bool member = (!user->quitting && userlist.find(user) != userlist.end());
+	for (std::map<std::string, NamesVariant>::iterator i = namescache->variants.begin(); i != namescache->variants.end(); ++i)
 	{
-		user->WriteNumeric(RPL_NAMREPLY, list);
+		RemoveNamesEntry(i->second, user);
+		if (member)
+			i->second.pending.insert(user);
+		else
+			i->second.pending.erase(user);
 	}
-
-	user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", this->name.c_str());
 }
 
 /* returns the status character for a given user on a channel, e.g. @ for op,
@@ -748,6 +1122,16 @@ const char* Channel::GetPrefixChar(User *user)
 	return pf;
 }
 
+void* Membership::operator new(size_t size)
+{
+	return membershipslab.Allocate(size);
+}
+
+void Membership::operator delete(void* ptr, size_t size)
+{
+	membershipslab.Deallocate(ptr, size);
+}
+
 unsigned int Membership::getRank()
 {
 	char mchar = modes.c_str()[0];
@@ -792,6 +1176,8 @@ unsigned int Channel::GetPrefixValue(User* user)
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
 	char prefix = delta_mh->GetModeChar();
+	bool changed = adding;
+	bool found = false;
 	for (unsigned int i = 0; i < modes.length(); i++)
 	{
 		char mchar = modes[i];
@@ -801,12 +1187,27 @@ bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 			modes = modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+			changed = (adding != (mchar == prefix));
+			found = true;
+			break;
 		}
 	}
-	if (adding)
+	if (adding && !found)
 		modes.push_back(prefix);
-	return adding;
+
+	if (changed)
+		chan->UpdateNamesCache(user);
+	return changed;
+}
+
+void* Invitation::operator new(size_t size)
+{
+	return invitationslab.Allocate(size);
+}
+
+void Invitation::operator delete(void* ptr, size_t size)
+{
+	invitationslab.Deallocate(ptr, size);
 }
 
 void Invitation::Create(Channel* c, LocalUser* u, time_t timeout)
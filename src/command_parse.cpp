@@ -304,11 +304,15 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	{
 		/* passed all checks.. first, do the (ugly) stats counters. */
 		handler->use_count++;
+		unsigned long long start = LatencyHistogram::GetTimestamp();
 
 		/* module calls too */
 		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, true, cmd));
 		if (MOD_RESULT == MOD_RES_DENY)
+		{
+			handler->latency.Record(LatencyHistogram::GetTimestamp() - start);
 			return;
+		}
 
 		/*
 		 * WARNING: be careful, the user may be deleted soon
@@ -316,6 +320,7 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		CmdResult result = handler->Handle(command_p, user);
 
 		FOREACH_MOD(OnPostCommand, (handler, command_p, user, result, cmd));
+		handler->latency.Record(LatencyHistogram::GetTimestamp() - start);
 	}
 }
 
@@ -20,6 +20,76 @@
 
 #include "inspircd.h"
 
+/** Sends the channel list as the sendq of the user allows
+ */
+class ListProducer : public ReplyProducer
+{
+	/** Names of the channels which existed when the LIST was requested */
+	std::vector<std::string> names;
+	std::vector<std::string>::size_type pos;
+
+	const long minusers;
+	const long maxusers;
+	const std::string mask;
+	const bool has_privs;
+	ChanModeReference& secretmode;
+	ChanModeReference& privatemode;
+
+ public:
+	ListProducer(Module* mod, long minu, long maxu, const std::string& listmask, bool hasprivs, ChanModeReference& secret, ChanModeReference& priv)
+		: ReplyProducer(mod), pos(0), minusers(minu), maxusers(maxu), mask(listmask), has_privs(hasprivs)
+		, secretmode(secret), privatemode(priv)
+	{
+		names.reserve(ServerInstance->chanlist->size());
+		for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+			names.push_back(i->first);
+	}
+
+	bool Produce(User* user)
+	{
+		while (pos < names.size())
+		{
+			Channel* chan = ServerInstance->FindChan(names[pos++]);
+			if (!chan)
+				continue;
+
+			// attempt to match a glob pattern
+			long users = chan->GetUserCounter();
+
+			bool too_few = (minusers && (users <= minusers));
+			bool too_many = (maxusers && (users >= maxusers));
+
+			if (too_many || too_few)
+				continue;
+
+			if (!mask.empty())
+			{
+				if (!InspIRCd::Match(chan->name, mask) && !InspIRCd::Match(chan->topic, mask))
+					continue;
+			}
+
+			// if the channel is not private/secret, OR the user is on the channel anyway
+			bool n = (has_privs || chan->HasUser(user));
+
+			if (!n && chan->IsModeSet(privatemode))
+			{
+				/* Channel is +p and user is outside/not privileged */
+				user->WriteNumeric(RPL_LIST, "* %ld :", users);
+				return true;
+			}
+			else if (n || !chan->IsModeSet(secretmode))
+			{
+				/* User is in the channel/privileged, channel is not +s */
+				user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s", chan->name.c_str(), users, chan->ChanModes(n), chan->topic.c_str());
+				return true;
+			}
+		}
+
+		user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+		return false;
+	}
+};
+
 /** Handle /LIST. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -56,6 +126,7 @@ class CommandList : public Command
 CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
 {
 	int minusers = 0, maxusers = 0;
+	std::string mask;
 
 	user->WriteNumeric(RPL_LISTSTART, "Channel :Users Name");
 
@@ -72,41 +143,11 @@ CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User
 		}
 	}
 
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
-	{
-		// attempt to match a glob pattern
-		long users = i->second->GetUserCounter();
-
-		bool too_few = (minusers && (users <= minusers));
-		bool too_many = (maxusers && (users >= maxusers));
+	if (parameters.size() && !parameters[0].empty() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
+		mask = parameters[0];
 
-		if (too_many || too_few)
-			continue;
-
-		if (parameters.size() && !parameters[0].empty() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
-		{
-			if (!InspIRCd::Match(i->second->name, parameters[0]) && !InspIRCd::Match(i->second->topic, parameters[0]))
-				continue;
-		}
-
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (i->second->HasUser(user) || user->HasPrivPermission("channels/auspex"));
-
-		if (!n && i->second->IsModeSet(privatemode))
-		{
-			/* Channel is +p and user is outside/not privileged */
-			user->WriteNumeric(RPL_LIST, "* %ld :", users);
-		}
-		else
-		{
-			if (n || !i->second->IsModeSet(secretmode))
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s",i->second->name.c_str(),users,i->second->ChanModes(n),i->second->topic.c_str());
-			}
-		}
-	}
-	user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+	/* The channels are listed a line at a time as the sendq of the user allows */
+	user->AddReplyProducer(new ListProducer(creator, minusers, maxusers, mask, user->HasPrivPermission("channels/auspex"), secretmode, privatemode));
 
 	return CMD_SUCCESS;
 }
@@ -20,6 +20,36 @@
 
 #include "inspircd.h"
 
+/** Sends the lines of a MOTD file as the sendq of the user allows
+ */
+class MotdProducer : public ReplyProducer
+{
+	/** Name of the file in the configuration file cache, it is looked up again each time
+	 * as the cache is replaced on rehash
+	 */
+	const std::string motd_name;
+	file_cache::size_type pos;
+
+ public:
+	MotdProducer(Module* mod, const std::string& name)
+		: ReplyProducer(mod), motd_name(name), pos(0)
+	{
+	}
+
+	bool Produce(User* user)
+	{
+		ConfigFileCache::iterator motd = ServerInstance->Config->Files.find(motd_name);
+		if (motd != ServerInstance->Config->Files.end() && pos < motd->second.size())
+		{
+			user->SendText(":%s %03d %s :- %s", ServerInstance->Config->ServerName.c_str(), RPL_MOTD, user->nick.c_str(), motd->second[pos++].c_str());
+			return true;
+		}
+
+		user->SendText(":%s %03d %s :End of message of the day.", ServerInstance->Config->ServerName.c_str(), RPL_ENDOFMOTD, user->nick.c_str());
+		return false;
+	}
+};
+
 /** Handle /MOTD. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -69,10 +99,7 @@ CmdResult CommandMotd::Handle (const std::vector<std::string>& parameters, User
 	user->SendText(":%s %03d %s :%s message of the day", ServerInstance->Config->ServerName.c_str(),
 		RPL_MOTDSTART, user->nick.c_str(), ServerInstance->Config->ServerName.c_str());
 
-	for (file_cache::iterator i = motd->second.begin(); i != motd->second.end(); i++)
-		user->SendText(":%s %03d %s :- %s", ServerInstance->Config->ServerName.c_str(), RPL_MOTD, user->nick.c_str(), i->c_str());
-
-	user->SendText(":%s %03d %s :End of message of the day.", ServerInstance->Config->ServerName.c_str(), RPL_ENDOFMOTD, user->nick.c_str());
+	user->AddReplyProducer(new MotdProducer(creator, motd_name));
 
 	return CMD_SUCCESS;
 }
@@ -19,6 +19,7 @@
 
 
 #include "inspircd.h"
+#include "hotrestart.h"
 
 /** Handle /RESTART
  */
@@ -27,7 +28,7 @@ class CommandRestart : public Command
  public:
 	/** Constructor for restart.
 	 */
-	CommandRestart(Module* parent) : Command(parent,"RESTART",1,1) { flags_needed = 'o'; syntax = "<password>"; }
+	CommandRestart(Module* parent) : Command(parent,"RESTART",1,2) { flags_needed = 'o'; syntax = "<password> [HOT]"; }
 	/** Handle command.
 	 * @param parameters The parameters to the comamnd
 	 * @param pcnt The number of parameters passed to teh command
@@ -42,6 +43,17 @@ CmdResult CommandRestart::Handle (const std::vector<std::string>& parameters, Us
 	ServerInstance->Logs->Log("COMMAND", LOG_DEFAULT, "Restart: %s",user->nick.c_str());
 	if (!ServerInstance->PassCompare(user, ServerInstance->Config->restartpass, parameters[0].c_str(), ServerInstance->Config->powerhash))
 	{
+		if ((parameters.size() > 1) && (irc::string(parameters[1].c_str()) == "HOT"))
+		{
+			ServerInstance->SNO->WriteGlobalSno('a', "RESTART HOT command from %s, restarting server without disconnecting clients.", user->GetFullRealHost().c_str());
+
+			// Only returns if the new process could not be started
+			std::string error = HotRestart::Restart();
+			ServerInstance->SNO->WriteGlobalSno('a', "Failed RESTART HOT - %s", error.c_str());
+			user->WriteNotice("*** Hot restart failed: " + error);
+			return CMD_FAILURE;
+		}
+
 		ServerInstance->SNO->WriteGlobalSno('a', "RESTART command from %s, restarting server.", user->GetFullRealHost().c_str());
 
 		ServerInstance->SendError("Server restarting.");
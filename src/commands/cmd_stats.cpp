@@ -21,6 +21,8 @@
 
 #include "inspircd.h"
 #include "xline.h"
+#include "bancache.h"
+#include "slab.h"
 
 #ifdef _WIN32
 #include <psapi.h>
@@ -97,7 +99,8 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 				std::string hook = ls->bind_tag->getString("ssl", "plaintext");
 
 				results.push_back(sn+" 249 "+user->nick+" :"+ ip + ":"+ConvToStr(ls->bind_port)+
-					" (" + type + ", " + hook + ")");
+					" (" + type + ", " + hook + ") accepted " + ConvToStr(ls->accepted) + " refused " + ConvToStr(ls->refused) +
+					" (" + ConvToStr(ls->rejected) + " before admission) rate " + ConvToStr(ls->lastrate) + "/s peak " + ConvToStr(ls->peakrate) + "/s");
 			}
 		}
 		break;
@@ -201,6 +204,26 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			}
 		break;
 
+		/* stats M (time taken to process each command) */
+		case 'M':
+			for (Commandtable::iterator i = ServerInstance->Parser->cmdlist.begin(); i != ServerInstance->Parser->cmdlist.end(); i++)
+			{
+				const LatencyHistogram& hist = i->second->latency;
+				if (hist.GetCount())
+					results.push_back(sn+" 249 "+user->nick+" :"+i->second->name+" "+hist.ToString());
+			}
+		break;
+
+		/* stats J (time taken by the phases of the main loop and loop lag) */
+		case 'J':
+		{
+			for (unsigned int i = 0; i < serverstats::LOOP_PHASES; i++)
+				results.push_back(sn+" 249 "+user->nick+" :"+serverstats::GetLoopPhaseName(i)+" "+ServerInstance->stats->LoopPhases[i].ToString());
+			results.push_back(sn+" 249 "+user->nick+" :busy "+ServerInstance->stats->LoopBusy.ToString());
+			results.push_back(sn+" 249 "+user->nick+" :lag "+ConvToStr(ServerInstance->stats->LoopLag)+"us");
+		}
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
@@ -221,6 +244,14 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Bandwidth out:    "+ConvToStr(kbitpersec_out_s)+" kilobits/sec");
 			results.push_back(sn+" 249 "+user->nick+" :Bandwidth in:     "+ConvToStr(kbitpersec_in_s)+" kilobits/sec");
 
+			const std::vector<SlabAllocator*>& slabs = SlabAllocator::GetAll();
+			for (std::vector<SlabAllocator*>::const_iterator i = slabs.begin(); i != slabs.end(); ++i)
+			{
+				SlabAllocator* slab = *i;
+				results.push_back(sn+" 249 "+user->nick+" :Slab "+slab->name+": "+ConvToStr(slab->inuse)+" in use (peak "+ConvToStr(slab->peak)+
+					"), "+ConvToStr(slab->allocations)+" allocations, "+ConvToStr(slab->slabs)+" slabs ("+ConvToStr(slab->GetReservedBytes() / 1024)+"K)");
+			}
+
 #ifndef _WIN32
 			/* Moved this down here so all the not-windows stuff (look w00tie, I didn't say win32!) is in one ifndef.
 			 * Also cuts out some identical code in both branches of the ifndef. -- Om
@@ -297,6 +328,8 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :nick collisions "+ConvToStr(ServerInstance->stats->statsCollisions));
 			results.push_back(sn+" 249 "+user->nick+" :dns requests "+ConvToStr(ServerInstance->stats->statsDnsGood+ServerInstance->stats->statsDnsBad)+" succeeded "+ConvToStr(ServerInstance->stats->statsDnsGood)+" failed "+ConvToStr(ServerInstance->stats->statsDnsBad));
 			results.push_back(sn+" 249 "+user->nick+" :connection count "+ConvToStr(ServerInstance->stats->statsConnects));
+			results.push_back(sn+" 249 "+user->nick+" :bancache entries "+ConvToStr(ServerInstance->BanCache->size())+" hits "+ConvToStr(ServerInstance->BanCache->Hits)+
+				" (range "+ConvToStr(ServerInstance->BanCache->RangeHits)+") misses "+ConvToStr(ServerInstance->BanCache->Misses)+" evicted "+ConvToStr(ServerInstance->BanCache->Evictions));
 			results.push_back(InspIRCd::Format("%s 249 %s :bytes sent %5.2fK recv %5.2fK", sn.c_str(), user->nick.c_str(),
 				ServerInstance->stats->statsSent / 1024.0, ServerInstance->stats->statsRecv / 1024.0));
 		}
@@ -20,6 +20,34 @@
 
 #include "inspircd.h"
 
+/** Sends the lines of a WHO reply as the sendq of the user allows
+ */
+class WhoProducer : public ReplyProducer
+{
+	std::vector<std::string> lines;
+	std::vector<std::string>::size_type pos;
+	const std::string mask;
+
+ public:
+	WhoProducer(Module* mod, std::vector<std::string>& whoresults, const std::string& whomask)
+		: ReplyProducer(mod), pos(0), mask(whomask)
+	{
+		lines.swap(whoresults);
+	}
+
+	bool Produce(User* user)
+	{
+		if (pos < lines.size())
+		{
+			user->WriteServ(lines[pos++]);
+			return true;
+		}
+
+		user->WriteNumeric(RPL_ENDOFWHO, "%s :End of /WHO list.", mask.empty() ? "*" : mask.c_str());
+		return false;
+	}
+};
+
 /** Handle /WHO. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -385,15 +413,13 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 			}
 		}
 	}
-	/* Send the results out */
-	for (std::vector<std::string>::const_iterator n = whoresults.begin(); n != whoresults.end(); n++)
-		user->WriteServ(*n);
-	user->WriteNumeric(RPL_ENDOFWHO, "%s :End of /WHO list.", *parameters[0].c_str() ? parameters[0].c_str() : "*");
-
 	// Penalize the user a bit for large queries
 	// (add one unit of penalty per 200 results)
 	if (IS_LOCAL(user))
 		IS_LOCAL(user)->CommandFloodPenalty += whoresults.size() * 5;
+
+	/* Send the results out */
+	user->AddReplyProducer(new WhoProducer(creator, whoresults, parameters[0]));
 	return CMD_SUCCESS;
 }
 
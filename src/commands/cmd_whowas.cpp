@@ -31,6 +31,47 @@ CommandWhowas::CommandWhowas( Module* parent)
 	Penalty = 2;
 }
 
+/** Sends the WHOWAS entries of a nick an entry at a time as the sendq of the user allows
+ */
+class WhowasProducer : public ReplyProducer
+{
+	const std::string nick;
+	std::vector<WhoWasGroup> entries;
+	std::vector<WhoWasGroup>::size_type pos;
+
+ public:
+	WhowasProducer(Module* mod, const std::string& whowasnick, const whowas_set& grp)
+		: ReplyProducer(mod), nick(whowasnick), pos(0)
+	{
+		entries.reserve(grp.size());
+		for (whowas_set::const_iterator i = grp.begin(); i != grp.end(); ++i)
+			entries.push_back(**i);
+	}
+
+	bool Produce(User* user)
+	{
+		if (pos == entries.size())
+		{
+			user->WriteNumeric(RPL_ENDOFWHOWAS, "%s :End of WHOWAS", nick.c_str());
+			return false;
+		}
+
+		const WhoWasGroup* u = &entries[pos++];
+
+		user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", nick.c_str(),
+			u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
+
+		if (user->HasPrivPermission("users/auspex"))
+			user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
+				nick.c_str(), u->host.c_str());
+
+		std::string signon = InspIRCd::TimeString(u->signon);
+		bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
+		user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", nick.c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->server.c_str()), signon.c_str());
+		return true;
+	}
+};
+
 CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, User* user)
 {
 	/* if whowas disabled in config */
@@ -40,7 +81,7 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		return CMD_FAILURE;
 	}
 
-	whowas_users::iterator i = whowas.find(assign(parameters[0]));
+	whowas_users::iterator i = whowas.find(parameters[0]);
 
 	if (i == whowas.end())
 	{
@@ -51,21 +92,9 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		whowas_set* grp = i->second;
 		if (!grp->empty())
 		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-
-				user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
-
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
-						parameters[0].c_str(), u->host.c_str());
-
-				std::string signon = InspIRCd::TimeString(u->signon);
-				bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
-				user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->server.c_str()), signon.c_str());
-			}
+			/* The entries are copied, they may be pruned before the reply is complete */
+			user->AddReplyProducer(new WhowasProducer(creator, parameters[0], *grp));
+			return CMD_SUCCESS;
 		}
 		else
 		{
@@ -100,7 +129,7 @@ void CommandWhowas::AddToWhoWas(User* user)
 
 	// Insert nick if it doesn't exist
 	// 'first' will point to the newly inserted element or to the existing element with an equivalent key
-	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(irc::string(user->nick.c_str()), static_cast<whowas_set*>(NULL)));
+	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(user->nick, static_cast<whowas_set*>(NULL)));
 
 	if (ret.second) // If inserted
 	{
@@ -36,12 +36,16 @@ ServerConfig::ServerConfig()
 	dns_timeout = 5;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
+	IOThreadCount = 0;
 	SoftLimit = ServerInstance->SE->GetMaxFds();
 	MaxConn = SOMAXCONN;
 	MaxChans = 20;
 	OperMaxChans = 30;
 	c_ipv4_range = 32;
 	c_ipv6_range = 128;
+	c_ipv4_bancache_range = 32;
+	c_ipv6_bancache_range = 128;
+	BanCacheSize = 65536;
 }
 
 static void ValidHost(const std::string& p, const std::string& msg)
@@ -385,6 +389,7 @@ void ServerConfig::Fill()
 	AdminEmail = ConfValue("admin")->getString("email", "null@example.com");
 	AdminNick = ConfValue("admin")->getString("nick", "admin");
 	NetBufferSize = ConfValue("performance")->getInt("netbuffersize", 10240, 1024, 65534);
+	IOThreadCount = ConfValue("performance")->getInt("iothreads", 0, 0, 64);
 	dns_timeout = ConfValue("dns")->getInt("timeout", 5);
 	DisabledCommands = ConfValue("disabled")->getString("commands", "");
 	DisabledDontExist = ConfValue("disabled")->getBool("fakenonexistant");
@@ -407,6 +412,9 @@ void ServerConfig::Fill()
 	OperMaxChans = ConfValue("channels")->getInt("opers", 60);
 	c_ipv4_range = ConfValue("cidr")->getInt("ipv4clone", 32);
 	c_ipv6_range = ConfValue("cidr")->getInt("ipv6clone", 128);
+	c_ipv4_bancache_range = ConfValue("cidr")->getInt("ipv4bancache", 32, 0, 32);
+	c_ipv6_bancache_range = ConfValue("cidr")->getInt("ipv6bancache", 128, 0, 128);
+	BanCacheSize = ConfValue("performance")->getInt("bancachesize", 65536, 1);
 	Limits.NickMax = ConfValue("limits")->getInt("maxnick", 32);
 	Limits.ChanMax = ConfValue("limits")->getInt("maxchan", 64);
 	Limits.MaxModes = ConfValue("limits")->getInt("maxmodes", 20);
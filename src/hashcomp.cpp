@@ -23,6 +23,10 @@
 #include "inspircd.h"
 #include "hashcomp.h"
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 /******************************************************
  *
  * The hash functions of InspIRCd are the centrepoint
@@ -152,55 +156,174 @@ unsigned const char rfc_case_sensitive_map[256] = {
 	250, 251, 252, 253, 254, 255,                     // 250-255
 };
 
+/* The RFC 1459 and ASCII casemaps only differ from the identity map in one range of
+ * characters which are folded by adding 32, strings using them are folded 16 characters
+ * at a time with SSE2. Custom casemaps, e.g. those of m_nationalchars, use their table.
+ */
+namespace
+{
+	/** Get the last character folded by the current casemap if it can be folded with
+	 * vector instructions, the first one is always 'A'
+	 * @return The last folded character or 0 if the table must be used
+	 */
+	inline unsigned char GetFoldLast()
+	{
+#ifdef __SSE2__
+		if (national_case_insensitive_map == rfc_case_insensitive_map)
+			return ']';
+		if (national_case_insensitive_map == ascii_case_insensitive_map)
+			return 'Z';
+#endif
+		return 0;
+	}
+
+#ifdef __SSE2__
+	/** Load up to 16 characters into a vector without reading past them, the rest is zeroed */
+	inline __m128i LoadBlock(const unsigned char* src, size_t len)
+	{
+		if (len == 16)
+			return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+		// Overlapping loads of the start and the end, shifted so nothing is read twice
+		uint64_t lo = 0;
+		uint64_t hi = 0;
+		uint32_t a, b;
+		if (len > 8)
+		{
+			memcpy(&lo, src, 8);
+			memcpy(&hi, src + len - 8, 8);
+			hi >>= 8 * (16 - len);
+		}
+		else if (len >= 4)
+		{
+			memcpy(&a, src, 4);
+			memcpy(&b, src + len - 4, 4);
+			lo = a | (static_cast<uint64_t>(b) << (8 * (len - 4)));
+		}
+		else
+		{
+			for (size_t i = 0; i < len; i++)
+				lo |= static_cast<uint64_t>(src[i]) << (8 * i);
+		}
+		return _mm_set_epi64x(hi, lo);
+	}
+
+	inline __m128i FoldVector(__m128i v, __m128i first, __m128i last)
+	{
+		// Characters above 127 are negative and never in the range
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, first), _mm_cmplt_epi8(v, last));
+		return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(32)));
+	}
+#endif
+
+	/** Fold up to 16 characters, the rest of the block is zeroed
+	 * @param src The characters to fold
+	 * @param len The number of characters, at most 16
+	 * @param dst Receives the 16 folded characters
+	 * @param last The result of GetFoldLast()
+	 */
+	inline void FoldBlock(const unsigned char* src, size_t len, unsigned char* dst, unsigned char last)
+	{
+#ifdef __SSE2__
+		if (last)
+		{
+			__m128i v = FoldVector(LoadBlock(src, len), _mm_set1_epi8('A' - 1), _mm_set1_epi8(last + 1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v);
+			return;
+		}
+#endif
+		size_t i = 0;
+		for (; i < len; i++)
+			dst[i] = national_case_insensitive_map[src[i]];
+		for (; i < 16; i++)
+			dst[i] = 0;
+	}
+
+	/** Hash a string after folding it, the hash is the same whether or not it is folded with vector instructions */
+	size_t FoldedHash(const unsigned char* str, size_t len)
+	{
+		const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+		const unsigned char last = GetFoldLast();
+		uint64_t t = len;
+		uint64_t words[2];
+		for (size_t pos = 0; pos < len; pos += 16)
+		{
+			FoldBlock(str + pos, std::min<size_t>(len - pos, 16), reinterpret_cast<unsigned char*>(words), last);
+			t = (t ^ words[0]) * mul;
+			t ^= t >> 29;
+			t = (t ^ words[1]) * mul;
+			t ^= t >> 32;
+		}
+		return static_cast<size_t>(t);
+	}
+
+	/** Compare two strings of the same length after folding them
+	 * @return Zero if they are equal, less than zero if the first folded difference is lower in str1 and greater otherwise
+	 */
+	int FoldedCompare(const unsigned char* str1, const unsigned char* str2, size_t len)
+	{
+		size_t i = 0;
+#ifdef __SSE2__
+		const unsigned char last = GetFoldLast();
+		if (last)
+		{
+			const __m128i first = _mm_set1_epi8('A' - 1);
+			const __m128i after = _mm_set1_epi8(last + 1);
+			for (; i < len; i += 16)
+			{
+				size_t count = std::min<size_t>(len - i, 16);
+				__m128i v1 = LoadBlock(str1 + i, count);
+				__m128i v2 = LoadBlock(str2 + i, count);
+				unsigned int diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(FoldVector(v1, first, after), FoldVector(v2, first, after))) & 0xFFFF;
+				if (diff)
+				{
+					// Let the table find out which one is greater
+					i += __builtin_ctz(diff);
+					break;
+				}
+			}
+		}
+#endif
+		for (; i < len; i++)
+		{
+			unsigned char c1 = national_case_insensitive_map[str1[i]];
+			unsigned char c2 = national_case_insensitive_map[str2[i]];
+			if (c1 != c2)
+				return c1 < c2 ? -1 : 1;
+		}
+		return 0;
+	}
+}
+
 size_t CoreExport irc::hash::operator()(const irc::string &s) const
 {
-	register size_t t = 0;
-	for (irc::string::const_iterator x = s.begin(); x != s.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
-	return t;
+	return FoldedHash(reinterpret_cast<const unsigned char*>(s.data()), s.length());
 }
 
 bool irc::StrHashComp::operator()(const std::string& s1, const std::string& s2) const
 {
-	const unsigned char* n1 = (const unsigned char*)s1.c_str();
-	const unsigned char* n2 = (const unsigned char*)s2.c_str();
-	for (; *n1 && *n2; n1++, n2++)
-		if (national_case_insensitive_map[*n1] != national_case_insensitive_map[*n2])
-			return false;
-	return (national_case_insensitive_map[*n1] == national_case_insensitive_map[*n2]);
+	if (s1.length() != s2.length())
+		return false;
+	return !FoldedCompare(reinterpret_cast<const unsigned char*>(s1.data()), reinterpret_cast<const unsigned char*>(s2.data()), s1.length());
 }
 
 bool irc::insensitive_swo::operator()(const std::string& a, const std::string& b) const
 {
-	const unsigned char* charmap = national_case_insensitive_map;
 	std::string::size_type asize = a.size();
 	std::string::size_type bsize = b.size();
-	std::string::size_type maxsize = std::min(asize, bsize);
-
-	for (std::string::size_type i = 0; i < maxsize; i++)
-	{
-		unsigned char A = charmap[(unsigned char)a[i]];
-		unsigned char B = charmap[(unsigned char)b[i]];
-		if (A > B)
-			return false;
-		else if (A < B)
-			return true;
-	}
+	int res = FoldedCompare(reinterpret_cast<const unsigned char*>(a.data()), reinterpret_cast<const unsigned char*>(b.data()), std::min(asize, bsize));
+	if (res)
+		return (res < 0);
 	return (asize < bsize);
 }
 
 size_t irc::insensitive::operator()(const std::string &s) const
 {
 	/* XXX: NO DATA COPIES! :)
-	 * The hash function here is practically
-	 * a copy of the one in STL's hash_fun.h,
-	 * only with *x replaced with national_case_insensitive_map[*x].
-	 * This avoids a copy to use hash<const char*>
+	 * The string is folded in blocks on the stack and hashed a word at a time,
+	 * irc::hash gives the same result for the same characters.
 	 */
-	register size_t t = 0;
-	for (std::string::const_iterator x = s.begin(); x != s.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
-	return t;
+	return FoldedHash(reinterpret_cast<const unsigned char*>(s.data()), s.length());
 }
 
 /******************************************************
@@ -231,21 +354,7 @@ bool irc::irc_char_traits::lt(char c1st, char c2nd)
 
 int irc::irc_char_traits::compare(const char* str1, const char* str2, size_t n)
 {
-	for(unsigned int i = 0; i < n; i++)
-	{
-		if(national_case_insensitive_map[(unsigned char)*str1] > national_case_insensitive_map[(unsigned char)*str2])
-			return 1;
-
-		if(national_case_insensitive_map[(unsigned char)*str1] < national_case_insensitive_map[(unsigned char)*str2])
-			return -1;
-
-		if(*str1 == 0 || *str2 == 0)
-		   	return 0;
-
-		str1++;
-		str2++;
-	}
-	return 0;
+	return FoldedCompare(reinterpret_cast<const unsigned char*>(str1), reinterpret_cast<const unsigned char*>(str2), n);
 }
 
 const char* irc::irc_char_traits::find(const char* s1, int  n, char c)
@@ -0,0 +1,815 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "hotrestart.h"
+#include "listmode.h"
+#include "xline.h"
+#include "modules/cap.h"
+
+/*
+ * The state file is made of lines in the format of IRC messages, the parameter
+ * after the last colon may contain spaces. Users come first, followed by channels:
+ *
+ * HANDOFF <version> <seconds> <nanoseconds>
+ * LISTEN <fd> <bind_desc>
+ * XLINE <type> <mask> <source> <settime> <duration> :<reason>
+ * USER <uuid> <fd> <nick> <ident> <host> <dhost> <ip> <port> <server ip> <server port> <age> <signon> <idle> +<umodes> +<snomasks> <oper> <awaytime> :<realname>
+ * UAWAY <uuid> :<message>
+ * UCAPS <uuid> :<capabilities>
+ * USENDQ <uuid> <hex data>
+ * URECVQ <uuid> <hex data>
+ * UEXT <uuid> <name> :<value>
+ * CHAN <name> <age> <topicset> <setby> :<topic>
+ * CMODE <name> +<modes> [<params>]
+ * CLIST <name> <mode> <mask> <setter> <time>
+ * CEXT <name> <ext> :<value>
+ * MEMB <name> <uuid> +<prefix modes>
+ * MEXT <name> <uuid> <ext> :<value>
+ * END
+ *
+ * The uuids are those of the old process, users get a new uuid after the restart.
+ */
+
+namespace
+{
+	const char* const HANDOFF_ENV = "INSPIRCD_HANDOFF";
+	const char* const HANDOFF_VERSION = "1";
+
+	/** True if this process was started by a hot restart */
+	bool resuming = false;
+
+	/** When the previous process started the restart, in seconds and nanoseconds */
+	time_t restartsec;
+	long restartnsec;
+
+	/** Listeners which were inherited and not taken over yet, by bind_desc */
+	std::map<std::string, int> listeners;
+
+	/** Lines of the state file which are processed by HotRestart::Resume() */
+	std::vector<std::string> statelines;
+
+	/** Users restored by HotRestart::Load(), by their uuid in the previous process */
+	std::map<std::string, LocalUser*> restoredusers;
+
+	/** User modes of the restored users, modes of modules can only be set once they are loaded */
+	std::map<LocalUser*, std::string> pendingumodes;
+
+	std::string HexToBin(const std::string& hex)
+	{
+		std::string bin;
+		bin.reserve(hex.length() / 2);
+		for (std::string::size_type i = 0; i + 1 < hex.length(); i += 2)
+			bin.push_back(static_cast<char>(strtoul(hex.substr(i, 2).c_str(), NULL, 16)));
+		return bin;
+	}
+
+	/** Placeholder for strings which may be empty, but aren't the last parameter */
+	std::string OrStar(const std::string& str)
+	{
+		return (str.empty() ? "*" : str);
+	}
+
+	std::string FromStar(const std::string& str)
+	{
+		return (str == "*" ? "" : str);
+	}
+
+	void SerializeExtensions(std::string& out, const std::string& prefix, const Extensible* container)
+	{
+		const Extensible::ExtensibleStore& list = container->GetExtList();
+		for (Extensible::ExtensibleStore::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			ExtensionItem* item = i->first;
+			std::string value = item->serialize(FORMAT_INTERNAL, container, i->second);
+			if ((value.empty()) || (value.find_first_of("\r\n") != std::string::npos))
+				continue;
+			out.append(prefix).append(" ").append(item->name).append(" :").append(value).push_back('\n');
+		}
+	}
+
+	void UnserializeExtension(Extensible* container, const std::string& name, const std::string& value)
+	{
+		ExtensionItem* item = ServerInstance->Extensions.GetItem(name);
+		if (item)
+			item->unserialize(FORMAT_INTERNAL, container, value);
+	}
+
+	std::string GetUserModes(User* user)
+	{
+		std::string modes("+");
+		for (unsigned char c = 'A'; c <= 'z'; c++)
+		{
+			if ((ServerInstance->Modes->FindMode(c, MODETYPE_USER)) && (user->IsModeSet(c)))
+				modes.push_back(c);
+		}
+		return modes;
+	}
+
+	void SetUserModes(LocalUser* user, const std::string& modes)
+	{
+		for (std::string::const_iterator i = modes.begin(); i != modes.end(); ++i)
+		{
+			ModeHandler* mh = ServerInstance->Modes->FindMode(*i, MODETYPE_USER);
+			if (mh)
+				user->SetMode(mh, true);
+		}
+	}
+
+	/** Queue the quit of a local user who is not handed over for the handed over users who can see it
+	 * @param user The user who is left behind
+	 * @param handedover The users who are handed over
+	 * @param quits Receives the quit lines by recipient, they are added to the sendq in the state file
+	 */
+	void QueueQuit(LocalUser* user, const std::set<LocalUser*>& handedover, std::map<LocalUser*, std::string>& quits)
+	{
+		if (user->registered != REG_ALL)
+			return;
+
+		already_sent_t uniq_id = ++LocalUser::already_sent_id;
+		const std::string line = ":" + user->GetFullHost() + " QUIT :Server restarting\r\n";
+
+		UserChanList include_c(user->chans);
+		std::map<User*,bool> exceptions;
+		FOREACH_MOD(OnBuildNeighborList, (user, include_c, exceptions));
+
+		for (std::map<User*,bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		{
+			LocalUser* u = IS_LOCAL(i->first);
+			if ((u) && (handedover.count(u)))
+			{
+				u->already_sent = uniq_id;
+				if (i->second)
+					quits[u].append(line);
+			}
+		}
+		for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+		{
+			const UserMembList* ulist = (*v)->GetUsers();
+			for (UserMembCIter i = ulist->begin(); i != ulist->end(); ++i)
+			{
+				LocalUser* u = IS_LOCAL(i->first);
+				if ((u) && (u->already_sent != uniq_id) && (handedover.count(u)))
+				{
+					u->already_sent = uniq_id;
+					quits[u].append(line);
+				}
+			}
+		}
+	}
+
+	/** Write a user to the state
+	 * @param out The state
+	 * @param user The user
+	 * @param extra Lines to send to the user after its sendq
+	 */
+	void SerializeUser(std::string& out, LocalUser* user, const std::string& extra)
+	{
+		std::string snomasks("+");
+		for (unsigned char c = 'A'; c <= 'z'; c++)
+		{
+			if (user->snomasks[c - 'A'])
+				snomasks.push_back(c);
+		}
+
+		std::string oper("*");
+		if (user->IsOper())
+			oper = (user->oper->oper_block ? "B:" + user->oper->oper_block->getString("name") : "T:" + user->oper->name);
+
+		irc::sockets::sockaddrs& server = user->server_sa;
+		out.append("USER ").append(user->uuid).append(" ").append(ConvToStr(user->eh.GetFd()))
+			.append(" ").append(user->nick).append(" ").append(user->ident)
+			.append(" ").append(user->host).append(" ").append(user->dhost)
+			.append(" ").append(user->client_sa.addr()).append(" ").append(ConvToStr(user->client_sa.port()))
+			.append(" ").append(server.addr()).append(" ").append(ConvToStr(server.port()))
+			.append(" ").append(ConvToStr(user->age)).append(" ").append(ConvToStr(user->signon))
+			.append(" ").append(ConvToStr(user->idle_lastmsg)).append(" ").append(GetUserModes(user))
+			.append(" ").append(snomasks).append(" ").append(oper).append(" ").append(ConvToStr(user->awaytime))
+			.append(" :").append(user->fullname).push_back('\n');
+
+		if (user->IsAway())
+			out.append("UAWAY ").append(user->uuid).append(" :").append(user->awaymsg).push_back('\n');
+
+		// The bits of the capabilities may be assigned differently in the new process, pass their names
+		CapEvent caps(NULL, user, CapEvent::CAPEVENT_LIST);
+		caps.Send();
+		if (!caps.wanted.empty())
+			out.append("UCAPS ").append(user->uuid).append(" :").append(irc::stringjoiner(caps.wanted).GetJoined()).push_back('\n');
+
+		std::string sendq;
+		const std::deque<std::string>& queue = user->eh.GetSendQ();
+		for (std::deque<std::string>::const_iterator i = queue.begin(); i != queue.end(); ++i)
+			sendq.append(*i);
+		sendq.append(extra);
+		if (!sendq.empty())
+			out.append("USENDQ ").append(user->uuid).append(" ").append(BinToHex(sendq)).push_back('\n');
+
+		const std::string& recvq = user->eh.GetRecvQ();
+		if (!recvq.empty())
+			out.append("URECVQ ").append(user->uuid).append(" ").append(BinToHex(recvq)).push_back('\n');
+
+		SerializeExtensions(out, "UEXT " + user->uuid, user);
+	}
+
+	void SerializeChannel(std::string& out, Channel* chan, const std::set<LocalUser*>& handedover)
+	{
+		out.append("CHAN ").append(chan->name).append(" ").append(ConvToStr(chan->age))
+			.append(" ").append(ConvToStr(chan->topicset)).append(" ").append(OrStar(chan->setby))
+			.append(" :").append(chan->topic).push_back('\n');
+		out.append("CMODE ").append(chan->name).append(" +").append(chan->ChanModes(true)).push_back('\n');
+
+		const ModeParser::ListModeList& listmodes = ServerInstance->Modes->GetListModes();
+		for (ModeParser::ListModeList::const_iterator i = listmodes.begin(); i != listmodes.end(); ++i)
+		{
+			ListModeBase* lm = *i;
+			ListModeBase::ModeList* list = lm->GetList(chan);
+			if (!list)
+				continue;
+
+			for (ListModeBase::ModeList::const_iterator j = list->begin(); j != list->end(); ++j)
+			{
+				out.append("CLIST ").append(chan->name).append(" ").append(1, lm->GetModeChar())
+					.append(" ").append(j->mask).append(" ").append(OrStar(j->setter))
+					.append(" ").append(ConvToStr(j->time)).push_back('\n');
+			}
+		}
+
+		SerializeExtensions(out, "CEXT " + chan->name, chan);
+
+		const UserMembList* members = chan->GetUsers();
+		for (UserMembCIter i = members->begin(); i != members->end(); ++i)
+		{
+			LocalUser* user = IS_LOCAL(i->first);
+			if ((!user) || (!handedover.count(user)))
+				continue;
+
+			out.append("MEMB ").append(chan->name).append(" ").append(user->uuid).append(" +").append(i->second->modes).push_back('\n');
+			SerializeExtensions(out, "MEXT " + chan->name + " " + user->uuid, i->second);
+		}
+	}
+
+	/** Restore a user from a USER line
+	 * @return The new user, or NULL if the user could not be restored
+	 */
+	LocalUser* RestoreUser(irc::tokenstream& tokens, std::string& olduuid)
+	{
+		std::string fd, nick, ident, host, dhost, ip, port, serverip, serverport, age, signon, idle, umodes, snomasks, oper, awaytime, fullname;
+		tokens.GetToken(olduuid);
+		tokens.GetToken(fd);
+		tokens.GetToken(nick);
+		tokens.GetToken(ident);
+		tokens.GetToken(host);
+		tokens.GetToken(dhost);
+		tokens.GetToken(ip);
+		tokens.GetToken(port);
+		tokens.GetToken(serverip);
+		tokens.GetToken(serverport);
+		tokens.GetToken(age);
+		tokens.GetToken(signon);
+		tokens.GetToken(idle);
+		tokens.GetToken(umodes);
+		tokens.GetToken(snomasks);
+		tokens.GetToken(oper);
+		tokens.GetToken(awaytime);
+		tokens.GetToken(fullname);
+
+		int sockfd = ConvToInt(fd);
+		irc::sockets::sockaddrs client;
+		irc::sockets::sockaddrs server;
+		if ((!irc::sockets::aptosa(ip, ConvToInt(port), client)) || (!irc::sockets::aptosa(serverip, ConvToInt(serverport), server))
+			|| (ServerInstance->FindNickOnly(nick)))
+		{
+			ServerInstance->Logs->Log("HOTRESTART", LOG_DEFAULT, "Unable to restore user %s on fd %d", nick.c_str(), sockfd);
+			ServerInstance->SE->Close(sockfd);
+			return NULL;
+		}
+
+		LocalUser* user = new LocalUser(sockfd, &client, &server);
+		user->nick = nick;
+		user->ident = ident;
+		user->host = host;
+		user->dhost = dhost;
+		user->fullname = fullname;
+		user->age = ConvToInt(age);
+		user->signon = ConvToInt(signon);
+		user->idle_lastmsg = ConvToInt(idle);
+		user->awaytime = ConvToInt(awaytime);
+		user->registered = REG_ALL;
+		user->lastping = 1;
+
+		(*ServerInstance->Users->clientlist)[user->nick] = user;
+		user->localuseriter = ServerInstance->Users->local_users.insert(ServerInstance->Users->local_users.end(), user);
+		ServerInstance->Users->local_count++;
+		ServerInstance->Users->AddLocalClone(user);
+		ServerInstance->Users->AddGlobalClone(user);
+
+		// Modes provided by modules are set by HotRestart::Resume()
+		SetUserModes(user, umodes.substr(1));
+		pendingumodes[user] = umodes.substr(1);
+		for (std::string::const_iterator i = snomasks.begin() + 1; i != snomasks.end(); ++i)
+			user->snomasks[*i - 'A'] = true;
+
+		if (oper != "*")
+		{
+			const OperIndex& index = (oper[0] == 'B' ? ServerInstance->Config->oper_blocks : ServerInstance->Config->OperTypes);
+			OperIndex::const_iterator it = index.find(oper.substr(2));
+			if (it != index.end())
+			{
+				user->oper = it->second;
+				user->oper->init();
+				ServerInstance->Users->all_opers.push_back(user);
+			}
+			else
+			{
+				// The oper block or type was removed from the configuration
+				user->SetMode(ServerInstance->Modes->FindMode('o', MODETYPE_USER), false);
+			}
+		}
+
+		user->SetClass();
+		user->CheckClass(false);
+		if (user->quitting)
+			return NULL;
+
+		user->exempt = (ServerInstance->XLines->MatchesLine("E", user) != NULL);
+		user->nping = ServerInstance->Time() + user->MyClass->GetPingTime();
+		if ((!ServerInstance->IOThreads.Add(&user->eh)) && (!ServerInstance->SE->AddFd(&user->eh, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE)))
+		{
+			ServerInstance->Users->QuitUser(user, "Internal error handling connection");
+			return NULL;
+		}
+		return user;
+	}
+
+	/** Restore the modes of a channel from a CMODE line, modes which are not in the line are removed */
+	void RestoreChannelModes(Channel* chan, irc::tokenstream& tokens)
+	{
+		std::string modes;
+		tokens.GetToken(modes);
+
+		for (unsigned char c = 'A'; c <= 'z'; c++)
+		{
+			ModeHandler* mh = ServerInstance->Modes->FindMode(c, MODETYPE_CHANNEL);
+			if ((mh) && (chan->IsModeSet(mh)) && (modes.find(c) == std::string::npos))
+			{
+				std::string param = chan->GetModeParameter(mh);
+				if ((mh->OnModeChange(ServerInstance->FakeClient, ServerInstance->FakeClient, chan, param, false) == MODEACTION_ALLOW) && (mh->GetNumParams(true)))
+					chan->SetModeParam(mh, "");
+			}
+		}
+
+		for (std::string::const_iterator i = modes.begin() + 1; i != modes.end(); ++i)
+		{
+			ModeHandler* mh = ServerInstance->Modes->FindMode(*i, MODETYPE_CHANNEL);
+			if (!mh)
+				continue;
+
+			std::string param;
+			if (mh->GetNumParams(true))
+				tokens.GetToken(param);
+			else if (chan->IsModeSet(mh))
+				continue;
+			// The parameter is stored by the caller of OnModeChange(), as in ModeParser::TryMode()
+			if ((mh->OnModeChange(ServerInstance->FakeClient, ServerInstance->FakeClient, chan, param, true) == MODEACTION_ALLOW) && (!param.empty()))
+				chan->SetModeParam(mh, param);
+		}
+	}
+
+	void RestoreListEntry(Channel* chan, irc::tokenstream& tokens)
+	{
+		std::string mode, mask, setter, time;
+		tokens.GetToken(mode);
+		tokens.GetToken(mask);
+		tokens.GetToken(setter);
+		tokens.GetToken(time);
+
+		ModeHandler* mh = ServerInstance->Modes->FindMode(mode[0], MODETYPE_CHANNEL);
+		ListModeBase* lm = (mh ? mh->IsListModeBase() : NULL);
+		if ((!lm) || (lm->OnModeChange(ServerInstance->FakeClient, ServerInstance->FakeClient, chan, mask, true) != MODEACTION_ALLOW))
+			return;
+
+		// Keep who set the entry and when
+		ListModeBase::ListItem& item = lm->GetList(chan)->back();
+		item.setter = FromStar(setter);
+		item.time = ConvToInt(time);
+	}
+
+	void RestoreMembership(Channel* chan, irc::tokenstream& tokens)
+	{
+		std::string olduuid, modes;
+		tokens.GetToken(olduuid);
+		tokens.GetToken(modes);
+
+		std::map<std::string, LocalUser*>::const_iterator it = restoredusers.find(olduuid);
+		if ((it == restoredusers.end()) || (it->second->quitting))
+			return;
+
+		// The join is not announced, the members already know about each other
+		LocalUser* user = it->second;
+		Membership* memb = chan->AddUser(user);
+		if (!memb)
+			return;
+		user->chans.insert(chan);
+
+		for (std::string::const_iterator i = modes.begin() + 1; i != modes.end(); ++i)
+		{
+			PrefixMode* pm = ServerInstance->Modes->FindPrefixMode(*i);
+			if (pm)
+				memb->SetPrefix(pm, true);
+		}
+	}
+}
+
+std::string HotRestart::Restart()
+{
+#ifdef _WIN32
+	return "hot restart is not supported on Windows";
+#else
+	ServerInstance->UpdateTime();
+
+	const char* binary = ServerInstance->Config->cmdline.argv[0];
+	if (access(binary, X_OK))
+		return "could not execute '" + std::string(binary) + "' (" + strerror(errno) + ")";
+
+	FILE* f = tmpfile();
+	if (!f)
+		return "could not create the state file (" + std::string(strerror(errno)) + ")";
+
+	// The sockets and their queues have to be on the main thread to be handed over
+	ServerInstance->IOThreads.Stop();
+
+	// Nothing is torn down before the exec, so if it fails the server carries on as before.
+	// Connections which can't be handed over (SSL sessions, unregistered clients) and the
+	// server links are closed by the exec, the remote users come back with the bursts of the
+	// links which are reestablished by the new process.
+	std::vector<int> fds;
+	fds.push_back(fileno(f));
+
+	std::string state = "HANDOFF " + std::string(HANDOFF_VERSION) + " " + ConvToStr(ServerInstance->Time()) + " " + ConvToStr(ServerInstance->Time_ns()) + "\n";
+	for (std::vector<ListenSocket*>::const_iterator i = ServerInstance->ports.begin(); i != ServerInstance->ports.end(); ++i)
+	{
+		ListenSocket* ls = *i;
+		if (ls->GetFd() < 0)
+			continue;
+		state.append("LISTEN ").append(ConvToStr(ls->GetFd())).append(" ").append(ls->bind_desc).push_back('\n');
+		fds.push_back(ls->GetFd());
+	}
+
+	std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
+	for (std::vector<std::string>::const_iterator i = types.begin(); i != types.end(); ++i)
+	{
+		XLineLookup* lookup = ServerInstance->XLines->GetAll(*i);
+		if (!lookup)
+			continue;
+
+		for (LookupIter j = lookup->begin(); j != lookup->end(); ++j)
+		{
+			XLine* line = j->second;
+			state.append("XLINE ").append(line->type).append(" ").append(line->Displayable()).append(" ").append(line->source)
+				.append(" ").append(ConvToStr(line->set_time)).append(" ").append(ConvToStr(line->duration))
+				.append(" :").append(line->reason).push_back('\n');
+		}
+	}
+
+	const LocalUserList& users = ServerInstance->Users->local_users;
+	std::set<LocalUser*> handedover;
+	for (LocalUserList::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		LocalUser* user = *i;
+		if ((user->quitting) || (user->registered != REG_ALL) || (user->eh.GetIOHook()))
+			continue;
+
+		// Send as much as possible now, the rest is queued again by the new process
+		user->eh.DoWrite();
+		if ((!user->quitting) && (user->eh.GetFd() >= 0))
+			handedover.insert(user);
+	}
+
+	// The users who stay see the others leave
+	std::map<LocalUser*, std::string> quits;
+	for (LocalUserList::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if ((!(*i)->quitting) && (!handedover.count(*i)))
+			QueueQuit(*i, handedover, quits);
+	}
+
+	for (LocalUserList::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (!handedover.count(*i))
+			continue;
+
+		std::map<LocalUser*, std::string>::const_iterator quit = quits.find(*i);
+		SerializeUser(state, *i, (quit != quits.end() ? quit->second : ""));
+		fds.push_back((*i)->eh.GetFd());
+	}
+
+	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+		SerializeChannel(state, i->second, handedover);
+	state.append("END\n");
+
+	if ((fwrite(state.data(), 1, state.length(), f) != state.length()) || (fflush(f)))
+	{
+		std::string error = "could not write the state file (" + std::string(strerror(errno)) + ")";
+		fclose(f);
+		ServerInstance->IOThreads.Start();
+		return error;
+	}
+
+	// Close everything except the descriptors which are handed over, see cmd_restart.
+	// The old flags are kept so they can be put back if the exec fails.
+	std::vector<std::pair<int, int> > oldflags;
+	for (int i = getdtablesize(); --i > 2;)
+	{
+		int flags = fcntl(i, F_GETFD);
+		if (flags != -1)
+		{
+			oldflags.push_back(std::make_pair(i, flags));
+			fcntl(i, F_SETFD, flags | FD_CLOEXEC);
+		}
+	}
+	for (std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); ++i)
+		fcntl(*i, F_SETFD, fcntl(*i, F_GETFD) & ~FD_CLOEXEC);
+
+	setenv(HANDOFF_ENV, ConvToStr(fileno(f)).c_str(), 1);
+	execv(binary, ServerInstance->Config->cmdline.argv);
+
+	// Nothing was changed, the server keeps running as if the restart was not attempted
+	std::string error = "could not execute '" + std::string(binary) + "' (" + strerror(errno) + ")";
+	for (std::vector<std::pair<int, int> >::const_iterator i = oldflags.begin(); i != oldflags.end(); ++i)
+		fcntl(i->first, F_SETFD, i->second);
+	unsetenv(HANDOFF_ENV);
+	fclose(f);
+	ServerInstance->IOThreads.Start();
+	return error;
+#endif
+}
+
+void HotRestart::Load()
+{
+#ifndef _WIN32
+	const char* env = getenv(HANDOFF_ENV);
+	if (!env)
+		return;
+
+	int fd = atoi(env);
+	unsetenv(HANDOFF_ENV);
+
+	FILE* f = fdopen(fd, "r");
+	if (!f)
+	{
+		ServerInstance->Logs->Log("HOTRESTART", LOG_DEFAULT, "Unable to open the state file on fd %d: %s", fd, strerror(errno));
+		return;
+	}
+
+	rewind(f);
+	std::vector<std::string> lines;
+	std::string line;
+	char buffer[65536];
+	while (fgets(buffer, sizeof(buffer), f))
+	{
+		line.append(buffer);
+		if (line[line.length() - 1] != '\n')
+			continue;
+		line.erase(line.length() - 1);
+		lines.push_back(line);
+		line.clear();
+	}
+	fclose(f);
+
+	irc::tokenstream header(lines.empty() ? "" : lines[0]);
+	std::string command, version, sec, nsec;
+	header.GetToken(command);
+	header.GetToken(version);
+	header.GetToken(sec);
+	header.GetToken(nsec);
+	if ((command != "HANDOFF") || (version != HANDOFF_VERSION) || (lines.back() != "END"))
+	{
+		ServerInstance->Logs->Log("HOTRESTART", LOG_DEFAULT, "The state file is invalid or incomplete, not resuming");
+		return;
+	}
+
+	resuming = true;
+	restartsec = ConvToInt(sec);
+	restartnsec = ConvToInt(nsec);
+
+	// Listeners and users are restored now, everything else needs the modules to be loaded
+	LocalUser* user = NULL;
+	for (std::vector<std::string>::const_iterator i = lines.begin() + 1; i != lines.end(); ++i)
+	{
+		irc::tokenstream tokens(*i);
+		tokens.GetToken(command);
+
+		if (command == "LISTEN")
+		{
+			std::string listenfd, desc;
+			tokens.GetToken(listenfd);
+			tokens.GetToken(desc);
+			listeners[desc] = ConvToInt(listenfd);
+			continue;
+		}
+
+		if (command == "USER")
+		{
+			std::string olduuid;
+			user = RestoreUser(tokens, olduuid);
+			if (user)
+				restoredusers[olduuid] = user;
+			continue;
+		}
+
+		if ((command == "UAWAY") || (command == "USENDQ") || (command == "URECVQ"))
+		{
+			std::string olduuid, value;
+			tokens.GetToken(olduuid);
+			tokens.GetToken(value);
+			if (!user)
+				continue;
+
+			if (command == "UAWAY")
+				user->awaymsg = value;
+			else if (command == "USENDQ")
+				user->eh.AddWriteBuf(HexToBin(value));
+			else
+				user->eh.GetRecvQ() = HexToBin(value);
+			continue;
+		}
+
+		statelines.push_back(*i);
+	}
+#endif
+}
+
+int HotRestart::TakeListener(const std::string& bind_desc)
+{
+	std::map<std::string, int>::iterator it = listeners.find(bind_desc);
+	if (it == listeners.end())
+		return -1;
+
+	int fd = it->second;
+	listeners.erase(it);
+	return fd;
+}
+
+void HotRestart::Resume()
+{
+	if (!resuming)
+		return;
+
+	// Listeners which are not in the configuration anymore
+	for (std::map<std::string, int>::const_iterator i = listeners.begin(); i != listeners.end(); ++i)
+		ServerInstance->SE->Close(i->second);
+	listeners.clear();
+
+	for (std::map<LocalUser*, std::string>::const_iterator i = pendingumodes.begin(); i != pendingumodes.end(); ++i)
+	{
+		if (!i->first->quitting)
+			SetUserModes(i->first, i->second);
+	}
+
+	std::vector<Channel*> channels;
+	Channel* chan = NULL;
+	for (std::vector<std::string>::const_iterator i = statelines.begin(); i != statelines.end(); ++i)
+	{
+		irc::tokenstream tokens(*i);
+		std::string command, target;
+		tokens.GetToken(command);
+		tokens.GetToken(target);
+
+		if (command == "XLINE")
+		{
+			std::string mask, source, settime, duration, reason;
+			tokens.GetToken(mask);
+			tokens.GetToken(source);
+			tokens.GetToken(settime);
+			tokens.GetToken(duration);
+			tokens.GetToken(reason);
+
+			XLineFactory* factory = ServerInstance->XLines->GetFactory(target);
+			if (!factory)
+				continue;
+
+			XLine* line = factory->Generate(ConvToInt(settime), ConvToInt(duration), source, reason, mask);
+			if (!ServerInstance->XLines->AddLine(line, NULL))
+				delete line;
+		}
+		else if (command == "UEXT")
+		{
+			std::string name, value;
+			tokens.GetToken(name);
+			tokens.GetToken(value);
+
+			std::map<std::string, LocalUser*>::const_iterator it = restoredusers.find(target);
+			if ((it != restoredusers.end()) && (!it->second->quitting))
+				UnserializeExtension(it->second, name, value);
+		}
+		else if (command == "UCAPS")
+		{
+			std::string value;
+			tokens.GetToken(value);
+
+			std::map<std::string, LocalUser*>::const_iterator it = restoredusers.find(target);
+			if ((it == restoredusers.end()) || (it->second->quitting))
+				continue;
+
+			// Enable them as if the client requested them, capabilities of modules which are gone are dropped
+			CapEvent caps(NULL, it->second, CapEvent::CAPEVENT_REQ);
+			irc::spacesepstream capstream(value);
+			std::string cap;
+			while (capstream.GetToken(cap))
+				caps.wanted.push_back(cap);
+			caps.Send();
+		}
+		else if (command == "CHAN")
+		{
+			std::string age, topicset, setby, topic;
+			tokens.GetToken(age);
+			tokens.GetToken(topicset);
+			tokens.GetToken(setby);
+			tokens.GetToken(topic);
+
+			// The channel may already exist if it is permanent
+			chan = ServerInstance->FindChan(target);
+			if (!chan)
+				chan = new Channel(target, ConvToInt(age));
+			chan->age = ConvToInt(age);
+			chan->topic = topic;
+			chan->topicset = ConvToInt(topicset);
+			chan->setby = FromStar(setby);
+			channels.push_back(chan);
+		}
+		else if ((!chan) || (chan->name != target))
+		{
+			continue;
+		}
+		else if (command == "CMODE")
+		{
+			RestoreChannelModes(chan, tokens);
+		}
+		else if (command == "CLIST")
+		{
+			RestoreListEntry(chan, tokens);
+		}
+		else if (command == "CEXT")
+		{
+			std::string name, value;
+			tokens.GetToken(name);
+			tokens.GetToken(value);
+			UnserializeExtension(chan, name, value);
+		}
+		else if (command == "MEMB")
+		{
+			RestoreMembership(chan, tokens);
+		}
+		else if (command == "MEXT")
+		{
+			std::string olduuid, name, value;
+			tokens.GetToken(olduuid);
+			tokens.GetToken(name);
+			tokens.GetToken(value);
+
+			std::map<std::string, LocalUser*>::const_iterator it = restoredusers.find(olduuid);
+			Membership* memb = (it != restoredusers.end() ? chan->GetUser(it->second) : NULL);
+			if (memb)
+				UnserializeExtension(memb, name, value);
+		}
+	}
+
+	// Channels whose members all failed to be restored
+	for (std::vector<Channel*>::const_iterator i = channels.begin(); i != channels.end(); ++i)
+		(*i)->CheckDestroy();
+
+	ServerInstance->UpdateTime();
+	double elapsed = (ServerInstance->Time() - restartsec) + (ServerInstance->Time_ns() - restartnsec) / 1000000000.0;
+
+	unsigned long restored = 0;
+	for (std::map<std::string, LocalUser*>::const_iterator i = restoredusers.begin(); i != restoredusers.end(); ++i)
+	{
+		if (!i->second->quitting)
+			restored++;
+	}
+
+	ServerInstance->Logs->Log("HOTRESTART", LOG_DEFAULT, "Hot restart completed in %.3f seconds, restored %lu users and %lu channels",
+		elapsed, restored, (unsigned long)channels.size());
+	ServerInstance->SNO->WriteGlobalSno('a', "Hot restart completed in %.3f seconds, restored %lu users and %lu channels",
+		elapsed, restored, (unsigned long)channels.size());
+
+	statelines.clear();
+	restoredusers.clear();
+	pendingumodes.clear();
+	resuming = false;
+}
@@ -57,6 +57,7 @@
 #include "socket.h"
 #include "command_parse.h"
 #include "exitcodes.h"
+#include "hotrestart.h"
 #include "caller.h"
 #include "testsuite.h"
 
@@ -98,6 +99,9 @@ template<typename T> static void DeleteZero(T*&n)
 
 void InspIRCd::Cleanup()
 {
+	// Move the client connections back to the main thread so they are closed below
+	IOThreads.Stop();
+
 	// Close all listening sockets
 	for (unsigned int i = 0; i < ports.size(); i++)
 	{
@@ -472,6 +476,11 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	// This is needed as all new XLines are marked pending until ApplyLines() is called
 	this->XLines->ApplyLines();
 
+	IOThreads.Start();
+
+	// Restore the listeners and clients handed over by a hot restart, if any
+	HotRestart::Load();
+
 	int bounditems = BindPorts(pl);
 
 	std::cout << std::endl;
@@ -482,6 +491,8 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->ISupport.Build();
 	Config->ApplyDisabledCommands(Config->DisabledCommands);
 
+	HotRestart::Resume();
+
 	if (!pl.empty())
 	{
 		std::cout << std::endl << "WARNING: Not all your client ports could be bound -- " << std::endl << "starting anyway with " << bounditems
@@ -655,6 +666,7 @@ void InspIRCd::Run()
 #ifndef _WIN32
 		static rusage ru;
 #endif
+		unsigned long long loopstart = LatencyHistogram::GetTimestamp();
 
 		/* Check if there is a config thread which has finished executing but has not yet been freed */
 		if (this->ConfigThread && this->ConfigThread->IsDone())
@@ -713,7 +725,11 @@ void InspIRCd::Run()
 				FOREACH_MOD(OnGarbageCollect, ());
 			}
 
+			unsigned long long phasestart = LatencyHistogram::GetTimestamp();
 			Timers->TickTimers(TIME.tv_sec);
+			unsigned long long phaseend = LatencyHistogram::GetTimestamp();
+			stats->LoopPhases[serverstats::LOOP_TIMERS].Record(phaseend - phasestart);
+
 			Users->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
@@ -721,6 +737,10 @@ void InspIRCd::Run()
 				FOREACH_MOD(OnBackgroundTimer, (TIME.tv_sec));
 				SNO->FlushSnotices();
 			}
+			stats->LoopPhases[serverstats::LOOP_BACKGROUND].Record(LatencyHistogram::GetTimestamp() - phaseend);
+
+			stats->LoopLag = stats->LoopLagCurrent;
+			stats->LoopLagCurrent = 0;
 		}
 
 		/* Call the socket engine to wait on the active
@@ -730,12 +750,29 @@ void InspIRCd::Run()
 		 * This will cause any read or write events to be
 		 * dispatched to their handlers.
 		 */
+		unsigned long long writestart = LatencyHistogram::GetTimestamp();
 		this->SE->DispatchTrialWrites();
+		this->IOThreads.Flush();
+		unsigned long long dispatchstart = LatencyHistogram::GetTimestamp();
 		this->SE->DispatchEvents();
 
 		/* if any users were quit, take them out */
+		unsigned long long cullstart = LatencyHistogram::GetTimestamp();
 		GlobalCulls.Apply();
+		unsigned long long actionstart = LatencyHistogram::GetTimestamp();
 		AtomicActions.Run();
+		unsigned long long loopend = LatencyHistogram::GetTimestamp();
+
+		/* Everything but waiting for events is time in which new events are not noticed */
+		unsigned long long waittime = std::min(SE->LastWaitTime, cullstart - dispatchstart);
+		unsigned long busy = loopend - loopstart - waittime;
+		stats->LoopPhases[serverstats::LOOP_WRITES].Record(dispatchstart - writestart);
+		stats->LoopPhases[serverstats::LOOP_DISPATCH].Record(cullstart - dispatchstart - waittime);
+		stats->LoopPhases[serverstats::LOOP_CULLS].Record(actionstart - cullstart);
+		stats->LoopPhases[serverstats::LOOP_ACTIONS].Record(loopend - actionstart);
+		stats->LoopBusy.Record(busy);
+		if (busy > stats->LoopLagCurrent)
+			stats->LoopLagCurrent = busy;
 
 		if (s_signal)
 		{
@@ -117,10 +117,26 @@ BufferedSocketError BufferedSocket::BeginConnect(const irc::sockets::sockaddrs&
 	return I_ERR_NONE;
 }
 
+void StreamSocket::AddIOHook(IOHook* hook)
+{
+	// The hook has to be called on the main thread
+	if (iothread)
+		ServerInstance->IOThreads.Detach(this);
+	iohook = hook;
+}
+
 void StreamSocket::Close()
 {
 	if (this->fd > -1)
 	{
+		if (iothread)
+		{
+			// The I/O thread sends what it can and closes the socket
+			ServerInstance->IOThreads.Remove(this);
+			fd = -1;
+			return;
+		}
+
 		// final chance, dump as much of the sendq as we can
 		DoWrite();
 		if (GetIOHook())
@@ -427,6 +443,14 @@ void StreamSocket::WriteData(const std::string &data)
 		return;
 	}
 
+	if (iothread)
+	{
+		// Counted until the I/O thread reports it as sent
+		sendq_len += data.length();
+		ServerInstance->IOThreads.Write(this, data);
+		return;
+	}
+
 	/* Append the data to the back of the queue ready for writing */
 	sendq.push_back(data);
 	sendq_len += data.length();
@@ -525,7 +549,18 @@ void StreamSocket::HandleEvent(EventType et, int errornum)
 			}
 			case EVENT_WRITE:
 			{
-				DoWrite();
+				// Keep writing while OnDataSent() queues more data and the socket accepts it
+				while (true)
+				{
+					size_t oldlen = sendq_len;
+					DoWrite();
+					if (!error.empty() || sendq_len >= oldlen)
+						break;
+					oldlen = sendq_len;
+					OnDataSent();
+					if (sendq_len <= oldlen)
+						break;
+				}
 				break;
 			}
 		}
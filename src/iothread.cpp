@@ -0,0 +1,724 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "iothread.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/uio.h>
+#endif
+
+namespace
+{
+	/** Don't try to prepare huge blobs of data to send to a blocked socket */
+	const int IOTHREAD_IOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
+
+	/** A connection as seen by the thread handling it */
+	struct IOConnection
+	{
+		/** The descriptor of the socket */
+		const int fd;
+
+		/** Received data which does not end with a newline yet */
+		std::string line;
+
+		/** Complete lines which were not passed to the main thread yet, each ending with '\n' */
+		std::string lines;
+
+		/** Data waiting to be sent */
+		std::deque<std::string> sendq;
+
+		/** Number of bytes sent which were not reported to the main thread yet */
+		size_t sent;
+
+		/** Set once reading or writing failed, the socket is not polled anymore */
+		std::string error;
+
+		/** True if the error was reported to the main thread */
+		bool reported;
+
+		IOConnection(int sockfd) : fd(sockfd), sent(0), reported(false) { }
+	};
+
+	/** A request from the main thread to an I/O thread */
+	struct IOCommand
+	{
+		enum Type
+		{
+			/** Start handling a socket */
+			IOCMD_ADD,
+			/** Send data on a socket */
+			IOCMD_WRITE,
+			/** Send what is left in the sendq and close the socket */
+			IOCMD_CLOSE,
+			/** Give the socket back to the main thread without closing it */
+			IOCMD_DETACH
+		};
+
+		Type type;
+		unsigned long id;
+		int fd;
+		std::string data;
+
+		IOCommand(Type cmdtype, unsigned long sockid, int sockfd = -1) : type(cmdtype), id(sockid), fd(sockfd) { }
+	};
+
+	/** A notification from an I/O thread to the main thread */
+	struct IOEvent
+	{
+		enum Type
+		{
+			/** Lines were received */
+			IOEVENT_DATA,
+			/** Data was sent, the sendq is smaller */
+			IOEVENT_SENT,
+			/** The connection failed */
+			IOEVENT_ERROR
+		};
+
+		Type type;
+		unsigned long id;
+		size_t bytes;
+		std::string data;
+
+		IOEvent(Type eventtype, unsigned long sockid) : type(eventtype), id(sockid), bytes(0) { }
+	};
+
+	typedef std::map<unsigned long, IOConnection*> IOConnectionMap;
+}
+
+/** A thread which reads and writes the sockets given to it by the IOThreadManager.
+ *
+ * Commands and events are swapped in batches under the SocketThread queue lock, once per loop
+ * iteration on each side, so the lock is hardly contended. A ThreadCompletionQueue does not fit
+ * here: it only delivers to the main thread, and IOThreadManager::Detach() has to pick the events
+ * of one socket out of those which are still queued, under the same lock.
+ */
+class IOThread : public SocketThread
+{
+	/** Connections handled by this thread, only used by this thread while it is running */
+	IOConnectionMap connections;
+
+	/** The pipe the main thread writes to when it queued commands */
+	int wakeup[2];
+
+	/** Maximum length of a line, as in <limits:maxline> */
+	const size_t maxline;
+
+	/** Size of the read buffer, as in <performance:netbuffersize> */
+	const size_t bufsize;
+
+	/** Apply the commands sent by the main thread */
+	void ApplyCommands(std::vector<IOCommand>& cmds);
+
+	/** Receive data on a socket and split it into lines */
+	void ReadConnection(IOConnection* conn, char* buffer);
+
+	/** Send as much of the sendq of a socket as possible */
+	void WriteConnection(IOConnection* conn);
+
+	/** Pass the received lines, the number of bytes sent and the errors to the main thread */
+	void ReportEvents();
+
+ public:
+	/** Commands from the main thread, guarded by the queue lock */
+	std::vector<IOCommand> commands;
+
+	/** Events for the main thread, guarded by the queue lock */
+	std::vector<IOEvent> events;
+
+	/** Connections given back after a detach command, guarded by the queue lock */
+	IOConnectionMap detached;
+
+	/** Commands queued since the last IOThreadManager::Flush(), only used by the main thread */
+	std::vector<IOCommand> pending;
+
+	IOThread(size_t MaxLine, size_t BufSize);
+	~IOThread();
+
+	/** Wake the thread up if it is waiting for events */
+	void Wakeup();
+
+	/** Wait until the thread gave a connection back after a detach command.
+	 * The queue lock must be held, it is released while waiting.
+	 */
+	IOConnection* WaitForDetach(unsigned long id);
+
+	/** Get the connections of the thread, may only be used once it has exited */
+	IOConnectionMap& GetConnections() { return connections; }
+
+	void Run();
+	void SetExitFlag();
+	void OnNotify();
+};
+
+IOThread::IOThread(size_t MaxLine, size_t BufSize)
+	: maxline(MaxLine), bufsize(BufSize)
+{
+#ifndef _WIN32
+	if (pipe(wakeup))
+		throw CoreException("Could not create pipe " + std::string(strerror(errno)));
+	ServerInstance->SE->NonBlocking(wakeup[0]);
+	ServerInstance->SE->NonBlocking(wakeup[1]);
+#endif
+}
+
+IOThread::~IOThread()
+{
+	for (IOConnectionMap::iterator i = connections.begin(); i != connections.end(); ++i)
+		delete i->second;
+	for (IOConnectionMap::iterator i = detached.begin(); i != detached.end(); ++i)
+		delete i->second;
+#ifndef _WIN32
+	close(wakeup[0]);
+	close(wakeup[1]);
+#endif
+}
+
+void IOThread::Wakeup()
+{
+#ifndef _WIN32
+	static const char dummy = '*';
+	if (write(wakeup[1], &dummy, 1) < 0)
+	{
+		// The pipe is full so the thread will wake up anyway
+	}
+#endif
+}
+
+void IOThread::SetExitFlag()
+{
+	SocketThread::SetExitFlag();
+	Wakeup();
+}
+
+IOConnection* IOThread::WaitForDetach(unsigned long id)
+{
+	IOConnectionMap::iterator it;
+	while ((it = detached.find(id)) == detached.end())
+		WaitForQueue();
+
+	IOConnection* conn = it->second;
+	detached.erase(it);
+	return conn;
+}
+
+void IOThread::OnNotify()
+{
+	ServerInstance->IOThreads.Process(this);
+}
+
+void IOThread::Run()
+{
+#ifndef _WIN32
+	std::vector<char> buffer(bufsize);
+	std::vector<pollfd> pfds;
+	std::vector<IOConnection*> polled;
+	std::vector<IOCommand> cmds;
+
+	while (true)
+	{
+		this->LockQueue();
+		bool exiting = GetExitFlag();
+		cmds.swap(commands);
+		this->UnlockQueue();
+
+		ApplyCommands(cmds);
+		cmds.clear();
+
+		// Data queued by the commands is sent right away, most sockets are writable
+		for (IOConnectionMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+		{
+			IOConnection* conn = i->second;
+			if ((!conn->sendq.empty()) && (conn->error.empty()))
+				WriteConnection(conn);
+		}
+		ReportEvents();
+
+		// The remaining connections are taken over by the main thread
+		if (exiting)
+			break;
+
+		pfds.clear();
+		polled.clear();
+
+		pollfd pfd;
+		pfd.fd = wakeup[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		pfds.push_back(pfd);
+
+		for (IOConnectionMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+		{
+			IOConnection* conn = i->second;
+			if (!conn->error.empty())
+				continue;
+
+			pfd.fd = conn->fd;
+			pfd.events = (conn->sendq.empty() ? POLLIN : POLLIN | POLLOUT);
+			pfds.push_back(pfd);
+			polled.push_back(conn);
+		}
+
+		if (poll(&pfds[0], pfds.size(), -1) < 0)
+			continue;
+
+		if (pfds[0].revents)
+		{
+			char dummy[128];
+			while (read(wakeup[0], dummy, sizeof(dummy)) > 0);
+		}
+
+		for (size_t i = 1; i < pfds.size(); i++)
+		{
+			IOConnection* conn = polled[i - 1];
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				ReadConnection(conn, &buffer[0]);
+			if ((pfds[i].revents & POLLOUT) && (conn->error.empty()))
+				WriteConnection(conn);
+		}
+	}
+#endif
+}
+
+void IOThread::ApplyCommands(std::vector<IOCommand>& cmds)
+{
+	for (std::vector<IOCommand>::iterator i = cmds.begin(); i != cmds.end(); ++i)
+	{
+		IOCommand& cmd = *i;
+		if (cmd.type == IOCommand::IOCMD_ADD)
+		{
+			connections.insert(std::make_pair(cmd.id, new IOConnection(cmd.fd)));
+			continue;
+		}
+
+		IOConnectionMap::iterator it = connections.find(cmd.id);
+		if (it == connections.end())
+			continue;
+
+		IOConnection* conn = it->second;
+		switch (cmd.type)
+		{
+			case IOCommand::IOCMD_WRITE:
+				if (conn->error.empty())
+				{
+					conn->sendq.push_back(std::string());
+					conn->sendq.back().swap(cmd.data);
+				}
+				break;
+
+			case IOCommand::IOCMD_CLOSE:
+				// Final chance, dump as much of the sendq as we can
+				if (conn->error.empty())
+					WriteConnection(conn);
+				shutdown(conn->fd, 2);
+				close(conn->fd);
+				delete conn;
+				connections.erase(it);
+				break;
+
+			case IOCommand::IOCMD_DETACH:
+				if (conn->error.empty())
+					WriteConnection(conn);
+				connections.erase(it);
+
+				this->LockQueue();
+				detached.insert(std::make_pair(cmd.id, conn));
+				this->UnlockQueueWakeup();
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+void IOThread::ReadConnection(IOConnection* conn, char* buffer)
+{
+#ifndef _WIN32
+	ssize_t n = recv(conn->fd, buffer, bufsize, 0);
+	if (n > 0)
+	{
+		// Same line splitting as UserIOHandler::OnDataReady()
+		for (ssize_t i = 0; i < n; i++)
+		{
+			char c = buffer[i];
+			switch (c)
+			{
+				case '\0':
+					c = ' ';
+					break;
+				case '\r':
+					continue;
+				case '\n':
+					conn->lines.append(conn->line).push_back('\n');
+					conn->line.clear();
+					continue;
+			}
+			if (conn->line.length() < maxline - 2)
+				conn->line.push_back(c);
+		}
+	}
+	else if (n == 0)
+	{
+		conn->error = "Connection closed";
+	}
+	else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+	{
+		conn->error = strerror(errno);
+	}
+#endif
+}
+
+void IOThread::WriteConnection(IOConnection* conn)
+{
+#ifndef _WIN32
+	while (!conn->sendq.empty())
+	{
+		iovec iovecs[IOTHREAD_IOV_MAX];
+		int bufcount = std::min<int>(conn->sendq.size(), IOTHREAD_IOV_MAX);
+		size_t total = 0;
+		for (int i = 0; i < bufcount; i++)
+		{
+			iovecs[i].iov_base = const_cast<char*>(conn->sendq[i].data());
+			iovecs[i].iov_len = conn->sendq[i].length();
+			total += conn->sendq[i].length();
+		}
+
+		ssize_t rv = writev(conn->fd, iovecs, bufcount);
+		if (rv > 0)
+		{
+			conn->sent += rv;
+			size_t left = rv;
+			while (left > 0)
+			{
+				std::string& front = conn->sendq.front();
+				if (front.length() <= left)
+				{
+					left -= front.length();
+					conn->sendq.pop_front();
+				}
+				else
+				{
+					front.erase(0, left);
+					left = 0;
+				}
+			}
+
+			// It's going to block now
+			if ((size_t)rv < total)
+				return;
+		}
+		else if (rv == 0)
+		{
+			conn->error = "Connection closed";
+			return;
+		}
+		else if (errno != EINTR)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				conn->error = strerror(errno);
+			return;
+		}
+	}
+#endif
+}
+
+void IOThread::ReportEvents()
+{
+	std::vector<IOEvent> list;
+	for (IOConnectionMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+	{
+		IOConnection* conn = i->second;
+		if (conn->sent)
+		{
+			list.push_back(IOEvent(IOEvent::IOEVENT_SENT, i->first));
+			list.back().bytes = conn->sent;
+			conn->sent = 0;
+		}
+
+		if (!conn->lines.empty())
+		{
+			list.push_back(IOEvent(IOEvent::IOEVENT_DATA, i->first));
+			list.back().data.swap(conn->lines);
+		}
+
+		if ((!conn->error.empty()) && (!conn->reported))
+		{
+			list.push_back(IOEvent(IOEvent::IOEVENT_ERROR, i->first));
+			list.back().data = conn->error;
+			conn->reported = true;
+		}
+	}
+
+	if (list.empty())
+		return;
+
+	this->LockQueue();
+	if (events.empty())
+		events.swap(list);
+	else
+		events.insert(events.end(), list.begin(), list.end());
+	this->UnlockQueue();
+	NotifyParent();
+}
+
+IOThreadManager::IOThreadManager()
+	: nextid(0), nextthread(0)
+{
+}
+
+void IOThreadManager::Start()
+{
+	if (!threads.empty())
+		return;
+
+	unsigned int count = ServerInstance->Config->IOThreadCount;
+	if (!count)
+		return;
+
+#ifdef _WIN32
+	ServerInstance->Logs->Log("IOTHREAD", LOG_DEFAULT, "I/O threads are not supported on Windows, <performance:iothreads> is ignored");
+#else
+	for (unsigned int i = 0; i < count; i++)
+	{
+		IOThread* thread = NULL;
+		try
+		{
+			thread = new IOThread(ServerInstance->Config->Limits.MaxLine, ServerInstance->Config->NetBufferSize);
+			ServerInstance->Threads->Start(thread);
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log("IOTHREAD", LOG_DEFAULT, "Unable to start the I/O threads: %s", ex.GetReason().c_str());
+			delete thread;
+			Stop();
+			return;
+		}
+		threads.push_back(thread);
+	}
+
+	ServerInstance->Logs->Log("IOTHREAD", LOG_DEFAULT, "Started %u I/O threads", count);
+#endif
+}
+
+void IOThreadManager::Stop()
+{
+	if (threads.empty())
+		return;
+
+	// Everything queued is handled by the threads before they exit
+	Flush();
+	for (std::vector<IOThread*>::const_iterator i = threads.begin(); i != threads.end(); ++i)
+		(*i)->join();
+
+	for (std::vector<IOThread*>::const_iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		IOThread* thread = *i;
+
+		// The lines are not processed now as this may be called while a line is being processed
+		std::map<unsigned long, std::string> errors;
+		for (std::vector<IOEvent>::const_iterator j = thread->events.begin(); j != thread->events.end(); ++j)
+		{
+			std::map<unsigned long, StreamSocket*>::const_iterator it = sockets.find(j->id);
+			if (it == sockets.end())
+				continue;
+
+			if (j->type == IOEvent::IOEVENT_DATA)
+				it->second->recvq.append(j->data);
+			else if (j->type == IOEvent::IOEVENT_ERROR)
+				errors[j->id] = j->data;
+		}
+		thread->events.clear();
+
+		IOConnectionMap& connections = thread->GetConnections();
+		for (IOConnectionMap::iterator j = connections.begin(); j != connections.end(); ++j)
+		{
+			IOConnection* conn = j->second;
+			std::map<unsigned long, StreamSocket*>::const_iterator it = sockets.find(j->first);
+			if (it != sockets.end())
+				Reclaim(it->second, conn->sendq, conn->lines + conn->line, conn->error.empty() ? errors[j->first] : conn->error);
+			else
+				close(conn->fd);
+		}
+
+		// This may be called from the thread's OnNotify() so it is deleted later
+		stopped.push_back(thread);
+	}
+
+	threads.clear();
+	sockets.clear();
+	ServerInstance->Logs->Log("IOTHREAD", LOG_DEFAULT, "Stopped the I/O threads");
+}
+
+bool IOThreadManager::Add(StreamSocket* sock)
+{
+	if ((threads.empty()) || (sock->GetIOHook()))
+		return false;
+
+	IOThread* thread = threads[nextthread++ % threads.size()];
+	unsigned long id = ++nextid;
+	sock->iothread = thread;
+	sock->iothreadid = id;
+	sockets[id] = sock;
+	thread->pending.push_back(IOCommand(IOCommand::IOCMD_ADD, id, sock->GetFd()));
+	return true;
+}
+
+void IOThreadManager::Write(StreamSocket* sock, const std::string& data)
+{
+	std::vector<IOCommand>& pending = sock->iothread->pending;
+
+	// Consecutive writes to the same socket are sent as one buffer
+	if ((!pending.empty()) && (pending.back().type == IOCommand::IOCMD_WRITE) && (pending.back().id == sock->iothreadid))
+	{
+		pending.back().data.append(data);
+		return;
+	}
+
+	pending.push_back(IOCommand(IOCommand::IOCMD_WRITE, sock->iothreadid));
+	pending.back().data = data;
+}
+
+void IOThreadManager::Remove(StreamSocket* sock)
+{
+	sock->iothread->pending.push_back(IOCommand(IOCommand::IOCMD_CLOSE, sock->iothreadid));
+	sockets.erase(sock->iothreadid);
+	sock->iothread = NULL;
+	sock->iothreadid = 0;
+}
+
+void IOThreadManager::Detach(StreamSocket* sock)
+{
+	IOThread* thread = sock->iothread;
+	unsigned long id = sock->iothreadid;
+	thread->pending.push_back(IOCommand(IOCommand::IOCMD_DETACH, id));
+	Flush();
+
+	thread->LockQueue();
+	IOConnection* conn = thread->WaitForDetach(id);
+
+	// Events reported before the thread let go of the socket come before what is left in the connection
+	std::string error;
+	std::vector<IOEvent> others;
+	for (std::vector<IOEvent>::iterator i = thread->events.begin(); i != thread->events.end(); ++i)
+	{
+		if (i->id != id)
+			others.push_back(*i);
+		else if (i->type == IOEvent::IOEVENT_DATA)
+			sock->recvq.append(i->data);
+		else if (i->type == IOEvent::IOEVENT_ERROR)
+			error = i->data;
+	}
+	thread->events.swap(others);
+	thread->UnlockQueue();
+
+	sockets.erase(id);
+	Reclaim(sock, conn->sendq, conn->lines + conn->line, conn->error.empty() ? error : conn->error);
+	delete conn;
+}
+
+void IOThreadManager::Reclaim(StreamSocket* sock, std::deque<std::string>& sendq, const std::string& recvq, const std::string& error)
+{
+	sock->iothread = NULL;
+	sock->iothreadid = 0;
+	sock->recvq.append(recvq);
+
+	sock->sendq.swap(sendq);
+	sock->sendq_len = 0;
+	for (std::deque<std::string>::const_iterator i = sock->sendq.begin(); i != sock->sendq.end(); ++i)
+		sock->sendq_len += i->length();
+
+	if (!ServerInstance->SE->AddFd(sock, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE))
+	{
+		sock->SetError("Internal error handling connection");
+		sock->OnError(I_ERR_OTHER);
+	}
+	else if (!error.empty())
+	{
+		sock->SetError(error);
+		sock->OnError(I_ERR_OTHER);
+	}
+	else if (sock->sendq_len)
+	{
+		ServerInstance->SE->ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
+	}
+}
+
+void IOThreadManager::Flush()
+{
+	for (std::vector<IOThread*>::const_iterator i = stopped.begin(); i != stopped.end(); ++i)
+		delete *i;
+	stopped.clear();
+
+	for (std::vector<IOThread*>::const_iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		IOThread* thread = *i;
+		if (thread->pending.empty())
+			continue;
+
+		thread->LockQueue();
+		if (thread->commands.empty())
+			thread->commands.swap(thread->pending);
+		else
+			thread->commands.insert(thread->commands.end(), thread->pending.begin(), thread->pending.end());
+		thread->UnlockQueue();
+
+		thread->pending.clear();
+		thread->Wakeup();
+	}
+}
+
+void IOThreadManager::Process(IOThread* thread)
+{
+	std::vector<IOEvent> list;
+	thread->LockQueue();
+	list.swap(thread->events);
+	thread->UnlockQueue();
+
+	for (std::vector<IOEvent>::const_iterator i = list.begin(); i != list.end(); ++i)
+	{
+		// The socket may have been closed by an earlier event
+		std::map<unsigned long, StreamSocket*>::const_iterator it = sockets.find(i->id);
+		if (it == sockets.end())
+			continue;
+
+		StreamSocket* sock = it->second;
+		switch (i->type)
+		{
+			case IOEvent::IOEVENT_DATA:
+				sock->recvq.append(i->data);
+				sock->OnDataReady();
+				break;
+
+			case IOEvent::IOEVENT_SENT:
+				sock->sendq_len -= std::min(i->bytes, sock->sendq_len);
+				sock->OnDataSent();
+				break;
+
+			case IOEvent::IOEVENT_ERROR:
+				if (sock->getError().empty())
+				{
+					sock->SetError(i->data);
+					sock->OnError(I_ERR_OTHER);
+				}
+				break;
+		}
+	}
+}
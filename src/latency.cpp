@@ -0,0 +1,139 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+LatencyHistogram::LatencyHistogram()
+	: counts(NULL), count(0), total(0), max(0)
+{
+}
+
+LatencyHistogram::~LatencyHistogram()
+{
+	delete[] counts;
+}
+
+unsigned int LatencyHistogram::GetBucket(unsigned long value)
+{
+	if (value > MAX_VALUE)
+		value = MAX_VALUE;
+
+	if (value < SUB_BUCKETS)
+		return value;
+
+	// Position of the highest bit, the bits below it select the sub bucket
+	unsigned int magnitude = SUB_BUCKET_BITS;
+	while (magnitude < 31 && (value >> (magnitude + 1)))
+		magnitude++;
+
+	unsigned int shift = magnitude - SUB_BUCKET_BITS;
+	return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+unsigned long LatencyHistogram::GetBucketLimit(unsigned int bucket)
+{
+	if (bucket < SUB_BUCKETS)
+		return bucket;
+
+	unsigned int shift = bucket / SUB_BUCKETS - 1;
+	unsigned long base = SUB_BUCKETS + bucket % SUB_BUCKETS;
+	return ((base + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(unsigned long value)
+{
+	if (!counts)
+	{
+		counts = new unsigned long[BUCKETS];
+		std::fill(counts, counts + BUCKETS, 0);
+	}
+
+	counts[GetBucket(value)]++;
+	count++;
+	total += value;
+	if (value > max)
+		max = value;
+}
+
+void LatencyHistogram::Reset()
+{
+	delete[] counts;
+	counts = NULL;
+	count = 0;
+	total = 0;
+	max = 0;
+}
+
+unsigned long LatencyHistogram::GetPercentile(double percent) const
+{
+	if (!count)
+		return 0;
+
+	unsigned long wanted = (unsigned long)ceil(count * percent / 100);
+	if (wanted < 1)
+		wanted = 1;
+
+	unsigned long seen = 0;
+	for (unsigned int i = 0; i < BUCKETS; i++)
+	{
+		seen += counts[i];
+		if (seen >= wanted)
+			return std::min(GetBucketLimit(i), max);
+	}
+	return max;
+}
+
+unsigned long LatencyHistogram::GetCountUpTo(unsigned long limit) const
+{
+	if (!count)
+		return 0;
+	if (limit >= max)
+		return count;
+
+	unsigned long seen = 0;
+	for (unsigned int i = 0; i < BUCKETS && GetBucketLimit(i) <= limit; i++)
+		seen += counts[i];
+	return seen;
+}
+
+std::string LatencyHistogram::ToString() const
+{
+	return InspIRCd::Format("count %lu mean %luus p50 %luus p90 %luus p99 %luus max %luus", count, GetMean(),
+		GetPercentile(50), GetPercentile(90), GetPercentile(99), max);
+}
+
+unsigned long long LatencyHistogram::GetTimestamp()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart * 1000000ULL / frequency.QuadPart;
+#elif defined HAS_CLOCK_GETTIME
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+#else
+	timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000ULL + now.tv_usec;
+#endif
+}
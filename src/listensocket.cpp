@@ -21,6 +21,9 @@
 #include "inspircd.h"
 #include "socket.h"
 #include "socketengine.h"
+#include "bancache.h"
+#include "xline.h"
+#include "hotrestart.h"
 
 #ifndef _WIN32
 #include <netinet/tcp.h>
@@ -28,10 +31,23 @@
 
 ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
 	: bind_tag(tag)
+	, acceptbatch(tag->getInt("acceptbatch", 32, 1))
+	, clientport(tag->getString("type", "clients") == "clients")
+	, accepted(0), refused(0), rejected(0)
+	, ratecount(0), lastrate(0), peakrate(0), ratetime(0)
 {
 	irc::sockets::satoap(bind_to, bind_addr, bind_port);
 	bind_desc = bind_to.str();
 
+	// Listener inherited from the previous process on a hot restart
+	fd = HotRestart::TakeListener(bind_desc);
+	if (fd != -1)
+	{
+		ServerInstance->SE->NonBlocking(this->fd);
+		ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+		return;
+	}
+
 	fd = socket(bind_to.sa.sa_family, SOCK_STREAM, 0);
 
 	if (this->fd == -1)
@@ -101,8 +117,72 @@ ListenSocket::~ListenSocket()
 	}
 }
 
+bool ListenSocket::CheckAdmission(int newfd, irc::sockets::sockaddrs& client)
+{
+	std::string reason;
+	std::string bantype;
+	bool banned = false;
+	if (ServerInstance->Users->local_users.size() >= ServerInstance->Config->SoftLimit)
+	{
+		ServerInstance->SNO->WriteToSnoMask('a', "Warning: softlimit value has been reached: %d clients", ServerInstance->Config->SoftLimit);
+		reason = "No more connections allowed";
+	}
+	else
+	{
+		// A positive ban cache hit or a matching Z-line refuses the connection unless it is E-lined.
+		// Negative hits are left to the checks done after the user was created.
+		BanCacheHit* hit = ServerInstance->BanCache->GetHit(client);
+		XLine* zline = NULL;
+		if (hit)
+		{
+			if (hit->IsPositive())
+			{
+				reason = hit->Reason;
+				bantype = hit->Type;
+			}
+		}
+		else
+		{
+			zline = ServerInstance->XLines->MatchesLine("Z", client.addr());
+			if (zline)
+			{
+				reason = "Z-Lined: " + zline->reason;
+				bantype = "Z";
+			}
+		}
+
+		if ((reason.empty()) || (ServerInstance->XLines->MatchesLine("E", "unknown@" + client.addr())))
+			return true;
+
+		banned = true;
+		if (zline)
+		{
+			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding positive hit (Z) for " + client.addr());
+			ServerInstance->BanCache->AddHit(client, "Z", reason, zline->duration);
+		}
+	}
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Refusing connection from %s on %s before admission: %s",
+		client.addr().c_str(), bind_desc.c_str(), reason.c_str());
+
+	// The error can only be delivered on plaintext listeners, no IOHook is attached yet
+	if (bind_tag->getString("ssl").empty())
+	{
+		std::string error;
+		if ((banned) && (!ServerInstance->Config->XLineMessage.empty()))
+			error = ":" + ServerInstance->Config->ServerName + " NOTICE * :*** " + ServerInstance->Config->XLineMessage + "\r\n";
+		// As when a user is quit because of an X-line, only the type of the ban is shown if bans are hidden
+		const std::string shownreason = ((banned) && (ServerInstance->Config->HideBans)) ? bantype + "-Lined" : reason;
+		error += "ERROR :Closing link: (unknown@" + client.addr() + ") [" + shownreason + "]\r\n";
+		send(newfd, error.data(), error.length(), 0);
+	}
+
+	rejected++;
+	return false;
+}
+
 /* Just seperated into another func for tidiness really.. */
-void ListenSocket::AcceptInternal()
+bool ListenSocket::AcceptInternal()
 {
 	irc::sockets::sockaddrs client;
 	irc::sockets::sockaddrs server;
@@ -113,10 +193,20 @@ void ListenSocket::AcceptInternal()
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "HandleEvent for Listensocket %s nfd=%d", bind_desc.c_str(), incomingSockfd);
 	if (incomingSockfd < 0)
 	{
-		ServerInstance->stats->statsRefused++;
-		return;
+		if (!SocketEngine::IgnoreError())
+			ServerInstance->stats->statsRefused++;
+		return false;
 	}
 
+	if (ratetime != ServerInstance->Time())
+	{
+		lastrate = (ratetime == ServerInstance->Time() - 1) ? ratecount : 0;
+		ratetime = ServerInstance->Time();
+		ratecount = 0;
+	}
+	if (++ratecount > peakrate)
+		peakrate = ratecount;
+
 	socklen_t sz = sizeof(server);
 	if (getsockname(incomingSockfd, &server.sa, &sz))
 	{
@@ -140,7 +230,8 @@ void ListenSocket::AcceptInternal()
 		ServerInstance->SE->Shutdown(incomingSockfd, 2);
 		ServerInstance->SE->Close(incomingSockfd);
 		ServerInstance->stats->statsRefused++;
-		return;
+		refused++;
+		return true;
 	}
 
 	if (client.sa.sa_family == AF_INET6)
@@ -173,30 +264,39 @@ void ListenSocket::AcceptInternal()
 		}
 	}
 
-	ServerInstance->SE->NonBlocking(incomingSockfd);
+	if ((clientport) && (!CheckAdmission(incomingSockfd, client)))
+	{
+		ServerInstance->SE->Close(incomingSockfd);
+		ServerInstance->stats->statsRefused++;
+		refused++;
+		return true;
+	}
 
 	ModResult res;
 	FIRST_MOD_RESULT(OnAcceptConnection, res, (incomingSockfd, this, &client, &server));
 	if (res == MOD_RES_PASSTHRU)
 	{
-		std::string type = bind_tag->getString("type", "clients");
-		if (type == "clients")
+		if (clientport)
 		{
-			ServerInstance->Users->AddUser(incomingSockfd, this, &client, &server);
+			// The ban cache and the Z-lines were checked by CheckAdmission() already
+			ServerInstance->Users->AddUser(incomingSockfd, this, &client, &server, true);
 			res = MOD_RES_ALLOW;
 		}
 	}
 	if (res == MOD_RES_ALLOW)
 	{
 		ServerInstance->stats->statsAccept++;
+		accepted++;
 	}
 	else
 	{
 		ServerInstance->stats->statsRefused++;
+		refused++;
 		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Refusing connection on %s - %s",
 			bind_desc.c_str(), res == MOD_RES_DENY ? "Connection refused by module" : "Module for this port not found");
 		ServerInstance->SE->Close(incomingSockfd);
 	}
+	return true;
 }
 
 void ListenSocket::HandleEvent(EventType e, int err)
@@ -210,7 +310,12 @@ void ListenSocket::HandleEvent(EventType e, int err)
 			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "*** BUG *** ListenSocket::HandleEvent() got a WRITE event!!!");
 			break;
 		case EVENT_READ:
-			this->AcceptInternal();
+			// Drain the backlog, but leave the rest for the next iteration if a lot of connections are pending
+			for (unsigned int i = 0; i < acceptbatch; i++)
+			{
+				if (!this->AcceptInternal())
+					break;
+			}
 			break;
 	}
 }
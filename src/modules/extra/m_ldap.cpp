@@ -19,6 +19,9 @@
 
 #include "inspircd.h"
 #include "modules/ldap.h"
+#include "modules/hash.h"
+
+#include <iostream>
 
 #include <ldap.h>
 
@@ -29,12 +32,52 @@
 
 /* $LinkerFlags: -lldap */
 
-class LDAPService : public LDAPProvider, public SocketThread
+class LDAPService;
+
+/** An operation which was sent to the LDAP server and was not answered yet
+ */
+struct LDAPRequest
+{
+	/** The interface the result is sent to, NULL if nobody wants it */
+	LDAPInterface* inter;
+
+	/** When the operation was given to the service */
+	unsigned long long submitted;
+
+	/** The DN of a bind which is added to the bind cache if it succeeds */
+	std::string dn;
+
+	/** The hash of the password of that bind, empty if it is not cached */
+	std::string passhash;
+
+	/** True if this is the bind as the manager of a connection for operations other than binds */
+	bool managerbind;
+
+	LDAPRequest(LDAPInterface* i)
+		: inter(i), submitted(LatencyHistogram::GetTimestamp()), managerbind(false)
+	{
+	}
+};
+
+/** A bind waiting for a connection of the bind pool to become idle
+ */
+struct PendingBind
+{
+	LDAPRequest req;
+	std::string pass;
+
+	PendingBind(const LDAPRequest& r, const std::string& p) : req(r), pass(p)
+	{
+	}
+};
+
+/** A connection to the LDAP server, its thread waits for the results of the
+ * operations sent on it. Several operations can be in progress at once.
+ */
+class LDAPConnection : public QueuedThread
 {
 	LDAP* con;
-	reference<ConfigTag> config;
 	time_t last_connect;
-	int searchscope;
 
 	LDAPMod** BuildMods(const LDAPMods& attributes)
 	{
@@ -84,49 +127,54 @@ class LDAPService : public LDAPProvider, public SocketThread
 		delete[] mods;
 	}
 
-	void Reconnect()
-	{
-		// Only try one connect a minute. It is an expensive blocking operation
-		if (last_connect > ServerInstance->Time() - 60)
-			throw LDAPException("Unable to connect to LDAP service " + this->name + ": reconnecting too fast");
-		last_connect = ServerInstance->Time();
+	void Reconnect();
 
-		ldap_unbind_ext(this->con, NULL, NULL);
-		Connect();
-	}
+	/** Reconnect to retry an operation other than a bind */
+	void ReconnectForOperation();
 
-	void SaveInterface(LDAPInterface* i, LDAPQuery msgid)
+	/** Remember an operation which was sent, the queue lock must be held since sending it
+	 * as the thread could otherwise receive the result before the operation is known
+	 */
+	void SaveRequest(const LDAPRequest& req, LDAPQuery msgid)
 	{
-		if (i != NULL)
-		{
-			this->LockQueue();
-			this->queries[msgid] = i;
-			this->UnlockQueueWakeup();
-		}
+		this->inflight++;
+		this->queries.insert(std::make_pair(msgid, req));
 	}
 
  public:
-	typedef std::map<int, LDAPInterface*> query_queue;
-	typedef std::vector<std::pair<LDAPInterface*, LDAPResult*> > result_queue;
+	typedef std::map<int, LDAPRequest> query_queue;
 	query_queue queries;
-	result_queue results;
 
-	LDAPService(Module* c, ConfigTag* tag)
-		: LDAPProvider(c, "LDAP/" + tag->getString("id"))
-		, con(NULL), config(tag), last_connect(0)
-	{
-		std::string scope = config->getString("searchscope");
-		if (scope == "base")
-			searchscope = LDAP_SCOPE_BASE;
-		else if (scope == "onelevel")
-			searchscope = LDAP_SCOPE_ONELEVEL;
-		else
-			searchscope = LDAP_SCOPE_SUBTREE;
+	LDAPService* const service;
+
+	/** True if this connection is used for the binds of users, otherwise it stays
+	 * bound as the manager and is used for all other operations
+	 */
+	const bool forbinds;
 
-		Connect();
+	/** Number of operations sent on this connection which were not delivered yet, main thread only */
+	unsigned int inflight;
+
+	/** States of the bind as the manager of a connection for operations other than binds */
+	enum BindState
+	{
+		/** The connection is bound or does not need a bind, it can be used */
+		BIND_DONE,
+		/** The bind was sent, the connection is not used until it succeeds */
+		BIND_PENDING,
+		/** The bind failed, the connection is not used until a retry succeeds */
+		BIND_FAILED
+	};
+
+	/** State of the bind as the manager, main thread only */
+	BindState bindstate;
+
+	LDAPConnection(LDAPService* s, bool binds)
+		: con(NULL), last_connect(0), service(s), forbinds(binds), inflight(0), bindstate(BIND_DONE)
+	{
 	}
 
-	~LDAPService()
+	~LDAPConnection()
 	{
 		this->LockQueue();
 
@@ -134,343 +182,863 @@ class LDAPService : public LDAPProvider, public SocketThread
 			ldap_abandon_ext(this->con, i->first, NULL, NULL);
 		this->queries.clear();
 
-		for (result_queue::iterator i = this->results.begin(); i != this->results.end(); ++i)
-		{
-			i->second->error = "LDAP Interface is going away";
-			i->first->OnError(*i->second);
-		}
-		this->results.clear();
-
 		this->UnlockQueue();
 
 		ldap_unbind_ext(this->con, NULL, NULL);
 	}
 
-	void Connect()
-	{
-		std::string server = config->getString("server");
-		int i = ldap_initialize(&this->con, server.c_str());
-		if (i != LDAP_SUCCESS)
-			throw LDAPException("Unable to connect to LDAP service " + this->name + ": " + ldap_err2string(i));
-		const int version = LDAP_VERSION3;
-		i = ldap_set_option(this->con, LDAP_OPT_PROTOCOL_VERSION, &version);
-		if (i != LDAP_OPT_SUCCESS)
-		{
-			ldap_unbind_ext(this->con, NULL, NULL);
-			this->con = NULL;
-			throw LDAPException("Unable to set protocol version for " + this->name + ": " + ldap_err2string(i));
-		}
-	}
+	void Connect();
 
-	LDAPQuery BindAsManager(LDAPInterface* i) CXX11_OVERRIDE
-	{
-		std::string binddn = config->getString("binddn");
-		std::string bindauth = config->getString("bindauth");
-		return this->Bind(i, binddn, bindauth);
-	}
+	/** Send the bind as the manager, the connection is not used for other operations until it succeeds */
+	void BindAsManager();
 
-	LDAPQuery Bind(LDAPInterface* i, const std::string& who, const std::string& pass) CXX11_OVERRIDE
+	LDAPQuery Bind(const LDAPRequest& req, const std::string& who, const std::string& pass)
 	{
 		berval cred;
 		cred.bv_val = strdup(pass.c_str());
 		cred.bv_len = pass.length();
 
 		LDAPQuery msgid;
+		this->LockQueue();
 		int ret = ldap_sasl_bind(con, who.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, &msgid);
+		if (ret == LDAP_SUCCESS)
+			SaveRequest(req, msgid);
+		this->UnlockQueueWakeup();
 		free(cred.bv_val);
 		if (ret != LDAP_SUCCESS)
 		{
 			if (ret == LDAP_SERVER_DOWN || ret == LDAP_TIMEOUT)
 			{
+				// Reconnecting sends the bind as the manager again
 				this->Reconnect();
-				return this->Bind(i, who, pass);
+				if (req.managerbind)
+					return -1;
+				return this->Bind(req, who, pass);
 			}
 			else
 				throw LDAPException(ldap_err2string(ret));
 		}
 
-		SaveInterface(i, msgid);
 		return msgid;
 	}
 
-	LDAPQuery Search(LDAPInterface* i, const std::string& base, const std::string& filter) CXX11_OVERRIDE
+	LDAPQuery Search(const LDAPRequest& req, const std::string& base, int scope, const std::string& filter)
 	{
-		if (i == NULL)
-			throw LDAPException("No interface");
-
 		LDAPQuery msgid;
-		int ret = ldap_search_ext(this->con, base.c_str(), searchscope, filter.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msgid);
+		this->LockQueue();
+		int ret = ldap_search_ext(this->con, base.c_str(), scope, filter.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msgid);
+		if (ret == LDAP_SUCCESS)
+			SaveRequest(req, msgid);
+		this->UnlockQueueWakeup();
 		if (ret != LDAP_SUCCESS)
 		{
 			if (ret == LDAP_SERVER_DOWN || ret == LDAP_TIMEOUT)
 			{
-				this->Reconnect();
-				return this->Search(i, base, filter);
+				this->ReconnectForOperation();
+				return this->Search(req, base, scope, filter);
 			}
 			else
 				throw LDAPException(ldap_err2string(ret));
 		}
 
-		SaveInterface(i, msgid);
 		return msgid;
 	}
 
-	LDAPQuery Add(LDAPInterface* i, const std::string& dn, LDAPMods& attributes) CXX11_OVERRIDE
+	LDAPQuery Add(const LDAPRequest& req, const std::string& dn, LDAPMods& attributes)
 	{
 		LDAPMod** mods = this->BuildMods(attributes);
 		LDAPQuery msgid;
+		this->LockQueue();
 		int ret = ldap_add_ext(this->con, dn.c_str(), mods, NULL, NULL, &msgid);
+		if (ret == LDAP_SUCCESS)
+			SaveRequest(req, msgid);
+		this->UnlockQueueWakeup();
 		this->FreeMods(mods);
 
 		if (ret != LDAP_SUCCESS)
 		{
 			if (ret == LDAP_SERVER_DOWN || ret == LDAP_TIMEOUT)
 			{
-				this->Reconnect();
-				return this->Add(i, dn, attributes);
+				this->ReconnectForOperation();
+				return this->Add(req, dn, attributes);
 			}
 			else
 				throw LDAPException(ldap_err2string(ret));
 		}
 
-		SaveInterface(i, msgid);
 		return msgid;
 	}
 
-	LDAPQuery Del(LDAPInterface* i, const std::string& dn) CXX11_OVERRIDE
+	LDAPQuery Del(const LDAPRequest& req, const std::string& dn)
 	{
 		LDAPQuery msgid;
+		this->LockQueue();
 		int ret = ldap_delete_ext(this->con, dn.c_str(), NULL, NULL, &msgid);
+		if (ret == LDAP_SUCCESS)
+			SaveRequest(req, msgid);
+		this->UnlockQueueWakeup();
 
 		if (ret != LDAP_SUCCESS)
 		{
 			if (ret == LDAP_SERVER_DOWN || ret == LDAP_TIMEOUT)
 			{
-				this->Reconnect();
-				return this->Del(i, dn);
+				this->ReconnectForOperation();
+				return this->Del(req, dn);
 			}
 			else
 				throw LDAPException(ldap_err2string(ret));
 		}
 
-		SaveInterface(i, msgid);
 		return msgid;
 	}
 
-	LDAPQuery Modify(LDAPInterface* i, const std::string& base, LDAPMods& attributes) CXX11_OVERRIDE
+	LDAPQuery Modify(const LDAPRequest& req, const std::string& base, LDAPMods& attributes)
 	{
 		LDAPMod** mods = this->BuildMods(attributes);
 		LDAPQuery msgid;
+		this->LockQueue();
 		int ret = ldap_modify_ext(this->con, base.c_str(), mods, NULL, NULL, &msgid);
+		if (ret == LDAP_SUCCESS)
+			SaveRequest(req, msgid);
+		this->UnlockQueueWakeup();
 		this->FreeMods(mods);
 
 		if (ret != LDAP_SUCCESS)
 		{
 			if (ret == LDAP_SERVER_DOWN || ret == LDAP_TIMEOUT)
 			{
-				this->Reconnect();
-				return this->Modify(i, base, attributes);
+				this->ReconnectForOperation();
+				return this->Modify(req, base, attributes);
 			}
 			else
 				throw LDAPException(ldap_err2string(ret));
 		}
 
-		SaveInterface(i, msgid);
 		return msgid;
 	}
 
-	LDAPQuery Compare(LDAPInterface* i, const std::string& dn, const std::string& attr, const std::string& val) CXX11_OVERRIDE
+	LDAPQuery Compare(const LDAPRequest& req, const std::string& dn, const std::string& attr, const std::string& val)
 	{
 		berval cred;
 		cred.bv_val = strdup(val.c_str());
 		cred.bv_len = val.length();
 
 		LDAPQuery msgid;
+		this->LockQueue();
 		int ret = ldap_compare_ext(con, dn.c_str(), attr.c_str(), &cred, NULL, NULL, &msgid);
+		if (ret == LDAP_SUCCESS)
+			SaveRequest(req, msgid);
+		this->UnlockQueueWakeup();
 		free(cred.bv_val);
 
 		if (ret != LDAP_SUCCESS)
 		{
 			if (ret == LDAP_SERVER_DOWN || ret == LDAP_TIMEOUT)
 			{
-				this->Reconnect();
-				return this->Compare(i, dn, attr, val);
+				this->ReconnectForOperation();
+				return this->Compare(req, dn, attr, val);
 			}
 			else
 				throw LDAPException(ldap_err2string(ret));
 		}
 
-		SaveInterface(i, msgid);
 		return msgid;
 	}
 
-	void Run() CXX11_OVERRIDE
+	void Run() CXX11_OVERRIDE;
+};
+
+/** A result which is passed from the thread of an LDAPConnection to the main thread
+ */
+class LDAPResultItem : public ThreadCompletion
+{
+	LDAPService* const service;
+	LDAPConnection* const conn;
+	const LDAPRequest req;
+	LDAPResult* const res;
+
+ public:
+	/** @param c The connection the operation was sent on, NULL if it was answered from the bind cache */
+	LDAPResultItem(LDAPService* s, LDAPConnection* c, const LDAPRequest& r, LDAPResult* result) : service(s), conn(c), req(r), res(result)
+	{
+	}
+
+	~LDAPResultItem()
+	{
+		delete res;
+	}
+
+	void OnComplete() CXX11_OVERRIDE;
+};
+
+/** A positive result of a bind, kept for a short time so a user who reconnects
+ * does not cause another bind
+ */
+struct BindCacheEntry
+{
+	std::string passhash;
+	time_t expires;
+};
+
+/** All connections to one LDAP server. Operations other than binds are spread over the
+ * connections bound as the manager and pipelined on them. Binds change the identity of
+ * the connection they are sent on and the server finishes every other operation on it
+ * first, so they go to a separate pool of connections which each run one bind at a time.
+ */
+class LDAPService : public LDAPProvider
+{
+	reference<ConfigTag> config;
+	int searchscope;
+
+	/** Connections for searches and other operations */
+	std::vector<LDAPConnection*> conns;
+
+	/** Connections for binds */
+	std::vector<LDAPConnection*> bindconns;
+
+	/** Binds waiting for an idle bind connection */
+	std::deque<PendingBind> pending;
+
+	/** Positive binds by DN */
+	std::map<std::string, BindCacheEntry> cache;
+
+	/** How long a successful bind is cached, 0 to disable the cache */
+	time_t cachetime;
+
+	/** Salt of the password hashes in the cache */
+	const std::string salt;
+
+	/** True once the threads were stopped, binds are not sent anymore */
+	bool stopping;
+
+	/** Create the connections of a pool */
+	void CreateConnections(std::vector<LDAPConnection*>& pool, unsigned int count, bool binds)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			LDAPConnection* conn = new LDAPConnection(this, binds);
+			pool.push_back(conn);
+			conn->Connect();
+		}
+	}
+
+	/** Find the hash of a password for the bind cache
+	 * @return The hash, or an empty string if bind results can not be cached
+	 */
+	std::string HashPassword(const std::string& pass)
+	{
+		if (!cachetime)
+			return "";
+
+		HashProvider* sha256 = ServerInstance->Modules->FindDataService<HashProvider>("hash/sha256");
+		if (!sha256)
+			return "";
+
+		return sha256->sum(salt + pass);
+	}
+
+	/** Send queued binds on the idle bind connections */
+	void DispatchBinds()
 	{
-		while (!this->GetExitFlag())
+		for (std::vector<LDAPConnection*>::iterator i = bindconns.begin(); i != bindconns.end() && !stopping; ++i)
 		{
-			this->LockQueue();
-			if (this->queries.empty())
+			// A bind which can not be sent fails, the next one is tried on the same connection
+			LDAPConnection* conn = *i;
+			while (!conn->inflight && !pending.empty())
 			{
-				this->WaitForQueue();
-				this->UnlockQueue();
-				continue;
+				PendingBind bind = pending.front();
+				pending.pop_front();
+				try
+				{
+					conn->Bind(bind.req, bind.req.dn, bind.pass);
+				}
+				catch (LDAPException& ex)
+				{
+					if (bind.req.inter)
+					{
+						LDAPResult err;
+						err.type = LDAPResult::QUERY_BIND;
+						err.error = ex.GetReason();
+						bind.req.inter->OnError(err);
+					}
+				}
 			}
-			else
-				this->UnlockQueue();
+		}
+	}
 
-			struct timeval tv = { 1, 0 };
-			LDAPMessage* result;
-			int rtype = ldap_result(this->con, LDAP_RES_ANY, 1, &tv, &result);
-			if (rtype <= 0 || this->GetExitFlag())
-				continue;
+	/** Find the least busy connection for an operation other than a bind, only connections
+	 * which are bound as the manager are used so that nothing is done anonymously
+	 */
+	LDAPConnection* GetConnection()
+	{
+		LDAPConnection* best = NULL;
+		for (std::vector<LDAPConnection*>::const_iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			if ((*i)->bindstate == LDAPConnection::BIND_DONE && (!best || (*i)->inflight < best->inflight))
+				best = *i;
+		}
+
+		if (!best)
+			throw LDAPException("No connection to LDAP service " + this->name + " is bound as the manager");
+		return best;
+	}
+
+ public:
+	/** Results waiting to be delivered on the main thread, a batch at a time
+	 */
+	ThreadCompletionQueue results;
 
-			int cur_id = ldap_msgid(result);
+	/** Time from giving an operation to the service until its result is delivered */
+	LatencyHistogram latency;
 
-			this->LockQueue();
+	/** Longest the bind queue has been */
+	size_t maxqueued;
 
-			query_queue::iterator it = this->queries.find(cur_id);
-			if (it == this->queries.end())
+	/** Binds which were answered from the cache, and those which were not */
+	unsigned long cachehits;
+	unsigned long cachemisses;
+
+	LDAPService(Module* c, ConfigTag* tag)
+		: LDAPProvider(c, "LDAP/" + tag->getString("id"))
+		, config(tag)
+		, cachetime(tag->getDuration("bindcache", 30, 0, 3600))
+		, salt(ServerInstance->GenRandomStr(16, false))
+		, stopping(false)
+		, maxqueued(0)
+		, cachehits(0)
+		, cachemisses(0)
+	{
+		std::string scope = config->getString("searchscope");
+		if (scope == "base")
+			searchscope = LDAP_SCOPE_BASE;
+		else if (scope == "onelevel")
+			searchscope = LDAP_SCOPE_ONELEVEL;
+		else
+			searchscope = LDAP_SCOPE_SUBTREE;
+
+		try
+		{
+			unsigned int poolsize = config->getInt("poolsize", 1, 1, 32);
+			CreateConnections(conns, poolsize, false);
+			CreateConnections(bindconns, config->getInt("bindpoolsize", poolsize, 1, 32), true);
+		}
+		catch (...)
+		{
+			Cleanup();
+			throw;
+		}
+	}
+
+	~LDAPService()
+	{
+		Cleanup();
+	}
+
+	ConfigTag* GetConfig() const { return config; }
+
+	/** Start the threads of the connections */
+	void Start()
+	{
+		for (std::vector<LDAPConnection*>::iterator i = conns.begin(); i != conns.end(); ++i)
+			ServerInstance->Threads->Start(*i);
+		for (std::vector<LDAPConnection*>::iterator i = bindconns.begin(); i != bindconns.end(); ++i)
+			ServerInstance->Threads->Start(*i);
+	}
+
+	/** Stop the threads of the connections, the results they already received are
+	 * delivered by the next results.Deliver()
+	 */
+	void Stop()
+	{
+		stopping = true;
+		for (std::vector<LDAPConnection*>::iterator i = conns.begin(); i != conns.end(); ++i)
+			(*i)->join();
+		for (std::vector<LDAPConnection*>::iterator i = bindconns.begin(); i != bindconns.end(); ++i)
+			(*i)->join();
+	}
+
+	/** Fail the queued binds and close the connections, the threads must have been stopped */
+	void Cleanup()
+	{
+		while (!pending.empty())
+		{
+			LDAPRequest req = pending.front().req;
+			pending.pop_front();
+			if (req.inter)
 			{
-				this->UnlockQueue();
-				ldap_msgfree(result);
-				continue;
+				LDAPResult err;
+				err.type = LDAPResult::QUERY_BIND;
+				err.error = "LDAP service " + this->name + " was removed";
+				req.inter->OnError(err);
 			}
-			LDAPInterface* i = it->second;
-			this->queries.erase(it);
+		}
 
-			this->UnlockQueue();
+		for (std::vector<LDAPConnection*>::iterator i = conns.begin(); i != conns.end(); ++i)
+			delete *i;
+		conns.clear();
+		for (std::vector<LDAPConnection*>::iterator i = bindconns.begin(); i != bindconns.end(); ++i)
+			delete *i;
+		bindconns.clear();
+	}
 
-			LDAPResult* ldap_result = new LDAPResult();
-			ldap_result->id = cur_id;
+	/** Called on the main thread when the result of an operation arrived */
+	void Complete(LDAPConnection* conn, const LDAPRequest& req, LDAPResult& res)
+	{
+		if (conn)
+			conn->inflight--;
 
-			for (LDAPMessage* cur = ldap_first_message(this->con, result); cur; cur = ldap_next_message(this->con, cur))
+		if (req.managerbind)
+		{
+			if (res.error.empty())
+			{
+				if (conn->bindstate == LDAPConnection::BIND_FAILED)
+					ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Bound to LDAP service %s as the manager again", this->name.c_str());
+				conn->bindstate = LDAPConnection::BIND_DONE;
+			}
+			else
 			{
-				int cur_type = ldap_msgtype(cur);
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to bind to LDAP service %s as the manager: %s, the connection is not used until a retry succeeds",
+					this->name.c_str(), res.error.c_str());
+				conn->bindstate = LDAPConnection::BIND_FAILED;
+			}
+			return;
+		}
 
-				LDAPAttributes attributes;
+		if (!req.passhash.empty())
+		{
+			if (res.error.empty())
+			{
+				BindCacheEntry& entry = cache[req.dn];
+				entry.passhash = req.passhash;
+				entry.expires = ServerInstance->Time() + cachetime;
+			}
+			else
+				cache.erase(req.dn);
+		}
 
+		if (req.inter)
+		{
+			latency.Record(LatencyHistogram::GetTimestamp() - req.submitted);
+			if (!res.error.empty())
+				req.inter->OnError(res);
+			else
+				req.inter->OnResult(res);
+		}
+
+		if (conn && conn->forbinds)
+			DispatchBinds();
+	}
+
+	/** Remove the expired entries from the bind cache */
+	void PruneCache()
+	{
+		for (std::map<std::string, BindCacheEntry>::iterator i = cache.begin(); i != cache.end(); )
+		{
+			if (i->second.expires <= ServerInstance->Time())
+				cache.erase(i++);
+			else
+				++i;
+		}
+	}
+
+	/** Retry the binds as the manager which failed and send the binds which are still queued */
+	void Retry()
+	{
+		if (stopping)
+			return;
+
+		for (std::vector<LDAPConnection*>::iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			LDAPConnection* conn = *i;
+			if (conn->bindstate != LDAPConnection::BIND_FAILED)
+				continue;
+
+			try
+			{
+				conn->BindAsManager();
+			}
+			catch (LDAPException& ex)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to bind to LDAP service %s as the manager: %s", this->name.c_str(), ex.GetReason().c_str());
+			}
+		}
+
+		DispatchBinds();
+	}
+
+	/** Forget the interfaces of a module which is being unloaded */
+	void RemoveInterfaces(Module* m)
+	{
+		for (std::deque<PendingBind>::iterator i = pending.begin(); i != pending.end(); )
+		{
+			if (i->req.inter && i->req.inter->creator == m)
+				i = pending.erase(i);
+			else
+				++i;
+		}
+
+		for (int pool = 0; pool < 2; ++pool)
+		{
+			std::vector<LDAPConnection*>& list = pool ? bindconns : conns;
+			for (std::vector<LDAPConnection*>::iterator i = list.begin(); i != list.end(); ++i)
+			{
+				LDAPConnection* conn = *i;
+				conn->LockQueue();
+				for (LDAPConnection::query_queue::iterator j = conn->queries.begin(); j != conn->queries.end(); ++j)
 				{
-					char* dn = ldap_get_dn(this->con, cur);
-					if (dn != NULL)
-					{
-						attributes["dn"].push_back(dn);
-						ldap_memfree(dn);
-					}
+					if (j->second.inter && j->second.inter->creator == m)
+						j->second.inter = NULL;
 				}
+				conn->UnlockQueue();
+			}
+		}
+	}
+
+	void GetStats(const std::string& id, User* user, string_list& stats)
+	{
+		unsigned int inflight = 0;
+		unsigned int binding = 0;
+		unsigned int unbound = 0;
+		for (std::vector<LDAPConnection*>::const_iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			inflight += (*i)->inflight;
+			if ((*i)->bindstate != LDAPConnection::BIND_DONE)
+				unbound++;
+		}
+		for (std::vector<LDAPConnection*>::const_iterator i = bindconns.begin(); i != bindconns.end(); ++i)
+			binding += (*i)->inflight;
+
+		stats.push_back(ServerInstance->Config->ServerName + " 249 " + user->nick + " :ldap " + id + " connections " + ConvToStr(conns.size()) +
+			" unbound " + ConvToStr(unbound) + " inflight " + ConvToStr(inflight) + " bindconnections " + ConvToStr(bindconns.size()) + " binding " + ConvToStr(binding) +
+			" queued " + ConvToStr(pending.size()) + " peak " + ConvToStr(maxqueued) + " cache " + ConvToStr(cache.size()) +
+			" hits " + ConvToStr(cachehits) + " misses " + ConvToStr(cachemisses) + " " + latency.ToString());
+	}
+
+	LDAPQuery BindAsManager(LDAPInterface* i) CXX11_OVERRIDE
+	{
+		// The connections used for the other operations are always bound as the manager
+		if (i == NULL)
+			return -1;
+
+		std::string binddn = config->getString("binddn");
+		std::string bindauth = config->getString("bindauth");
+		return this->Bind(i, binddn, bindauth);
+	}
+
+	LDAPQuery Bind(LDAPInterface* i, const std::string& who, const std::string& pass) CXX11_OVERRIDE
+	{
+		LDAPRequest req(i);
+		req.dn = who;
+		req.passhash = HashPassword(pass);
+
+		if (!req.passhash.empty())
+		{
+			std::map<std::string, BindCacheEntry>::const_iterator it = cache.find(who);
+			if (it != cache.end() && it->second.passhash == req.passhash && it->second.expires > ServerInstance->Time())
+			{
+				// Delivered from the main loop like any other result, not before this returns
+				cachehits++;
+				LDAPResult* res = new LDAPResult();
+				res->type = LDAPResult::QUERY_BIND;
+				req.passhash.clear();
+				results.Add(new LDAPResultItem(this, NULL, req, res));
+				return -1;
+			}
+			cachemisses++;
+		}
+
+		for (std::vector<LDAPConnection*>::iterator it = bindconns.begin(); it != bindconns.end(); ++it)
+		{
+			if (!(*it)->inflight)
+				return (*it)->Bind(req, who, pass);
+		}
+
+		pending.push_back(PendingBind(req, pass));
+		if (pending.size() > maxqueued)
+			maxqueued = pending.size();
+		return -1;
+	}
+
+	LDAPQuery Search(LDAPInterface* i, const std::string& base, const std::string& filter) CXX11_OVERRIDE
+	{
+		if (i == NULL)
+			throw LDAPException("No interface");
+
+		return GetConnection()->Search(LDAPRequest(i), base, searchscope, filter);
+	}
+
+	LDAPQuery Add(LDAPInterface* i, const std::string& dn, LDAPMods& attributes) CXX11_OVERRIDE
+	{
+		return GetConnection()->Add(LDAPRequest(i), dn, attributes);
+	}
+
+	LDAPQuery Del(LDAPInterface* i, const std::string& dn) CXX11_OVERRIDE
+	{
+		return GetConnection()->Del(LDAPRequest(i), dn);
+	}
+
+	LDAPQuery Modify(LDAPInterface* i, const std::string& base, LDAPMods& attributes) CXX11_OVERRIDE
+	{
+		return GetConnection()->Modify(LDAPRequest(i), base, attributes);
+	}
+
+	LDAPQuery Compare(LDAPInterface* i, const std::string& dn, const std::string& attr, const std::string& val) CXX11_OVERRIDE
+	{
+		return GetConnection()->Compare(LDAPRequest(i), dn, attr, val);
+	}
+};
+
+void LDAPResultItem::OnComplete()
+{
+	service->Complete(conn, req, *res);
+}
+
+void LDAPConnection::Connect()
+{
+	ConfigTag* config = service->GetConfig();
+	std::string server = config->getString("server");
+	int i = ldap_initialize(&this->con, server.c_str());
+	if (i != LDAP_SUCCESS)
+		throw LDAPException("Unable to connect to LDAP service " + service->name + ": " + ldap_err2string(i));
+	const int version = LDAP_VERSION3;
+	i = ldap_set_option(this->con, LDAP_OPT_PROTOCOL_VERSION, &version);
+	if (i != LDAP_OPT_SUCCESS)
+	{
+		ldap_unbind_ext(this->con, NULL, NULL);
+		this->con = NULL;
+		throw LDAPException("Unable to set protocol version for " + service->name + ": " + ldap_err2string(i));
+	}
+
+	if (!forbinds && !config->getString("binddn").empty())
+		this->BindAsManager();
+}
+
+void LDAPConnection::BindAsManager()
+{
+	ConfigTag* config = service->GetConfig();
+	LDAPRequest req(NULL);
+	req.managerbind = true;
+	this->bindstate = BIND_PENDING;
+	try
+	{
+		this->Bind(req, config->getString("binddn"), config->getString("bindauth"));
+	}
+	catch (LDAPException&)
+	{
+		this->bindstate = BIND_FAILED;
+		throw;
+	}
+}
 
-				switch (cur_type)
+void LDAPConnection::Reconnect()
+{
+	// Only try one connect a minute. It is an expensive blocking operation
+	if (last_connect > ServerInstance->Time() - 60)
+		throw LDAPException("Unable to connect to LDAP service " + service->name + ": reconnecting too fast");
+	last_connect = ServerInstance->Time();
+
+	// The operations in progress are lost with the connection
+	query_queue lost;
+	this->LockQueue();
+	this->queries.swap(lost);
+	this->UnlockQueue();
+	for (query_queue::const_iterator i = lost.begin(); i != lost.end(); ++i)
+	{
+		LDAPResult* res = new LDAPResult();
+		res->id = i->first;
+		res->error = "Connection to LDAP service " + service->name + " was lost";
+		service->results.Add(new LDAPResultItem(service, this, i->second, res));
+	}
+
+	ldap_unbind_ext(this->con, NULL, NULL);
+	Connect();
+}
+
+void LDAPConnection::ReconnectForOperation()
+{
+	this->Reconnect();
+
+	// The operation being retried must not be sent before the bind as the manager succeeded
+	if (this->bindstate != BIND_DONE)
+		throw LDAPException("Reconnected to LDAP service " + service->name + ", the bind as the manager is in progress");
+}
+
+void LDAPConnection::Run()
+{
+	while (!this->GetExitFlag())
+	{
+		this->LockQueue();
+		if (this->queries.empty())
+		{
+			this->WaitForQueue();
+			this->UnlockQueue();
+			continue;
+		}
+		else
+			this->UnlockQueue();
+
+		struct timeval tv = { 1, 0 };
+		LDAPMessage* result;
+		int rtype = ldap_result(this->con, LDAP_RES_ANY, 1, &tv, &result);
+		if (rtype <= 0 || this->GetExitFlag())
+			continue;
+
+		int cur_id = ldap_msgid(result);
+
+		this->LockQueue();
+		bool wanted = (this->queries.find(cur_id) != this->queries.end());
+		this->UnlockQueue();
+
+		if (!wanted)
+		{
+			ldap_msgfree(result);
+			continue;
+		}
+
+		LDAPResult* ldap_result = new LDAPResult();
+		ldap_result->id = cur_id;
+
+		for (LDAPMessage* cur = ldap_first_message(this->con, result); cur; cur = ldap_next_message(this->con, cur))
+		{
+			int cur_type = ldap_msgtype(cur);
+
+			LDAPAttributes attributes;
+
+			{
+				char* dn = ldap_get_dn(this->con, cur);
+				if (dn != NULL)
 				{
-					case LDAP_RES_BIND:
-						ldap_result->type = LDAPResult::QUERY_BIND;
-						break;
-					case LDAP_RES_SEARCH_ENTRY:
-						ldap_result->type = LDAPResult::QUERY_SEARCH;
-						break;
-					case LDAP_RES_ADD:
-						ldap_result->type = LDAPResult::QUERY_ADD;
-						break;
-					case LDAP_RES_DELETE:
-						ldap_result->type = LDAPResult::QUERY_DELETE;
-						break;
-					case LDAP_RES_MODIFY:
-						ldap_result->type = LDAPResult::QUERY_MODIFY;
-						break;
-					case LDAP_RES_SEARCH_RESULT:
-						// If we get here and ldap_result->type is LDAPResult::QUERY_UNKNOWN
-						// then the result set is empty
-						ldap_result->type = LDAPResult::QUERY_SEARCH;
-						break;
-					case LDAP_RES_COMPARE:
-						ldap_result->type = LDAPResult::QUERY_COMPARE;
-						break;
-					default:
-						continue;
+					attributes["dn"].push_back(dn);
+					ldap_memfree(dn);
 				}
+			}
+
+			switch (cur_type)
+			{
+				case LDAP_RES_BIND:
+					ldap_result->type = LDAPResult::QUERY_BIND;
+					break;
+				case LDAP_RES_SEARCH_ENTRY:
+					ldap_result->type = LDAPResult::QUERY_SEARCH;
+					break;
+				case LDAP_RES_ADD:
+					ldap_result->type = LDAPResult::QUERY_ADD;
+					break;
+				case LDAP_RES_DELETE:
+					ldap_result->type = LDAPResult::QUERY_DELETE;
+					break;
+				case LDAP_RES_MODIFY:
+					ldap_result->type = LDAPResult::QUERY_MODIFY;
+					break;
+				case LDAP_RES_SEARCH_RESULT:
+					// If we get here and ldap_result->type is LDAPResult::QUERY_UNKNOWN
+					// then the result set is empty
+					ldap_result->type = LDAPResult::QUERY_SEARCH;
+					break;
+				case LDAP_RES_COMPARE:
+					ldap_result->type = LDAPResult::QUERY_COMPARE;
+					break;
+				default:
+					continue;
+			}
 
-				switch (cur_type)
+			switch (cur_type)
+			{
+				case LDAP_RES_SEARCH_ENTRY:
 				{
-					case LDAP_RES_SEARCH_ENTRY:
+					BerElement* ber = NULL;
+					for (char* attr = ldap_first_attribute(this->con, cur, &ber); attr; attr = ldap_next_attribute(this->con, cur, ber))
 					{
-						BerElement* ber = NULL;
-						for (char* attr = ldap_first_attribute(this->con, cur, &ber); attr; attr = ldap_next_attribute(this->con, cur, ber))
-						{
-							berval** vals = ldap_get_values_len(this->con, cur, attr);
-							int count = ldap_count_values_len(vals);
+						berval** vals = ldap_get_values_len(this->con, cur, attr);
+						int count = ldap_count_values_len(vals);
 
-							std::vector<std::string> attrs;
-							for (int j = 0; j < count; ++j)
-								attrs.push_back(vals[j]->bv_val);
-							attributes[attr] = attrs;
+						std::vector<std::string> attrs;
+						for (int j = 0; j < count; ++j)
+							attrs.push_back(vals[j]->bv_val);
+						attributes[attr] = attrs;
 
-							ldap_value_free_len(vals);
-							ldap_memfree(attr);
-						}
-						if (ber != NULL)
-							ber_free(ber, 0);
+						ldap_value_free_len(vals);
+						ldap_memfree(attr);
+					}
+					if (ber != NULL)
+						ber_free(ber, 0);
 
-						break;
+					break;
+				}
+				case LDAP_RES_BIND:
+				case LDAP_RES_ADD:
+				case LDAP_RES_DELETE:
+				case LDAP_RES_MODIFY:
+				case LDAP_RES_COMPARE:
+				{
+					int errcode = -1;
+					int parse_result = ldap_parse_result(this->con, cur, &errcode, NULL, NULL, NULL, NULL, 0);
+					if (parse_result != LDAP_SUCCESS)
+					{
+						ldap_result->error = ldap_err2string(parse_result);
 					}
-					case LDAP_RES_BIND:
-					case LDAP_RES_ADD:
-					case LDAP_RES_DELETE:
-					case LDAP_RES_MODIFY:
-					case LDAP_RES_COMPARE:
+					else
 					{
-						int errcode = -1;
-						int parse_result = ldap_parse_result(this->con, cur, &errcode, NULL, NULL, NULL, NULL, 0);
-						if (parse_result != LDAP_SUCCESS)
+						if (cur_type == LDAP_RES_COMPARE)
 						{
-							ldap_result->error = ldap_err2string(parse_result);
-						}
-						else
-						{
-							if (cur_type == LDAP_RES_COMPARE)
-							{
-								if (errcode != LDAP_COMPARE_TRUE)
-									ldap_result->error = ldap_err2string(errcode);
-							}
-							else if (errcode != LDAP_SUCCESS)
+							if (errcode != LDAP_COMPARE_TRUE)
 								ldap_result->error = ldap_err2string(errcode);
 						}
-						break;
+						else if (errcode != LDAP_SUCCESS)
+							ldap_result->error = ldap_err2string(errcode);
 					}
-					default:
-						continue;
+					break;
 				}
-
-				ldap_result->messages.push_back(attributes);
+				default:
+					continue;
 			}
 
-			ldap_msgfree(result);
-
-			this->LockQueue();
-			this->results.push_back(std::make_pair(i, ldap_result));
-			this->UnlockQueueWakeup();
-
-			this->NotifyParent();
+			ldap_result->messages.push_back(attributes);
 		}
-	}
 
-	void OnNotify() CXX11_OVERRIDE
-	{
-		LDAPService::result_queue r;
+		ldap_msgfree(result);
 
+		// The request is looked up again as OnUnloadModule() may have changed it
+		// meanwhile, its interface must not be used after that has returned
 		this->LockQueue();
-		this->results.swap(r);
+		query_queue::iterator it = this->queries.find(cur_id);
+		if (it != this->queries.end())
+		{
+			service->results.Add(new LDAPResultItem(service, this, it->second, ldap_result));
+			this->queries.erase(it);
+		}
+		else
+			delete ldap_result;
 		this->UnlockQueue();
+	}
+}
 
-		for (LDAPService::result_queue::iterator i = r.begin(); i != r.end(); ++i)
-		{
-			LDAPInterface* li = i->first;
-			LDAPResult* res = i->second;
+/** Query sent by the test suite, counts the results
+ */
+class TestInterface : public LDAPInterface
+{
+	unsigned int& done;
+	unsigned int& failed;
 
-			if (!res->error.empty())
-				li->OnError(*res);
-			else
-				li->OnResult(*res);
+ public:
+	TestInterface(Module* me, unsigned int& d, unsigned int& f)
+		: LDAPInterface(me), done(d), failed(f)
+	{
+	}
 
-			delete res;
-		}
+	void OnResult(const LDAPResult& r) CXX11_OVERRIDE
+	{
+		done++;
+		delete this;
+	}
+
+	void OnError(const LDAPResult& err) CXX11_OVERRIDE
+	{
+		if (!failed)
+			std::cout << "Operation failed: " << err.getError() << std::endl;
+		failed++;
+		done++;
+		delete this;
 	}
 };
 
@@ -501,7 +1069,7 @@ class ModuleLDAP : public Module
 				conns[id] = conn;
 
 				ServerInstance->Modules->AddService(*conn);
-				ServerInstance->Threads->Start(conn);
+				conn->Start();
 			}
 			else
 			{
@@ -514,8 +1082,8 @@ class ModuleLDAP : public Module
 		{
 			LDAPService* conn = i->second;
 			ServerInstance->Modules->DelService(*conn);
-			conn->join();
-			conn->OnNotify();
+			conn->Stop();
+			conn->results.Deliver();
 			delete conn;
 		}
 
@@ -527,28 +1095,78 @@ class ModuleLDAP : public Module
 		for (ServiceMap::iterator it = this->LDAPServices.begin(); it != this->LDAPServices.end(); ++it)
 		{
 			LDAPService* s = it->second;
-			s->LockQueue();
-			for (LDAPService::query_queue::iterator it2 = s->queries.begin(); it2 != s->queries.end();)
-			{
-				int msgid = it2->first;
-				LDAPInterface* i = it2->second;
-				++it2;
+			s->RemoveInterfaces(m);
 
-				if (i->creator == m)
-					s->queries.erase(msgid);
-			}
-			for (unsigned int i = s->results.size(); i > 0; --i)
+			// Results which were already received are passed on while the module is still loaded
+			s->results.Deliver();
+		}
+	}
+
+	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE
+	{
+		for (ServiceMap::iterator i = LDAPServices.begin(); i != LDAPServices.end(); ++i)
+		{
+			i->second->PruneCache();
+			i->second->Retry();
+		}
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'D')
+			return MOD_RES_PASSTHRU;
+
+		for (ServiceMap::iterator i = LDAPServices.begin(); i != LDAPServices.end(); ++i)
+			i->second->GetStats(i->first, user, results);
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		// Searches and binds like the connects after a restart, against each configured server.
+		// The binds of the second round can be answered from the bind cache.
+		const unsigned int count = 1000;
+		for (ServiceMap::iterator i = LDAPServices.begin(); i != LDAPServices.end(); ++i)
+		{
+			LDAPService* s = i->second;
+			ConfigTag* tag = s->GetConfig();
+			std::string binddn = tag->getString("binddn");
+			std::string bindauth = tag->getString("bindauth");
+
+			for (int round = 1; round <= 2; ++round)
 			{
-				LDAPInterface* li = s->results[i - 1].first;
-				LDAPResult* r = s->results[i - 1].second;
+				std::cout << "\nm_ldap: sending " << count << " searches and " << count << " binds to " << i->first << ", round " << round << "\n";
 
-				if (li->creator == m)
+				unsigned int done = 0;
+				unsigned int failed = 0;
+				unsigned long hits = s->cachehits;
+				unsigned long long start = LatencyHistogram::GetTimestamp();
+				try
 				{
-					s->results.erase(s->results.begin() + i - 1);
-					delete r;
+					for (unsigned int n = 0; n < count; n++)
+					{
+						s->Search(new TestInterface(this, done, failed), binddn, "(objectClass=*)");
+						s->Bind(new TestInterface(this, done, failed), binddn, bindauth);
+					}
 				}
+				catch (LDAPException& ex)
+				{
+					std::cout << "LDAP exception: " << ex.GetReason() << "\n";
+					break;
+				}
+
+				while (done < count * 2 && LatencyHistogram::GetTimestamp() - start < 30000000)
+					ServerInstance->SE->DispatchEvents();
+
+				// Operations which did not finish in time refer to the counters above, drop them now
+				if (done < count * 2)
+					OnUnloadModule(this);
+
+				double elapsed = (LatencyHistogram::GetTimestamp() - start) / 1000000.0;
+				std::cout << done << " done, " << failed << " failed in " << elapsed << "s (" << (done / elapsed) << " operations/s), "
+					<< (s->cachehits - hits) << " binds from the cache, peak bind queue " << s->maxqueued << "\n";
+				std::cout << "Latency: " << s->latency.ToString() << "\n";
 			}
-			s->UnlockQueue();
 		}
 	}
 
@@ -557,8 +1175,8 @@ class ModuleLDAP : public Module
 		for (std::map<std::string, LDAPService*>::iterator i = LDAPServices.begin(); i != LDAPServices.end(); ++i)
 		{
 			LDAPService* conn = i->second;
-			conn->join();
-			conn->OnNotify();
+			conn->Stop();
+			conn->results.Deliver();
 			delete conn;
 		}
 	}
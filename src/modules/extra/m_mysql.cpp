@@ -24,6 +24,7 @@
 #define NO_CLIENT_LONG_LONG
 
 #include "inspircd.h"
+#include <iostream>
 #include <mysql.h>
 #include "modules/sql.h"
 
@@ -44,21 +45,24 @@
  * that instead, you should thread your program. This is what i've done here to allow for
  * asyncronous SQL requests via mysql. The way this works is as follows:
  *
- * The module spawns a thread via class Thread, and performs its mysql queries in this thread,
- * using a queue with priorities. There is a mutex on either end which prevents two threads
- * adjusting the queue at the same time, and crashing the ircd. Every 50 milliseconds, the
- * worker thread wakes up, and checks if there is a request at the head of its queue.
- * If there is, it processes this request, blocking the worker thread but leaving the ircd
- * thread to go about its business as usual. During this period, the ircd thread is able
- * to insert futher pending requests into the queue.
+ * The module starts a ThreadPool, and performs its mysql queries on the threads of the pool.
+ * Each database has a queue of queries which only the ircd thread touches, and a pool of
+ * <database:poolsize> connections. When a query is submitted and some connections are idle,
+ * the queued queries are split between them and each gets a job containing its share. The
+ * idle threads of the pool pick them up at once and run the queries of each job in order,
+ * blocking those threads but leaving the ircd thread to go about its business as usual.
+ * Queries submitted while every connection is busy are queued and form the next jobs. With
+ * a poolsize of 1 the queries of a database are run one after another in the order they were
+ * submitted, with more connections they run in parallel and may complete out of order.
  *
- * Once the processing of a request is complete, it is removed from the incoming queue to
- * an outgoing queue, and initialized as a 'response'. The worker thread then signals the
- * ircd thread (via a loopback socket) of the fact a result is available, by sending the
- * connection ID through the connection.
+ * The result of each query is passed back to the ircd thread as soon as the query is done,
+ * together with any other results which came in the meantime, waking up the main loop once
+ * for all of them. The ircd thread then sends each result on its way to the original calling
+ * module. Once all queries of a job are done the connection gets the next part of the queue.
  *
- * The ircd thread then mutexes the queue once more, reads the outbound response off the head
- * of the queue, and sends it on its way to the original calling module.
+ * The client library is initialised before the pool is started and each thread of the pool
+ * sets up its own state for it, as mysql_init() and connections used from several threads
+ * require.
  *
  * XXX: You might be asking "why doesnt he just send the response from within the worker thread?"
  * The answer to this is simple. The majority of InspIRCd, and in fact most ircd's are not
@@ -68,41 +72,33 @@
  * if a module is ever put in a re-enterant state (stack corruption could occur, crashes, data
  * corruption, and worse, so DONT think about it until the day comes when InspIRCd is 100%
  * gauranteed threadsafe!)
- *
- * For a diagram of this system please see http://wiki.inspircd.org/Mysql2
  */
 
 class SQLConnection;
+class MySQLConn;
 class MySQLresult;
-class DispatcherThread;
+class QueryJob;
 
 struct QQueueItem
 {
 	SQLQuery* q;
 	std::string query;
-	SQLConnection* c;
-	QQueueItem(SQLQuery* Q, const std::string& S, SQLConnection* C) : q(Q), query(S), c(C) {}
-};
-
-struct RQueueItem
-{
-	SQLQuery* q;
-	MySQLresult* r;
-	RQueueItem(SQLQuery* Q, MySQLresult* R) : q(Q), r(R) {}
+	unsigned long long submitted;
+	QQueueItem(SQLQuery* Q, const std::string& S) : q(Q), query(S), submitted(LatencyHistogram::GetTimestamp()) {}
 };
 
 typedef std::map<std::string, SQLConnection*> ConnMap;
 typedef std::deque<QQueueItem> QueryQueue;
-typedef std::deque<RQueueItem> ResultQueue;
 
 /** MySQL module
  *  */
 class ModuleSQL : public Module
 {
+	/** True once mysql_library_init() succeeded */
+	bool libinit;
+
  public:
-	DispatcherThread* Dispatcher;
-	QueryQueue qq;       // MUST HOLD MUTEX
-	ResultQueue rq;      // MUST HOLD MUTEX
+	ThreadPool* Pool;
 	ConnMap connections; // main thread only
 
 	ModuleSQL();
@@ -110,20 +106,11 @@ class ModuleSQL : public Module
 	~ModuleSQL();
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE;
+	void OnRunTestSuite() CXX11_OVERRIDE;
 	Version GetVersion() CXX11_OVERRIDE;
 };
 
-class DispatcherThread : public SocketThread
-{
- private:
-	ModuleSQL* const Parent;
- public:
-	DispatcherThread(ModuleSQL* CreatorModule) : Parent(CreatorModule) { }
-	~DispatcherThread() { }
-	void Run();
-	void OnNotify();
-};
-
 #if !defined(MYSQL_VERSION_ID) || MYSQL_VERSION_ID<32224
 #define mysql_field_count mysql_num_fields
 #endif
@@ -224,51 +211,26 @@ class MySQLresult : public SQLResult
 
 /** Represents a connection to a mysql database
  */
-class SQLConnection : public SQLProvider
+class MySQLConn
 {
  public:
-	reference<ConfigTag> config;
+	SQLConnection* const db;
 	MYSQL *connection;
-	Mutex lock;
+	QueryJob* job;    // main thread only, the job running queries on this connection, NULL if it is idle
 
-	// This constructor creates an SQLConnection object with the given credentials, but does not connect yet.
-	SQLConnection(Module* p, ConfigTag* tag) : SQLProvider(p, "SQL/" + tag->getString("id")),
-		config(tag), connection(NULL)
+	// This constructor creates a MySQLConn object for the given database, but does not connect yet.
+	MySQLConn(SQLConnection* d) : db(d), connection(NULL), job(NULL)
 	{
 	}
 
-	~SQLConnection()
+	~MySQLConn()
 	{
 		Close();
 	}
 
-	// This method connects to the database using the credentials supplied to the constructor, and returns
+	// This method connects to the database using the credentials of the database, and returns
 	// true upon success.
-	bool Connect()
-	{
-		unsigned int timeout = 1;
-		connection = mysql_init(connection);
-		mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
-		std::string host = config->getString("host");
-		std::string user = config->getString("user");
-		std::string pass = config->getString("pass");
-		std::string dbname = config->getString("name");
-		int port = config->getInt("port");
-		bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
-		if (!rv)
-			return rv;
-		std::string initquery;
-		if (config->readString("initialquery", initquery))
-		{
-			mysql_query(connection,initquery.c_str());
-		}
-		return true;
-	}
-
-	ModuleSQL* Parent()
-	{
-		return (ModuleSQL*)(Module*)creator;
-	}
+	bool Connect();
 
 	MySQLresult* DoBlockingQuery(const std::string& query)
 	{
@@ -306,12 +268,55 @@ class SQLConnection : public SQLProvider
 	{
 		mysql_close(connection);
 	}
+};
+
+/** Represents a database, its queries are spread over a pool of connections
+ */
+class SQLConnection : public SQLProvider
+{
+ public:
+	reference<ConfigTag> config;
+	std::vector<MySQLConn*> conns;
+	QueryQueue queue;          // main thread only, queries waiting for an idle connection
+	unsigned int running;      // main thread only, number of connections running a job
+	bool closing;              // main thread only, delete this once the running jobs are done
+	LatencyHistogram latency;  // main thread only, time from submitting a query until its result is delivered
+	size_t maxqueued;          // main thread only, longest the queue has been
+
+	SQLConnection(Module* p, ConfigTag* tag) : SQLProvider(p, "SQL/" + tag->getString("id")),
+		config(tag), running(0), closing(false), maxqueued(0)
+	{
+		unsigned int size = tag->getInt("poolsize", 1, 1, 100);
+		for (unsigned int i = 0; i < size; i++)
+			conns.push_back(new MySQLConn(this));
+	}
+
+	~SQLConnection()
+	{
+		for (std::vector<MySQLConn*>::iterator i = conns.begin(); i != conns.end(); ++i)
+			delete *i;
+	}
+
+	ModuleSQL* Parent()
+	{
+		return (ModuleSQL*)(Module*)creator;
+	}
+
+	// Give the queued queries to the idle connections
+	void RunQueue();
+
+	// Call OnError() on the queued queries and delete them
+	void FailQueue(SQLerror& err);
+
+	// Take back the jobs which did not start yet and fail their queries
+	void CancelJobs(SQLerror& err);
 
 	void submit(SQLQuery* q, const std::string& qs)
 	{
-		Parent()->Dispatcher->LockQueue();
-		Parent()->qq.push_back(QQueueItem(q, qs, this));
-		Parent()->Dispatcher->UnlockQueueWakeup();
+		queue.push_back(QQueueItem(q, qs));
+		if (queue.size() > maxqueued)
+			maxqueued = queue.size();
+		RunQueue();
 	}
 
 	void submit(SQLQuery* call, const std::string& q, const ParamL& p)
@@ -372,29 +377,213 @@ class SQLConnection : public SQLProvider
 	}
 };
 
+bool MySQLConn::Connect()
+{
+	unsigned int timeout = 1;
+	ConfigTag* config = db->config;
+	connection = mysql_init(connection);
+	mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
+	std::string host = config->getString("host");
+	std::string user = config->getString("user");
+	std::string pass = config->getString("pass");
+	std::string dbname = config->getString("name");
+	int port = config->getInt("port");
+	bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
+	if (!rv)
+		return rv;
+	std::string initquery;
+	if (config->readString("initialquery", initquery))
+	{
+		mysql_query(connection,initquery.c_str());
+	}
+	return true;
+}
+
+/** Runs a batch of queries on a connection on one of the threads of the pool. The result of
+ * each query is passed to the main thread as soon as it is there, see QueryResult.
+ */
+class QueryJob : public ThreadJob
+{
+ public:
+	MySQLConn* const conn;
+	std::vector<std::string> texts;     // read by the thread
+	std::vector<SQLQuery*> queries;     // main thread only, NULL if the creator was unloaded or the result was delivered
+	std::vector<unsigned long long> submitted; // main thread only, when each query was submitted
+
+	QueryJob(MySQLConn* c) : conn(c)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE;
+
+	void Fail(SQLerror& err)
+	{
+		for (std::vector<SQLQuery*>::iterator i = queries.begin(); i != queries.end(); ++i)
+		{
+			SQLQuery* q = *i;
+			if (q)
+			{
+				q->OnError(err);
+				delete q;
+			}
+		}
+		queries.clear();
+	}
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		// The results were delivered by the QueryResults of the job
+		SQLConnection* db = conn->db;
+		conn->job = NULL;
+		db->running--;
+		if (!db->closing)
+			db->RunQueue();
+		else if (!db->running)
+			delete db;
+	}
+};
+
+/** The result of one query of a QueryJob, delivered before the rest of the job is done
+ */
+class QueryResult : public ThreadCompletion
+{
+	QueryJob* const job;
+	const size_t index;
+	MySQLresult* const res;
+
+ public:
+	QueryResult(QueryJob* j, size_t i, MySQLresult* r) : job(j), index(i), res(r)
+	{
+	}
+
+	~QueryResult()
+	{
+		delete res;
+	}
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		SQLQuery* q = job->queries[index];
+		if (!q)
+			return;
+
+		job->queries[index] = NULL;
+		job->conn->db->latency.Record(LatencyHistogram::GetTimestamp() - job->submitted[index]);
+		if (res->err.id == SQL_NO_ERROR)
+			q->OnResult(*res);
+		else
+			q->OnError(res->err);
+		delete q;
+	}
+};
+
+void QueryJob::Run()
+{
+	ThreadPool* pool = conn->db->Parent()->Pool;
+	for (size_t i = 0; i < texts.size(); i++)
+		pool->Complete(new QueryResult(this, i, conn->DoBlockingQuery(texts[i])));
+}
+
+void SQLConnection::RunQueue()
+{
+	std::vector<MySQLConn*> idle;
+	for (std::vector<MySQLConn*>::const_iterator i = conns.begin(); i != conns.end(); ++i)
+		if (!(*i)->job)
+			idle.push_back(*i);
+
+	// Split the queue evenly, each connection runs its share of it as one job
+	for (size_t i = 0; i < idle.size() && !queue.empty(); i++)
+	{
+		size_t remaining = idle.size() - i;
+		size_t count = (queue.size() + remaining - 1) / remaining;
+
+		QueryJob* job = new QueryJob(idle[i]);
+		for (size_t j = 0; j < count; j++)
+		{
+			const QQueueItem& item = queue.front();
+			job->queries.push_back(item.q);
+			job->texts.push_back(item.query);
+			job->submitted.push_back(item.submitted);
+			queue.pop_front();
+		}
+		idle[i]->job = job;
+		running++;
+		Parent()->Pool->Submit(job);
+	}
+}
+
+void SQLConnection::FailQueue(SQLerror& err)
+{
+	for (QueryQueue::iterator i = queue.begin(); i != queue.end(); ++i)
+	{
+		i->q->OnError(err);
+		delete i->q;
+	}
+	queue.clear();
+}
+
+void SQLConnection::CancelJobs(SQLerror& err)
+{
+	for (std::vector<MySQLConn*>::iterator i = conns.begin(); i != conns.end(); ++i)
+	{
+		MySQLConn* conn = *i;
+		if (conn->job && Parent()->Pool->Cancel(conn->job))
+		{
+			conn->job->Fail(err);
+			delete conn->job;
+			conn->job = NULL;
+			running--;
+		}
+	}
+}
+
+static void InitThread()
+{
+	mysql_thread_init();
+}
+
+static void EndThread()
+{
+	mysql_thread_end();
+}
+
 ModuleSQL::ModuleSQL()
+	: libinit(false)
 {
-	Dispatcher = NULL;
+	Pool = NULL;
 }
 
 void ModuleSQL::init()
 {
-	Dispatcher = new DispatcherThread(this);
-	ServerInstance->Threads->Start(Dispatcher);
+	// mysql_init() is only thread safe once the library is initialised
+	if (mysql_library_init(0, NULL, NULL))
+		throw ModuleException("Unable to initialise the MySQL client library");
+	libinit = true;
+
+	ConfigTag* tag = ServerInstance->Config->ConfValue("mysql");
+	Pool = new ThreadPool(tag->getInt("threads", 4, 1, 64), InitThread, EndThread);
 }
 
 ModuleSQL::~ModuleSQL()
 {
-	if (Dispatcher)
+	SQLerror err(SQL_BAD_DBID);
+	if (Pool)
 	{
-		Dispatcher->join();
-		Dispatcher->OnNotify();
-		delete Dispatcher;
+		// Let the running queries finish and deliver their results, then fail
+		// the jobs which did not start yet
+		Pool->Stop();
+		Pool->Deliver();
+		for (ConnMap::iterator i = connections.begin(); i != connections.end(); ++i)
+			i->second->CancelJobs(err);
+		delete Pool;
 	}
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
+		i->second->FailQueue(err);
 		delete i->second;
 	}
+	if (libinit)
+		mysql_library_end();
 }
 
 void ModuleSQL::ReadConfig(ConfigStatus& status)
@@ -421,123 +610,142 @@ void ModuleSQL::ReadConfig(ConfigStatus& status)
 	}
 
 	// now clean up the deleted databases
-	Dispatcher->LockQueue();
 	SQLerror err(SQL_BAD_DBID);
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
-		ServerInstance->Modules->DelService(*i->second);
-		// it might be running a query on this database. Wait for that to complete
-		i->second->lock.Lock();
-		i->second->lock.Unlock();
-		// now remove all active queries to this DB
-		for (size_t j = qq.size(); j > 0; j--)
-		{
-			size_t k = j - 1;
-			if (qq[k].c == i->second)
-			{
-				qq[k].q->OnError(err);
-				delete qq[k].q;
-				qq.erase(qq.begin() + k);
-			}
-		}
-		// finally, nuke the connection
-		delete i->second;
+		SQLConnection* conn = i->second;
+		ServerInstance->Modules->DelService(*conn);
+		// remove all queries to this DB which are not running yet
+		conn->FailQueue(err);
+		conn->CancelJobs(err);
+
+		// it might be running queries on this database, the last job
+		// deletes it once they are done
+		if (conn->running)
+			conn->closing = true;
+		else
+			delete conn;
 	}
-	Dispatcher->UnlockQueue();
 	connections.swap(conns);
 }
 
 void ModuleSQL::OnUnloadModule(Module* mod)
 {
 	SQLerror err(SQL_BAD_DBID);
-	Dispatcher->LockQueue();
-	unsigned int i = qq.size();
-	while (i > 0)
+	for (ConnMap::iterator i = connections.begin(); i != connections.end(); ++i)
 	{
-		i--;
-		if (qq[i].q->creator == mod)
+		SQLConnection* conn = i->second;
+		for (size_t j = conn->queue.size(); j > 0; j--)
+		{
+			QQueueItem& item = conn->queue[j - 1];
+			if (item.q->creator == mod)
+			{
+				item.q->OnError(err);
+				delete item.q;
+				conn->queue.erase(conn->queue.begin() + j - 1);
+			}
+		}
+
+		// the results of running queries are discarded
+		for (std::vector<MySQLConn*>::iterator j = conn->conns.begin(); j != conn->conns.end(); ++j)
 		{
-			if (i == 0)
+			if (!(*j)->job)
+				continue;
+
+			std::vector<SQLQuery*>& queries = (*j)->job->queries;
+			for (std::vector<SQLQuery*>::iterator k = queries.begin(); k != queries.end(); ++k)
 			{
-				// need to wait until the query is done
-				// (the result will be discarded)
-				qq[i].c->lock.Lock();
-				qq[i].c->lock.Unlock();
+				if (*k && (*k)->creator == mod)
+				{
+					(*k)->OnError(err);
+					delete *k;
+					*k = NULL;
+				}
 			}
-			qq[i].q->OnError(err);
-			delete qq[i].q;
-			qq.erase(qq.begin() + i);
 		}
 	}
-	Dispatcher->UnlockQueue();
-	// clean up any result queue entries
-	Dispatcher->OnNotify();
 }
 
-Version ModuleSQL::GetVersion()
+ModResult ModuleSQL::OnStats(char symbol, User* user, string_list& results)
 {
-	return Version("MySQL support", VF_VENDOR);
+	if (symbol != 'D')
+		return MOD_RES_PASSTHRU;
+
+	for (ConnMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+	{
+		SQLConnection* conn = i->second;
+		results.push_back(ServerInstance->Config->ServerName + " 249 " + user->nick + " :mysql " + i->first + " connections " + ConvToStr(conn->conns.size()) +
+			" busy " + ConvToStr(conn->running) + " queued " + ConvToStr(conn->queue.size()) + " peak " + ConvToStr(conn->maxqueued) + " " + conn->latency.ToString());
+	}
+	return MOD_RES_PASSTHRU;
 }
 
-void DispatcherThread::Run()
+/** Query sent by the test suite, checks that the value it selects comes back
+ */
+class TestQuery : public SQLQuery
 {
-	this->LockQueue();
-	while (!this->GetExitFlag())
+	const std::string expected;
+	unsigned int& done;
+	unsigned int& failed;
+
+ public:
+	TestQuery(Module* me, const std::string& e, unsigned int& d, unsigned int& f)
+		: SQLQuery(me), expected(e), done(d), failed(f)
 	{
-		if (!Parent->qq.empty())
-		{
-			QQueueItem i = Parent->qq.front();
-			i.c->lock.Lock();
-			this->UnlockQueue();
-			MySQLresult* res = i.c->DoBlockingQuery(i.query);
-			i.c->lock.Unlock();
-
-			/*
-			 * At this point, the main thread could be working on:
-			 *  Rehash - delete i.c out from under us. We don't care about that.
-			 *  UnloadModule - delete i.q and the qq item. Need to avoid reporting results.
-			 */
-
-			this->LockQueue();
-			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
-			{
-				Parent->qq.pop_front();
-				Parent->rq.push_back(RQueueItem(i.q, res));
-				NotifyParent();
-			}
-			else
-			{
-				// UnloadModule ate the query
-				delete res;
-			}
-		}
-		else
+	}
+
+	void OnResult(SQLResult& result) CXX11_OVERRIDE
+	{
+		SQLEntries row;
+		if (!result.GetRow(row) || row.empty() || row[0].value != expected)
+			failed++;
+		done++;
+	}
+
+	void OnError(SQLerror& error) CXX11_OVERRIDE
+	{
+		if (!failed)
+			std::cout << "Query failed: " << error.Str() << std::endl;
+		failed++;
+		done++;
+	}
+};
+
+void ModuleSQL::OnRunTestSuite()
+{
+	// A burst like the logins after a restart, against each configured database
+	const unsigned int count = 2000;
+	for (ConnMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+	{
+		SQLConnection* conn = i->second;
+		std::cout << "\nm_mysql: sending " << count << " queries to " << i->first << " over " << conn->conns.size() << " connections\n";
+
+		unsigned int done = 0;
+		unsigned int failed = 0;
+		unsigned long long start = LatencyHistogram::GetTimestamp();
+		for (unsigned int n = 0; n < count; n++)
 		{
-			/* We know the queue is empty, we can safely hang this thread until
-			 * something happens
-			 */
-			this->WaitForQueue();
+			ParamL p;
+			p.push_back(ConvToStr(n));
+			conn->submit(new TestQuery(this, p[0], done, failed), "SELECT '?'", p);
 		}
+
+		while (done < count && LatencyHistogram::GetTimestamp() - start < 30000000)
+			ServerInstance->SE->DispatchEvents();
+
+		// Queries which did not finish in time refer to the counters above, fail them now
+		if (done < count)
+			OnUnloadModule(this);
+
+		double elapsed = (LatencyHistogram::GetTimestamp() - start) / 1000000.0;
+		std::cout << done << " done, " << failed << " failed in " << elapsed << "s (" << (done / elapsed) << " queries/s), peak queue " << conn->maxqueued << "\n";
+		std::cout << "Latency: " << conn->latency.ToString() << "\n";
 	}
-	this->UnlockQueue();
 }
 
-void DispatcherThread::OnNotify()
+Version ModuleSQL::GetVersion()
 {
-	// this could unlock during the dispatch, but OnResult isn't expected to take that long
-	this->LockQueue();
-	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
-	{
-		MySQLresult* res = i->r;
-		if (res->err.id == SQL_NO_ERROR)
-			i->q->OnResult(*res);
-		else
-			i->q->OnError(res->err);
-		delete i->q;
-		delete i->r;
-	}
-	Parent->rq.clear();
-	this->UnlockQueue();
+	return Version("MySQL support", VF_VENDOR);
 }
 
 MODULE_INIT(ModuleSQL)
@@ -25,6 +25,7 @@
 #include "inspircd.h"
 #include <cstdlib>
 #include <sstream>
+#include <iostream>
 #include <libpq-fe.h>
 #include "modules/sql.h"
 
@@ -40,9 +41,10 @@
 
 /* Forward declare, so we can have the typedef neatly at the top */
 class SQLConn;
+class SQLPool;
 class ModulePgSQL;
 
-typedef std::map<std::string, SQLConn*> ConnMap;
+typedef std::map<std::string, SQLPool*> PoolMap;
 
 /* CREAD,	Connecting and wants read event
  * CWRITE,	Connecting and wants write event
@@ -68,7 +70,10 @@ struct QueueItem
 {
 	SQLQuery* c;
 	std::string q;
-	QueueItem(SQLQuery* C, const std::string& Q) : c(C), q(Q) {}
+	std::vector<std::string> params;	/* Parameters, if q is run as a prepared statement */
+	bool prepared;
+	unsigned long long submitted;
+	QueueItem(SQLQuery* C, const std::string& Q) : c(C), q(Q), prepared(false), submitted(LatencyHistogram::GetTimestamp()) {}
 };
 
 /** PgSQLresult is a subclass of the mostly-pure-virtual class SQLresult.
@@ -135,48 +140,37 @@ class PgSQLresult : public SQLResult
 	}
 };
 
-/** SQLConn represents one SQL session.
+/** SQLConn represents one SQL session, one of the connections of an SQLPool.
  */
-class SQLConn : public SQLProvider, public EventHandler
+class SQLConn : public EventHandler
 {
  public:
-	reference<ConfigTag> conf;	/* The <database> entry */
-	std::deque<QueueItem> queue;
+	SQLPool* const pool;
 	PGconn* 		sql;		/* PgSQL database connection handle */
 	SQLstatus		status;		/* PgSQL database connection status */
 	QueueItem		qinprog;	/* If there is currently a query in progress */
+	std::string		preparing;	/* Name of the statement being prepared for qinprog */
+	std::map<std::string, std::string> statements;	/* Statements prepared on this session by their query */
 
-	SQLConn(Module* Creator, ConfigTag* tag)
-	: SQLProvider(Creator, "SQL/" + tag->getString("id")), conf(tag), sql(NULL), status(CWRITE), qinprog(NULL, "")
-	{
-		if (!DoConnect())
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not connect to database " + tag->getString("id"));
-			DelayReconnect();
-		}
-	}
-
-	CullResult cull()
+	SQLConn(SQLPool* p)
+	: pool(p), sql(NULL), status(CWRITE), qinprog(NULL, "")
 	{
-		this->SQLProvider::cull();
-		ServerInstance->Modules->DelService(*this);
-		return this->EventHandler::cull();
 	}
 
 	~SQLConn()
 	{
-		SQLerror err(SQL_BAD_DBID);
 		if (qinprog.c)
 		{
+			SQLerror err(SQL_BAD_CONN);
 			qinprog.c->OnError(err);
 			delete qinprog.c;
 		}
-		for(std::deque<QueueItem>::iterator i = queue.begin(); i != queue.end(); i++)
-		{
-			SQLQuery* q = i->c;
-			q->OnError(err);
-			delete q;
-		}
+		Close();
+	}
+
+	bool IsIdle() const
+	{
+		return qinprog.q.empty() && (status == WREAD || status == WWRITE);
 	}
 
 	void HandleEvent(EventType et, int errornum)
@@ -193,33 +187,7 @@ class SQLConn : public SQLProvider, public EventHandler
 		}
 	}
 
-	std::string GetDSN()
-	{
-		std::ostringstream conninfo("connect_timeout = '5'");
-		std::string item;
-
-		if (conf->readString("host", item))
-			conninfo << " host = '" << item << "'";
-
-		if (conf->readString("port", item))
-			conninfo << " port = '" << item << "'";
-
-		if (conf->readString("name", item))
-			conninfo << " dbname = '" << item << "'";
-
-		if (conf->readString("user", item))
-			conninfo << " user = '" << item << "'";
-
-		if (conf->readString("pass", item))
-			conninfo << " password = '" << item << "'";
-
-		if (conf->getBool("ssl"))
-			conninfo << " sslmode = 'require'";
-		else
-			conninfo << " sslmode = 'disable'";
-
-		return conninfo.str();
-	}
+	std::string GetDSN();
 
 	bool DoConnect()
 	{
@@ -274,75 +242,7 @@ class SQLConn : public SQLProvider, public EventHandler
 		}
 	}
 
-	void DoConnectedPoll()
-	{
-restart:
-		while (qinprog.q.empty() && !queue.empty())
-		{
-			/* There's no query currently in progress, and there's queries in the queue. */
-			DoQuery(queue.front());
-			queue.pop_front();
-		}
-
-		if (PQconsumeInput(sql))
-		{
-			if (PQisBusy(sql))
-			{
-				/* Nothing happens here */
-			}
-			else if (qinprog.c)
-			{
-				/* Fetch the result.. */
-				PGresult* result = PQgetResult(sql);
-
-				/* PgSQL would allow a query string to be sent which has multiple
-				 * queries in it, this isn't portable across database backends and
-				 * we don't want modules doing it. But just in case we make sure we
-				 * drain any results there are and just use the last one.
-				 * If the module devs are behaving there will only be one result.
-				 */
-				while (PGresult* temp = PQgetResult(sql))
-				{
-					PQclear(result);
-					result = temp;
-				}
-
-				/* ..and the result */
-				PgSQLresult reply(result);
-				switch(PQresultStatus(result))
-				{
-					case PGRES_EMPTY_QUERY:
-					case PGRES_BAD_RESPONSE:
-					case PGRES_FATAL_ERROR:
-					{
-						SQLerror err(SQL_QREPLY_FAIL, PQresultErrorMessage(result));
-						qinprog.c->OnError(err);
-						break;
-					}
-					default:
-						/* Other values are not errors */
-						qinprog.c->OnResult(reply);
-				}
-
-				delete qinprog.c;
-				qinprog = QueueItem(NULL, "");
-				goto restart;
-			}
-			else
-			{
-				qinprog.q.clear();
-			}
-		}
-		else
-		{
-			/* I think we'll assume this means the server died...it might not,
-			 * but I think that any error serious enough we actually get here
-			 * deserves to reconnect [/excuse]
-			 * Returning true so the core doesn't try and close the connection.
-			 */
-			DelayReconnect();
-		}
-	}
+	void DoConnectedPoll();
 
 	bool DoResetPoll()
 	{
@@ -373,7 +273,8 @@ restart:
 	{
 		if((status == CREAD) || (status == CWRITE))
 		{
-			DoPoll();
+			if (!DoPoll())
+				DelayReconnect();
 		}
 		else if((status == RREAD) || (status == RWRITE))
 		{
@@ -385,21 +286,206 @@ restart:
 		}
 	}
 
-	void submit(SQLQuery *req, const std::string& q)
+	void DoQuery(const QueueItem& req)
 	{
-		if (qinprog.q.empty())
+		if (status != WREAD && status != WWRITE)
 		{
-			DoQuery(QueueItem(req,q));
+			// whoops, not connected...
+			SQLerror err(SQL_BAD_CONN);
+			req.c->OnError(err);
+			delete req.c;
+			return;
+		}
+
+		int sent;
+		if (!req.prepared)
+		{
+			sent = PQsendQuery(sql, req.q.c_str());
+		}
+		else
+		{
+			std::map<std::string, std::string>::const_iterator stmt = statements.find(req.q);
+			if (stmt != statements.end())
+			{
+				sent = SendPrepared(stmt->second, req.params);
+			}
+			else
+			{
+				// The statement is run once it was prepared
+				preparing = "inspircd_" + ConvToStr(statements.size());
+				sent = PQsendPrepare(sql, preparing.c_str(), req.q.c_str(), req.params.size(), NULL);
+			}
+		}
+
+		if (sent)
+		{
+			qinprog = req;
 		}
 		else
 		{
-			// wait your turn.
-			queue.push_back(QueueItem(req,q));
+			preparing.clear();
+			SQLerror err(SQL_QSEND_FAIL, PQerrorMessage(sql));
+			req.c->OnError(err);
+			delete req.c;
+		}
+	}
+
+	int SendPrepared(const std::string& name, const std::vector<std::string>& params)
+	{
+		std::vector<const char*> values(params.size());
+		std::vector<int> lengths(params.size());
+		for (size_t i = 0; i < params.size(); i++)
+		{
+			values[i] = params[i].c_str();
+			lengths[i] = params[i].length();
+		}
+		return PQsendQueryPrepared(sql, name.c_str(), params.size(), params.empty() ? NULL : &values[0], params.empty() ? NULL : &lengths[0], NULL, 0);
+	}
+
+	void Close()
+	{
+		if (fd >= 0 && ServerInstance->SE->GetRef(fd) == this)
+			ServerInstance->SE->DelFd(this);
+		fd = -1;
+
+		if(sql)
+		{
+			PQfinish(sql);
+			sql = NULL;
+		}
+	}
+};
+
+/** All connections to one database. Queries wait in a shared queue and are
+ * given to whichever connection is idle first.
+ */
+class SQLPool : public SQLProvider
+{
+ public:
+	reference<ConfigTag> conf;	/* The <database> entry */
+	std::vector<SQLConn*> conns;
+	std::deque<QueueItem> queue;
+	LatencyHistogram latency;	/* Time from submitting a query until its result */
+	unsigned long maxqueued;
+
+	SQLPool(Module* Creator, ConfigTag* tag)
+	: SQLProvider(Creator, "SQL/" + tag->getString("id")), conf(tag), maxqueued(0)
+	{
+		Fill();
+	}
+
+	CullResult cull()
+	{
+		ServerInstance->Modules->DelService(*this);
+		return this->SQLProvider::cull();
+	}
+
+	~SQLPool()
+	{
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			(*i)->cull();
+			delete *i;
+		}
+		Fail(SQL_BAD_DBID);
+	}
+
+	/** Open connections until there are as many as configured */
+	void Fill()
+	{
+		size_t poolsize = conf->getInt("poolsize", 1, 1, 100);
+		while (conns.size() < poolsize)
+		{
+			SQLConn* conn = new SQLConn(this);
+			conns.push_back(conn);
+			if (!conn->DoConnect())
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not connect to database " + conf->getString("id"));
+				conn->DelayReconnect();
+				break;
+			}
+		}
+	}
+
+	/** Give queued queries to the idle connections */
+	void Dispatch()
+	{
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end() && !queue.empty(); ++i)
+		{
+			SQLConn* conn = *i;
+			while (conn->IsIdle() && !queue.empty())
+			{
+				QueueItem item = queue.front();
+				queue.pop_front();
+				conn->DoQuery(item);
+			}
+		}
+	}
+
+	/** Fail the queued queries */
+	void Fail(SQLerrorNum id)
+	{
+		SQLerror err(id);
+		while (!queue.empty())
+		{
+			SQLQuery* q = queue.front().c;
+			queue.pop_front();
+			q->OnError(err);
+			delete q;
+		}
+	}
+
+	std::string Escape(const std::string& parm)
+	{
+		std::vector<char> buffer(parm.length() * 2 + 1);
+		PGconn* sql = NULL;
+		for (std::vector<SQLConn*>::const_iterator i = conns.begin(); i != conns.end() && !sql; ++i)
+			sql = (*i)->sql;
+#ifdef PGSQL_HAS_ESCAPECONN
+		if (sql)
+		{
+			int error;
+			size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
+			if (error)
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
+			return std::string(&buffer[0], escapedsize);
+		}
+#endif
+		size_t escapedsize = PQescapeString(&buffer[0], parm.data(), parm.length());
+		return std::string(&buffer[0], escapedsize);
+	}
+
+	void Queue(const QueueItem& item)
+	{
+		if (conns.empty())
+		{
+			// every connection failed, they are reopened by the reconnect timer
+			SQLerror err(SQL_BAD_CONN);
+			item.c->OnError(err);
+			delete item.c;
+			return;
 		}
+
+		queue.push_back(item);
+		if (queue.size() > maxqueued)
+			maxqueued = queue.size();
+		Dispatch();
+	}
+
+	void submit(SQLQuery *req, const std::string& q)
+	{
+		Queue(QueueItem(req, q));
 	}
 
 	void submit(SQLQuery *req, const std::string& q, const ParamL& p)
 	{
+		QueueItem item(req, "");
+		if (MakeStatement(q, '?', &p, NULL, item))
+		{
+			Queue(item);
+			return;
+		}
+
 		std::string res;
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
@@ -409,19 +495,7 @@ restart:
 			else
 			{
 				if (param < p.size())
-				{
-					std::string parm = p[param++];
-					std::vector<char> buffer(parm.length() * 2 + 1);
-#ifdef PGSQL_HAS_ESCAPECONN
-					int error;
-					size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
-					if (error)
-						ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
-#else
-					size_t escapedsize = PQescapeString(&buffer[0], parm.data(), parm.length());
-#endif
-					res.append(&buffer[0], escapedsize);
-				}
+					res.append(Escape(p[param++]));
 			}
 		}
 		submit(req, res);
@@ -429,6 +503,13 @@ restart:
 
 	void submit(SQLQuery *req, const std::string& q, const ParamM& p)
 	{
+		QueueItem item(req, "");
+		if (MakeStatement(q, '$', NULL, &p, item))
+		{
+			Queue(item);
+			return;
+		}
+
 		std::string res;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
@@ -444,63 +525,204 @@ restart:
 
 				ParamM::const_iterator it = p.find(field);
 				if (it != p.end())
-				{
-					std::string parm = it->second;
-					std::vector<char> buffer(parm.length() * 2 + 1);
-#ifdef PGSQL_HAS_ESCAPECONN
-					int error;
-					size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
-					if (error)
-						ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
-#else
-					size_t escapedsize = PQescapeString(&buffer[0], parm.data(), parm.length());
-#endif
-					res.append(&buffer[0], escapedsize);
-				}
+					res.append(Escape(it->second));
 			}
 		}
 		submit(req, res);
 	}
 
-	void DoQuery(const QueueItem& req)
+	/** Turn the placeholders of a query into the parameters of a prepared statement, which
+	 * each connection prepares once and reuses. A placeholder has to stand on its own or be
+	 * the whole of a quoted string like '$nick', otherwise the parameters are escaped into
+	 * the query text instead.
+	 * @param q The query
+	 * @param marker The character placeholders start with
+	 * @param pl Parameters of placeholders without a name, or NULL
+	 * @param pm Parameters by name, or NULL
+	 * @param item Receives the statement and its parameters
+	 * @return True if the query was turned into a statement
+	 */
+	static bool MakeStatement(const std::string& q, char marker, const ParamL* pl, const ParamM* pm, QueueItem& item)
 	{
-		if (status != WREAD && status != WWRITE)
+		std::map<std::string, std::string> numbers;
+		bool quoted = false;
+		for (std::string::size_type i = 0; i < q.length(); i++)
 		{
-			// whoops, not connected...
-			SQLerror err(SQL_BAD_CONN);
-			req.c->OnError(err);
-			delete req.c;
-			return;
-		}
+			if (q[i] != marker)
+			{
+				if (q[i] == '\'')
+					quoted = !quoted;
+				item.q.push_back(q[i]);
+				continue;
+			}
 
-		if(PQsendQuery(sql, req.q.c_str()))
-		{
-			qinprog = req;
-		}
-		else
-		{
-			SQLerror err(SQL_QSEND_FAIL, PQerrorMessage(sql));
-			req.c->OnError(err);
-			delete req.c;
+			std::string::size_type end = i + 1;
+			std::string field;
+			if (pm)
+			{
+				while (end < q.length() && isalnum(q[end]))
+					field.push_back(q[end++]);
+				if (field.empty())
+					return false;
+			}
+
+			if (quoted)
+			{
+				// drop the quotes, the statement gets the value as it is
+				if (q[i - 1] != '\'' || (i > 1 && q[i - 2] == '\'') || end >= q.length() || q[end] != '\'')
+					return false;
+				item.q.erase(item.q.length() - 1);
+				quoted = false;
+				end++;
+			}
+
+			std::map<std::string, std::string>::const_iterator num = numbers.find(field);
+			if (pm && num != numbers.end())
+			{
+				item.q.append(num->second);
+			}
+			else
+			{
+				std::string value;
+				if (pl && item.params.size() < pl->size())
+					value = (*pl)[item.params.size()];
+				else if (pm && pm->find(field) != pm->end())
+					value = pm->find(field)->second;
+
+				item.params.push_back(value);
+				item.q.append("$" + ConvToStr(item.params.size()));
+				numbers[field] = "$" + ConvToStr(item.params.size());
+			}
+			i = end - 1;
 		}
+
+		item.prepared = true;
+		return true;
 	}
+};
 
-	void Close()
+std::string SQLConn::GetDSN()
+{
+	std::ostringstream conninfo("connect_timeout = '5'");
+	std::string item;
+	ConfigTag* conf = pool->conf;
+
+	if (conf->readString("host", item))
+		conninfo << " host = '" << item << "'";
+
+	if (conf->readString("port", item))
+		conninfo << " port = '" << item << "'";
+
+	if (conf->readString("name", item))
+		conninfo << " dbname = '" << item << "'";
+
+	if (conf->readString("user", item))
+		conninfo << " user = '" << item << "'";
+
+	if (conf->readString("pass", item))
+		conninfo << " password = '" << item << "'";
+
+	if (conf->getBool("ssl"))
+		conninfo << " sslmode = 'require'";
+	else
+		conninfo << " sslmode = 'disable'";
+
+	return conninfo.str();
+}
+
+void SQLConn::DoConnectedPoll()
+{
+restart:
+	if (qinprog.q.empty())
 	{
-		ServerInstance->SE->DelFd(this);
+		/* There's no query currently in progress, take the next one waiting for the pool. */
+		pool->Dispatch();
+	}
 
-		if(sql)
+	if (PQconsumeInput(sql))
+	{
+		if (PQisBusy(sql))
 		{
-			PQfinish(sql);
-			sql = NULL;
+			/* Nothing happens here */
+		}
+		else if (!qinprog.q.empty())
+		{
+			/* Fetch the result.. */
+			PGresult* result = PQgetResult(sql);
+
+			/* PgSQL would allow a query string to be sent which has multiple
+			 * queries in it, this isn't portable across database backends and
+			 * we don't want modules doing it. But just in case we make sure we
+			 * drain any results there are and just use the last one.
+			 * If the module devs are behaving there will only be one result.
+			 */
+			while (PGresult* temp = PQgetResult(sql))
+			{
+				PQclear(result);
+				result = temp;
+			}
+
+			if (!preparing.empty() && PQresultStatus(result) == PGRES_COMMAND_OK)
+			{
+				/* The statement was prepared, now run it */
+				PQclear(result);
+				statements[qinprog.q] = preparing;
+				preparing.clear();
+				if (SendPrepared(statements[qinprog.q], qinprog.params))
+					goto restart;
+
+				SQLerror err(SQL_QSEND_FAIL, PQerrorMessage(sql));
+				if (qinprog.c)
+				{
+					qinprog.c->OnError(err);
+					delete qinprog.c;
+				}
+				qinprog = QueueItem(NULL, "");
+				goto restart;
+			}
+			preparing.clear();
+
+			/* ..and the result */
+			PgSQLresult reply(result);
+			if (qinprog.c)
+			{
+				pool->latency.Record(LatencyHistogram::GetTimestamp() - qinprog.submitted);
+				switch(PQresultStatus(result))
+				{
+					case PGRES_EMPTY_QUERY:
+					case PGRES_BAD_RESPONSE:
+					case PGRES_FATAL_ERROR:
+					{
+						SQLerror err(SQL_QREPLY_FAIL, PQresultErrorMessage(result));
+						qinprog.c->OnError(err);
+						break;
+					}
+					default:
+						/* Other values are not errors */
+						qinprog.c->OnResult(reply);
+				}
+
+				delete qinprog.c;
+			}
+			qinprog = QueueItem(NULL, "");
+			goto restart;
 		}
 	}
-};
+	else
+	{
+		/* I think we'll assume this means the server died...it might not,
+		 * but I think that any error serious enough we actually get here
+		 * deserves to reconnect [/excuse]
+		 * Returning true so the core doesn't try and close the connection.
+		 */
+		DelayReconnect();
+	}
+}
 
 class ModulePgSQL : public Module
 {
  public:
-	ConnMap connections;
+	PoolMap connections;
 	ReconnectTimer* retimer;
 
 	ModulePgSQL()
@@ -521,22 +743,24 @@ class ModulePgSQL : public Module
 
 	void ReadConf()
 	{
-		ConnMap conns;
+		PoolMap conns;
 		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
 		for(ConfigIter i = tags.first; i != tags.second; i++)
 		{
 			if (i->second->getString("module", "pgsql") != "pgsql")
 				continue;
 			std::string id = i->second->getString("id");
-			ConnMap::iterator curr = connections.find(id);
+			PoolMap::iterator curr = connections.find(id);
 			if (curr == connections.end())
 			{
-				SQLConn* conn = new SQLConn(this, i->second);
+				SQLPool* conn = new SQLPool(this, i->second);
 				conns.insert(std::make_pair(id, conn));
 				ServerInstance->Modules->AddService(*conn);
 			}
 			else
 			{
+				// reopen connections which failed
+				curr->second->Fill();
 				conns.insert(*curr);
 				connections.erase(curr);
 			}
@@ -547,7 +771,7 @@ class ModulePgSQL : public Module
 
 	void ClearAllConnections()
 	{
-		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+		for(PoolMap::iterator i = connections.begin(); i != connections.end(); i++)
 		{
 			i->second->cull();
 			delete i->second;
@@ -558,24 +782,28 @@ class ModulePgSQL : public Module
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
 		SQLerror err(SQL_BAD_DBID);
-		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+		for(PoolMap::iterator i = connections.begin(); i != connections.end(); i++)
 		{
-			SQLConn* conn = i->second;
-			if (conn->qinprog.c && conn->qinprog.c->creator == mod)
+			SQLPool* pool = i->second;
+			for (std::vector<SQLConn*>::iterator j = pool->conns.begin(); j != pool->conns.end(); ++j)
 			{
-				conn->qinprog.c->OnError(err);
-				delete conn->qinprog.c;
-				conn->qinprog.c = NULL;
+				SQLConn* conn = *j;
+				if (conn->qinprog.c && conn->qinprog.c->creator == mod)
+				{
+					conn->qinprog.c->OnError(err);
+					delete conn->qinprog.c;
+					conn->qinprog.c = NULL;
+				}
 			}
-			std::deque<QueueItem>::iterator j = conn->queue.begin();
-			while (j != conn->queue.end())
+			std::deque<QueueItem>::iterator j = pool->queue.begin();
+			while (j != pool->queue.end())
 			{
 				SQLQuery* q = j->c;
 				if (q->creator == mod)
 				{
 					q->OnError(err);
 					delete q;
-					j = conn->queue.erase(j);
+					j = pool->queue.erase(j);
 				}
 				else
 					j++;
@@ -583,12 +811,106 @@ class ModulePgSQL : public Module
 		}
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'D')
+			return MOD_RES_PASSTHRU;
+
+		for (PoolMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+		{
+			SQLPool* pool = i->second;
+			unsigned int busy = 0;
+			for (std::vector<SQLConn*>::const_iterator j = pool->conns.begin(); j != pool->conns.end(); ++j)
+				if (!(*j)->qinprog.q.empty())
+					busy++;
+
+			results.push_back(ServerInstance->Config->ServerName + " 249 " + user->nick + " :pgsql " + i->first + " connections " + ConvToStr(pool->conns.size()) +
+				" busy " + ConvToStr(busy) + " queued " + ConvToStr(pool->queue.size()) + " peak " + ConvToStr(pool->maxqueued) + " " + pool->latency.ToString());
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnRunTestSuite() CXX11_OVERRIDE;
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("PostgreSQL Service Provider module for all other m_sql* modules, uses v2 of the SQL API", VF_VENDOR);
 	}
 };
 
+/** Query sent by the test suite, checks that the value it selects comes back
+ */
+class TestQuery : public SQLQuery
+{
+	const std::string expected;
+	unsigned int& done;
+	unsigned int& failed;
+
+ public:
+	TestQuery(Module* me, const std::string& e, unsigned int& d, unsigned int& f)
+		: SQLQuery(me), expected(e), done(d), failed(f)
+	{
+	}
+
+	void OnResult(SQLResult& result) CXX11_OVERRIDE
+	{
+		SQLEntries row;
+		if (!result.GetRow(row) || row.empty() || row[0].value != expected)
+			failed++;
+		done++;
+	}
+
+	void OnError(SQLerror& error) CXX11_OVERRIDE
+	{
+		if (!failed)
+			std::cout << "Query failed: " << error.Str() << std::endl;
+		failed++;
+		done++;
+	}
+};
+
+void ModulePgSQL::OnRunTestSuite()
+{
+	// A burst like the logins after a restart, against each configured database
+	const unsigned int count = 2000;
+	for (PoolMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
+	{
+		SQLPool* pool = i->second;
+		std::cout << "\nm_pgsql: sending " << count << " queries to " << i->first << " over " << pool->conns.size() << " connections\n";
+
+		unsigned int done = 0;
+		unsigned int failed = 0;
+		unsigned long long start = LatencyHistogram::GetTimestamp();
+		for (unsigned int n = 0; n < count; n++)
+		{
+			const std::string value = ConvToStr(n);
+			if (n % 2)
+			{
+				ParamL p;
+				p.push_back(value);
+				pool->submit(new TestQuery(this, value, done, failed), "SELECT ?", p);
+			}
+			else
+			{
+				ParamM p;
+				p["value"] = value;
+				pool->submit(new TestQuery(this, value, done, failed), "SELECT '$value'", p);
+			}
+		}
+
+		while (done < count && LatencyHistogram::GetTimestamp() - start < 30000000)
+			ServerInstance->SE->DispatchEvents();
+
+		// Queries which did not finish in time refer to the counters above, fail them now
+		if (done < count)
+			OnUnloadModule(this);
+
+		double elapsed = (LatencyHistogram::GetTimestamp() - start) / 1000000.0;
+		std::cout << done << " done, " << failed << " failed in " << elapsed << "s (" << (done / elapsed) << " queries/s), peak queue " << pool->maxqueued << "\n";
+		std::cout << "Latency: " << pool->latency.ToString() << "\n";
+	}
+}
+
 bool ReconnectTimer::Tick(time_t time)
 {
 	mod->retimer = NULL;
@@ -598,12 +920,15 @@ bool ReconnectTimer::Tick(time_t time)
 
 void SQLConn::DelayReconnect()
 {
-	ModulePgSQL* mod = (ModulePgSQL*)(Module*)creator;
-	ConnMap::iterator it = mod->connections.find(conf->getString("id"));
-	if (it != mod->connections.end())
+	ModulePgSQL* mod = (ModulePgSQL*)(Module*)pool->creator;
+	std::vector<SQLConn*>::iterator it = std::find(pool->conns.begin(), pool->conns.end(), this);
+	if (it != pool->conns.end())
 	{
-		mod->connections.erase(it);
+		pool->conns.erase(it);
+		Close();
 		ServerInstance->GlobalCulls.AddItem((EventHandler*)this);
+		if (pool->conns.empty())
+			pool->Fail(SQL_BAD_CONN);
 		if (!mod->retimer)
 		{
 			mod->retimer = new ReconnectTimer(mod);
@@ -612,4 +937,5 @@ void SQLConn::DelayReconnect()
 	}
 }
 
+
 MODULE_INIT(ModulePgSQL)
@@ -25,6 +25,7 @@
 #include "inspircd.h"
 #include "modules/regex.h"
 #include <re2/re2.h>
+#include <re2/set.h>
 
 
 /* $CompileFlags: -std=c++11 */
@@ -49,6 +50,82 @@ class RE2Regex : public Regex
 	}
 };
 
+class RE2RegexSet : public RegexSet
+{
+	/** Memory the DFA of a set may use, a set of thousands of expressions needs more than the default */
+	static const int64_t SET_MAX_MEM = 64 * 1024 * 1024;
+
+	RE2::Set regexset;
+
+	/** The expressions of the set, matched one by one if the DFA of the set runs out of memory */
+	std::vector<std::string> exprs;
+
+	/** The compiled expressions, created the first time the DFA runs out of memory */
+	std::vector<RE2*> single;
+
+	static RE2::Options GetOptions()
+	{
+		RE2::Options options(RE2::Quiet);
+		options.set_max_mem(SET_MAX_MEM);
+		return options;
+	}
+
+	void MatchOneByOne(const std::string& text, std::vector<size_t>& matches)
+	{
+		if (single.empty())
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "The regex set of %lu expressions ran out of memory, matching them one by one",
+				(unsigned long)exprs.size());
+			for (std::vector<std::string>::const_iterator i = exprs.begin(); i != exprs.end(); ++i)
+				single.push_back(new RE2(*i, RE2::Quiet));
+		}
+
+		for (size_t i = 0; i < single.size(); i++)
+		{
+			if (RE2::FullMatch(text, *single[i]))
+				matches.push_back(i);
+		}
+	}
+
+ public:
+	RE2RegexSet(const std::vector<std::string>& expressions) : regexset(GetOptions(), RE2::ANCHOR_BOTH), exprs(expressions)
+	{
+		for (std::vector<std::string>::const_iterator i = exprs.begin(); i != exprs.end(); ++i)
+		{
+			std::string error;
+			if (regexset.Add(*i, &error) < 0)
+				throw RegexException(*i, error);
+		}
+
+		if (!regexset.Compile())
+			throw ModuleException("Unable to compile regex set, out of memory");
+	}
+
+	~RE2RegexSet()
+	{
+		for (std::vector<RE2*>::const_iterator i = single.begin(); i != single.end(); ++i)
+			delete *i;
+	}
+
+	void Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		std::vector<int> found;
+		RE2::Set::ErrorInfo error;
+		if (!regexset.Match(text, &found, &error))
+		{
+			// The DFA gives up on texts for which its cache is too small, the expressions are still
+			// matched. Only the first failure is logged, the compiled expressions are kept.
+			if (error.kind == RE2::Set::kOutOfMemory)
+				MatchOneByOne(text, matches);
+			return;
+		}
+
+		std::sort(found.begin(), found.end());
+		for (std::vector<int>::const_iterator i = found.begin(); i != found.end(); ++i)
+			matches.push_back(*i);
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
@@ -57,6 +134,11 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new RE2RegexSet(exprs);
+	}
 };
 
 class ModuleRegexRE2 : public Module
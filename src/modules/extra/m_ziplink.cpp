@@ -0,0 +1,363 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "modules/compress.h"
+#include <zlib.h>
+#include <ctime>
+
+/* $LinkerFlags: -lz */
+
+/** Get the CPU time used by the calling thread, in microseconds.
+ * The CPU time of the process would also count the I/O threads and everything else the server does.
+ */
+static unsigned long long GetThreadCPUTime()
+{
+#if defined HAS_CLOCK_GETTIME && defined CLOCK_THREAD_CPUTIME_ID
+	timespec now;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0)
+		return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+#endif
+	return 0;
+}
+
+/** Compression state of a single socket
+ */
+class zip_session
+{
+ public:
+	z_stream deflater;
+	z_stream inflater;
+	bool deflating;
+	bool inflating;
+
+	/** Number of bytes of the sendq which were queued before compression was switched on */
+	size_t rawleft;
+
+	/** Data which was processed but not yet written to the socket */
+	std::string outbuf;
+
+	CompressStats stats;
+
+	zip_session() : deflating(false), inflating(false), rawleft(0) { }
+};
+
+class ZipLinkIOHook : public CompressIOHook
+{
+	zip_session* sessions;
+
+	zip_session* GetSession(StreamSocket* sock)
+	{
+		int fd = sock->GetFd();
+		if ((fd < 0) || (fd > ServerInstance->SE->GetMaxFds() - 1))
+			return NULL;
+		return &sessions[fd];
+	}
+
+	void CloseSession(zip_session* session)
+	{
+		if (session->deflating)
+			deflateEnd(&session->deflater);
+		if (session->inflating)
+			inflateEnd(&session->inflater);
+		session->deflating = false;
+		session->inflating = false;
+		session->rawleft = 0;
+		session->outbuf.clear();
+		session->stats = CompressStats();
+	}
+
+	/** Decompress data and append the result to the receive queue
+	 * @return True on success, false if the compressed stream is invalid
+	 */
+	bool Inflate(zip_session* session, const char* data, size_t len, std::string& recvq)
+	{
+		unsigned long long start = GetThreadCPUTime();
+		char buffer[16384];
+		z_stream& zs = session->inflater;
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		zs.avail_in = len;
+		while (true)
+		{
+			zs.next_out = reinterpret_cast<Bytef*>(buffer);
+			zs.avail_out = sizeof(buffer);
+			int ret = inflate(&zs, Z_SYNC_FLUSH);
+			if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+				return false;
+
+			size_t produced = sizeof(buffer) - zs.avail_out;
+			recvq.append(buffer, produced);
+			session->stats.plain_in += produced;
+
+			// Stop once all input is consumed and the output buffer wasn't filled up
+			if ((ret == Z_BUF_ERROR) || (zs.avail_out != 0))
+				break;
+		}
+
+		session->stats.compressed_in += len;
+		session->stats.cpu_usec += GetThreadCPUTime() - start;
+		return (zs.avail_in == 0);
+	}
+
+	/** Compress data, flushing the compressor afterwards so the remote end can decode
+	 * every complete line it has received so far
+	 */
+	void Deflate(zip_session* session, const char* data, size_t len)
+	{
+		unsigned long long start = GetThreadCPUTime();
+		char buffer[16384];
+		z_stream& zs = session->deflater;
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		zs.avail_in = len;
+		size_t before = session->outbuf.length();
+		do
+		{
+			zs.next_out = reinterpret_cast<Bytef*>(buffer);
+			zs.avail_out = sizeof(buffer);
+			deflate(&zs, Z_SYNC_FLUSH);
+			session->outbuf.append(buffer, sizeof(buffer) - zs.avail_out);
+		} while (zs.avail_out == 0);
+
+		session->stats.plain_out += len;
+		session->stats.compressed_out += session->outbuf.length() - before;
+		session->stats.cpu_usec += GetThreadCPUTime() - start;
+	}
+
+	/** Write as much of the processed data to the socket as possible
+	 * @return 1 if everything was written, 0 if the socket blocked, -1 on error
+	 */
+	int Flush(StreamSocket* sock, zip_session* session)
+	{
+		while (!session->outbuf.empty())
+		{
+			int rv = ServerInstance->SE->Send(sock, session->outbuf.data(), session->outbuf.length(), 0);
+			if (rv == 0)
+			{
+				sock->SetError("Connection closed");
+				return -1;
+			}
+			else if (rv < 0)
+			{
+				if ((errno == EINTR) || (SocketEngine::IgnoreError()))
+				{
+					ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
+					return 0;
+				}
+				sock->SetError(SocketEngine::LastError());
+				return -1;
+			}
+			session->outbuf.erase(0, rv);
+		}
+		return 1;
+	}
+
+ public:
+	int level;
+
+	ZipLinkIOHook(Module* mod)
+		: CompressIOHook(mod, "compress/zlib", "zlib"), level(Z_DEFAULT_COMPRESSION)
+	{
+		sessions = new zip_session[ServerInstance->SE->GetMaxFds()];
+	}
+
+	~ZipLinkIOHook()
+	{
+		for (int i = 0; i < ServerInstance->SE->GetMaxFds(); i++)
+			CloseSession(&sessions[i]);
+		delete[] sessions;
+	}
+
+	void OnStreamSocketAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if (session)
+			CloseSession(session);
+	}
+
+	void OnStreamSocketConnect(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if (session)
+			CloseSession(session);
+
+		// Nothing to negotiate at this point, start reading and writing right away
+		ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE);
+	}
+
+	void OnStreamSocketClose(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if (session)
+			CloseSession(session);
+	}
+
+	int OnStreamSocketRead(StreamSocket* sock, std::string& recvq) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if (!session)
+			return -1;
+
+		char* ReadBuffer = ServerInstance->GetReadBuffer();
+		int n = ServerInstance->SE->Recv(sock, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
+		if (n > 0)
+		{
+			if (n == ServerInstance->Config->NetBufferSize)
+				ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+			else
+				ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ);
+
+			if (!session->inflating)
+			{
+				recvq.append(ReadBuffer, n);
+				return 1;
+			}
+
+			if (!Inflate(session, ReadBuffer, n, recvq))
+			{
+				sock->SetError("Invalid compressed data");
+				return -1;
+			}
+			return 1;
+		}
+		else if (n == 0)
+		{
+			sock->SetError("Connection closed");
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+			return -1;
+		}
+		else if (SocketEngine::IgnoreError())
+		{
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_READ_WILL_BLOCK);
+			return 0;
+		}
+		else if (errno == EINTR)
+		{
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+			return 0;
+		}
+
+		sock->SetError(SocketEngine::LastError());
+		ServerInstance->SE->ChangeEventMask(sock, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		return -1;
+	}
+
+	int OnStreamSocketWrite(StreamSocket* sock, std::string& sendq) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if (!session)
+			return -1;
+
+		// Finish writing what was processed earlier before taking on new data
+		int rv = Flush(sock, session);
+		if (rv <= 0)
+			return rv;
+
+		size_t raw = std::min(session->rawleft, sendq.length());
+		session->rawleft -= raw;
+		session->outbuf.append(sendq, 0, raw);
+		if (raw < sendq.length())
+		{
+			if (session->deflating)
+				Deflate(session, sendq.data() + raw, sendq.length() - raw);
+			else
+				session->outbuf.append(sendq, raw, std::string::npos);
+		}
+
+		// The data is now owned by us, an empty string is left behind in the sendq
+		// until the rest of it is written
+		sendq.clear();
+		rv = Flush(sock, session);
+		if (rv > 0)
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_EDGE_WRITE);
+		return rv;
+	}
+
+	bool StartCompress(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if ((!session) || (session->deflating))
+			return false;
+
+		memset(&session->deflater, 0, sizeof(session->deflater));
+		if (deflateInit(&session->deflater, level) != Z_OK)
+			return false;
+
+		session->deflating = true;
+		session->rawleft = sock->getSendQSize();
+		session->stats.compressing = true;
+		return true;
+	}
+
+	bool StartDecompress(StreamSocket* sock, std::string& recvq) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if ((!session) || (session->inflating))
+			return false;
+
+		memset(&session->inflater, 0, sizeof(session->inflater));
+		if (inflateInit(&session->inflater) != Z_OK)
+			return false;
+
+		session->inflating = true;
+		session->stats.decompressing = true;
+
+		// Everything after the switch point has already been read as plaintext
+		std::string compressed;
+		compressed.swap(recvq);
+		return Inflate(session, compressed.data(), compressed.length(), recvq);
+	}
+
+	void GetStats(StreamSocket* sock, CompressStats& stats) CXX11_OVERRIDE
+	{
+		zip_session* session = GetSession(sock);
+		if (session)
+			stats = session->stats;
+	}
+};
+
+class ModuleZipLink : public Module
+{
+	ZipLinkIOHook iohook;
+
+ public:
+	ModuleZipLink()
+		: iohook(this)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("ziplink");
+		iohook.level = tag->getInt("level", 6);
+		if ((iohook.level < Z_NO_COMPRESSION) || (iohook.level > Z_BEST_COMPRESSION))
+			throw ModuleException("<ziplink:level> must be between 0 and 9");
+	}
+
+	void OnHookIO(StreamSocket* sock, ListenSocket* lsb) CXX11_OVERRIDE
+	{
+		if (!sock->GetIOHook() && lsb->bind_tag->getString("ssl") == "zlib")
+			sock->AddIOHook(&iohook);
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides zlib stream compression for server links", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZipLink)
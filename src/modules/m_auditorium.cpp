@@ -85,6 +85,14 @@ class ModuleAuditorium : public Module
 		return false;
 	}
 
+	ModResult OnNamesListVariant(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE
+	{
+		// Who is visible depends on who is asking
+		if (chan->IsModeSet(&aum))
+			return MOD_RES_DENY;
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
 		// Some module already hid this from being displayed, don't bother
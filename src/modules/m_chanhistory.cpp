@@ -19,20 +19,203 @@
 
 #include "inspircd.h"
 
+struct HistoryList;
+
 struct HistoryItem
 {
 	time_t ts;
+	/** Position of this line in the order lines were added to any channel */
+	unsigned long serial;
+	/** The line, including the trailing CR/LF so lines can be sent in one batch */
 	std::string line;
-	HistoryItem(const std::string& Line) : ts(ServerInstance->Time()), line(Line) {}
+	HistoryItem() : ts(0), serial(0) {}
+};
+
+/** Keeps the total size of all history lines below a limit by dropping the
+ * oldest line on the network whenever a new one would exceed the limit.
+ */
+class HistoryArena
+{
+	struct Entry
+	{
+		HistoryList* list;
+		unsigned long serial;
+		Entry(HistoryList* List, unsigned long Serial) : list(List), serial(Serial) {}
+	};
+
+	/** Every line stored, oldest first. Entries for lines that were removed
+	 * from their list are skipped when found and compacted away occasionally.
+	 */
+	std::deque<Entry> order;
+
+	/** All history lists currently alive */
+	std::set<HistoryList*> lists;
+
+	unsigned long nextserial;
+
+	bool IsLive(const Entry& entry) const;
+	void Compact();
+
+ public:
+	/** Size of all lines stored, in bytes */
+	size_t bytes;
+	/** Number of lines stored */
+	size_t lines;
+	/** Maximum size of all lines, 0 for no limit */
+	size_t maxbytes;
+
+	HistoryArena() : nextserial(0), bytes(0), lines(0), maxbytes(0) {}
+
+	void Register(HistoryList* list) { lists.insert(list); }
+	void Unregister(HistoryList* list) { lists.erase(list); }
+
+	/** Account for a line added to a list, may drop old lines */
+	unsigned long Added(HistoryList* list, size_t size);
+
+	/** Account for a line removed from a list */
+	void Removed(size_t size)
+	{
+		bytes -= size;
+		lines--;
+	}
+
+	/** Drop the oldest lines until the size limit is met */
+	void Trim();
 };
 
+/** The history of a channel, kept as a ring buffer which grows up to maxlen lines
+ */
 struct HistoryList
 {
-	std::deque<HistoryItem> lines;
+	HistoryArena& arena;
+	std::vector<HistoryItem> ring;
+	/** Index of the oldest line in the ring */
+	unsigned int first;
+	/** Number of lines in the ring */
+	unsigned int count;
 	unsigned int maxlen, maxtime;
-	HistoryList(unsigned int len, unsigned int time) : maxlen(len), maxtime(time) {}
+
+	HistoryList(HistoryArena& Arena, unsigned int len, unsigned int time)
+		: arena(Arena), first(0), count(0), maxlen(len), maxtime(time)
+	{
+		arena.Register(this);
+	}
+
+	~HistoryList()
+	{
+		while (count)
+			PopFront();
+		arena.Unregister(this);
+	}
+
+	HistoryItem& Get(unsigned int index)
+	{
+		return ring[(first + index) % ring.size()];
+	}
+
+	static size_t ItemSize(const HistoryItem& item)
+	{
+		return sizeof(HistoryItem) + item.line.length();
+	}
+
+	void PopFront()
+	{
+		HistoryItem& item = ring[first];
+		arena.Removed(ItemSize(item));
+		std::string().swap(item.line);
+		first = (first + 1) % ring.size();
+		count--;
+	}
+
+	void PushBack(const std::string& line)
+	{
+		// Expired lines would never be replayed again, free them right away
+		if (maxtime)
+		{
+			time_t mintime = ServerInstance->Time() - maxtime;
+			while ((count) && (Get(0).ts < mintime))
+				PopFront();
+		}
+
+		if (count == maxlen)
+			PopFront();
+
+		if (count == ring.size())
+		{
+			// Grow the ring, putting the lines back into order first
+			std::rotate(ring.begin(), ring.begin() + first, ring.end());
+			first = 0;
+			ring.push_back(HistoryItem());
+		}
+
+		HistoryItem& item = Get(count);
+		item.ts = ServerInstance->Time();
+		item.line = line;
+		count++;
+		item.serial = arena.Added(this, ItemSize(item));
+		arena.Trim();
+	}
+
+	void Resize(unsigned int len)
+	{
+		while (count > len)
+			PopFront();
+
+		std::vector<HistoryItem> newring(count);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			HistoryItem& item = Get(i);
+			newring[i].ts = item.ts;
+			newring[i].serial = item.serial;
+			newring[i].line.swap(item.line);
+		}
+		ring.swap(newring);
+		first = 0;
+		maxlen = len;
+	}
 };
 
+bool HistoryArena::IsLive(const Entry& entry) const
+{
+	if (lists.find(entry.list) == lists.end())
+		return false;
+	// Lines are only ever removed from the front of a list
+	return ((entry.list->count) && (entry.serial >= entry.list->Get(0).serial));
+}
+
+void HistoryArena::Compact()
+{
+	std::deque<Entry> live;
+	for (std::deque<Entry>::const_iterator i = order.begin(); i != order.end(); ++i)
+	{
+		if (IsLive(*i))
+			live.push_back(*i);
+	}
+	order.swap(live);
+}
+
+unsigned long HistoryArena::Added(HistoryList* list, size_t size)
+{
+	bytes += size;
+	lines++;
+	order.push_back(Entry(list, ++nextserial));
+
+	if (order.size() > (lines * 2) + 64)
+		Compact();
+	return nextserial;
+}
+
+void HistoryArena::Trim()
+{
+	while ((maxbytes) && (bytes > maxbytes) && (!order.empty()))
+	{
+		Entry entry = order.front();
+		order.pop_front();
+		if ((IsLive(entry)) && (entry.list->Get(0).serial == entry.serial))
+			entry.list->PopFront();
+	}
+}
+
 class HistoryMode : public ModeHandler
 {
 	bool IsValidDuration(const std::string& duration)
@@ -50,6 +233,7 @@ class HistoryMode : public ModeHandler
 	}
 
  public:
+	HistoryArena arena;
 	SimpleExtItem<HistoryList> ext;
 	unsigned int maxlines;
 	HistoryMode(Module* Creator) : ModeHandler(Creator, "history", 'H', PARAM_SETONLY, MODETYPE_CHANNEL),
@@ -82,15 +266,12 @@ class HistoryMode : public ModeHandler
 			if (history)
 			{
 				// Shrink the list if the new line number limit is lower than the old one
-				if (len < history->lines.size())
-					history->lines.erase(history->lines.begin(), history->lines.begin() + (history->lines.size() - len));
-
-				history->maxlen = len;
+				history->Resize(len);
 				history->maxtime = time;
 			}
 			else
 			{
-				ext.set(channel, new HistoryList(len, time));
+				ext.set(channel, new HistoryList(arena, len, time));
 			}
 		}
 		else
@@ -118,6 +299,8 @@ class ModuleChanHistory : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("chanhistory");
 		m.maxlines = tag->getInt("maxlines", 50);
+		m.arena.maxbytes = tag->getInt("maxmem", 16*1024*1024, 0);
+		m.arena.Trim();
 		sendnotice = tag->getBool("notice", true);
 		dobots = tag->getBool("bots", true);
 	}
@@ -130,17 +313,19 @@ class ModuleChanHistory : public Module
 			HistoryList* list = m.ext.get(c);
 			if (list)
 			{
-				const std::string line = ":" + user->GetFullHost() + " PRIVMSG " + c->name + " :" + text;
-				list->lines.push_back(HistoryItem(line));
-				if (list->lines.size() > list->maxlen)
-					list->lines.pop_front();
+				std::string line = ":" + user->GetFullHost() + " PRIVMSG " + c->name + " :" + text;
+				if (line.length() > ServerInstance->Config->Limits.MaxLine - 2)
+					line.erase(ServerInstance->Config->Limits.MaxLine - 2);
+				line.append("\r\n");
+				list->PushBack(line);
 			}
 		}
 	}
 
 	void OnPostJoin(Membership* memb) CXX11_OVERRIDE
 	{
-		if (IS_REMOTE(memb->user))
+		LocalUser* localuser = IS_LOCAL(memb->user);
+		if (!localuser)
 			return;
 
 		if (memb->user->IsModeSet(botmode) && !dobots)
@@ -158,11 +343,20 @@ class ModuleChanHistory : public Module
 			memb->user->WriteNotice("Replaying up to " + ConvToStr(list->maxlen) + " lines of pre-join history spanning up to " + ConvToStr(list->maxtime) + " seconds");
 		}
 
-		for(std::deque<HistoryItem>::iterator i = list->lines.begin(); i != list->lines.end(); ++i)
+		// Queue all lines with a single write rather than going through Write() for each one
+		std::string batch;
+		unsigned int lines = 0;
+		for (unsigned int i = 0; i < list->count; i++)
 		{
-			if (i->ts >= mintime)
-				memb->user->Write(i->line);
+			HistoryItem& item = list->Get(i);
+			if (item.ts >= mintime)
+			{
+				batch.append(item.line);
+				lines++;
+			}
 		}
+
+		localuser->WriteLines(batch, lines);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -25,6 +25,7 @@
 
 #include "inspircd.h"
 #include "modules/hash.h"
+#include <iostream>
 
 enum CloakMode
 {
@@ -142,8 +143,26 @@ class ModuleCloaking : public Module
 	const char* xtab[4];
 	dynamic_reference<HashProvider> Hash;
 
-	ModuleCloaking() : cu(this), mode(MODE_OPAQUE), ck(this), Hash(this, "hash/md5")
+	/** Inputs of the hashes of the segments of a cloak, each starts with the segment id,
+	 * the key and a null which are kept between cloaks
+	 */
+	std::string hashinput[4];
+	std::string::size_type hashprefix;
+
+	/** Recently generated cloaks with their cache keys, most recently used first */
+	typedef std::list<std::pair<std::string, std::string> > CloakList;
+	CloakList cache;
+	TR1NS::unordered_map<std::string, CloakList::iterator> cacheindex;
+	size_t cachesize;
+	std::string cachekey;
+
+	/** Reused by OnCheckBan() to build the cloaked mask of a user */
+	std::string banmask;
+
+	ModuleCloaking() : cu(this), mode(MODE_OPAQUE), ck(this), Hash(this, "hash/md5"), hashprefix(2), cachesize(0)
 	{
+		for (unsigned int i = 0; i < 4; i++)
+			hashinput[i].assign(hashprefix, '\0');
 	}
 
 	/** This function takes a domain name string and returns just the last two domain parts,
@@ -185,33 +204,72 @@ class ModuleCloaking : public Module
 	 */
 	std::string SegmentCloak(const std::string& item, char id, int len)
 	{
-		std::string input;
-		input.reserve(key.length() + 3 + item.length());
-		input.append(1, id);
-		input.append(key);
-		input.append(1, '\0'); // null does not terminate a C++ string
-		input.append(item);
-
-		std::string rv = Hash->sum(input).substr(0,len);
+		unsigned char digest[16];
+		SetSegment(0, item.data(), item.length(), id);
+		HashSegments(1, digest);
+
+		std::string rv;
+		AppendDigest(rv, digest, len);
+		return rv;
+	}
+
+	/** Set the item of one of the hash inputs
+	 * @param n The index of the input
+	 * @param item The item to cloak
+	 * @param itemlen The length of the item
+	 * @param id A unique ID for this type of item
+	 */
+	void SetSegment(unsigned int n, const char* item, size_t itemlen, char id)
+	{
+		std::string& input = hashinput[n];
+		input.resize(hashprefix);
+		input[0] = id;
+		input.append(item, itemlen);
+	}
+
+	/** Hash the first inputs in one batch
+	 * @param count The number of inputs to hash
+	 * @param digests Receives count hashes, Hash is always hash/md5 which produces 16 bytes each
+	 */
+	void HashSegments(unsigned int count, unsigned char* digests)
+	{
+		const void* data[4];
+		size_t lens[4];
+		for (unsigned int i = 0; i < count; i++)
+		{
+			data[i] = hashinput[i].data();
+			lens[i] = hashinput[i].length();
+		}
+		Hash->batchsum(count, data, lens, digests);
+	}
+
+	/** Append the cloak of a segment to a string
+	 * @param out The string to append the cloak to
+	 * @param digest The hash of the segment
+	 * @param len The length of the output. Maximum for MD5 is 16 characters.
+	 */
+	static void AppendDigest(std::string& out, const unsigned char* digest, int len)
+	{
 		for(int i=0; i < len; i++)
 		{
 			// this discards 3 bits per byte. We have an
 			// overabundance of bits in the hash output, doesn't
 			// matter which ones we are discarding.
-			rv[i] = base32[rv[i] & 0x1F];
+			out.push_back(base32[digest[i] & 0x1F]);
 		}
-		return rv;
 	}
 
 	std::string SegmentIP(const irc::sockets::sockaddrs& ip, bool full)
 	{
-		std::string bindata;
+		const char* bindata;
+		size_t binlen;
 		int hop1, hop2, hop3;
 		int len1, len2;
 		std::string rv;
 		if (ip.sa.sa_family == AF_INET6)
 		{
-			bindata = std::string((const char*)ip.in6.sin6_addr.s6_addr, 16);
+			bindata = (const char*)ip.in6.sin6_addr.s6_addr;
+			binlen = 16;
 			hop1 = 8;
 			hop2 = 6;
 			hop3 = 4;
@@ -223,7 +281,8 @@ class ModuleCloaking : public Module
 		}
 		else
 		{
-			bindata = std::string((const char*)&ip.in4.sin_addr, 4);
+			bindata = (const char*)&ip.in4.sin_addr;
+			binlen = 4;
 			hop1 = 3;
 			hop2 = 0;
 			hop3 = 2;
@@ -232,23 +291,32 @@ class ModuleCloaking : public Module
 			rv.reserve(prefix.length() + 15 + suffix.length());
 		}
 
+		// The segments are independent so they are hashed in one batch
+		unsigned int count = 0;
+		SetSegment(count++, bindata, binlen, 10);
+		SetSegment(count++, bindata, hop1, 11);
+		if (hop2)
+			SetSegment(count++, bindata, hop2, 12);
+		if (full)
+			SetSegment(count++, bindata, hop3, 13);
+		unsigned char digests[4 * 16];
+		HashSegments(count, digests);
+
 		rv.append(prefix);
-		rv.append(SegmentCloak(bindata, 10, len1));
+		AppendDigest(rv, digests, len1);
 		rv.append(1, '.');
-		bindata.erase(hop1);
-		rv.append(SegmentCloak(bindata, 11, len2));
+		AppendDigest(rv, digests + 16, len2);
+		unsigned int next = 2;
 		if (hop2)
 		{
 			rv.append(1, '.');
-			bindata.erase(hop2);
-			rv.append(SegmentCloak(bindata, 12, len2));
+			AppendDigest(rv, digests + 16 * next++, len2);
 		}
 
 		if (full)
 		{
 			rv.append(1, '.');
-			bindata.erase(hop3);
-			rv.append(SegmentCloak(bindata, 13, 6));
+			AppendDigest(rv, digests + 16 * next, 6);
 			rv.append(suffix);
 		}
 		else
@@ -281,8 +349,8 @@ class ModuleCloaking : public Module
 		/* Check if they have a cloaked host, but are not using it */
 		if (cloak && *cloak != user->dhost)
 		{
-			const std::string cloakMask = user->nick + "!" + user->ident + "@" + *cloak;
-			if (InspIRCd::Match(cloakMask, mask))
+			banmask.assign(user->nick).append(1, '!').append(user->ident).append(1, '@').append(*cloak);
+			if (InspIRCd::Match(banmask, mask))
 				return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
@@ -339,6 +407,19 @@ class ModuleCloaking : public Module
 		key = tag->getString("key");
 		if (key.empty() || key == "secret")
 			throw ModuleException("You have not defined cloak keys for m_cloaking. Define <cloak:key> as a network-wide secret.");
+
+		hashprefix = key.length() + 2;
+		for (unsigned int i = 0; i < 4; i++)
+		{
+			hashinput[i].assign(1, '\0');
+			hashinput[i].append(key);
+			hashinput[i].append(1, '\0'); // null does not terminate a C++ string
+		}
+
+		// Cloaks generated with the old settings are no longer valid
+		cachesize = tag->getInt("cachesize", 4096, 0);
+		cache.clear();
+		cacheindex.clear();
 	}
 
 	std::string GenCloak(const irc::sockets::sockaddrs& ip, const std::string& ipstr, const std::string& host)
@@ -362,13 +443,100 @@ class ModuleCloaking : public Module
 		return chost;
 	}
 
+	/** Like GenCloak() but looks the cloak up in the cache first, so clients reconnecting
+	 * from the same address during a connect storm do not need to be hashed again
+	 */
+	const std::string& GetCachedCloak(const irc::sockets::sockaddrs& ip, const std::string& ipstr, const std::string& host)
+	{
+		// The cloak only depends on the address, and in half mode on the hostname as well
+		cachekey.assign(1, static_cast<char>(ip.sa.sa_family));
+		if (ip.sa.sa_family == AF_INET6)
+			cachekey.append((const char*)ip.in6.sin6_addr.s6_addr, 16);
+		else
+			cachekey.append((const char*)&ip.in4.sin_addr, 4);
+		if (mode == MODE_HALF_CLOAK)
+			cachekey.append(host);
+
+		TR1NS::unordered_map<std::string, CloakList::iterator>::iterator it = cacheindex.find(cachekey);
+		if (it != cacheindex.end())
+		{
+			cache.splice(cache.begin(), cache, it->second);
+			return it->second->second;
+		}
+
+		cache.push_front(std::make_pair(cachekey, GenCloak(ip, ipstr, host)));
+		cacheindex[cachekey] = cache.begin();
+		if (cacheindex.size() > cachesize)
+		{
+			cacheindex.erase(cache.back().first);
+			cache.pop_back();
+		}
+		return cache.front().second;
+	}
+
 	void OnUserConnect(LocalUser* dest) CXX11_OVERRIDE
 	{
 		std::string* cloak = cu.ext.get(dest);
 		if (cloak)
 			return;
 
-		cu.ext.set(dest, GenCloak(dest->client_sa, dest->GetIPString(), dest->host));
+		const int family = dest->client_sa.sa.sa_family;
+		if (cachesize && (family == AF_INET || family == AF_INET6))
+			cu.ext.set(dest, GetCachedCloak(dest->client_sa, dest->GetIPString(), dest->host));
+		else
+			cu.ext.set(dest, GenCloak(dest->client_sa, dest->GetIPString(), dest->host));
+	}
+
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		if (!Hash)
+		{
+			std::cout << "\nm_cloaking: hash/md5 is not loaded, skipping the benchmark\n";
+			return;
+		}
+
+		const unsigned long count = 1000000;
+		const unsigned long distinct = 1000;
+		const std::string host = "192.0.2.1";
+		std::cout << "\nm_cloaking: benchmarking with " << count << " cloaks of " << distinct << " distinct addresses\n";
+
+		irc::sockets::sockaddrs sa;
+		irc::sockets::aptosa(host, 0, sa);
+		unsigned char* ip4 = (unsigned char*)&sa.in4.sin_addr;
+
+		// Every cloak computed from scratch, as it was done on every connect
+		double start = GetTime();
+		for (unsigned long i = 0; i < count; i++)
+		{
+			ip4[2] = (i % distinct) / 256;
+			ip4[3] = (i % distinct) % 256;
+			GenCloak(sa, host, host);
+		}
+		double cold = GetTime() - start;
+		std::cout << "Uncached: " << cold << "s (" << (count / cold) << " cloaks/s)\n";
+
+		// The same addresses reconnecting, as during a connect storm
+		const size_t oldsize = cachesize;
+		cachesize = std::max<size_t>(cachesize, distinct);
+		start = GetTime();
+		for (unsigned long i = 0; i < count; i++)
+		{
+			ip4[2] = (i % distinct) / 256;
+			ip4[3] = (i % distinct) % 256;
+			GetCachedCloak(sa, host, host);
+		}
+		double warm = GetTime() - start;
+		std::cout << "Cached: " << warm << "s (" << (count / warm) << " cloaks/s)\n";
+
+		cachesize = oldsize;
+		cache.clear();
+		cacheindex.clear();
+	}
+
+	static double GetTime()
+	{
+		ServerInstance->UpdateTime();
+		return ServerInstance->Time() + ServerInstance->Time_ns() / 1000000000.0;
 	}
 };
 
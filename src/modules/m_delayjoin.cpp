@@ -45,6 +45,7 @@ class ModuleDelayJoin : public Module
 	}
 
 	Version GetVersion() CXX11_OVERRIDE;
+	ModResult OnNamesListVariant(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE;
 	void OnNamesListItem(User* issuer, Membership*, std::string &prefixes, std::string &nick) CXX11_OVERRIDE;
 	void OnUserJoin(Membership*, bool, bool, CUList&) CXX11_OVERRIDE;
 	void CleanUser(User* user);
@@ -80,6 +81,14 @@ Version ModuleDelayJoin::GetVersion()
 	return Version("Allows for delay-join channels (+D) where users don't appear to join until they speak", VF_VENDOR);
 }
 
+ModResult ModuleDelayJoin::OnNamesListVariant(User* issuer, Channel* chan, std::string& variant)
+{
+	/* Users can always see themselves, so the list differs for every user */
+	if (chan->IsModeSet(&djm))
+		return MOD_RES_DENY;
+	return MOD_RES_PASSTHRU;
+}
+
 void ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick)
 {
 	/* don't prevent the user from seeing themself */
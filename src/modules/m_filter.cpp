@@ -137,6 +137,391 @@ class FilterResult
 	}
 };
 
+/** Finds which of a number of literal strings occur in a text, using an Aho-Corasick
+ * automaton. Literals and text are both folded with the case mapping that was active
+ * when the automaton was built.
+ */
+class LiteralMatcher
+{
+	static const unsigned int NONE = UINT_MAX;
+
+	struct Node
+	{
+		/** Transitions, sorted by character */
+		std::vector<std::pair<unsigned char, unsigned int> > next;
+		/** Longest proper suffix of this node which is also a node */
+		unsigned int fail;
+		/** Nearest node along the fail links which has outputs, or NONE */
+		unsigned int dict;
+		/** Identifiers of the literals ending at this node */
+		std::vector<size_t> outputs;
+
+		Node() : fail(0), dict(NONE) { }
+	};
+
+	std::vector<Node> nodes;
+	unsigned char casemap[256];
+
+	unsigned int Next(unsigned int node, unsigned char c) const
+	{
+		const std::vector<std::pair<unsigned char, unsigned int> >& next = nodes[node].next;
+		std::vector<std::pair<unsigned char, unsigned int> >::const_iterator it =
+			std::lower_bound(next.begin(), next.end(), std::make_pair(c, 0U));
+		if ((it != next.end()) && (it->first == c))
+			return it->second;
+		return NONE;
+	}
+
+ public:
+	LiteralMatcher()
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		nodes.clear();
+		nodes.push_back(Node());
+		memcpy(casemap, national_case_insensitive_map, sizeof(casemap));
+	}
+
+	/** Check whether the automaton is still valid for the current case mapping */
+	bool IsCurrent() const
+	{
+		return (memcmp(casemap, national_case_insensitive_map, sizeof(casemap)) == 0);
+	}
+
+	bool empty() const
+	{
+		return (nodes.size() == 1);
+	}
+
+	void Add(const std::string& literal, size_t id)
+	{
+		unsigned int node = 0;
+		for (std::string::const_iterator i = literal.begin(); i != literal.end(); ++i)
+		{
+			unsigned char c = casemap[(unsigned char)*i];
+			unsigned int next = Next(node, c);
+			if (next == NONE)
+			{
+				next = nodes.size();
+				std::vector<std::pair<unsigned char, unsigned int> >& trans = nodes[node].next;
+				trans.insert(std::lower_bound(trans.begin(), trans.end(), std::make_pair(c, 0U)), std::make_pair(c, next));
+				nodes.push_back(Node());
+			}
+			node = next;
+		}
+		nodes[node].outputs.push_back(id);
+	}
+
+	/** Compute the fail and dictionary links, must be called after all literals were added */
+	void Build()
+	{
+		std::deque<unsigned int> queue;
+		for (size_t i = 0; i < nodes[0].next.size(); i++)
+		{
+			unsigned int child = nodes[0].next[i].second;
+			nodes[child].fail = 0;
+			queue.push_back(child);
+		}
+
+		while (!queue.empty())
+		{
+			unsigned int node = queue.front();
+			queue.pop_front();
+			for (size_t i = 0; i < nodes[node].next.size(); i++)
+			{
+				unsigned char c = nodes[node].next[i].first;
+				unsigned int child = nodes[node].next[i].second;
+
+				unsigned int fail = nodes[node].fail;
+				while ((fail != 0) && (Next(fail, c) == NONE))
+					fail = nodes[fail].fail;
+				unsigned int target = Next(fail, c);
+				nodes[child].fail = (target != NONE && target != child) ? target : 0;
+
+				unsigned int suffix = nodes[child].fail;
+				nodes[child].dict = nodes[suffix].outputs.empty() ? nodes[suffix].dict : suffix;
+				queue.push_back(child);
+			}
+		}
+	}
+
+	/** Find the literals occurring in a text
+	 * @param text The text to search
+	 * @param hits The identifiers of all literals found are appended to this, possibly more than once
+	 */
+	void Match(const std::string& text, std::vector<size_t>& hits) const
+	{
+		unsigned int node = 0;
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			unsigned char c = casemap[(unsigned char)*i];
+			unsigned int next = Next(node, c);
+			while ((next == NONE) && (node != 0))
+			{
+				node = nodes[node].fail;
+				next = Next(node, c);
+			}
+			node = (next == NONE) ? 0 : next;
+
+			for (unsigned int out = nodes[node].outputs.empty() ? nodes[node].dict : node; out != NONE; out = nodes[out].dict)
+				hits.insert(hits.end(), nodes[out].outputs.begin(), nodes[out].outputs.end());
+		}
+	}
+};
+
+/** A compiled form of the filter list, used to find the few filters worth matching
+ * against a text without evaluating every single regex.
+ */
+class FilterSet
+{
+	/** Prefilter built from the required literals of the filters */
+	LiteralMatcher literals;
+
+	/** Combined automaton from the regex engine, if it supports one */
+	RegexSet* regexset;
+
+	/** Index in the filter list of each member of the set */
+	std::vector<size_t> members;
+
+	/** Filters without a usable literal which have to be checked every time */
+	std::vector<size_t> unconditional;
+
+ public:
+	FilterSet() : regexset(NULL) { }
+	~FilterSet() { delete regexset; }
+
+	/** True if the candidates returned are guaranteed matches */
+	bool IsExact() const { return (regexset != NULL); }
+
+	bool IsCurrent() const { return literals.IsCurrent(); }
+
+	bool empty() const { return members.empty(); }
+
+	void Clear()
+	{
+		delete regexset;
+		regexset = NULL;
+		literals.Clear();
+		members.clear();
+		unconditional.clear();
+	}
+
+	/** Rebuild the set from the filters which do or do not strip colors
+	 * @param factory The regex engine the filters were compiled with
+	 * @param filters The filter list
+	 * @param stripcolor Whether to take the filters with or without the 'c' flag
+	 */
+	void Build(RegexFactory* factory, const std::vector<FilterResult>& filters, bool stripcolor)
+	{
+		Clear();
+
+		std::vector<std::string> exprs;
+		for (size_t i = 0; i < filters.size(); i++)
+		{
+			if (filters[i].flag_strip_color != stripcolor)
+				continue;
+			members.push_back(i);
+			exprs.push_back(filters[i].freeform);
+		}
+
+		if (members.empty())
+			return;
+
+		try
+		{
+			regexset = factory->CreateSet(exprs);
+		}
+		catch (ModuleException& e)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to build a combined regex set, falling back to literal matching: %s", e.GetReason().c_str());
+			regexset = NULL;
+		}
+
+		if (regexset)
+			return;
+
+		bool glob = (factory->name == "regex/glob");
+		for (size_t i = 0; i < members.size(); i++)
+		{
+			std::string literal = FindRequiredLiteral(exprs[i], glob);
+			if (literal.length() < 3)
+				unconditional.push_back(members[i]);
+			else
+				literals.Add(literal, members[i]);
+		}
+		literals.Build();
+	}
+
+	/** Find the filters which may match a text
+	 * @param text The text to check
+	 * @param candidates The indexes of the filters which may match are appended to this
+	 */
+	void GetCandidates(const std::string& text, std::vector<size_t>& candidates)
+	{
+		if (regexset)
+		{
+			std::vector<size_t> found;
+			regexset->Matches(text, found);
+			for (std::vector<size_t>::const_iterator i = found.begin(); i != found.end(); ++i)
+				candidates.push_back(members[*i]);
+			return;
+		}
+
+		candidates.insert(candidates.end(), unconditional.begin(), unconditional.end());
+		if (!literals.empty())
+			literals.Match(text, candidates);
+	}
+
+	/** Find a literal which must be present in every text a pattern matches.
+	 * This is deliberately conservative, anything that could make part of the pattern
+	 * optional ends the literal being collected.
+	 * @param pattern The pattern to examine
+	 * @param glob True if the pattern is a glob rather than a regular expression
+	 * @return The longest required literal, or an empty string if none was found
+	 */
+	static std::string FindRequiredLiteral(const std::string& pattern, bool glob)
+	{
+		std::string best;
+		std::string current;
+
+		if (glob)
+		{
+			for (std::string::const_iterator i = pattern.begin(); i != pattern.end(); ++i)
+			{
+				if ((*i == '*') || (*i == '?'))
+					EndLiteral(current, best);
+				else
+					current.push_back(*i);
+			}
+			EndLiteral(current, best);
+			return best;
+		}
+
+		// Alternation or inline options can affect any part of the pattern
+		if ((pattern.find('|') != std::string::npos) || (pattern.find("(?") != std::string::npos) ||
+			(pattern.find("[:") != std::string::npos) || (pattern.find("[.") != std::string::npos) ||
+			(pattern.find("[=") != std::string::npos))
+			return "";
+
+		for (std::string::size_type i = 0; i < pattern.length(); i++)
+		{
+			unsigned char c = pattern[i];
+			switch (c)
+			{
+				case '\\':
+				{
+					// Escapes are either character classes or have engine specific meanings
+					unsigned char escaped = (i + 1 < pattern.length()) ? pattern[++i] : 0;
+					if ((escaped == '{') || (escaped == '?') || (escaped == '*'))
+						DropLast(current);
+					EndLiteral(current, best);
+					if (escaped == '(')
+						i = SkipGroup(pattern, i);
+				}
+				break;
+				case '*':
+				case '?':
+				case '{':
+					// The previous character may be absent
+					DropLast(current);
+					EndLiteral(current, best);
+				break;
+				case '(':
+					EndLiteral(current, best);
+					i = SkipGroup(pattern, i);
+				break;
+				case '[':
+					EndLiteral(current, best);
+					i = SkipClass(pattern, i);
+					if (i == std::string::npos)
+						return "";
+				break;
+				case '.':
+				case '^':
+				case '$':
+				case '+':
+				case ')':
+				case ']':
+				case '}':
+					EndLiteral(current, best);
+				break;
+				default:
+					if (c >= 0x80)
+						EndLiteral(current, best);
+					else
+						current.push_back(c);
+				break;
+			}
+		}
+		EndLiteral(current, best);
+		return best;
+	}
+
+ private:
+	static void DropLast(std::string& current)
+	{
+		if (!current.empty())
+			current.erase(current.length() - 1);
+	}
+
+	static void EndLiteral(std::string& current, std::string& best)
+	{
+		if (current.length() > best.length())
+			best.swap(current);
+		current.clear();
+	}
+
+	/** Skip to the end of a group, the group may be optional so nothing in it is used */
+	static std::string::size_type SkipGroup(const std::string& pattern, std::string::size_type pos)
+	{
+		unsigned int depth = 1;
+		for (pos++; pos < pattern.length(); pos++)
+		{
+			if (pattern[pos] == '\\')
+			{
+				if ((pos + 1 < pattern.length()) && (pattern[pos + 1] == '(' || pattern[pos + 1] == ')'))
+				{
+					// Might be a group in a basic regex
+					if (pattern[++pos] == '(')
+						depth++;
+					else if (!--depth)
+						return pos;
+				}
+				else
+					pos++;
+			}
+			else if (pattern[pos] == '(')
+				depth++;
+			else if ((pattern[pos] == ')') && (!--depth))
+				return pos;
+		}
+		return pos;
+	}
+
+	/** Skip to the end of a bracket expression
+	 * @return The position of the closing bracket, or npos if the expression contains a backslash.
+	 * Whether "\]" ends the expression depends on the engine, so where it ends is unknown then.
+	 */
+	static std::string::size_type SkipClass(const std::string& pattern, std::string::size_type pos)
+	{
+		pos++;
+		if ((pos < pattern.length()) && (pattern[pos] == '^'))
+			pos++;
+		if ((pos < pattern.length()) && (pattern[pos] == ']'))
+			pos++;
+		while ((pos < pattern.length()) && (pattern[pos] != ']'))
+		{
+			if (pattern[pos] == '\\')
+				return std::string::npos;
+			pos++;
+		}
+		return pos;
+	}
+};
+
 class CommandFilter : public Command
 {
  public:
@@ -160,6 +545,15 @@ class ModuleFilter : public Module
 	RegexFactory* factory;
 	void FreeFilters();
 
+	/** Compiled forms of the filters which match against the text as is, and against the text with colors stripped */
+	FilterSet rawset;
+	FilterSet strippedset;
+
+	/** True if the filter list changed since the filter sets were built */
+	bool setsdirty;
+
+	void BuildFilterSets();
+
  public:
 	CommandFilter filtcommand;
 	dynamic_reference<RegexFactory> RegexEngine;
@@ -286,7 +680,7 @@ bool ModuleFilter::AppliesToMe(User* user, FilterResult* filter, int iflags)
 }
 
 ModuleFilter::ModuleFilter()
-	: initing(true), filtcommand(this), RegexEngine(this, "regex")
+	: initing(true), setsdirty(true), filtcommand(this), RegexEngine(this, "regex")
 {
 }
 
@@ -302,6 +696,23 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	rawset.Clear();
+	strippedset.Clear();
+	setsdirty = true;
+}
+
+void ModuleFilter::BuildFilterSets()
+{
+	setsdirty = false;
+	if (!RegexEngine)
+	{
+		rawset.Clear();
+		strippedset.Clear();
+		return;
+	}
+
+	rawset.Build(*RegexEngine, filters, false);
+	strippedset.Build(*RegexEngine, filters, true);
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype)
@@ -552,21 +963,34 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
 	static std::string stripped_text;
-	stripped_text.clear();
+	static std::vector<size_t> candidates;
+	candidates.clear();
 
-	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
+	if ((setsdirty) || (!rawset.IsCurrent()) || (!strippedset.IsCurrent()))
+		BuildFilterSets();
+
+	rawset.GetCandidates(text, candidates);
+	if (!strippedset.empty())
 	{
-		FilterResult* filter = &*i;
+		stripped_text = text;
+		InspIRCd::StripColor(stripped_text);
+		strippedset.GetCandidates(stripped_text, candidates);
+	}
+
+	// Filters are tried in the order they were added, the first match wins
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+	for (std::vector<size_t>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		FilterResult* filter = &filters[*i];
 
 		/* Skip ones that dont apply to us */
 		if (!AppliesToMe(user, filter, flgs))
 			continue;
 
-		if ((filter->flag_strip_color) && (stripped_text.empty()))
-		{
-			stripped_text = text;
-			InspIRCd::StripColor(stripped_text);
-		}
+		if (filter->flag_strip_color ? strippedset.IsExact() : rawset.IsExact())
+			return filter;
 
 		if (filter->regex->Matches(filter->flag_strip_color ? stripped_text : text))
 			return filter;
@@ -582,6 +1006,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 		{
 			delete i->regex;
 			filters.erase(i);
+			setsdirty = true;
 			return true;
 		}
 	}
@@ -601,6 +1026,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string &freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs));
+		setsdirty = true;
 	}
 	catch (ModuleException &e)
 	{
@@ -664,6 +1090,7 @@ void ModuleFilter::ReadFilters()
 		try
 		{
 			filters.push_back(FilterResult(RegexEngine, pattern, reason, fa, gline_time, flgs));
+			setsdirty = true;
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
@@ -32,6 +32,15 @@ static ModuleHttpServer* HttpModule;
 static bool claimed;
 static std::set<HttpServerSocket*> sockets;
 
+/** Seconds a request may take, 0 for no limit */
+static unsigned int timeoutsec;
+
+/** Seconds a kept alive connection may wait for its next request */
+static unsigned int keepalivesec;
+
+/** Number of idle kept alive connections on each listener */
+static std::map<ListenSocket*, unsigned int> idlecount;
+
 /** HTTP socket states
  */
 enum HttpState
@@ -42,8 +51,10 @@ enum HttpState
 };
 
 /** A socket used for HTTP transport
+ * The socket is its own timer, it times out the request being received or sent and
+ * closes the connection when it was kept alive and no new request came in.
  */
-class HttpServerSocket : public BufferedSocket
+class HttpServerSocket : public BufferedSocket, public Timer
 {
 	HttpState InternalState;
 	std::string ip;
@@ -56,15 +67,190 @@ class HttpServerSocket : public BufferedSocket
 	std::string uri;
 	std::string http_version;
 
- public:
-	const time_t createtime;
+	/** The stream generating the response being sent, if any */
+	HTTPDocumentStream* stream;
+
+	/** True if the streamed response uses chunked transfer encoding */
+	bool chunked;
+
+	/** True if the connection is closed once the response has been sent */
+	bool closeafter;
+
+	/** True if the connection is kept open after the current response */
+	bool keepalive;
+
+	/** True if the connection is waiting for the next request after a response */
+	bool idle;
+
+	/** The listener the connection came in on, only used to count its idle connections */
+	ListenSocket* const listener;
+
+	/** Maximum number of idle connections on the listener, from <bind:maxidle> */
+	const unsigned int maxidle;
+
+	/** (Re)start the timer, or stop it if the timeout is 0 */
+	void SetTimeout(unsigned int timeout)
+	{
+		if (timeout)
+			SetInterval(timeout);
+		else
+			ServerInstance->Timers->DelTimer(this);
+	}
+
+	void SetIdle(bool newidle)
+	{
+		if (idle == newidle)
+			return;
 
+		idle = newidle;
+		if (idle)
+		{
+			idlecount[listener]++;
+			SetTimeout(keepalivesec);
+		}
+		else
+		{
+			std::map<ListenSocket*, unsigned int>::iterator it = idlecount.find(listener);
+			if (it != idlecount.end() && !--it->second)
+				idlecount.erase(it);
+		}
+	}
+
+	/** Close the connection and delete the socket once the current event is over */
+	void Drop()
+	{
+		SetIdle(false);
+		ServerInstance->Timers->DelTimer(this);
+		sockets.erase(this);
+		Close();
+		ServerInstance->GlobalCulls.AddItem(this);
+	}
+
+	/** Send more of the streamed response while the sendq is small */
+	void SendStream()
+	{
+		time_t now = ServerInstance->Time();
+		while (stream && getSendQSize() < 65536)
+		{
+			std::string data;
+			bool more = stream->Produce(data);
+
+			// Streamed responses are only timed out when the client stops reading them
+			if (lastprogress != now)
+			{
+				lastprogress = now;
+				SetTimeout(timeoutsec);
+			}
+
+			if (!data.empty())
+			{
+				if (chunked)
+				{
+					char size[20];
+					snprintf(size, sizeof(size), "%lx\r\n", (unsigned long)data.length());
+					WriteData(size);
+					data.append("\r\n");
+				}
+				WriteData(data);
+			}
+
+			if (!more)
+			{
+				delete stream;
+				stream = NULL;
+				if (chunked)
+					WriteData("0\r\n\r\n");
+				FinishResponse();
+			}
+		}
+	}
+
+	/** Called when the whole response has been queued, prepares for the next request
+	 * or closes the connection
+	 */
+	void FinishResponse()
+	{
+		if (!keepalive)
+		{
+			// Without a length or chunked encoding the client needs the connection to be closed at the end
+			closeafter = true;
+			SetTimeout(timeoutsec ? timeoutsec : keepalivesec);
+			CheckClose();
+			return;
+		}
+
+		InternalState = HTTP_SERVE_WAIT_REQUEST;
+		headers.Clear();
+		postdata.clear();
+		postsize = 0;
+		request_type.clear();
+		uri.clear();
+		http_version.clear();
+
+		// The request timeout applies until the response has been sent, a slow reader is not idle
+		SetTimeout(timeoutsec);
+		CheckIdle();
+	}
+
+	/** Start waiting for the next request with the keepalive timeout once the response has been sent */
+	void CheckIdle()
+	{
+		if (keepalive && InternalState == HTTP_SERVE_WAIT_REQUEST && !stream && reqbuffer.empty() && !getSendQSize())
+			SetIdle(true);
+	}
+
+	void CheckClose()
+	{
+		if (closeafter && !getSendQSize())
+		{
+			closeafter = false;
+			Drop();
+		}
+	}
+
+	/** Serve the requests in the request buffer while the responses are being sent quickly enough */
+	void ProcessRequests()
+	{
+		while (InternalState == HTTP_SERVE_WAIT_REQUEST && !closeafter && getSendQSize() < 65536)
+		{
+			if (!CheckRequestBuffer())
+				break;
+		}
+	}
+
+	/** Check whether the client wants the connection to be kept open and whether it may be */
+	bool WantKeepAlive()
+	{
+		std::string connection = headers.GetHeader("Connection");
+		std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+
+		bool wanted;
+		if (http_version == "HTTP/1.1")
+			wanted = (connection.find("close") == std::string::npos);
+		else
+			wanted = (connection.find("keep-alive") != std::string::npos);
+
+		if (!wanted || !keepalivesec)
+			return false;
+
+		// Connections which are idle now are already counted
+		std::map<ListenSocket*, unsigned int>::const_iterator it = idlecount.find(listener);
+		return ((it == idlecount.end() ? 0 : it->second) < maxidle);
+	}
+
+	/** The last time the streamed response made progress */
+	time_t lastprogress;
+
+ public:
 	HttpServerSocket(int newfd, const std::string& IP, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
-		: BufferedSocket(newfd), ip(IP), postsize(0)
-		, createtime(ServerInstance->Time())
+		: BufferedSocket(newfd), Timer(timeoutsec, ServerInstance->Time()), ip(IP), postsize(0), stream(NULL), chunked(false), closeafter(false)
+		, keepalive(false), idle(false), listener(via), maxidle(via->bind_tag->getInt("maxidle", 32)), lastprogress(0)
 	{
 		InternalState = HTTP_SERVE_WAIT_REQUEST;
 
+		if (timeoutsec)
+			ServerInstance->Timers->AddTimer(this);
+
 		FOREACH_MOD(OnHookIO, (this, via));
 		if (GetIOHook())
 			GetIOHook()->OnStreamSocketAccept(this, client, server);
@@ -72,12 +258,24 @@ class HttpServerSocket : public BufferedSocket
 
 	~HttpServerSocket()
 	{
+		delete stream;
+		SetIdle(false);
 		sockets.erase(this);
 	}
 
+	HTTPDocumentStream* GetStream() const { return stream; }
+
 	void OnError(BufferedSocketError) CXX11_OVERRIDE
 	{
-		ServerInstance->GlobalCulls.AddItem(this);
+		Drop();
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "m_httpd dropped %s connection from %s due to a timeout", idle ? "idle" : "busy", ip.c_str());
+		Drop();
+		// The timer is part of the socket, the socket deletes it
+		return true;
 	}
 
 	std::string Response(int response)
@@ -177,12 +375,21 @@ class HttpServerSocket : public BufferedSocket
 		std::string data = "<html><head></head><body>Server error "+ConvToStr(response)+": "+Response(response)+"<br>"+
 		                   "<small>Powered by <a href='http://www.inspircd.org'>InspIRCd</a></small></body></html>";
 
+		// After a malformed request the start of the next one can not be found
+		if (response == 400 || response == 505)
+			keepalive = false;
+
+		InternalState = HTTP_SERVE_SEND_DATA;
 		SendHeaders(data.length(), response, empty);
-		WriteData(data);
+		if (request_type != "HEAD")
+			WriteData(data);
+		FinishResponse();
 	}
 
-	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders)
+	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders, bool streamed = false)
 	{
+		if (http_version.empty())
+			http_version = "HTTP/1.0";
 
 		WriteData(http_version + " "+ConvToStr(response)+" "+Response(response)+"\r\n");
 
@@ -193,17 +400,25 @@ class HttpServerSocket : public BufferedSocket
 		rheaders.CreateHeader("Date", date);
 
 		rheaders.CreateHeader("Server", BRANCH);
-		rheaders.SetHeader("Content-Length", ConvToStr(size));
-
-		if (size)
+		if (streamed)
+		{
+			// HTTP/1.0 clients read until the connection is closed instead
+			rheaders.RemoveHeader("Content-Length");
+			if (chunked)
+				rheaders.SetHeader("Transfer-Encoding", "chunked");
 			rheaders.CreateHeader("Content-Type", "text/html");
+		}
 		else
-			rheaders.RemoveHeader("Content-Type");
+		{
+			rheaders.SetHeader("Content-Length", ConvToStr(size));
 
-		/* Supporting Connection: keep-alive causes a whole world of hurt syncronizing timeouts,
-		 * so remove it, its not essential for what we need.
-		 */
-		rheaders.SetHeader("Connection", "Close");
+			if (size)
+				rheaders.CreateHeader("Content-Type", "text/html");
+			else
+				rheaders.RemoveHeader("Content-Type");
+		}
+
+		rheaders.SetHeader("Connection", keepalive ? "Keep-Alive" : "Close");
 
 		WriteData(rheaders.GetFormattedHeaders());
 		WriteData("\r\n");
@@ -214,30 +429,49 @@ class HttpServerSocket : public BufferedSocket
 		if (InternalState == HTTP_SERVE_RECV_POSTDATA)
 		{
 			postdata.append(recvq);
+			recvq.clear();
 			if (postdata.length() >= postsize)
+			{
+				// Anything after the POST data is the next request
+				reqbuffer.assign(postdata, postsize, std::string::npos);
+				postdata.erase(postsize);
 				ServeData();
+			}
 		}
 		else
 		{
+			if (idle)
+			{
+				SetIdle(false);
+				SetTimeout(timeoutsec);
+			}
+
 			reqbuffer.append(recvq);
+			recvq.clear();
 
-			if (reqbuffer.length() >= 8192)
+			// Pipelined requests may fill the buffer while earlier responses are being sent
+			if (reqbuffer.length() >= 65536 || (reqbuffer.length() >= 8192 && reqbuffer.find("\r\n\r\n") == std::string::npos))
 			{
 				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "m_httpd dropped connection due to an oversized request buffer");
 				reqbuffer.clear();
 				SetError("Buffer");
+				return;
 			}
-
-			if (InternalState == HTTP_SERVE_WAIT_REQUEST)
-				CheckRequestBuffer();
 		}
+
+		ProcessRequests();
 	}
 
-	void CheckRequestBuffer()
+	/** Start serving the request at the start of the request buffer
+	 * @return True if a complete request was found
+	 */
+	bool CheckRequestBuffer()
 	{
 		std::string::size_type reqend = reqbuffer.find("\r\n\r\n");
 		if (reqend == std::string::npos)
-			return;
+			return false;
+
+		keepalive = false;
 
 		// We have the headers; parse them all
 		std::string::size_type hbegin = 0, hend;
@@ -256,7 +490,7 @@ class HttpServerSocket : public BufferedSocket
 				if (request_type.empty() || uri.empty() || http_version.empty())
 				{
 					SendHTTPError(400);
-					return;
+					return true;
 				}
 
 				hbegin = hend + 2;
@@ -269,7 +503,7 @@ class HttpServerSocket : public BufferedSocket
 			if ((fieldsep == std::string::npos) || (fieldsep == 0) || (fieldsep == cheader.length() - 1))
 			{
 				SendHTTPError(400);
-				return;
+				return true;
 			}
 
 			headers.SetHeader(cheader.substr(0, fieldsep), cheader.substr(fieldsep + 2));
@@ -285,9 +519,11 @@ class HttpServerSocket : public BufferedSocket
 		if ((http_version != "HTTP/1.1") && (http_version != "HTTP/1.0"))
 		{
 			SendHTTPError(505);
-			return;
+			return true;
 		}
 
+		keepalive = WantKeepAlive();
+
 		if (headers.IsSet("Content-Length") && (postsize = ConvToInt(headers.GetHeader("Content-Length"))) > 0)
 		{
 			InternalState = HTTP_SERVE_RECV_POSTDATA;
@@ -306,10 +542,11 @@ class HttpServerSocket : public BufferedSocket
 			if (postdata.length() >= postsize)
 				ServeData();
 
-			return;
+			return true;
 		}
 
 		ServeData();
+		return true;
 	}
 
 	void ServeData()
@@ -333,7 +570,39 @@ class HttpServerSocket : public BufferedSocket
 	void Page(std::stringstream* n, int response, HTTPHeaders *hheaders)
 	{
 		SendHeaders(n->str().length(), response, *hheaders);
-		WriteData(n->str());
+		if (request_type != "HEAD")
+			WriteData(n->str());
+		FinishResponse();
+	}
+
+	void Page(HTTPDocumentStream* n, int response, HTTPHeaders *hheaders)
+	{
+		stream = n;
+		chunked = (http_version == "HTTP/1.1");
+		if (!chunked)
+			keepalive = false;
+		SendHeaders(0, response, *hheaders, true);
+
+		if (request_type == "HEAD")
+		{
+			delete stream;
+			stream = NULL;
+			FinishResponse();
+			return;
+		}
+		SendStream();
+	}
+
+	void OnDataSent() CXX11_OVERRIDE
+	{
+		if (stream)
+			SendStream();
+		CheckClose();
+		CheckIdle();
+
+		// Continue with pipelined requests held back while the sendq was large
+		if (!reqbuffer.empty())
+			ProcessRequests();
 	}
 };
 
@@ -348,7 +617,10 @@ class HTTPdAPIImpl : public HTTPdAPIBase
 	void SendResponse(HTTPDocumentResponse& resp) CXX11_OVERRIDE
 	{
 		claimed = true;
-		resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
+		if (resp.stream)
+			resp.src.sock->Page(resp.stream, resp.responsecode, &resp.headers);
+		else
+			resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
 	}
 };
 
@@ -356,7 +628,6 @@ class ModuleHttpServer : public Module
 {
 	std::vector<HttpServerSocket *> httpsocks;
 	HTTPdAPIImpl APIImpl;
-	unsigned int timeoutsec;
 
  public:
 	ModuleHttpServer()
@@ -373,6 +644,7 @@ class ModuleHttpServer : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("httpd");
 		timeoutsec = tag->getInt("timeout");
+		keepalivesec = tag->getInt("keepalive", 10);
 	}
 
 	ModResult OnAcceptConnection(int nfd, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
@@ -386,17 +658,14 @@ class ModuleHttpServer : public Module
 		return MOD_RES_ALLOW;
 	}
 
-	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
-		if (!timeoutsec)
-			return;
-
-		time_t oldest_allowed = curtime - timeoutsec;
+		// Responses being generated by the module can not be finished
 		for (std::set<HttpServerSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); )
 		{
 			HttpServerSocket* sock = *i;
 			++i;
-			if (sock->createtime < oldest_allowed)
+			if (sock->GetStream() && sock->GetStream()->creator == mod)
 			{
 				sock->cull();
 				delete sock;
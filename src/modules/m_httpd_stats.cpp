@@ -25,19 +25,143 @@
 #include "modules/httpd.h"
 #include "xline.h"
 #include "protocol.h"
+#include <iostream>
 
-class ModuleHttpStats : public Module
+/** Writes the statistics either as XML or as compact JSON.
+ * Objects and lists are written the same way in XML, in JSON the items of a list are
+ * anonymous so the names passed for them are only used for XML.
+ */
+class StatsSerializer
 {
 	static std::map<char, char const*> const &entities;
-	HTTPdAPI API;
+
+	/** True to write JSON, false to write XML */
+	const bool json;
+
+	/** The string being written to */
+	std::string* out;
+
+	/** For each open JSON object or list, whether it is a list and whether it has an item */
+	std::vector<std::pair<bool, bool> > stack;
+
+	/** Write the separator and, unless in a list, the key of the next JSON item */
+	void Key(const char* name)
+	{
+		if (stack.empty())
+			return;
+
+		if (stack.back().second)
+			out->push_back(',');
+		stack.back().second = true;
+
+		if (!stack.back().first)
+		{
+			out->push_back('"');
+			out->append(name);
+			out->append("\":");
+		}
+	}
+
+	/** Get the length of the multibyte UTF-8 sequence at a position
+	 * @param str The string the sequence is in
+	 * @param pos The position of the first byte of the sequence, which is not ASCII
+	 * @return The length of the sequence, 0 if the bytes there are not valid UTF-8
+	 */
+	static std::string::size_type GetUTF8Length(const std::string& str, std::string::size_type pos)
+	{
+		unsigned char c = str[pos];
+		std::string::size_type len;
+		unsigned long codepoint;
+		if (c >= 0xC2 && c <= 0xDF)
+		{
+			len = 2;
+			codepoint = c & 0x1F;
+		}
+		else if (c >= 0xE0 && c <= 0xEF)
+		{
+			len = 3;
+			codepoint = c & 0x0F;
+		}
+		else if (c >= 0xF0 && c <= 0xF4)
+		{
+			len = 4;
+			codepoint = c & 0x07;
+		}
+		else
+			return 0; // A continuation byte, an overlong form of ASCII or a byte UTF-8 never uses
+
+		if (str.length() - pos < len)
+			return 0;
+
+		for (std::string::size_type i = 1; i < len; i++)
+		{
+			unsigned char cont = str[pos + i];
+			if ((cont & 0xC0) != 0x80)
+				return 0;
+			codepoint = (codepoint << 6) | (cont & 0x3F);
+		}
+
+		// Overlong forms, UTF-16 surrogates and anything above U+10FFFF
+		if ((len == 3 && codepoint < 0x800) || (len == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF)) || (codepoint >= 0xD800 && codepoint <= 0xDFFF))
+			return 0;
+		return len;
+	}
+
+	/** Write a JSON string. JSON text has to be UTF-8, every byte which is not part of
+	 * valid UTF-8 (e.g. a Latin-1 topic) is written as U+FFFD.
+	 */
+	void Quote(const std::string& str)
+	{
+		out->push_back('"');
+		for (std::string::size_type x = 0; x < str.length(); )
+		{
+			unsigned char c = str[x];
+			if (c >= 0x80)
+			{
+				std::string::size_type len = GetUTF8Length(str, x);
+				if (len)
+				{
+					out->append(str, x, len);
+					x += len;
+				}
+				else
+				{
+					out->append("\\ufffd");
+					x++;
+				}
+				continue;
+			}
+
+			if (c == '"' || c == '\\')
+			{
+				out->push_back('\\');
+				out->push_back(c);
+			}
+			else if (c < 0x20)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out->append(buf);
+			}
+			else
+				out->push_back(c);
+			x++;
+		}
+		out->push_back('"');
+	}
 
  public:
-	ModuleHttpStats()
-		: API(this)
+	StatsSerializer(bool usejson)
+		: json(usejson), out(NULL)
 	{
 	}
 
-	std::string Sanitize(const std::string &str)
+	bool IsJSON() const { return json; }
+
+	/** Set the string the next output is appended to */
+	void SetOutput(std::string& data) { out = &data; }
+
+	static std::string Sanitize(const std::string &str)
 	{
 		std::string ret;
 		ret.reserve(str.length() * 2);
@@ -73,183 +197,678 @@ class ModuleHttpStats : public Module
 		return ret;
 	}
 
-	void DumpMeta(std::stringstream& data, Extensible* ext)
+	/** Begin an object or a list
+	 * @param name The name of the element
+	 * @param list True if this is a list
+	 * @param attr The name of an attribute of the XML element, written as a member in JSON
+	 * @param attrvalue The value of the attribute
+	 */
+	void Open(const char* name, bool list = false, const char* attr = NULL, const std::string& attrvalue = "")
+	{
+		if (json)
+		{
+			Key(name);
+			out->push_back(list ? '[' : '{');
+			stack.push_back(std::make_pair(list, false));
+			if (attr)
+				Value(attr, attrvalue);
+		}
+		else
+		{
+			out->append("<").append(name);
+			if (attr)
+				out->append(" ").append(attr).append("=\"").append(Sanitize(attrvalue)).append("\"");
+			out->append(">");
+		}
+	}
+
+	void Close(const char* name)
+	{
+		if (json)
+		{
+			out->push_back(stack.back().first ? ']' : '}');
+			stack.pop_back();
+		}
+		else
+			out->append("</").append(name).append(">");
+	}
+
+	void Value(const char* name, const std::string& value)
+	{
+		if (json)
+		{
+			Key(name);
+			Quote(value);
+		}
+		else
+			out->append("<").append(name).append(">").append(Sanitize(value)).append("</").append(name).append(">");
+	}
+
+	template<typename T>
+	void Value(const char* name, const T& value)
 	{
-		data << "<metadata>";
+		if (json)
+		{
+			Key(name);
+			out->append(ConvToStr(value));
+		}
+		else
+			out->append("<").append(name).append(">").append(ConvToStr(value)).append("</").append(name).append(">");
+	}
+
+	void Value(const char* name, const char* value)
+	{
+		Value(name, std::string(value));
+	}
+
+	/** Write a line of text in a list, XML puts each line on its own */
+	void Line(const std::string& text)
+	{
+		if (json)
+		{
+			Key("");
+			Quote(text);
+		}
+		else
+			out->append(Sanitize(text)).append("\n");
+	}
+
+	void DumpMeta(Extensible* ext)
+	{
+		Open("metadata");
 		for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
 		{
 			ExtensionItem* item = i->first;
 			std::string value = item->serialize(FORMAT_USER, ext, i->second);
-			if (!value.empty())
-				data << "<meta name=\"" << item->name << "\">" << Sanitize(value) << "</meta>";
+			if (json)
+			{
+				if (!item->name.empty())
+					Value(item->name.c_str(), value);
+			}
+			else if (!value.empty())
+				out->append("<meta name=\"").append(item->name).append("\">").append(Sanitize(value)).append("</meta>");
 			else if (!item->name.empty())
-				data << "<meta name=\"" << item->name << "\"/>";
+				out->append("<meta name=\"").append(item->name).append("\"/>");
 		}
-		data << "</metadata>";
+		Close("metadata");
 	}
+};
 
-	void OnEvent(Event& event) CXX11_OVERRIDE
+static std::map<char, char const*> const &init_entities()
+{
+	static std::map<char, char const*> entities;
+	entities['<'] = "lt";
+	entities['>'] = "gt";
+	entities['&'] = "amp";
+	entities['"'] = "quot";
+	return entities;
+}
+
+std::map<char, char const*> const &StatsSerializer::entities = init_entities ();
+
+/** Generates a statistics document a section at a time as the client reads it.
+ * The channel and user lists are written from a sorted snapshot of their names and UUIDs,
+ * entries which are gone by the time they are reached are skipped.
+ */
+class StatsStream : public HTTPDocumentStream
+{
+ public:
+	enum Section
 	{
-		std::stringstream data("");
+		SEC_GENERAL,
+		SEC_XLINES,
+		SEC_MODULES,
+		SEC_CHANNELS,
+		SEC_USERS,
+		SEC_SERVERS
+	};
+
+	/** Filters and cursor of the channel and user lists */
+	struct Query
+	{
+		/** Only list entries sorted after this channel name or UUID */
+		std::string after;
+
+		/** Maximum number of entries to list, 0 for no limit */
+		unsigned long limit;
 
-		if (event.id == "httpd_url")
+		/** Glob pattern the channel name or nick must match */
+		std::string mask;
+
+		/** Server the users must be on */
+		std::string server;
+
+		/** Minimum number of users in the channels */
+		unsigned long minusers;
+
+		Query() : limit(0), minusers(0) { }
+	};
+
+ private:
+	StatsSerializer out;
+	std::vector<Section> sections;
+	std::vector<Section>::size_type current;
+	bool started;
+	const Query query;
+
+	/** Names or UUIDs of the list being written */
+	std::vector<std::string> keys;
+	std::vector<std::string>::size_type keypos;
+
+	/** Number of entries written in the list being written */
+	unsigned long listed;
+
+	/** True if the list being written was opened */
+	bool listopen;
+
+	/** Stop producing when this much data has been generated */
+	static const std::string::size_type BatchSize = 32768;
+
+	static bool CompareNames(const std::string& a, const std::string& b)
+	{
+		return irc::insensitive_swo()(a, b);
+	}
+
+	void WriteGeneral()
+	{
+		out.Open("server");
+		out.Value("name", ServerInstance->Config->ServerName);
+		out.Value("gecos", ServerInstance->Config->ServerDesc);
+		out.Value("version", ServerInstance->GetVersionString());
+		out.Close("server");
+
+		out.Open("general");
+		out.Value("usercount", ServerInstance->Users->clientlist->size());
+		out.Value("channelcount", ServerInstance->chanlist->size());
+		out.Value("opercount", ServerInstance->Users->all_opers.size());
+		out.Value("socketcount", ServerInstance->SE->GetUsedFds());
+		out.Value("socketmax", ServerInstance->SE->GetMaxFds());
+		out.Value("socketengine", ServerInstance->SE->GetName());
+
+		time_t current_time = 0;
+		current_time = ServerInstance->Time();
+		time_t server_uptime = current_time - ServerInstance->startup_time;
+		struct tm* stime;
+		stime = gmtime(&server_uptime);
+		out.Open("uptime");
+		out.Value("days", stime->tm_yday);
+		out.Value("hours", stime->tm_hour);
+		out.Value("mins", stime->tm_min);
+		out.Value("secs", stime->tm_sec);
+		out.Value("boot_time_t", ServerInstance->startup_time);
+		out.Close("uptime");
+
+		out.Open("isupport", true);
+		const std::vector<std::string>& isupport = ServerInstance->ISupport.GetLines();
+		for (std::vector<std::string>::const_iterator it = isupport.begin(); it != isupport.end(); it++)
+			out.Line(*it);
+		out.Close("isupport");
+		out.Close("general");
+	}
+
+	void WriteXLines()
+	{
+		out.Open("xlines", true);
+		std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
+		for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
-			HTTPRequest* http = (HTTPRequest*)&event;
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
 
-			if ((http->GetURI() == "/stats") || (http->GetURI() == "/stats/"))
+			if (!lookup)
+				continue;
+			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
 			{
-				data << "<inspircdstats><server><name>" << ServerInstance->Config->ServerName << "</name><gecos>"
-					<< Sanitize(ServerInstance->Config->ServerDesc) << "</gecos><version>"
-					<< Sanitize(ServerInstance->GetVersionString()) << "</version></server>";
-
-				data << "<general>";
-				data << "<usercount>" << ServerInstance->Users->clientlist->size() << "</usercount>";
-				data << "<channelcount>" << ServerInstance->chanlist->size() << "</channelcount>";
-				data << "<opercount>" << ServerInstance->Users->all_opers.size() << "</opercount>";
-				data << "<socketcount>" << (ServerInstance->SE->GetUsedFds()) << "</socketcount><socketmax>" << ServerInstance->SE->GetMaxFds() << "</socketmax><socketengine>" << ServerInstance->SE->GetName() << "</socketengine>";
-
-				time_t current_time = 0;
-				current_time = ServerInstance->Time();
-				time_t server_uptime = current_time - ServerInstance->startup_time;
-				struct tm* stime;
-				stime = gmtime(&server_uptime);
-				data << "<uptime><days>" << stime->tm_yday << "</days><hours>" << stime->tm_hour << "</hours><mins>" << stime->tm_min << "</mins><secs>" << stime->tm_sec << "</secs><boot_time_t>" << ServerInstance->startup_time << "</boot_time_t></uptime>";
-
-				data << "<isupport>";
-				const std::vector<std::string>& isupport = ServerInstance->ISupport.GetLines();
-				for (std::vector<std::string>::const_iterator it = isupport.begin(); it != isupport.end(); it++)
-				{
-					data << Sanitize(*it) << std::endl;
-				}
-				data << "</isupport></general><xlines>";
-				std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
-				for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
-				{
-					XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-
-					if (!lookup)
-						continue;
-					for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-					{
-						data << "<xline type=\"" << it->c_str() << "\"><mask>"
-							<< Sanitize(i->second->Displayable()) << "</mask><settime>"
-							<< i->second->set_time << "</settime><duration>" << i->second->duration
-							<< "</duration><reason>" << Sanitize(i->second->reason)
-							<< "</reason></xline>";
-					}
-				}
+				out.Open("xline", false, "type", *it);
+				out.Value("mask", i->second->Displayable());
+				out.Value("settime", i->second->set_time);
+				out.Value("duration", i->second->duration);
+				out.Value("reason", i->second->reason);
+				out.Close("xline");
+			}
+		}
+		out.Close("xlines");
+	}
 
-				data << "</xlines><modulelist>";
-				const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+	void WriteModules()
+	{
+		out.Open("modulelist", true);
+		const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
 
-				for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
-				{
-					Version v = i->second->GetVersion();
-					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
-				}
-				data << "</modulelist><channellist>";
+		for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+		{
+			Version v = i->second->GetVersion();
+			out.Open("module");
+			out.Value("name", i->first);
+			out.Value("description", v.description);
+			out.Close("module");
+		}
+		out.Close("modulelist");
+	}
 
-				for (chan_hash::const_iterator a = ServerInstance->chanlist->begin(); a != ServerInstance->chanlist->end(); ++a)
-				{
-					Channel* c = a->second;
-
-					data << "<channel>";
-					data << "<usercount>" << c->GetUsers()->size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
-					data << "<channeltopic>";
-					data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
-					data << "<setby>" << Sanitize(c->setby) << "</setby>";
-					data << "<settime>" << c->topicset << "</settime>";
-					data << "</channeltopic>";
-					data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
-					const UserMembList* ulist = c->GetUsers();
-
-					for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
-					{
-						Membership* memb = x->second;
-						data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
-							<< Sanitize(c->GetAllPrefixChars(x->first)) << "</privs><modes>"
-							<< memb->modes << "</modes>";
-						DumpMeta(data, memb);
-						data << "</channelmember>";
-					}
-
-					DumpMeta(data, c);
-
-					data << "</channel>";
-				}
+	void WriteChannel(Channel* c)
+	{
+		out.Open("channel");
+		out.Value("usercount", c->GetUsers()->size());
+		out.Value("channelname", c->name);
+		out.Open("channeltopic");
+		out.Value("topictext", c->topic);
+		out.Value("setby", c->setby);
+		out.Value("settime", c->topicset);
+		out.Close("channeltopic");
+		out.Value("channelmodes", c->ChanModes(true));
+
+		out.Open("channelmembers", true);
+		const UserMembList* ulist = c->GetUsers();
+		for (UserMembCIter x = ulist->begin(); x != ulist->end(); ++x)
+		{
+			Membership* memb = x->second;
+			out.Open("channelmember");
+			out.Value("uid", memb->user->uuid);
+			out.Value("privs", c->GetAllPrefixChars(x->first));
+			out.Value("modes", memb->modes);
+			out.DumpMeta(memb);
+			out.Close("channelmember");
+		}
+		out.Close("channelmembers");
 
-				data << "</channellist><userlist>";
+		out.DumpMeta(c);
+		out.Close("channel");
+	}
 
-				for (user_hash::const_iterator a = ServerInstance->Users->clientlist->begin(); a != ServerInstance->Users->clientlist->end(); ++a)
-				{
-					User* u = a->second;
-
-					data << "<user>";
-					data << "<nickname>" << u->nick << "</nickname><uuid>" << u->uuid << "</uuid><realhost>"
-						<< u->host << "</realhost><displayhost>" << u->dhost << "</displayhost><gecos>"
-						<< Sanitize(u->fullname) << "</gecos><server>" << u->server << "</server>";
-					if (u->IsAway())
-						data << "<away>" << Sanitize(u->awaymsg) << "</away><awaytime>" << u->awaytime << "</awaytime>";
-					if (u->IsOper())
-						data << "<opertype>" << Sanitize(u->oper->name) << "</opertype>";
-					data << "<modes>" << u->FormatModes() << "</modes><ident>" << Sanitize(u->ident) << "</ident>";
-					LocalUser* lu = IS_LOCAL(u);
-					if (lu)
-						data << "<port>" << lu->GetServerPort() << "</port><servaddr>"
-							<< lu->server_sa.str() << "</servaddr>";
-					data << "<ipaddress>" << u->GetIPString() << "</ipaddress>";
-
-					DumpMeta(data, u);
-
-					data << "</user>";
-				}
+	void WriteUser(User* u)
+	{
+		out.Open("user");
+		out.Value("nickname", u->nick);
+		out.Value("uuid", u->uuid);
+		out.Value("realhost", u->host);
+		out.Value("displayhost", u->dhost);
+		out.Value("gecos", u->fullname);
+		out.Value("server", u->server->GetName());
+		if (u->IsAway())
+		{
+			out.Value("away", u->awaymsg);
+			out.Value("awaytime", u->awaytime);
+		}
+		if (u->IsOper())
+			out.Value("opertype", u->oper->name);
+		out.Value("modes", u->FormatModes());
+		out.Value("ident", u->ident);
+		LocalUser* lu = IS_LOCAL(u);
+		if (lu)
+		{
+			out.Value("port", lu->GetServerPort());
+			out.Value("servaddr", lu->server_sa.str());
+		}
+		out.Value("ipaddress", u->GetIPString());
 
-				data << "</userlist><serverlist>";
+		out.DumpMeta(u);
 
-				ProtocolInterface::ServerList sl;
-				ServerInstance->PI->GetServerList(sl);
+		out.Close("user");
+	}
 
-				for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
-				{
-					data << "<server>";
-					data << "<servername>" << b->servername << "</servername>";
-					data << "<parentname>" << b->parentname << "</parentname>";
-					data << "<gecos>" << b->gecos << "</gecos>";
-					data << "<usercount>" << b->usercount << "</usercount>";
-// This is currently not implemented, so, commented out.
-//					data << "<opercount>" << b->opercount << "</opercount>";
-					data << "<lagmillisecs>" << b->latencyms << "</lagmillisecs>";
-					data << "</server>";
-				}
+	void WriteServers()
+	{
+		out.Open("serverlist", true);
 
-				data << "</serverlist></inspircdstats>";
+		ProtocolInterface::ServerList sl;
+		ServerInstance->PI->GetServerList(sl);
 
-				/* Send the document back to m_httpd */
-				HTTPDocumentResponse response(this, *http, &data, 200);
-				response.headers.SetHeader("X-Powered-By", MODNAME);
-				response.headers.SetHeader("Content-Type", "text/xml");
-				API->SendResponse(response);
+		for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
+		{
+			out.Open("server");
+			out.Value("servername", b->servername);
+			out.Value("parentname", b->parentname);
+			out.Value("gecos", b->gecos);
+			out.Value("usercount", b->usercount);
+			out.Value("lagmillisecs", b->latencyms);
+			if (b->compressed)
+			{
+				out.Open("compression");
+				out.Value("ratioout", b->compressratio_out);
+				out.Value("ratioin", b->compressratio_in);
+				out.Value("cpumicrosecs", b->compresscpu);
+				out.Close("compression");
 			}
+			out.Close("server");
 		}
+
+		out.Close("serverlist");
 	}
 
-	Version GetVersion() CXX11_OVERRIDE
+	/** Take a sorted snapshot of the channels or users to list */
+	void BuildKeys(Section section)
 	{
-		return Version("Provides statistics over HTTP via m_httpd.so", VF_VENDOR);
+		keys.clear();
+		keypos = 0;
+		listed = 0;
+
+		if (section == SEC_CHANNELS)
+		{
+			for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+			{
+				if (!query.after.empty() && !CompareNames(query.after, i->first))
+					continue;
+				if (i->second->GetUserCounter() < (long)query.minusers)
+					continue;
+				if (!query.mask.empty() && !InspIRCd::Match(i->first, query.mask))
+					continue;
+				keys.push_back(i->first);
+			}
+			std::sort(keys.begin(), keys.end(), CompareNames);
+		}
+		else
+		{
+			for (user_hash::const_iterator i = ServerInstance->Users->uuidlist->begin(); i != ServerInstance->Users->uuidlist->end(); ++i)
+			{
+				User* u = i->second;
+				if (u->registered != REG_ALL || u->quitting || !ServerInstance->Users->clientlist->count(u->nick))
+					continue;
+				if (!query.after.empty() && i->first <= query.after)
+					continue;
+				if (!query.server.empty() && u->server->GetName() != query.server)
+					continue;
+				if (!query.mask.empty() && !InspIRCd::Match(u->nick, query.mask))
+					continue;
+				keys.push_back(i->first);
+			}
+			std::sort(keys.begin(), keys.end());
+		}
+	}
+
+	/** Write more of a channel or user list
+	 * @return True if the list is not complete yet
+	 */
+	bool WriteList(Section section, std::string& data)
+	{
+		const char* name = (section == SEC_CHANNELS ? "channellist" : "userlist");
+		if (!listopen)
+		{
+			listopen = true;
+			BuildKeys(section);
+			out.Open(name, true);
+		}
+
+		while (keypos < keys.size() && data.size() < BatchSize)
+		{
+			if (query.limit && listed >= query.limit)
+				break;
+
+			const std::string& key = keys[keypos++];
+			if (section == SEC_CHANNELS)
+			{
+				Channel* c = ServerInstance->FindChan(key);
+				if (!c)
+					continue;
+				WriteChannel(c);
+			}
+			else
+			{
+				User* u = ServerInstance->FindUUID(key);
+				if (!u || u->quitting)
+					continue;
+				WriteUser(u);
+			}
+			listed++;
+		}
+
+		bool limited = (query.limit && listed >= query.limit && keypos < keys.size());
+		if (keypos < keys.size() && !limited)
+			return true;
+
+		out.Close(name);
+
+		/* Tell the client where the next page starts */
+		if (limited)
+			out.Value("next", keys[keypos - 1]);
+
+		keys.clear();
+		listopen = false;
+		return false;
+	}
+
+ public:
+	StatsStream(Module* mod, bool json, const std::vector<Section>& sects, const Query& q)
+		: HTTPDocumentStream(mod), out(json), sections(sects), current(0), started(false), query(q), keypos(0), listed(0), listopen(false)
+	{
+	}
+
+	bool Produce(std::string& data) CXX11_OVERRIDE
+	{
+		out.SetOutput(data);
+		if (!started)
+		{
+			started = true;
+			out.Open("inspircdstats");
+		}
+
+		while (current < sections.size() && data.size() < BatchSize)
+		{
+			Section section = sections[current];
+			if ((section == SEC_CHANNELS || section == SEC_USERS) && WriteList(section, data))
+				continue;
+
+			switch (section)
+			{
+				case SEC_GENERAL:
+					WriteGeneral();
+					break;
+				case SEC_XLINES:
+					WriteXLines();
+					break;
+				case SEC_MODULES:
+					WriteModules();
+					break;
+				case SEC_SERVERS:
+					WriteServers();
+					break;
+				default:
+					break;
+			}
+			current++;
+		}
+
+		if (current < sections.size())
+			return true;
+
+		out.Close("inspircdstats");
+		return false;
 	}
 };
 
-static std::map<char, char const*> const &init_entities()
+class ModuleHttpStats : public Module
 {
-	static std::map<char, char const*> entities;
-	entities['<'] = "lt";
-	entities['>'] = "gt";
-	entities['&'] = "amp";
-	entities['"'] = "quot";
-	return entities;
-}
+	HTTPdAPI API;
 
-std::map<char, char const*> const &ModuleHttpStats::entities = init_entities ();
+	/** Decode a percent encoded query string value */
+	static std::string Unescape(const std::string& str)
+	{
+		std::string ret;
+		for (std::string::size_type i = 0; i < str.length(); i++)
+		{
+			if (str[i] == '+')
+				ret.push_back(' ');
+			else if (str[i] == '%' && i + 2 < str.length() && isxdigit(str[i+1]) && isxdigit(str[i+2]))
+			{
+				ret.push_back((char)strtol(str.substr(i + 1, 2).c_str(), NULL, 16));
+				i += 2;
+			}
+			else
+				ret.push_back(str[i]);
+		}
+		return ret;
+	}
+
+	/** Write a histogram in the Prometheus text format, with buckets from 16us to about 4s */
+	static void WriteHistogram(std::stringstream& data, const std::string& name, const std::string& label, const LatencyHistogram& hist)
+	{
+		const std::string sep = (label.empty() ? "" : ",");
+		for (unsigned long limit = 16; limit <= 4194304; limit *= 4)
+			data << name << "_bucket{" << label << sep << "le=\"" << limit / 1000000.0 << "\"} " << hist.GetCountUpTo(limit - 1) << "\n";
+		data << name << "_bucket{" << label << sep << "le=\"+Inf\"} " << hist.GetCount() << "\n";
+		data << name << "_sum{" << label << "} " << hist.GetTotal() / 1000000.0 << "\n";
+		data << name << "_count{" << label << "} " << hist.GetCount() << "\n";
+	}
+
+	/** Write the metrics for /metrics in the Prometheus text format */
+	static void WriteMetrics(std::stringstream& data)
+	{
+		data.precision(12);
+		data << "# HELP inspircd_users Number of users on the network.\n# TYPE inspircd_users gauge\n";
+		data << "inspircd_users " << ServerInstance->Users->clientlist->size() << "\n";
+		data << "# HELP inspircd_local_users Number of users on this server.\n# TYPE inspircd_local_users gauge\n";
+		data << "inspircd_local_users " << ServerInstance->Users->local_users.size() << "\n";
+		data << "# HELP inspircd_channels Number of channels.\n# TYPE inspircd_channels gauge\n";
+		data << "inspircd_channels " << ServerInstance->chanlist->size() << "\n";
+		data << "# HELP inspircd_sent_bytes_total Bytes sent.\n# TYPE inspircd_sent_bytes_total counter\n";
+		data << "inspircd_sent_bytes_total " << ServerInstance->stats->statsSent << "\n";
+		data << "# HELP inspircd_received_bytes_total Bytes received.\n# TYPE inspircd_received_bytes_total counter\n";
+		data << "inspircd_received_bytes_total " << ServerInstance->stats->statsRecv << "\n";
+
+		data << "# HELP inspircd_command_duration_seconds Time taken to process commands of local users.\n"
+			<< "# TYPE inspircd_command_duration_seconds histogram\n";
+		for (Commandtable::iterator i = ServerInstance->Parser->cmdlist.begin(); i != ServerInstance->Parser->cmdlist.end(); i++)
+		{
+			if (i->second->latency.GetCount())
+				WriteHistogram(data, "inspircd_command_duration_seconds", "command=\"" + i->second->name + "\"", i->second->latency);
+		}
+
+		data << "# HELP inspircd_loop_phase_duration_seconds Time taken by the phases of the main loop.\n"
+			<< "# TYPE inspircd_loop_phase_duration_seconds histogram\n";
+		for (unsigned int i = 0; i < serverstats::LOOP_PHASES; i++)
+		{
+			std::string label = "phase=\"" + std::string(serverstats::GetLoopPhaseName(i)) + "\"";
+			WriteHistogram(data, "inspircd_loop_phase_duration_seconds", label, ServerInstance->stats->LoopPhases[i]);
+		}
+
+		data << "# HELP inspircd_loop_busy_duration_seconds Time each main loop iteration spent not waiting for events.\n"
+			<< "# TYPE inspircd_loop_busy_duration_seconds histogram\n";
+		WriteHistogram(data, "inspircd_loop_busy_duration_seconds", "", ServerInstance->stats->LoopBusy);
+
+		data << "# HELP inspircd_loop_lag_seconds Longest main loop iteration during the last second.\n"
+			<< "# TYPE inspircd_loop_lag_seconds gauge\n";
+		data << "inspircd_loop_lag_seconds " << ServerInstance->stats->LoopLag / 1000000.0 << "\n";
+	}
+
+ public:
+	ModuleHttpStats()
+		: API(this)
+	{
+	}
+
+	void OnEvent(Event& event) CXX11_OVERRIDE
+	{
+		if (event.id != "httpd_url")
+			return;
+
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
+		HTTPRequest* http = (HTTPRequest*)&event;
+
+		std::string path = http->GetURI();
+		std::string querystring;
+		std::string::size_type qpos = path.find('?');
+		if (qpos != std::string::npos)
+		{
+			querystring.assign(path, qpos + 1, std::string::npos);
+			path.erase(qpos);
+		}
+		if (path.length() > 6 && path[path.length() - 1] == '/')
+			path.erase(path.length() - 1);
+
+		if (path == "/metrics")
+		{
+			std::stringstream data;
+			WriteMetrics(data);
+			HTTPDocumentResponse response(this, *http, &data, 200);
+			response.headers.SetHeader("X-Powered-By", MODNAME);
+			response.headers.SetHeader("Content-Type", "text/plain; version=0.0.4");
+			API->SendResponse(response);
+			return;
+		}
+
+		std::vector<StatsStream::Section> sections;
+		if (path == "/stats")
+		{
+			sections.push_back(StatsStream::SEC_GENERAL);
+			sections.push_back(StatsStream::SEC_XLINES);
+			sections.push_back(StatsStream::SEC_MODULES);
+			sections.push_back(StatsStream::SEC_CHANNELS);
+			sections.push_back(StatsStream::SEC_USERS);
+			sections.push_back(StatsStream::SEC_SERVERS);
+		}
+		else if (path == "/stats/general")
+			sections.push_back(StatsStream::SEC_GENERAL);
+		else if (path == "/stats/xlines")
+			sections.push_back(StatsStream::SEC_XLINES);
+		else if (path == "/stats/modules")
+			sections.push_back(StatsStream::SEC_MODULES);
+		else if (path == "/stats/channels")
+			sections.push_back(StatsStream::SEC_CHANNELS);
+		else if (path == "/stats/users")
+			sections.push_back(StatsStream::SEC_USERS);
+		else if (path == "/stats/servers")
+			sections.push_back(StatsStream::SEC_SERVERS);
+		else
+			return;
+
+		StatsStream::Query query;
+		bool json = false;
+		irc::sepstream params(querystring, '&');
+		std::string param;
+		while (params.GetToken(param))
+		{
+			std::string::size_type eq = param.find('=');
+			std::string key(param, 0, eq);
+			std::string value = (eq == std::string::npos ? "" : Unescape(param.substr(eq + 1)));
+
+			if (key == "format")
+				json = (value == "json");
+			else if (key == "after")
+				query.after = value;
+			else if (key == "limit")
+				query.limit = ConvToInt(value);
+			else if (key == "mask")
+				query.mask = value;
+			else if (key == "server")
+				query.server = value;
+			else if (key == "minusers")
+				query.minusers = ConvToInt(value);
+		}
+
+		/* Send the document back to m_httpd, it is generated as it is sent */
+		HTTPDocumentResponse response(this, *http, new StatsStream(this, json, sections, query), 200);
+		response.headers.SetHeader("X-Powered-By", MODNAME);
+		response.headers.SetHeader("Content-Type", json ? "application/json" : "text/xml");
+		API->SendResponse(response);
+	}
+
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		// Each input and the JSON string it has to be written as
+		static const char* const tests[][2] = {
+			{ "plain \"quoted\" \\ \x01", "\"plain \\\"quoted\\\" \\\\ \\u0001\"" },
+			{ "caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80", "\"caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80\"" },
+			{ "caf\xE9!", "\"caf\\ufffd!\"" }, // Latin-1
+			{ "\xC0\xAF", "\"\\ufffd\\ufffd\"" }, // Overlong '/'
+			{ "\xED\xA0\x80", "\"\\ufffd\\ufffd\\ufffd\"" }, // UTF-16 surrogate
+			{ "\xF4\x90\x80\x80", "\"\\ufffd\\ufffd\\ufffd\\ufffd\"" }, // Above U+10FFFF
+			{ "\xE2\x82", "\"\\ufffd\\ufffd\"" } // Truncated
+		};
+
+		std::cout << "\nm_httpd_stats: JSON string tests\n";
+		for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+		{
+			std::string result;
+			StatsSerializer serializer(true);
+			serializer.SetOutput(result);
+			serializer.Line(tests[i][0]);
+			std::cout << "Test " << (i + 1) << ": " << (result == tests[i][1] ? "SUCCESS" : "FAILURE, got " + result) << "\n";
+		}
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides statistics over HTTP via m_httpd.so", VF_VENDOR);
+	}
+};
 
 MODULE_INIT(ModuleHttpStats)
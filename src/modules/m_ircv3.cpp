@@ -31,23 +31,32 @@ class ModuleIRCv3 : public Module
 
 	CUList last_excepts;
 
-	void WriteNeighboursWithExt(User* user, const std::string& line, const LocalIntExt& ext)
+	void WriteNeighboursWithCap(User* user, const std::string& line, const CapBit& cap)
 	{
 		UserChanList chans(user->chans);
 
 		std::map<User*, bool> exceptions;
 		FOREACH_MOD(OnBuildNeighborList, (user, chans, exceptions));
 
-		// Send it to all local users who were explicitly marked as neighbours by modules and have the required ext
+		// Local users are marked once they were considered so each of them is only sent the line once
+		already_sent_t sent_id = ++LocalUser::already_sent_id;
+		LocalUser* localuser = IS_LOCAL(user);
+		if (localuser)
+			localuser->already_sent = sent_id;
+
+		// Send it to all local users who were explicitly marked as neighbours by modules and have the required cap
 		for (std::map<User*, bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
-			if ((u) && (i->second) && (ext.get(u)))
+			if (!u)
+				continue;
+
+			u->already_sent = sent_id;
+			if ((i->second) && (cap.get(u)))
 				u->Write(line);
 		}
 
 		// Now consider sending it to all other users who has at least a common channel with the user
-		std::set<User*> already_sent;
 		for (UCListIter i = chans.begin(); i != chans.end(); ++i)
 		{
 			const UserMembList* userlist = (*i)->GetUsers();
@@ -57,14 +66,18 @@ class ModuleIRCv3 : public Module
 				 * Send the line if the channel member in question meets all of the following criteria:
 				 * - local
 				 * - not the user who is doing the action (i.e. whose channels we're iterating)
-				 * - has the given extension
 				 * - not on the except list built by modules
 				 * - we haven't sent the line to the member yet
+				 * - has the given capability
 				 *
 				 */
 				LocalUser* member = IS_LOCAL(m->first);
-				if ((member) && (member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
-					member->Write(line);
+				if ((member) && (member->already_sent != sent_id))
+				{
+					member->already_sent = sent_id;
+					if (cap.get(member))
+						member->Write(line);
+				}
 			}
 		}
 	}
@@ -108,7 +121,7 @@ class ModuleIRCv3 : public Module
 				else
 					line += std::string(ae->account);
 
-				WriteNeighboursWithExt(ae->user, line, cap_accountnotify.ext);
+				WriteNeighboursWithCap(ae->user, line, cap_accountnotify.ext);
 			}
 		}
 	}
@@ -138,7 +151,7 @@ class ModuleIRCv3 : public Module
 		for (UserMembCIter it = userlist->begin(); it != userlist->end(); ++it)
 		{
 			// Send the extended join line if the current member is local, has the extended-join cap and isn't excepted
-			User* member = IS_LOCAL(it->first);
+			LocalUser* member = IS_LOCAL(it->first);
 			if ((member) && (cap_extendedjoin.ext.get(member)) && (excepts.find(member) == excepts.end()))
 			{
 				// Construct the lines we're going to send if we haven't constructed them already
@@ -196,7 +209,7 @@ class ModuleIRCv3 : public Module
 			if (!awaymsg.empty())
 				line += " :" + awaymsg;
 
-			WriteNeighboursWithExt(user, line, cap_awaynotify.ext);
+			WriteNeighboursWithCap(user, line, cap_awaynotify.ext);
 		}
 		return MOD_RES_PASSTHRU;
 	}
@@ -212,7 +225,7 @@ class ModuleIRCv3 : public Module
 		for (UserMembCIter it = userlist->begin(); it != userlist->end(); ++it)
 		{
 			// Send the away notify line if the current member is local, has the away-notify cap and isn't excepted
-			User* member = IS_LOCAL(it->first);
+			LocalUser* member = IS_LOCAL(it->first);
 			if ((member) && (cap_awaynotify.ext.get(member)) && (last_excepts.find(member) == last_excepts.end()))
 			{
 				member->Write(line);
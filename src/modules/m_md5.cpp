@@ -23,6 +23,7 @@
 
 #include "inspircd.h"
 #include "modules/hash.h"
+#include <iostream>
 
 /* The four core functions - F1 is optimized somewhat */
 #define F1(x, y, z) (z ^ (x & (y ^ z)))
@@ -37,6 +38,199 @@
 typedef uint32_t word32; /* NOT unsigned long. We don't support 16 bit platforms, anyway. */
 typedef unsigned char byte;
 
+/* The multi-buffer code hashes one message per vector lane, the rounds are inlined into
+ * functions built for each instruction set and one of them is picked when the module loads.
+ */
+#if defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+# define MD5_MULTIBUFFER
+# define MD5_INLINE inline __attribute__((always_inline))
+typedef word32 word32x4 __attribute__((vector_size(16)));
+typedef word32 word32x8 __attribute__((vector_size(32)));
+#else
+# define MD5_INLINE inline
+#endif
+
+/** The 64 rounds of the MD5 transform on one block, T is either a word or a vector
+ * of words from the same block of several messages
+ */
+template<typename T>
+static MD5_INLINE void MD5Rounds(T buf[4], T const in[16])
+{
+	T a = buf[0];
+	T b = buf[1];
+	T c = buf[2];
+	T d = buf[3];
+
+	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
+	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
+	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+#ifdef MD5_MULTIBUFFER
+static const byte zeroblock[64] = { 0 };
+
+/** A message of a batch, split into the blocks which are fed to its lane
+ */
+struct MD5Lane
+{
+	const byte* data;
+	/** Number of blocks taken directly from the message */
+	size_t full;
+	/** Number of blocks including the padding */
+	size_t blocks;
+	/** The end of the message with the padding and the length appended */
+	byte tail[128];
+
+	void Prepare(const void* msg, size_t len)
+	{
+		data = static_cast<const byte*>(msg);
+		full = len / 64;
+		size_t rest = len % 64;
+		size_t tailsize = rest < 56 ? 64 : 128;
+		memcpy(tail, data + full * 64, rest);
+		tail[rest] = 0x80;
+		memset(tail + rest + 1, 0, tailsize - rest - 1);
+		uint64_t bits = static_cast<uint64_t>(len) << 3;
+		for (size_t i = 0; i < 8; i++)
+			tail[tailsize - 8 + i] = static_cast<byte>(bits >> (8 * i));
+		blocks = full + tailsize / 64;
+	}
+
+	/** Get a block of the padded message, lanes which are done get zeroes */
+	const byte* Block(size_t n) const
+	{
+		if (n < full)
+			return data + n * 64;
+		if (n < blocks)
+			return tail + (n - full) * 64;
+		return zeroblock;
+	}
+};
+
+/** Hash up to L messages at once, each in its own lane of the vector type V */
+template<typename V, size_t L>
+static MD5_INLINE void MD5MultiBuffer(size_t count, const void* const* data, const size_t* lens, byte* out)
+{
+	MD5Lane lanes[L];
+	size_t maxblocks = 0;
+	for (size_t l = 0; l < L; l++)
+	{
+		if (l < count)
+			lanes[l].Prepare(data[l], lens[l]);
+		else
+			lanes[l].Prepare(zeroblock, 0);
+		maxblocks = std::max(maxblocks, lanes[l].blocks);
+	}
+
+	V buf[4] = { V() + 0x67452301, V() + 0xefcdab89, V() + 0x98badcfe, V() + 0x10325476 };
+	V in[16];
+	for (size_t n = 0; n < maxblocks; n++)
+	{
+		for (size_t l = 0; l < L; l++)
+		{
+			const byte* p = lanes[l].Block(n);
+			word32 words[16];
+			memcpy(words, p, 64); // x86 is little endian like MD5
+			for (size_t i = 0; i < 16; i++)
+				in[i][l] = words[i];
+		}
+		MD5Rounds<V>(buf, in);
+
+		for (size_t l = 0; l < count; l++)
+		{
+			if (lanes[l].blocks != n + 1)
+				continue;
+			byte* digest = out + l * 16;
+			for (size_t i = 0; i < 16; i++)
+				digest[i] = static_cast<byte>(buf[i / 4][l] >> (8 * (i % 4)));
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void MD5BatchAVX2(size_t count, const void* const* data, const size_t* lens, byte* out)
+{
+	for (size_t i = 0; i < count; i += 8)
+		MD5MultiBuffer<word32x8, 8>(std::min<size_t>(count - i, 8), data + i, lens + i, out + i * 16);
+}
+
+__attribute__((target("sse2")))
+static void MD5BatchSSE2(size_t count, const void* const* data, const size_t* lens, byte* out)
+{
+	for (size_t i = 0; i < count; i += 4)
+		MD5MultiBuffer<word32x4, 4>(std::min<size_t>(count - i, 4), data + i, lens + i, out + i * 16);
+}
+#endif
+
 /** An MD5 context, used by m_opermd5
  */
 class MD5Context
@@ -49,6 +243,37 @@ class MD5Context
 
 class MD5Provider : public HashProvider
 {
+	/** Incremental hash, wraps an MD5Context */
+	class Context : public HashContext
+	{
+		MD5Provider* const prov;
+		MD5Context ctx;
+
+	 public:
+		Context(MD5Provider* provider) : prov(provider)
+		{
+			prov->MD5Init(&ctx);
+		}
+
+		void update(const void* data, size_t len)
+		{
+			prov->MD5Update(&ctx, static_cast<const byte*>(data), len);
+		}
+
+		void final(unsigned char* out)
+		{
+			prov->MD5Final(out, &ctx);
+		}
+	};
+
+	typedef void (*BatchFunc)(size_t, const void* const*, const size_t*, byte*);
+
+	/** The multi-buffer implementation supported by this CPU, NULL if there is none */
+	BatchFunc batch;
+
+	/** The four lane implementation, used for batches which would leave most lanes of batch idle */
+	BatchFunc smallbatch;
+
 	void byteSwap(word32 *buf, unsigned words)
 	{
 		byte *p = (byte *)buf;
@@ -154,85 +379,7 @@ class MD5Provider : public HashProvider
 
 	void MD5Transform(word32 buf[4], word32 const in[16])
 	{
-		register word32 a, b, c, d;
-
-		a = buf[0];
-		b = buf[1];
-		c = buf[2];
-		d = buf[3];
-
-		MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
-		MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
-		MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
-		MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
-		MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
-		MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
-		MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
-		MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
-		MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
-		MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
-		MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-		MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-		MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
-		MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-		MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-		MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-		MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-		MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-		MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-		MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-		MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-		MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-		MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-		MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-		MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-		MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-		MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-		MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-		MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-		MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-		MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-		MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-		MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
-		MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
-		MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-		MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-		MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
-		MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
-		MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
-		MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-		MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
-		MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
-		MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
-		MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
-		MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
-		MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-		MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-		MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
-
-		MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
-		MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
-		MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-		MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
-		MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
-		MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
-		MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-		MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
-		MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
-		MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-		MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
-		MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-		MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
-		MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-		MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
-		MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
-
-		buf[0] += a;
-		buf[1] += b;
-		buf[2] += c;
-		buf[3] += d;
+		MD5Rounds<word32>(buf, in);
 	}
 
 
@@ -266,7 +413,47 @@ class MD5Provider : public HashProvider
 		return std::string(res, 16);
 	}
 
-	MD5Provider(Module* parent) : HashProvider(parent, "hash/md5", 16, 64) {}
+	void rawsum(const void* data, size_t len, unsigned char* out)
+	{
+		MyMD5(out, const_cast<void*>(data), len, NULL);
+	}
+
+	HashContext* init()
+	{
+		return new Context(this);
+	}
+
+	void batchsum(size_t count, const void* const* data, const size_t* lens, unsigned char* out)
+	{
+		if (smallbatch && count > 1 && count <= 4)
+			smallbatch(count, data, lens, out);
+		else if (batch && count > 1)
+			batch(count, data, lens, out);
+		else
+			HashProvider::batchsum(count, data, lens, out);
+	}
+
+	/** The name of the instruction set used by batchsum() */
+	const char* implementation;
+
+	MD5Provider(Module* parent) : HashProvider(parent, "hash/md5", 16, 64), batch(NULL), smallbatch(NULL), implementation("scalar")
+	{
+#ifdef MD5_MULTIBUFFER
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			batch = MD5BatchAVX2;
+			implementation = "AVX2";
+		}
+		else if (__builtin_cpu_supports("sse2"))
+		{
+			batch = MD5BatchSSE2;
+			implementation = "SSE2";
+		}
+		if (batch)
+			smallbatch = MD5BatchSSE2;
+#endif
+	}
 };
 
 class ModuleMD5 : public Module
@@ -277,6 +464,52 @@ class ModuleMD5 : public Module
 	{
 	}
 
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		const size_t count = 1000000;
+		const size_t batchsize = 64;
+		std::cout << "\nm_md5: benchmarking " << count << " hashes, batches use " << md5.implementation << "\n";
+
+		const size_t sizes[] = { 24, 64, 256 };
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			// Distinct messages of the same size, like the segments of a connect storm's cloaks
+			std::vector<std::string> messages(batchsize);
+			std::vector<const void*> data(batchsize);
+			std::vector<size_t> lens(batchsize, sizes[s]);
+			for (size_t i = 0; i < batchsize; i++)
+			{
+				messages[i] = std::string(sizes[s], static_cast<char>('a' + i % 26));
+				messages[i][0] = static_cast<char>(i);
+				data[i] = messages[i].data();
+			}
+			std::vector<unsigned char> single(batchsize * 16);
+			std::vector<unsigned char> batched(batchsize * 16);
+
+			double start = GetTime();
+			for (size_t n = 0; n < count; n += batchsize)
+			{
+				for (size_t i = 0; i < batchsize; i++)
+					md5.rawsum(data[i], lens[i], &single[i * 16]);
+			}
+			double scalar = GetTime() - start;
+
+			start = GetTime();
+			for (size_t n = 0; n < count; n += batchsize)
+				md5.batchsum(batchsize, &data[0], &lens[0], &batched[0]);
+			double multi = GetTime() - start;
+
+			std::cout << sizes[s] << " byte messages: " << (count / scalar) << " hashes/s one at a time, "
+				<< (count / multi) << " hashes/s batched" << (single == batched ? "" : ", RESULTS DIFFER") << "\n";
+		}
+	}
+
+	static double GetTime()
+	{
+		ServerInstance->UpdateTime();
+		return ServerInstance->Time() + ServerInstance->Time_ns() / 1000000000.0;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Implements MD5 hashing",VF_VENDOR);
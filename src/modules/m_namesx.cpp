@@ -52,13 +52,20 @@ class ModuleNamesX : public Module
 		{
 			if ((parameters.size()) && (!strcasecmp(parameters[0].c_str(),"NAMESX")))
 			{
-				cap.ext.set(user, 1);
+				cap.ext.set(user, true);
 				return MOD_RES_DENY;
 			}
 		}
 		return MOD_RES_PASSTHRU;
 	}
 
+	ModResult OnNamesListVariant(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE
+	{
+		if (cap.ext.get(issuer))
+			variant.push_back('x');
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
 		if (!cap.ext.get(issuer))
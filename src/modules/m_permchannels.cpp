@@ -20,7 +20,6 @@
 
 #include "inspircd.h"
 #include "listmode.h"
-#include <fstream>
 
 
 /** Handles the +P channel mode
@@ -47,119 +46,164 @@ class PermChannel : public ModeHandler
 	}
 };
 
-// Not in a class due to circular dependancy hell.
-static std::string permchannelsconf;
-static bool WriteDatabase(PermChannel& permchanmode, Module* mod, bool save_listmodes)
+/** Serialize a permanent channel into a config tag
+ * @param chan The channel to serialize
+ * @param save_listmodes True to include the entries of list modes
+ * @return A permchannels tag describing the channel, including the trailing newline
+ */
+static std::string SerializeChannel(Channel* chan, bool save_listmodes)
 {
-	ChanModeReference ban(mod, "ban");
-	/*
-	 * We need to perform an atomic write so as not to fuck things up.
-	 * So, let's write to a temporary file, flush it, then rename the file..
-	 *     -- w00t
-	 */
-	
-	// If the user has not specified a configuration file then we don't write one.
-	if (permchannelsconf.empty())
-		return true;
-
-	std::string permchannelsnewconf = permchannelsconf + ".tmp";
-	std::ofstream stream(permchannelsnewconf.c_str());
-	if (!stream.is_open())
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot create database! %s (%d)", strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot create new db: %s (%d)", strerror(errno), errno);
-		return false;
-	}
-	
-	stream << "# This file is automatically generated by m_permchannels. Any changes will be overwritten." << std::endl
-		<< "<config format=\"xml\">" << std::endl;
-
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
+	std::string chanmodes = chan->ChanModes(true);
+	if (save_listmodes)
 	{
-		Channel* chan = i->second;
-		if (!chan->IsModeSet(permchanmode))
-			continue;
+		std::string modes;
+		std::string params;
 
-		std::string chanmodes = chan->ChanModes(true);
-		if (save_listmodes)
+		const ModeParser::ListModeList& listmodes = ServerInstance->Modes->GetListModes();
+		for (ModeParser::ListModeList::const_iterator j = listmodes.begin(); j != listmodes.end(); ++j)
 		{
-			std::string modes;
-			std::string params;
+			ListModeBase* lm = *j;
+			ListModeBase::ModeList* list = lm->GetList(chan);
+			if (!list || list->empty())
+				continue;
 
-			const ModeParser::ListModeList& listmodes = ServerInstance->Modes->GetListModes();
-			for (ModeParser::ListModeList::const_iterator j = listmodes.begin(); j != listmodes.end(); ++j)
+			size_t n = 0;
+			// Append the parameters
+			for (ListModeBase::ModeList::const_iterator k = list->begin(); k != list->end(); ++k, n++)
 			{
-				ListModeBase* lm = *j;
-				ListModeBase::ModeList* list = lm->GetList(chan);
-				if (!list || list->empty())
-					continue;
+				params += k->mask;
+				params += ' ';
+			}
 
-				size_t n = 0;
-				// Append the parameters
-				for (ListModeBase::ModeList::const_iterator k = list->begin(); k != list->end(); ++k, n++)
-				{
-					params += k->mask;
-					params += ' ';
-				}
+			// Append the mode letters (for example "IIII", "gg")
+			modes.append(n, lm->GetModeChar());
+		}
 
-				// Append the mode letters (for example "IIII", "gg")
-				modes.append(n, lm->GetModeChar());
-			}
+		if (!params.empty())
+		{
+			// Remove the last space
+			params.erase(params.end()-1);
+
+			// If there is at least a space in chanmodes (that is, a non-listmode has a parameter)
+			// insert the listmode mode letters before the space. Otherwise just append them.
+			std::string::size_type p = chanmodes.find(' ');
+			if (p == std::string::npos)
+				chanmodes += modes;
+			else
+				chanmodes.insert(p, modes);
 
-			if (!params.empty())
-			{
-				// Remove the last space
-				params.erase(params.end()-1);
-
-				// If there is at least a space in chanmodes (that is, a non-listmode has a parameter)
-				// insert the listmode mode letters before the space. Otherwise just append them.
-				std::string::size_type p = chanmodes.find(' ');
-				if (p == std::string::npos)
-					chanmodes += modes;
-				else
-					chanmodes.insert(p, modes);
-
-				// Append the listmode parameters (the masks themselves)
-				chanmodes += ' ';
-				chanmodes += params;
-			}
+			// Append the listmode parameters (the masks themselves)
+			chanmodes += ' ';
+			chanmodes += params;
 		}
+	}
+
+	std::string record = "<permchannels channel=\"" + ServerConfig::Escape(chan->name)
+		+ "\" ts=\"" + ConvToStr(chan->age)
+		+ "\" topic=\"" + ServerConfig::Escape(chan->topic)
+		+ "\" topicts=\"" + ConvToStr(chan->topicset)
+		+ "\" topicsetby=\"" + ServerConfig::Escape(chan->setby)
+		+ "\" modes=\"" + ServerConfig::Escape(chanmodes)
+		+ "\">\n";
+	return record;
+}
 
-		stream << "<permchannels channel=\"" << ServerConfig::Escape(chan->name)
-			<< "\" ts=\"" << chan->age
-			<< "\" topic=\"" << ServerConfig::Escape(chan->topic)
-			<< "\" topicts=\"" << chan->topicset
-			<< "\" topicsetby=\"" << ServerConfig::Escape(chan->setby)
-			<< "\" modes=\"" << ServerConfig::Escape(chanmodes)
-			<< "\">" << std::endl;
+/** The serialized form of a single permanent channel. Records are created and released
+ * by the main thread only, the database writer just reads them.
+ */
+class ChannelRecord : public refcountbase
+{
+ public:
+	const std::string data;
+
+	ChannelRecord(const std::string& Data)
+		: data(Data)
+	{
 	}
+};
+
+typedef std::vector<reference<ChannelRecord> > RecordList;
+
+/** Writes a snapshot of the channel records to disk. This runs on a worker thread
+ * and never touches any channel.
+ */
+class DatabaseWriter : public Thread
+{
+	const std::string dbpath;
+	const RecordList records;
+	Mutex mutex;
+	bool done;
+
+ public:
+	/** Describes what went wrong, empty if the database was written successfully */
+	std::string error;
 
-	if (stream.fail())
+	DatabaseWriter(const std::string& db, const RecordList& Records)
+		: dbpath(db), records(Records), done(false)
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot write to new database! %s (%d)", strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to new db: %s (%d)", strerror(errno), errno);
-		return false;
 	}
-	stream.close();
 
-#ifdef _WIN32
-	if (remove(permchannelsconf.c_str()))
+	bool IsDone()
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot remove old database! %s (%d)", strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot remove old database: %s (%d)", strerror(errno), errno);
-		return false;
+		mutex.Lock();
+		bool ret = done;
+		mutex.Unlock();
+		return ret;
 	}
-#endif
-	// Use rename to move temporary to new db - this is guarenteed not to fuck up, even in case of a crash.
-	if (rename(permchannelsnewconf.c_str(), permchannelsconf.c_str()) < 0)
+
+	void Write()
 	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot move new to old database! %s (%d)", strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot replace old with new db: %s (%d)", strerror(errno), errno);
-		return false;
+		/*
+		 * We need to perform an atomic write so as not to fuck things up.
+		 * So, let's write to a temporary file, flush it, then rename the file..
+		 *     -- w00t
+		 */
+		std::string newdbpath = dbpath + ".tmp";
+		FILE* f = fopen(newdbpath.c_str(), "w");
+		if (!f)
+		{
+			error = "cannot create new db: " + std::string(strerror(errno));
+			return;
+		}
+
+		static const char header[] = "# This file is automatically generated by m_permchannels. Any changes will be overwritten.\n<config format=\"xml\">\n";
+		bool ok = (fputs(header, f) >= 0);
+		for (RecordList::const_iterator i = records.begin(); ok && i != records.end(); ++i)
+			ok = (fwrite((*i)->data.data(), 1, (*i)->data.length(), f) == (*i)->data.length());
+
+		// Make sure the data is on the disk before the old database is replaced
+		ok = ((ok) && (fflush(f) == 0));
+#ifndef _WIN32
+		ok = ((ok) && (fsync(fileno(f)) == 0));
+#endif
+		if (!ok)
+		{
+			error = "cannot write to new db: " + std::string(strerror(errno));
+			fclose(f);
+			return;
+		}
+		fclose(f);
+
+#ifdef _WIN32
+		if ((remove(dbpath.c_str())) && (errno != ENOENT))
+		{
+			error = "cannot remove old database: " + std::string(strerror(errno));
+			return;
+		}
+#endif
+		// Use rename to move temporary to new db - this is guarenteed not to fuck up, even in case of a crash.
+		if (rename(newdbpath.c_str(), dbpath.c_str()) < 0)
+			error = "cannot replace old with new db: " + std::string(strerror(errno));
 	}
 
-	return true;
-}
+	void Run() CXX11_OVERRIDE
+	{
+		Write();
+		mutex.Lock();
+		done = true;
+		mutex.Unlock();
+	}
+};
 
 class ModulePermanentChannels : public Module
 {
@@ -167,11 +211,46 @@ class ModulePermanentChannels : public Module
 	bool dirty;
 	bool loaded;
 	bool save_listmodes;
-public:
+	std::string permchannelsconf;
+
+	/** Channels whose record has to be serialized again */
+	std::set<Channel*> changed;
 
+	/** Serialized records of all permanent channels, by channel name */
+	std::map<std::string, reference<ChannelRecord> > records;
+
+	/** Database writer thread, NULL if no write is in progress */
+	DatabaseWriter* writer;
+
+	void Changed(Channel* chan)
+	{
+		changed.insert(chan);
+		dirty = true;
+	}
+
+	/** Queue every permanent channel to be serialized again */
+	void ChangedAll()
+	{
+		for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+		{
+			if (i->second->IsModeSet(p))
+				changed.insert(i->second);
+		}
+	}
+
+ public:
 	ModulePermanentChannels()
-		: p(this), dirty(false), loaded(false)
+		: p(this), dirty(false), loaded(false), save_listmodes(false), writer(NULL)
+	{
+	}
+
+	~ModulePermanentChannels()
 	{
+		if (writer)
+		{
+			writer->join();
+			delete writer;
+		}
 	}
 
 	CullResult cull()
@@ -204,7 +283,14 @@ public:
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("permchanneldb");
 		permchannelsconf = tag->getString("filename");
-		save_listmodes = tag->getBool("listmodes");
+		bool newlistmodes = tag->getBool("listmodes");
+		if ((loaded) && (newlistmodes != save_listmodes))
+		{
+			// Every record changes when list modes are turned on or off
+			ChangedAll();
+			dirty = true;
+		}
+		save_listmodes = newlistmodes;
 	}
 
 	void LoadDatabase()
@@ -278,7 +364,7 @@ public:
 	ModResult OnRawMode(User* user, Channel* chan, const char mode, const std::string &param, bool adding, int pcnt) CXX11_OVERRIDE
 	{
 		if (chan && (chan->IsModeSet(p) || mode == p.GetModeChar()))
-			dirty = true;
+			Changed(chan);
 
 		return MOD_RES_PASSTHRU;
 	}
@@ -286,13 +372,56 @@ public:
 	void OnPostTopicChange(User*, Channel *c, const std::string&) CXX11_OVERRIDE
 	{
 		if (c->IsModeSet(p))
+			Changed(c);
+	}
+
+	void OnChannelDelete(Channel* c) CXX11_OVERRIDE
+	{
+		changed.erase(c);
+		if (records.erase(c->name))
 			dirty = true;
 	}
 
 	void OnBackgroundTimer(time_t) CXX11_OVERRIDE
 	{
-		if (dirty)
-			WriteDatabase(p, this, save_listmodes);
+		if (writer)
+		{
+			if (!writer->IsDone())
+				return;
+
+			writer->join();
+			if (!writer->error.empty())
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot write database! %s", writer->error.c_str());
+				ServerInstance->SNO->WriteToSnoMask('a', "database: %s", writer->error.c_str());
+				dirty = true;
+			}
+			delete writer;
+			writer = NULL;
+		}
+
+		// Only the channels which changed since the last run are serialized again
+		for (std::set<Channel*>::const_iterator i = changed.begin(); i != changed.end(); ++i)
+		{
+			Channel* chan = *i;
+			if (chan->IsModeSet(p))
+				records[chan->name] = new ChannelRecord(SerializeChannel(chan, save_listmodes));
+			else
+				records.erase(chan->name);
+		}
+		changed.clear();
+
+		// If the user has not specified a configuration file then we don't write one.
+		if ((!dirty) || (permchannelsconf.empty()))
+			return;
+
+		RecordList list;
+		list.reserve(records.size());
+		for (std::map<std::string, reference<ChannelRecord> >::const_iterator i = records.begin(); i != records.end(); ++i)
+			list.push_back(i->second);
+
+		writer = new DatabaseWriter(permchannelsconf, list);
+		ServerInstance->Threads->Start(writer);
 		dirty = false;
 	}
 
@@ -324,6 +453,9 @@ public:
 				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Error loading permchannels database: " + std::string(e.GetReason()));
 			}
 		}
+
+		// Build the records of the loaded channels, there is no need to write them back
+		ChangedAll();
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
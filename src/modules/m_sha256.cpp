@@ -58,6 +58,7 @@
 
 #include "inspircd.h"
 #include "modules/hash.h"
+#include <iostream>
 
 #define SHA256_DIGEST_SIZE (256 / 8)
 #define SHA256_BLOCK_SIZE  (512 / 8)
@@ -74,8 +75,7 @@ class SHA256Context
 };
 
 #define SHFR(x, n)    (x >> n)
-#define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
-#define ROTL(x, n)   ((x << n) | (x >> ((sizeof(x) << 3) - n)))
+#define ROTR(x, n)   ((x >> n) | (x << (32 - n)))
 #define CH(x, y, z)  ((x & y) ^ (~x & z))
 #define MAJ(x, y, z) ((x & y) ^ (x & z) ^ (y & z))
 
@@ -114,7 +114,7 @@ const unsigned int sha256_h0[8] =
 	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
 };
 
-uint32_t sha256_k[64] =
+const uint32_t sha256_k[64] =
 {
 	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
 	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
@@ -134,8 +134,178 @@ uint32_t sha256_k[64] =
 	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
 };
 
+/* The multi-buffer code hashes one message per vector lane, the rounds are inlined into
+ * functions built for each instruction set and one of them is picked when the module loads.
+ */
+#if defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+# define SHA256_MULTIBUFFER
+# define SHA256_INLINE inline __attribute__((always_inline))
+typedef uint32_t uint32x4 __attribute__((vector_size(16)));
+typedef uint32_t uint32x8 __attribute__((vector_size(32)));
+#else
+# define SHA256_INLINE inline
+#endif
+
+/** The message schedule and the 64 rounds of SHA-256 on one block, T is either a word
+ * or a vector of words from the same block of several messages
+ * @param h The hash state to update
+ * @param w The first 16 words are the block, the rest is used for the message schedule
+ */
+template<typename T>
+static SHA256_INLINE void SHA256Rounds(T h[8], T w[64])
+{
+	T wv[8];
+	int j;
+	for (j = 16; j < 64; j++)
+		SHA256_SCR(j);
+	for (j = 0; j < 8; j++)
+		wv[j] = h[j];
+	for (j = 0; j < 64; j++)
+	{
+		T t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6]) + sha256_k[j] + w[j];
+		T t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+		wv[7] = wv[6];
+		wv[6] = wv[5];
+		wv[5] = wv[4];
+		wv[4] = wv[3] + t1;
+		wv[3] = wv[2];
+		wv[2] = wv[1];
+		wv[1] = wv[0];
+		wv[0] = t1 + t2;
+	}
+	for (j = 0; j < 8; j++)
+		h[j] += wv[j];
+}
+
+#ifdef SHA256_MULTIBUFFER
+static const unsigned char zeroblock[SHA256_BLOCK_SIZE] = { 0 };
+
+/** A message of a batch, split into the blocks which are fed to its lane
+ */
+struct SHA256Lane
+{
+	const unsigned char* data;
+	/** Number of blocks taken directly from the message */
+	size_t full;
+	/** Number of blocks including the padding */
+	size_t blocks;
+	/** The end of the message with the padding and the length appended */
+	unsigned char tail[2 * SHA256_BLOCK_SIZE];
+
+	void Prepare(const void* msg, size_t len)
+	{
+		data = static_cast<const unsigned char*>(msg);
+		full = len / SHA256_BLOCK_SIZE;
+		size_t rest = len % SHA256_BLOCK_SIZE;
+		size_t tailsize = rest < SHA256_BLOCK_SIZE - 8 ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE;
+		memcpy(tail, data + full * SHA256_BLOCK_SIZE, rest);
+		tail[rest] = 0x80;
+		memset(tail + rest + 1, 0, tailsize - rest - 1);
+		uint64_t bits = static_cast<uint64_t>(len) << 3;
+		for (size_t i = 0; i < 8; i++)
+			tail[tailsize - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+		blocks = full + tailsize / SHA256_BLOCK_SIZE;
+	}
+
+	/** Get a block of the padded message, lanes which are done get zeroes */
+	const unsigned char* Block(size_t n) const
+	{
+		if (n < full)
+			return data + n * SHA256_BLOCK_SIZE;
+		if (n < blocks)
+			return tail + (n - full) * SHA256_BLOCK_SIZE;
+		return zeroblock;
+	}
+};
+
+/** Hash up to L messages at once, each in its own lane of the vector type V */
+template<typename V, size_t L>
+static SHA256_INLINE void SHA256MultiBuffer(size_t count, const void* const* data, const size_t* lens, unsigned char* out)
+{
+	SHA256Lane lanes[L];
+	size_t maxblocks = 0;
+	for (size_t l = 0; l < L; l++)
+	{
+		if (l < count)
+			lanes[l].Prepare(data[l], lens[l]);
+		else
+			lanes[l].Prepare(zeroblock, 0);
+		maxblocks = std::max(maxblocks, lanes[l].blocks);
+	}
+
+	V h[8];
+	for (size_t i = 0; i < 8; i++)
+		h[i] = V() + sha256_h0[i];
+	V w[64];
+	for (size_t n = 0; n < maxblocks; n++)
+	{
+		for (size_t l = 0; l < L; l++)
+		{
+			uint32_t words[16];
+			memcpy(words, lanes[l].Block(n), SHA256_BLOCK_SIZE);
+			for (size_t i = 0; i < 16; i++)
+				w[i][l] = __builtin_bswap32(words[i]); // SHA-256 is big endian
+		}
+		SHA256Rounds<V>(h, w);
+
+		for (size_t l = 0; l < count; l++)
+		{
+			if (lanes[l].blocks != n + 1)
+				continue;
+			for (size_t i = 0; i < 8; i++)
+				UNPACK32(h[i][l], out + l * SHA256_DIGEST_SIZE + (i << 2));
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void SHA256BatchAVX2(size_t count, const void* const* data, const size_t* lens, unsigned char* out)
+{
+	for (size_t i = 0; i < count; i += 8)
+		SHA256MultiBuffer<uint32x8, 8>(std::min<size_t>(count - i, 8), data + i, lens + i, out + i * SHA256_DIGEST_SIZE);
+}
+
+__attribute__((target("sse2")))
+static void SHA256BatchSSE2(size_t count, const void* const* data, const size_t* lens, unsigned char* out)
+{
+	for (size_t i = 0; i < count; i += 4)
+		SHA256MultiBuffer<uint32x4, 4>(std::min<size_t>(count - i, 4), data + i, lens + i, out + i * SHA256_DIGEST_SIZE);
+}
+#endif
+
 class HashSHA256 : public HashProvider
 {
+	/** Incremental hash, wraps an SHA256Context */
+	class Context : public HashContext
+	{
+		HashSHA256* const prov;
+		SHA256Context ctx;
+
+	 public:
+		Context(HashSHA256* provider) : prov(provider)
+		{
+			prov->SHA256Init(&ctx, NULL);
+		}
+
+		void update(const void* data, size_t len)
+		{
+			prov->SHA256Update(&ctx, (unsigned char*)data, len);
+		}
+
+		void final(unsigned char* out)
+		{
+			prov->SHA256Final(&ctx, out);
+		}
+	};
+
+	typedef void (*BatchFunc)(size_t, const void* const*, const size_t*, unsigned char*);
+
+	/** The multi-buffer implementation supported by this CPU, NULL if there is none */
+	BatchFunc batch;
+
+	/** The four lane implementation, used for batches which would leave most lanes of batch idle */
+	BatchFunc smallbatch;
+
 	void SHA256Init(SHA256Context *ctx, const unsigned int* ikey)
 	{
 		if (ikey)
@@ -155,34 +325,14 @@ class HashSHA256 : public HashProvider
 	void SHA256Transform(SHA256Context *ctx, unsigned char *message, unsigned int block_nb)
 	{
 		uint32_t w[64];
-		uint32_t wv[8];
 		unsigned char *sub_block;
 		for (unsigned int i = 1; i <= block_nb; i++)
 		{
-			int j;
 			sub_block = message + ((i - 1) << 6);
 
-			for (j = 0; j < 16; j++)
+			for (int j = 0; j < 16; j++)
 				PACK32(&sub_block[j << 2], &w[j]);
-			for (j = 16; j < 64; j++)
-				SHA256_SCR(j);
-			for (j = 0; j < 8; j++)
-				wv[j] = ctx->h[j];
-			for (j = 0; j < 64; j++)
-			{
-				uint32_t t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6]) + sha256_k[j] + w[j];
-				uint32_t t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
-				wv[7] = wv[6];
-				wv[6] = wv[5];
-				wv[5] = wv[4];
-				wv[4] = wv[3] + t1;
-				wv[3] = wv[2];
-				wv[2] = wv[1];
-				wv[1] = wv[0];
-				wv[0] = t1 + t2;
-			}
-			for (j = 0; j < 8; j++)
-				ctx->h[j] += wv[j];
+			SHA256Rounds<uint32_t>(ctx->h, w);
 		}
 	}
 
@@ -254,7 +404,47 @@ class HashSHA256 : public HashProvider
 		return std::string((char*)bytes, SHA256_DIGEST_SIZE);
 	}
 
-	HashSHA256(Module* parent) : HashProvider(parent, "hash/sha256", 32, 64) {}
+	void rawsum(const void* data, size_t len, unsigned char* out)
+	{
+		SHA256(static_cast<const char*>(data), out, len);
+	}
+
+	HashContext* init()
+	{
+		return new Context(this);
+	}
+
+	void batchsum(size_t count, const void* const* data, const size_t* lens, unsigned char* out)
+	{
+		if (smallbatch && count > 1 && count <= 4)
+			smallbatch(count, data, lens, out);
+		else if (batch && count > 1)
+			batch(count, data, lens, out);
+		else
+			HashProvider::batchsum(count, data, lens, out);
+	}
+
+	/** The name of the instruction set used by batchsum() */
+	const char* implementation;
+
+	HashSHA256(Module* parent) : HashProvider(parent, "hash/sha256", 32, 64), batch(NULL), smallbatch(NULL), implementation("scalar")
+	{
+#ifdef SHA256_MULTIBUFFER
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			batch = SHA256BatchAVX2;
+			implementation = "AVX2";
+		}
+		else if (__builtin_cpu_supports("sse2"))
+		{
+			batch = SHA256BatchSSE2;
+			implementation = "SSE2";
+		}
+		if (batch)
+			smallbatch = SHA256BatchSSE2;
+#endif
+	}
 };
 
 class ModuleSHA256 : public Module
@@ -265,6 +455,52 @@ class ModuleSHA256 : public Module
 	{
 	}
 
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		const size_t count = 1000000;
+		const size_t batchsize = 64;
+		std::cout << "\nm_sha256: benchmarking " << count << " hashes, batches use " << sha.implementation << "\n";
+
+		const size_t sizes[] = { 24, 64, 256 };
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			// Distinct messages of the same size, like a burst of HMAC challenges or password checks
+			std::vector<std::string> messages(batchsize);
+			std::vector<const void*> data(batchsize);
+			std::vector<size_t> lens(batchsize, sizes[s]);
+			for (size_t i = 0; i < batchsize; i++)
+			{
+				messages[i] = std::string(sizes[s], static_cast<char>('a' + i % 26));
+				messages[i][0] = static_cast<char>(i);
+				data[i] = messages[i].data();
+			}
+			std::vector<unsigned char> single(batchsize * SHA256_DIGEST_SIZE);
+			std::vector<unsigned char> batched(batchsize * SHA256_DIGEST_SIZE);
+
+			double start = GetTime();
+			for (size_t n = 0; n < count; n += batchsize)
+			{
+				for (size_t i = 0; i < batchsize; i++)
+					sha.rawsum(data[i], lens[i], &single[i * SHA256_DIGEST_SIZE]);
+			}
+			double scalar = GetTime() - start;
+
+			start = GetTime();
+			for (size_t n = 0; n < count; n += batchsize)
+				sha.batchsum(batchsize, &data[0], &lens[0], &batched[0]);
+			double multi = GetTime() - start;
+
+			std::cout << sizes[s] << " byte messages: " << (count / scalar) << " hashes/s one at a time, "
+				<< (count / multi) << " hashes/s batched" << (single == batched ? "" : ", RESULTS DIFFER") << "\n";
+		}
+	}
+
+	static double GetTime()
+	{
+		ServerInstance->UpdateTime();
+		return ServerInstance->Time() + ServerInstance->Time_ns() / 1000000000.0;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Implements SHA-256 hashing", VF_VENDOR);
@@ -140,6 +140,11 @@ void TreeSocket::SendCapabilities(int phase)
 	if (proto_version == 1202)
 		extra.append(" PROTOCOL="+ConvToStr(ProtocolVersion));
 
+	/* Offer compression if this link is hooked by a compression module */
+	CompressIOHook* compress = GetCompressHook();
+	if (compress)
+		extra.append(" COMPRESS=" + compress->algorithm);
+
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
 			" CHANMAX="+ConvToStr(ServerInstance->Config->Limits.ChanMax)+
@@ -186,6 +191,14 @@ void TreeSocket::ListDifference(const std::string &one, const std::string &two,
 	}
 }
 
+CompressIOHook* TreeSocket::GetCompressHook()
+{
+	IOHook* hook = GetIOHook();
+	if ((!hook) || (hook->type != IOHook::IOH_COMPRESS))
+		return NULL;
+	return static_cast<CompressIOHook*>(hook);
+}
+
 bool TreeSocket::Capab(const parameterlist &params)
 {
 	if (params.size() < 1)
@@ -310,6 +323,19 @@ bool TreeSocket::Capab(const parameterlist &params)
 				reason = "One or more of the user modes on the remote server are invalid on this server.";
 		}
 
+		/* Both sides offered the same compression algorithm, everything we send after CAPAB COMPRESS is compressed */
+		std::map<std::string,std::string>::iterator z = this->capab->CapKeys.find("COMPRESS");
+		CompressIOHook* compress = GetCompressHook();
+		if ((reason.empty()) && (compress) && (z != this->capab->CapKeys.end()) && (z->second == compress->algorithm))
+		{
+			this->WriteLine("CAPAB COMPRESS");
+			if (!compress->StartCompress(this))
+			{
+				this->SendError("CAPAB negotiation failed: Unable to start compression");
+				return false;
+			}
+		}
+
 		/* Challenge response, store their challenge for our password */
 		std::map<std::string,std::string>::iterator n = this->capab->CapKeys.find("CHALLENGE");
 		if (Utils->ChallengeResponse && (n != this->capab->CapKeys.end()) && (ServerInstance->Modules->Find("m_sha256.so")))
@@ -370,6 +396,16 @@ bool TreeSocket::Capab(const parameterlist &params)
 	{
 		capab->UserModes = params[1];
 	}
+	else if (params[0] == "COMPRESS")
+	{
+		/* Everything after this line is compressed */
+		CompressIOHook* compress = GetCompressHook();
+		if ((!compress) || (!compress->StartDecompress(this, recvq)))
+		{
+			this->SendError("CAPAB negotiation failed: Unable to start decompression");
+			return false;
+		}
+	}
 	else if ((params[0] == "CAPABILITIES") && (params.size() == 2))
 	{
 		irc::tokenstream capabs(params[1]);
@@ -138,7 +138,15 @@ class CommandFJoin : public ServerCommand
 	 * @param newname The new name of the channel; must be the same or a case change of the current name
 	 */
 	static void LowerTS(Channel* chan, time_t TS, const std::string& newname);
-	bool ProcessModeUUIDPair(const std::string& item, TreeSocket* src_socket, Channel* chan, irc::modestacker* modestack);
+
+	/** Checks a 'modes,uuid' pair from an FJOIN and adds the user to the list of users to join
+	 * @param item The pair to check
+	 * @param src_socket The link the FJOIN came from, users behind other links are ignored
+	 * @param modestack The modes of the user are pushed here, NULL to ignore them
+	 * @param joins The list of users to join
+	 * @return False if the pair has an unknown mode letter and the link has to be dropped
+	 */
+	bool ProcessModeUUIDPair(const std::string& item, TreeSocket* src_socket, irc::modestacker* modestack, std::vector<User*>& joins);
  public:
 	CommandFJoin(Module* Creator) : ServerCommand(Creator, "FJOIN", 3) { }
 	CmdResult Handle(User* user, std::vector<std::string>& params);
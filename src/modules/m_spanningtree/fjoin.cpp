@@ -151,16 +151,27 @@ CmdResult CommandFJoin::Handle(User* srcuser, std::vector<std::string>& params)
 	irc::modestacker modestack(true);
 	TreeSocket* src_socket = TreeServer::Get(srcuser)->GetSocket();
 
-	/* Now, process every 'modes,uuid' pair */
+	/* Now, process every 'modes,uuid' pair, nobody joins until all of them are checked */
 	irc::tokenstream users(*params.rbegin());
 	std::string item;
+	std::vector<User*> joins;
 	irc::modestacker* modestackptr = (apply_other_sides_modes ? &modestack : NULL);
 	while (users.GetToken(item))
 	{
-		if (!ProcessModeUUIDPair(item, src_socket, chan, modestackptr))
+		if (!ProcessModeUUIDPair(item, src_socket, modestackptr, joins))
 			return CMD_INVALID;
 	}
 
+	/* Join them all at once, the users of servers that are still bursting are passed to modules as such.
+	 * The TreeSocket coalesces the lines every local member gets into one write.
+	 */
+	std::vector<User*> burstjoins;
+	std::vector<User*> otherjoins;
+	for (std::vector<User*>::const_iterator i = joins.begin(); i != joins.end(); ++i)
+		(TreeServer::Get(*i)->bursting ? burstjoins : otherjoins).push_back(*i);
+	chan->ForceJoinUsers(burstjoins, true);
+	chan->ForceJoinUsers(otherjoins, false);
+
 	/* Flush mode stacker if we lost the FJOIN or had equal TS */
 	if (apply_other_sides_modes)
 		CommandFJoin::ApplyModeStack(srcuser, chan, modestack);
@@ -168,7 +179,7 @@ CmdResult CommandFJoin::Handle(User* srcuser, std::vector<std::string>& params)
 	return CMD_SUCCESS;
 }
 
-bool CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeSocket* src_socket, Channel* chan, irc::modestacker* modestack)
+bool CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeSocket* src_socket, irc::modestacker* modestack, std::vector<User*>& joins)
 {
 	std::string::size_type comma = item.find(',');
 
@@ -206,7 +217,7 @@ bool CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeSocket* src_
 		}
 	}
 
-	chan->ForceJoin(who, NULL, route_back_again->bursting);
+	joins.push_back(who);
 	return true;
 }
 
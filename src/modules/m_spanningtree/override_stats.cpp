@@ -23,6 +23,7 @@
 #include "main.h"
 #include "utils.h"
 #include "link.h"
+#include "treeserver.h"
 
 ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &results)
 {
@@ -48,6 +49,27 @@ ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &r
 		}
 		return MOD_RES_DENY;
 	}
+	else if (statschar == 'b')
+	{
+		const TreeServer::ChildServers& children = Utils->TreeRoot->GetChildren();
+		for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
+		{
+			TreeSocket* sock = (*i)->GetSocket();
+			CompressIOHook* compress = sock->GetCompressHook();
+			if (!compress)
+				continue;
+
+			CompressStats stats;
+			compress->GetStats(sock, stats);
+			results.push_back(InspIRCd::Format("%s 249 %s :%s %s sent %llu/%llu (%.1f%%) recv %llu/%llu (%.1f%%) cpu %.3fs",
+				ServerInstance->Config->ServerName.c_str(), user->nick.c_str(), (*i)->GetName().c_str(),
+				stats.compressing ? compress->algorithm.c_str() : "uncompressed",
+				stats.compressed_out, stats.plain_out, stats.GetOutRatio() * 100,
+				stats.compressed_in, stats.plain_in, stats.GetInRatio() * 100,
+				stats.cpu_usec / 1000000.0));
+		}
+		return MOD_RES_DENY;
+	}
 	return MOD_RES_PASSTHRU;
 }
 
@@ -40,6 +40,16 @@ void SpanningTreeProtocolInterface::GetServerList(ServerList& sl)
 		ps.opercount = i->second->OperCount;
 		ps.gecos = i->second->GetDesc();
 		ps.latencyms = i->second->rtt;
+
+		CompressStats stats;
+		TreeSocket* sock = i->second->IsLocal() ? i->second->GetSocket() : NULL;
+		CompressIOHook* compress = sock ? sock->GetCompressHook() : NULL;
+		if (compress)
+			compress->GetStats(sock, stats);
+		ps.compressed = stats.compressing;
+		ps.compressratio_out = stats.GetOutRatio();
+		ps.compressratio_in = stats.GetInRatio();
+		ps.compresscpu = stats.cpu_usec;
 		sl.push_back(ps);
 	}
 }
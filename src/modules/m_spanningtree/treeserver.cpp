@@ -140,23 +140,6 @@ void TreeServer::FinishBurst()
 	AddServerEvent(Utils->Creator, GetName());
 }
 
-int TreeServer::QuitUsers(const std::string &reason)
-{
-	std::string publicreason = ServerInstance->Config->HideSplits ? "*.net *.split" : reason;
-
-	const user_hash& users = *ServerInstance->Users->clientlist;
-	unsigned int original_size = users.size();
-	for (user_hash::const_iterator i = users.begin(); i != users.end(); )
-	{
-		User* user = i->second;
-		// Increment the iterator now because QuitUser() removes the user from the container
-		++i;
-		if (user->server == this)
-			ServerInstance->Users->QuitUser(user, publicreason, &reason);
-	}
-	return original_size - users.size();
-}
-
 void TreeServer::CheckULine()
 {
 	uline = silentuline = false;
@@ -76,8 +76,6 @@ class TreeServer : public Server
 	 */
 	TreeServer(const std::string& Name, const std::string& Desc, const std::string& id, TreeServer* Above, TreeSocket* Sock, bool Hide);
 
-	int QuitUsers(const std::string &reason);
-
 	/** Get route.
 	 * The 'route' is defined as the locally-
 	 * connected server which can be used to reach this server.
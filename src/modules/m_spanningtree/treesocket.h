@@ -25,6 +25,7 @@
 #include "inspircd.h"
 
 #include "utils.h"
+#include "modules/compress.h"
 
 /*
  * The server list in InspIRCd is maintained as two structures
@@ -206,13 +207,19 @@ class TreeSocket : public BufferedSocket
 
 	bool Capab(const parameterlist &params);
 
-	/** This function forces this server to quit, removing this server
-	 * and any users on it (and servers and users below that, etc etc).
-	 * It's very slow and pretty clunky, but luckily unless your network
-	 * is having a REAL bad hair day, this function shouldnt be called
-	 * too many times a month ;-)
+	/** Get the compression hook of this link
+	 * @return The CompressIOHook used by this socket, or NULL if the link is not using one
 	 */
-	void SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, int& num_lost_users);
+	CompressIOHook* GetCompressHook();
+
+	/** Collect the users on a server and on all servers behind it, they are
+	 * quit together by Squit() once the whole lost part of the tree is known.
+	 * @param from The reason of the split
+	 * @param Current The server to collect the users of
+	 * @param num_lost_servers Incremented for each server
+	 * @param lost_users The users found are appended to this
+	 */
+	void SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, std::vector<User*>& lost_users);
 
 	/** This is a wrapper function for SquitServer above, which
 	 * does some validation first and passes on the SQUIT to all
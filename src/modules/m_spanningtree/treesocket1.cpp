@@ -138,27 +138,22 @@ void TreeSocket::SendError(const std::string &errormessage)
 }
 
 /** This function forces this server to quit, removing this server
- * and any users on it (and servers and users below that, etc etc).
- * It's very slow and pretty clunky, but luckily unless your network
- * is having a REAL bad hair day, this function shouldnt be called
- * too many times a month ;-)
+ * and any servers below it. The users on the lost servers are collected
+ * into lost_users so that the caller can quit them in one batch.
  */
-void TreeSocket::SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, int& num_lost_users)
+void TreeSocket::SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, std::vector<User*>& lost_users)
 {
 	ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "SquitServer for %s from %s", Current->GetName().c_str(), from.c_str());
-	/* recursively squit the servers attached to 'Current'.
-	 * We're going backwards so we don't remove users
-	 * while we still need them ;)
-	 */
+	/* recursively collect the servers attached to 'Current' */
 	const TreeServer::ChildServers& children = Current->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
 	{
 		TreeServer* recursive_server = *i;
-		this->SquitServer(from,recursive_server, num_lost_servers, num_lost_users);
+		this->SquitServer(from,recursive_server, num_lost_servers, lost_users);
 	}
-	/* Now we've whacked the kids, whack self */
 	num_lost_servers++;
-	num_lost_users += Current->QuitUsers(from);
+	for (intrusive_list<User>::iterator i = Current->users.begin(); i != Current->users.end(); ++i)
+		lost_users.push_back(*i);
 }
 
 /** This is a wrapper function for SquitServer above, which
@@ -190,13 +185,17 @@ void TreeSocket::Squit(TreeServer* Current, const std::string &reason)
 			ServerInstance->SNO->WriteGlobalSno('L', "Server \002"+Current->GetName()+"\002 split from server \002"+Current->GetParent()->GetName()+"\002 with reason: "+reason);
 		}
 		int num_lost_servers = 0;
-		int num_lost_users = 0;
+		std::vector<User*> lost_users;
 		std::string from = Current->GetParent()->GetName()+" "+Current->GetName();
+		std::string publicreason = ServerInstance->Config->HideSplits ? "*.net *.split" : from;
 
 		ModuleSpanningTree* st = Utils->Creator;
 		st->SplitInProgress = true;
-		SquitServer(from, Current, num_lost_servers, num_lost_users);
+		SquitServer(from, Current, num_lost_servers, lost_users);
+		// Quit everyone at once so local users get all the quits in one write
+		ServerInstance->Users->QuitUsers(lost_users, publicreason, &from);
 		st->SplitInProgress = false;
+		int num_lost_users = lost_users.size();
 
 		ServerInstance->SNO->WriteToSnoMask(LocalSquit ? 'l' : 'L', "Netsplit complete, lost \002%d\002 user%s on \002%d\002 server%s.",
 			num_lost_users, num_lost_users != 1 ? "s" : "", num_lost_servers, num_lost_servers != 1 ? "s" : "");
@@ -238,6 +237,9 @@ CmdResult CommandSQuit::HandleServer(TreeServer* server, std::vector<std::string
 void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
+	// A burst sends many lines to the same local users, e.g. one JOIN per remote user in
+	// each channel, give each of them everything caused by this read in one write
+	WriteCoalescer coalescer;
 	std::string line;
 	while (GetNextLine(line))
 	{
@@ -39,7 +39,7 @@ extern SpanningTreeUtilities* Utils;
 /* This hash_map holds the hash equivalent of the server
  * tree, used for rapid linear lookups.
  */
-typedef TR1NS::unordered_map<std::string, TreeServer*, irc::insensitive, irc::StrHashComp> server_hash;
+typedef irc::insensitive_map<TreeServer*>::type server_hash;
 
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
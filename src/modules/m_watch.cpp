@@ -23,81 +23,163 @@
 #include "inspircd.h"
 
 
-/*
- * Okay, it's nice that this was documented and all, but I at least understood very little
- * of it, so I'm going to attempt to explain the data structures in here a bit more.
- *
- * For efficiency, many data structures are kept.
+/* This module provides a very efficient (in terms of cpu time) implementation of
+ * /WATCH and the IRCv3 /MONITOR command, both backed by the same presence index.
  *
- * The first is a global list `watchentries':
- *	hash_map<irc::string, std::deque<User*> >
+ * The index is a hash_map of every nickname that somebody is watching, to a
+ * WatchedNick record. The record knows which user currently has the nick (if any),
+ * and has a vector of links to everyone watching the nick, one for each command:
  *
- * That is, if nick 'w00t' is being watched by user pointer 'Brain' and 'Om', <w00t, (Brain, Om)>
- * will be in the watchentries list.
+ * KEY: Brain   --->  Online as: Brain!brain@host  Watched by: Boo, w00t  Monitored by: Om
+ * KEY: Boo     --->  Offline                      Watched by: Brain, w00t
  *
- * The second is that each user has a per-user data structure attached to their user record via Extensible:
- *	std::map<irc::string, std::string> watchlist;
- * So, in the above example with w00t watched by Brain and Om, we'd have:
- * 	Brain-
- * 	      `- w00t
- * 	Om-
- * 	   `- w00t
+ * When Brain signs on, changes nick or quits, the notification is formatted once and
+ * then sent to each watcher by reading the links of the record.
  *
- * Hopefully this helps any brave soul that ventures into this file other than me. :-)
- *		-- w00t (mar 30, 2008)
+ * Each user also has a seperate (smaller) list of links for each command attached to
+ * their User whilst they have any entries, sorted by nick for 'WATCH L'. A link knows
+ * its position in the vector of the record, so adding and removing an entry is O(1)
+ * on the index side and does not depend on the number of other watchers. The online
+ * status of a nick is only kept in the record, so nothing has to be updated for each
+ * watcher when somebody signs on or off.
  */
 
+struct WatchedNick;
 
-/* This module has been refactored to provide a very efficient (in terms of cpu time)
- * implementation of /WATCH.
- *
- * To improve the efficiency of watch, many lists are kept. The first primary list is
- * a hash_map of who's being watched by who. For example:
- *
- * KEY: Brain   --->  Watched by:  Boo, w00t, Om
- * KEY: Boo     --->  Watched by:  Brain, w00t
- *
- * This is used when we want to tell all the users that are watching someone that
- * they are now available or no longer available. For example, if the hash was
- * populated as shown above, then when Brain signs on, messages are sent to Boo, w00t
- * and Om by reading their 'watched by' list. When this occurs, their online status
- * in each of these users lists (see below) is also updated.
- *
- * Each user also has a seperate (smaller) map attached to their User whilst they
- * have any watch entries, which is managed by class Extensible. When they add or remove
- * a watch entry from their list, it is inserted here, as well as the main list being
- * maintained. This map also contains the user's online status. For users that are
- * offline, the key points at an empty string, and for users that are online, the key
- * points at a string containing "users-ident users-host users-signon-time". This is
- * stored in this manner so that we don't have to FindUser() to fetch this info, the
- * users signon can populate the field for us.
- *
- * For example, going again on the example above, this would be w00t's watchlist:
- *
- * KEY: Boo    --->  Status: "Boo brains.sexy.babe 535342348"
- * KEY: Brain  --->  Status: ""
- *
- * In this list we can see that Boo is online, and Brain is offline. We can then
- * use this list for 'WATCH L', and 'WATCH S' can be implemented as a combination
- * of the above two data structures, with minimum CPU penalty for doing so.
- *
- * In short, the least efficient this ever gets is O(n), and thats only because
- * there are parts that *must* loop (e.g. telling all users that are watching a
- * nick that the user online), however this is a *major* improvement over the
- * 1.0 implementation, which in places had O(n^n) and worse in it, because this
- * implementation scales based upon the sizes of the watch entries, whereas the
- * old system would scale (or not as the case may be) according to the total number
- * of users using WATCH.
+/** A user watching a nick with either WATCH or MONITOR
  */
+struct WatchLink
+{
+	WatchedNick* entry;
+	User* watcher;
+	bool monitor;
+	/** Position of this link in the vector of the entry */
+	size_t pos;
+};
+
+/** A nick that somebody is watching
+ */
+struct WatchedNick
+{
+	irc::string nick;
+	/** The user who currently has the nick, NULL if nobody does */
+	User* user;
+	std::vector<WatchLink*> watchers;
+	std::vector<WatchLink*> monitors;
+
+	WatchedNick() : user(NULL) { }
+
+	std::vector<WatchLink*>& GetLinks(bool monitor) { return (monitor ? monitors : watchers); }
+};
+
+/** The presence index, which maps every watched nick to the users watching it
+ */
+class PresenceIndex
+{
+	typedef TR1NS::unordered_map<irc::string, WatchedNick, irc::hash> EntryMap;
+	EntryMap entries;
+
+ public:
+	WatchedNick* Find(const irc::string& nick)
+	{
+		EntryMap::iterator it = entries.find(nick);
+		return (it != entries.end() ? &it->second : NULL);
+	}
+
+	WatchLink* Add(const irc::string& nick, User* watcher, bool monitor)
+	{
+		std::pair<EntryMap::iterator, bool> ret = entries.insert(std::make_pair(nick, WatchedNick()));
+		WatchedNick* entry = &ret.first->second;
+		if (ret.second)
+		{
+			entry->nick = nick;
+			User* target = ServerInstance->FindNick(nick.c_str());
+			if ((target) && (target->registered == REG_ALL))
+				entry->user = target;
+		}
 
-typedef TR1NS::unordered_map<irc::string, std::deque<User*>, irc::hash> watchentries;
-typedef std::map<irc::string, std::string> watchlist;
+		std::vector<WatchLink*>& links = entry->GetLinks(monitor);
+		WatchLink* link = new WatchLink;
+		link->entry = entry;
+		link->watcher = watcher;
+		link->monitor = monitor;
+		link->pos = links.size();
+		links.push_back(link);
+		return link;
+	}
+
+	void Remove(WatchLink* link)
+	{
+		WatchedNick* entry = link->entry;
+		std::vector<WatchLink*>& links = entry->GetLinks(link->monitor);
 
-/* Who's watching each nickname.
+		// Move the last link into the gap
+		links[link->pos] = links.back();
+		links[link->pos]->pos = link->pos;
+		links.pop_back();
+		delete link;
+
+		if ((entry->watchers.empty()) && (entry->monitors.empty()))
+		{
+			irc::string nick = entry->nick;
+			entries.erase(nick);
+		}
+	}
+};
+
+/* The index of the nickname everyone is watching.
  * NOTE: We do NOT iterate this to display a user's WATCH list!
  * See the comments above!
  */
-watchentries* whos_watching_me;
+static PresenceIndex* presence;
+
+/** The entries of a user on either their WATCH or MONITOR list
+ */
+struct WatchList
+{
+	typedef std::map<irc::string, WatchLink*> LinkMap;
+	LinkMap links;
+
+	~WatchList()
+	{
+		for (LinkMap::iterator i = links.begin(); i != links.end(); ++i)
+			presence->Remove(i->second);
+	}
+};
+
+/** Get the "ident host signon" part of the WATCH numerics for an online user
+ */
+static std::string WatchStatus(User* user)
+{
+	return std::string(user->ident).append(" ").append(user->dhost).append(" ").append(ConvToStr(user->age));
+}
+
+/** Send the same numeric to every local user in a list of links, like User::WriteNumeric() does
+ * @param links The links to the users to send the numeric to
+ * @param numeric The numeric to send
+ * @param text The text following the nick of the recipient
+ */
+static void WriteNumericToLinks(const std::vector<WatchLink*>& links, unsigned int numeric, const std::string& text)
+{
+	if (links.empty())
+		return;
+
+	// Format everything except the nick of the recipient just once
+	const std::string prefix = InspIRCd::Format(":%s %03u ", ServerInstance->Config->ServerName.c_str(), numeric);
+	for (std::vector<WatchLink*>::const_iterator i = links.begin(); i != links.end(); ++i)
+	{
+		User* watcher = (*i)->watcher;
+		if (!IS_LOCAL(watcher))
+			continue;
+
+		ModResult MOD_RESULT;
+		FIRST_MOD_RESULT(OnNumeric, MOD_RESULT, (watcher, numeric, text));
+		if (MOD_RESULT == MOD_RES_DENY)
+			continue;
+
+		watcher->Write(prefix + watcher->nick + " " + text);
+	}
+}
 
 class CommandSVSWatch : public Command
 {
@@ -140,7 +222,7 @@ class CommandWatch : public Command
 {
 	unsigned int& MAX_WATCH;
  public:
-	SimpleExtItem<watchlist> ext;
+	SimpleExtItem<WatchList> ext;
 	CmdResult remove_watch(User* user, const char* nick)
 	{
 		// removing an item from the list
@@ -150,43 +232,28 @@ class CommandWatch : public Command
 			return CMD_FAILURE;
 		}
 
-		watchlist* wl = ext.get(user);
+		WatchList* wl = ext.get(user);
 		if (wl)
 		{
 			/* Yup, is on my list */
-			watchlist::iterator n = wl->find(nick);
-
-			if (!wl)
-				return CMD_FAILURE;
-
-			if (n != wl->end())
+			WatchList::LinkMap::iterator n = wl->links.find(nick);
+			if (n != wl->links.end())
 			{
-				if (!n->second.empty())
-					user->WriteNumeric(602, "%s %s :stopped watching", n->first.c_str(), n->second.c_str());
+				User* target = n->second->entry->user;
+				if (target)
+					user->WriteNumeric(602, "%s %s :stopped watching", n->first.c_str(), WatchStatus(target).c_str());
 				else
 					user->WriteNumeric(602, "%s * * 0 :stopped watching", nick);
 
-				wl->erase(n);
+				/* I'm no longer watching you... */
+				presence->Remove(n->second);
+				wl->links.erase(n);
 			}
 
-			if (wl->empty())
+			if (wl->links.empty())
 			{
 				ext.unset(user);
 			}
-
-			watchentries::iterator x = whos_watching_me->find(nick);
-			if (x != whos_watching_me->end())
-			{
-				/* People are watching this user, am i one of them? */
-				std::deque<User*>::iterator n2 = std::find(x->second.begin(), x->second.end(), user);
-				if (n2 != x->second.end())
-					/* I'm no longer watching you... */
-					x->second.erase(n2);
-
-				if (x->second.empty())
-					/* nobody else is, either. */
-					whos_watching_me->erase(nick);
-			}
 		}
 
 		return CMD_SUCCESS;
@@ -200,41 +267,30 @@ class CommandWatch : public Command
 			return CMD_FAILURE;
 		}
 
-		watchlist* wl = ext.get(user);
+		WatchList* wl = ext.get(user);
 		if (!wl)
 		{
-			wl = new watchlist();
+			wl = new WatchList();
 			ext.set(user, wl);
 		}
 
-		if (wl->size() == MAX_WATCH)
+		if (wl->links.size() == MAX_WATCH)
 		{
 			user->WriteNumeric(512, "%s :Too many WATCH entries", nick);
 			return CMD_FAILURE;
 		}
 
-		watchlist::iterator n = wl->find(nick);
-		if (n == wl->end())
+		WatchList::LinkMap::iterator n = wl->links.find(nick);
+		if (n == wl->links.end())
 		{
 			/* Don't already have the user on my watch list, proceed */
-			watchentries::iterator x = whos_watching_me->find(nick);
-			if (x != whos_watching_me->end())
-			{
-				/* People are watching this user, add myself */
-				x->second.push_back(user);
-			}
-			else
-			{
-				std::deque<User*> newlist;
-				newlist.push_back(user);
-				(*(whos_watching_me))[nick] = newlist;
-			}
+			WatchLink* link = presence->Add(nick, user, false);
+			wl->links.insert(std::make_pair(nick, link));
 
-			User* target = ServerInstance->FindNick(nick);
+			User* target = link->entry->user;
 			if (target)
 			{
-				(*wl)[nick] = std::string(target->ident).append(" ").append(target->dhost).append(" ").append(ConvToStr(target->age));
-				user->WriteNumeric(604, "%s %s :is online", nick, (*wl)[nick].c_str());
+				user->WriteNumeric(604, "%s %s :is online", nick, WatchStatus(target).c_str());
 				if (target->IsAway())
 				{
 					user->WriteNumeric(609, "%s %s %s %lu :is away", target->nick.c_str(), target->ident.c_str(), target->dhost.c_str(), (unsigned long) target->awaytime);
@@ -242,7 +298,6 @@ class CommandWatch : public Command
 			}
 			else
 			{
-				(*wl)[nick].clear();
 				user->WriteNumeric(605, "%s * * 0 :is offline", nick);
 			}
 		}
@@ -259,13 +314,14 @@ class CommandWatch : public Command
 	{
 		if (parameters.empty())
 		{
-			watchlist* wl = ext.get(user);
+			WatchList* wl = ext.get(user);
 			if (wl)
 			{
-				for (watchlist::iterator q = wl->begin(); q != wl->end(); q++)
+				for (WatchList::LinkMap::iterator q = wl->links.begin(); q != wl->links.end(); q++)
 				{
-					if (!q->second.empty())
-						user->WriteNumeric(604, "%s %s :is online", q->first.c_str(), q->second.c_str());
+					User* target = q->second->entry->user;
+					if (target)
+						user->WriteNumeric(604, "%s %s :is online", q->first.c_str(), WatchStatus(target).c_str());
 				}
 			}
 			user->WriteNumeric(607, ":End of WATCH list");
@@ -278,40 +334,19 @@ class CommandWatch : public Command
 				if (!strcasecmp(nick,"C"))
 				{
 					// watch clear
-					watchlist* wl = ext.get(user);
-					if (wl)
-					{
-						for (watchlist::iterator i = wl->begin(); i != wl->end(); i++)
-						{
-							watchentries::iterator i2 = whos_watching_me->find(i->first);
-							if (i2 != whos_watching_me->end())
-							{
-								/* People are watching this user, am i one of them? */
-								std::deque<User*>::iterator n = std::find(i2->second.begin(), i2->second.end(), user);
-								if (n != i2->second.end())
-									/* I'm no longer watching you... */
-									i2->second.erase(n);
-
-								if (i2->second.empty())
-									/* nobody else is, either. */
-									whos_watching_me->erase(i2);
-							}
-						}
-
-						ext.unset(user);
-					}
+					ext.unset(user);
 				}
 				else if (!strcasecmp(nick,"L"))
 				{
-					watchlist* wl = ext.get(user);
+					WatchList* wl = ext.get(user);
 					if (wl)
 					{
-						for (watchlist::iterator q = wl->begin(); q != wl->end(); q++)
+						for (WatchList::LinkMap::iterator q = wl->links.begin(); q != wl->links.end(); q++)
 						{
-							if (!q->second.empty())
+							User* targ = q->second->entry->user;
+							if (targ)
 							{
-								user->WriteNumeric(604, "%s %s :is online", q->first.c_str(), q->second.c_str());
-								User *targ = ServerInstance->FindNick(q->first.c_str());
+								user->WriteNumeric(604, "%s %s :is online", q->first.c_str(), WatchStatus(targ).c_str());
 								if (targ->IsAway())
 								{
 									user->WriteNumeric(609, "%s %s %s %lu :is away", targ->nick.c_str(), targ->ident.c_str(), targ->dhost.c_str(), (unsigned long) targ->awaytime);
@@ -325,21 +360,21 @@ class CommandWatch : public Command
 				}
 				else if (!strcasecmp(nick,"S"))
 				{
-					watchlist* wl = ext.get(user);
+					WatchList* wl = ext.get(user);
 					int you_have = 0;
 					int youre_on = 0;
 					std::string list;
 
 					if (wl)
 					{
-						for (watchlist::iterator q = wl->begin(); q != wl->end(); q++)
+						for (WatchList::LinkMap::iterator q = wl->links.begin(); q != wl->links.end(); q++)
 							list.append(q->first.c_str()).append(" ");
-						you_have = wl->size();
+						you_have = wl->links.size();
 					}
 
-					watchentries::iterator i2 = whos_watching_me->find(user->nick.c_str());
-					if (i2 != whos_watching_me->end())
-						youre_on = i2->second.size();
+					WatchedNick* entry = presence->Find(user->nick.c_str());
+					if (entry)
+						youre_on = entry->watchers.size();
 
 					user->WriteNumeric(603, ":You have %d and are on %d WATCH entries", you_have, youre_on);
 					user->WriteNumeric(606, ":%s", list.c_str());
@@ -361,167 +396,242 @@ class CommandWatch : public Command
 	}
 };
 
-class Modulewatch : public Module
+/** Handle /MONITOR, as described by the IRCv3 monitor specification
+ */
+class CommandMonitor : public SplitCommand
 {
-	unsigned int maxwatch;
-	CommandWatch cmdw;
-	CommandSVSWatch sw;
-
- public:
-	Modulewatch()
-		: maxwatch(32), cmdw(this, maxwatch), sw(this)
-	{
-		whos_watching_me = new watchentries();
-	}
+	unsigned int& maxmonitor;
 
-	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	/** Collects nicks or masks into as few numerics as possible */
+	class NumericBuilder
 	{
-		maxwatch = ServerInstance->Config->ConfValue("watch")->getInt("maxentries", 32);
-		if (!maxwatch)
-			maxwatch = 32;
-	}
+		User* const user;
+		const unsigned int numeric;
+		std::string list;
 
-	ModResult OnSetAway(User *user, const std::string &awaymsg) CXX11_OVERRIDE
-	{
-		std::string numeric;
-		int inum;
+	 public:
+		NumericBuilder(User* u, unsigned int num) : user(u), numeric(num) { }
+		~NumericBuilder() { Flush(); }
 
-		if (awaymsg.empty())
+		void Add(const std::string& item)
 		{
-			numeric = user->nick + " " + user->ident + " " + user->dhost + " " + ConvToStr(ServerInstance->Time()) + " :is no longer away";
-			inum = 599;
+			if (list.length() + item.length() > 400)
+				Flush();
+			if (!list.empty())
+				list.push_back(',');
+			list.append(item);
 		}
-		else
+
+		void Flush()
 		{
-			numeric = user->nick + " " + user->ident + " " + user->dhost + " " + ConvToStr(ServerInstance->Time()) + " :" + awaymsg;
-			inum = 598;
+			if (!list.empty())
+				user->WriteNumeric(numeric, ":" + list);
+			list.clear();
 		}
+	};
 
-		watchentries::iterator x = whos_watching_me->find(user->nick.c_str());
-		if (x != whos_watching_me->end())
+	void ShowStatus(User* user, WatchList* ml)
+	{
+		NumericBuilder online(user, 730);
+		NumericBuilder offline(user, 731);
+		for (WatchList::LinkMap::iterator i = ml->links.begin(); i != ml->links.end(); ++i)
 		{
-			for (std::deque<User*>::iterator n = x->second.begin(); n != x->second.end(); n++)
-			{
-				(*n)->WriteNumeric(inum, numeric);
-			}
+			User* target = i->second->entry->user;
+			if (target)
+				online.Add(target->GetFullHost());
+			else
+				offline.Add(i->first.c_str());
 		}
+	}
 
-		return MOD_RES_PASSTHRU;
+ public:
+	SimpleExtItem<WatchList> ext;
+
+	CommandMonitor(Module* parent, unsigned int& maxentries) : SplitCommand(parent, "MONITOR", 1), maxmonitor(maxentries), ext("monitorlist", parent)
+	{
+		syntax = "[C|L|S]|[+|-<nick>[,<nick>]+]";
 	}
 
-	void OnUserQuit(User* user, const std::string &reason, const std::string &oper_message) CXX11_OVERRIDE
+	CmdResult HandleLocal(const std::vector<std::string>& parameters, LocalUser* user)
 	{
-		watchentries::iterator x = whos_watching_me->find(user->nick.c_str());
-		if (x != whos_watching_me->end())
+		char subcmd = parameters[0][0];
+		WatchList* ml = ext.get(user);
+
+		if ((subcmd == '+') && (parameters.size() > 1))
 		{
-			for (std::deque<User*>::iterator n = x->second.begin(); n != x->second.end(); n++)
+			if (!ml)
+			{
+				ml = new WatchList();
+				ext.set(user, ml);
+			}
+
+			NumericBuilder online(user, 730);
+			NumericBuilder offline(user, 731);
+			irc::commasepstream targets(parameters[1]);
+			std::string target;
+			while (targets.GetToken(target))
 			{
-				(*n)->WriteNumeric(601, "%s %s %s %lu :went offline", user->nick.c_str(), user->ident.c_str(), user->dhost.c_str(), (unsigned long) ServerInstance->Time());
+				if ((target.empty()) || (!ServerInstance->IsNick(target.c_str())))
+					continue;
+				if (ml->links.find(target.c_str()) != ml->links.end())
+					continue;
 
-				watchlist* wl = cmdw.ext.get(*n);
-				if (wl)
-					/* We were on somebody's notify list, set ourselves offline */
-					(*wl)[user->nick.c_str()].clear();
+				if (ml->links.size() >= maxmonitor)
+				{
+					online.Flush();
+					offline.Flush();
+					std::string rest = target;
+					if (!targets.StreamEnd())
+						rest.append(",").append(targets.GetRemaining());
+					user->WriteNumeric(734, "%u %s :Monitor list is full.", maxmonitor, rest.c_str());
+					break;
+				}
+
+				WatchLink* link = presence->Add(target.c_str(), user, true);
+				ml->links.insert(std::make_pair(irc::string(target.c_str()), link));
+				if (link->entry->user)
+					online.Add(link->entry->user->GetFullHost());
+				else
+					offline.Add(target);
 			}
 		}
-
-		/* Now im quitting, if i have a notify list, im no longer watching anyone */
-		watchlist* wl = cmdw.ext.get(user);
-		if (wl)
+		else if ((subcmd == '-') && (parameters.size() > 1))
 		{
-			/* Iterate every user on my watch list, and take me out of the whos_watching_me map for each one we're watching */
-			for (watchlist::iterator i = wl->begin(); i != wl->end(); i++)
+			if (ml)
 			{
-				watchentries::iterator i2 = whos_watching_me->find(i->first);
-				if (i2 != whos_watching_me->end())
+				irc::commasepstream targets(parameters[1]);
+				std::string target;
+				while (targets.GetToken(target))
 				{
-						/* People are watching this user, am i one of them? */
-						std::deque<User*>::iterator n = std::find(i2->second.begin(), i2->second.end(), user);
-						if (n != i2->second.end())
-							/* I'm no longer watching you... */
-							i2->second.erase(n);
-
-						if (i2->second.empty())
-							/* and nobody else is, either. */
-							whos_watching_me->erase(i2);
+					WatchList::LinkMap::iterator it = ml->links.find(target.c_str());
+					if (it == ml->links.end())
+						continue;
+					presence->Remove(it->second);
+					ml->links.erase(it);
 				}
 			}
 		}
+		else if ((subcmd == 'C') || (subcmd == 'c'))
+		{
+			ml = NULL;
+		}
+		else if ((subcmd == 'L') || (subcmd == 'l'))
+		{
+			if (ml)
+			{
+				NumericBuilder list(user, 732);
+				for (WatchList::LinkMap::iterator i = ml->links.begin(); i != ml->links.end(); ++i)
+					list.Add(i->first.c_str());
+			}
+			user->WriteNumeric(733, ":End of MONITOR list");
+		}
+		else if ((subcmd == 'S') || (subcmd == 's'))
+		{
+			if (ml)
+				ShowStatus(user, ml);
+		}
+		else
+			return CMD_FAILURE;
+
+		if ((!ml) || (ml->links.empty()))
+			ext.unset(user);
+		return CMD_SUCCESS;
 	}
+};
 
-	void OnGarbageCollect()
+class Modulewatch : public Module
+{
+	unsigned int maxwatch;
+	CommandWatch cmdw;
+	CommandMonitor cmdm;
+	CommandSVSWatch sw;
+
+	/** Tell everyone watching a nick that it is now in use by a user */
+	void SetOnline(User* user)
 	{
-		watchentries* old_watch = whos_watching_me;
-		whos_watching_me = new watchentries();
+		WatchedNick* entry = presence->Find(user->nick.c_str());
+		if (!entry)
+			return;
 
-		for (watchentries::const_iterator n = old_watch->begin(); n != old_watch->end(); n++)
-			whos_watching_me->insert(*n);
+		entry->user = user;
+		WriteNumericToLinks(entry->watchers, 600, user->nick + " " + WatchStatus(user) + " :arrived online");
+		WriteNumericToLinks(entry->monitors, 730, ":" + user->GetFullHost());
+	}
 
-		delete old_watch;
+	/** Tell everyone watching a nick that it is no longer in use by a user */
+	void SetOffline(User* user, const std::string& nick, time_t when)
+	{
+		WatchedNick* entry = presence->Find(nick.c_str());
+		if ((!entry) || (entry->user != user))
+			return;
+
+		entry->user = NULL;
+		WriteNumericToLinks(entry->watchers, 601, nick + " " + user->ident + " " + user->dhost + " " + ConvToStr(when) + " :went offline");
+		WriteNumericToLinks(entry->monitors, 731, ":" + nick);
 	}
 
-	void OnPostConnect(User* user) CXX11_OVERRIDE
+ public:
+	Modulewatch()
+		: maxwatch(32), cmdw(this, maxwatch), cmdm(this, maxwatch), sw(this)
 	{
-		watchentries::iterator x = whos_watching_me->find(user->nick.c_str());
-		if (x != whos_watching_me->end())
-		{
-			for (std::deque<User*>::iterator n = x->second.begin(); n != x->second.end(); n++)
-			{
-				(*n)->WriteNumeric(600, "%s %s %s %lu :arrived online", user->nick.c_str(), user->ident.c_str(), user->dhost.c_str(), (unsigned long) user->age);
+		presence = new PresenceIndex();
+	}
 
-				watchlist* wl = cmdw.ext.get(*n);
-				if (wl)
-					/* We were on somebody's notify list, set ourselves online */
-					(*wl)[user->nick.c_str()] = std::string(user->ident).append(" ").append(user->dhost).append(" ").append(ConvToStr(user->age));
-			}
-		}
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		maxwatch = ServerInstance->Config->ConfValue("watch")->getInt("maxentries", 32);
+		if (!maxwatch)
+			maxwatch = 32;
 	}
 
-	void OnUserPostNick(User* user, const std::string &oldnick) CXX11_OVERRIDE
+	ModResult OnSetAway(User *user, const std::string &awaymsg) CXX11_OVERRIDE
 	{
-		watchentries::iterator new_offline = whos_watching_me->find(oldnick.c_str());
-		watchentries::iterator new_online = whos_watching_me->find(user->nick.c_str());
+		WatchedNick* entry = presence->Find(user->nick.c_str());
+		if (!entry)
+			return MOD_RES_PASSTHRU;
 
-		if (new_offline != whos_watching_me->end())
-		{
-			for (std::deque<User*>::iterator n = new_offline->second.begin(); n != new_offline->second.end(); n++)
-			{
-				watchlist* wl = cmdw.ext.get(*n);
-				if (wl)
-				{
-					(*n)->WriteNumeric(601, "%s %s %s %lu :went offline", oldnick.c_str(), user->ident.c_str(), user->dhost.c_str(), (unsigned long) user->age);
-					(*wl)[oldnick.c_str()].clear();
-				}
-			}
-		}
+		if (awaymsg.empty())
+			WriteNumericToLinks(entry->watchers, 599, user->nick + " " + user->ident + " " + user->dhost + " " + ConvToStr(ServerInstance->Time()) + " :is no longer away");
+		else
+			WriteNumericToLinks(entry->watchers, 598, user->nick + " " + user->ident + " " + user->dhost + " " + ConvToStr(ServerInstance->Time()) + " :" + awaymsg);
 
-		if (new_online != whos_watching_me->end())
-		{
-			for (std::deque<User*>::iterator n = new_online->second.begin(); n != new_online->second.end(); n++)
-			{
-				watchlist* wl = cmdw.ext.get(*n);
-				if (wl)
-				{
-					(*wl)[user->nick.c_str()] = std::string(user->ident).append(" ").append(user->dhost).append(" ").append(ConvToStr(user->age));
-					(*n)->WriteNumeric(600, "%s %s :arrived online", user->nick.c_str(), (*wl)[user->nick.c_str()].c_str());
-				}
-			}
-		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUserQuit(User* user, const std::string &reason, const std::string &oper_message) CXX11_OVERRIDE
+	{
+		SetOffline(user, user->nick, ServerInstance->Time());
+
+		/* Now im quitting, if i have a notify list, im no longer watching anyone */
+		cmdw.ext.unset(user);
+		cmdm.ext.unset(user);
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		SetOnline(user);
+	}
+
+	void OnUserPostNick(User* user, const std::string &oldnick) CXX11_OVERRIDE
+	{
+		SetOffline(user, oldnick, user->age);
+		SetOnline(user);
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["WATCH"] = ConvToStr(maxwatch);
+		tokens["MONITOR"] = ConvToStr(maxwatch);
 	}
 
 	~Modulewatch()
 	{
-		delete whos_watching_me;
+		delete presence;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
 	{
-		return Version("Provides support for the /WATCH command", VF_OPTCOMMON | VF_VENDOR);
+		return Version("Provides support for the /WATCH and /MONITOR commands", VF_OPTCOMMON | VF_VENDOR);
 	}
 };
 
@@ -20,153 +20,358 @@
 
 #include "inspircd.h"
 #include "xline.h"
+#include "threadengine.h"
 #include <fstream>
+#include <iostream>
 
-class ModuleXLineDB : public Module
+/*
+ * The database consists of two files. The snapshot (xline.db) holds every line that
+ * existed when it was last written, and the journal (xline.db.journal) has one record
+ * appended for every line added, removed or expired since then:
+ *
+ *   LINE <type> <mask> <source> <set time> <duration> <reason>
+ *   DEL <type> <mask>
+ *
+ * Once the journal has grown large enough it is renamed to xline.db.journal.compact and
+ * a worker thread merges it into a new snapshot, reading only the two files. On startup
+ * the snapshot is loaded and both journals are replayed on top of it; replaying a
+ * record twice does no harm, so a crash at any point leaves a usable database.
+ */
+
+/** Format a LINE record
+ */
+static std::string FormatLine(const std::string& type, const std::string& mask, time_t set_time, long duration, const std::string& reason)
 {
-	bool dirty;
-	std::string xlinedbpath;
- public:
-	void init() CXX11_OVERRIDE
-	{
-		/* Load the configuration
-		 * Note:
-		 * 		This is on purpose not changed on a rehash. It would be non-trivial to change the database on-the-fly.
-		 * 		Imagine a scenario where the new file already exists. Merging the current XLines with the existing database is likely a bad idea
-		 * 		...and so is discarding all current in-memory XLines for the ones in the database.
-		 */
-		ConfigTag* Conf = ServerInstance->Config->ConfValue("xlinedb");
-		xlinedbpath = ServerInstance->Config->Paths.PrependData(Conf->getString("filename", "xline.db"));
+	std::string record("LINE ");
+	record.append(type).append(" ").append(mask).append(" ").append(ServerInstance->Config->ServerName).append(" ")
+		.append(ConvToStr(set_time)).append(" ").append(ConvToStr(duration)).append(" ").append(reason).append("\n");
+	return record;
+}
+
+/** Split a record into the parts needed to merge it
+ * @return The record type, LINE or DEL, or an empty string for anything else
+ */
+static std::string ParseRecord(const std::string& record, std::string& type, irc::string& mask, time_t& expiry)
+{
+	irc::spacesepstream tokens(record);
+	std::string cmd, tmp;
+	tokens.GetToken(cmd);
+	if ((cmd != "LINE") && (cmd != "DEL"))
+		return "";
 
-		// Read xlines before attaching to events
-		ReadDatabase();
+	tokens.GetToken(type);
+	tokens.GetToken(tmp);
+	mask = tmp.c_str();
 
-		dirty = false;
+	expiry = 0;
+	if (cmd == "LINE")
+	{
+		tokens.GetToken(tmp);
+		tokens.GetToken(tmp);
+		time_t set_time = ConvToInt(tmp);
+		tokens.GetToken(tmp);
+		long duration = ConvToInt(tmp);
+		if (duration)
+			expiry = set_time + duration;
 	}
+	return cmd;
+}
 
-	/** Called whenever an xline is added by a local user.
-	 * This method is triggered after the line is added.
-	 * @param source The sender of the line or NULL for local server
-	 * @param line The xline being added
-	 */
-	void OnAddLine(User* source, XLine* line) CXX11_OVERRIDE
+/** Merges a journal into the snapshot. This runs on a worker thread and only ever
+ * touches the database files, never the XLineManager.
+ */
+class CompactThread : public Thread
+{
+	const std::string dbpath;
+	const std::string journalpath;
+	const time_t now;
+	Mutex mutex;
+	bool done;
+
+	static bool IsExpired(time_t expiry, time_t now)
 	{
-		dirty = true;
+		return ((expiry) && (expiry <= now));
 	}
 
-	/** Called whenever an xline is deleted.
-	 * This method is triggered after the line is deleted.
-	 * @param source The user removing the line or NULL for local server
-	 * @param line the line being deleted
-	 */
-	void OnDelLine(User* source, XLine* line) CXX11_OVERRIDE
+ public:
+	/** Describes what went wrong, empty if the compaction was successful */
+	std::string error;
+
+	CompactThread(const std::string& db, const std::string& journal, time_t Now)
+		: dbpath(db), journalpath(journal), now(Now), done(false)
 	{
-		dirty = true;
 	}
 
-	void OnExpireLine(XLine *line) CXX11_OVERRIDE
+	bool IsDone()
 	{
-		dirty = true;
+		mutex.Lock();
+		bool ret = done;
+		mutex.Unlock();
+		return ret;
 	}
 
-	void OnBackgroundTimer(time_t now) CXX11_OVERRIDE
+	void Compact()
 	{
-		if (dirty)
+		// Collect the final state of every line mentioned in the journal, an empty record means deleted
+		typedef std::map<std::pair<std::string, irc::string>, std::string> RecordMap;
+		RecordMap changes;
+
+		std::ifstream journal(journalpath.c_str());
+		std::string record, type;
+		irc::string mask;
+		time_t expiry;
+		while (std::getline(journal, record))
 		{
-			if (WriteDatabase())
-				dirty = false;
+			std::string cmd = ParseRecord(record, type, mask, expiry);
+			if (cmd == "LINE")
+				changes[std::make_pair(type, mask)] = record;
+			else if (cmd == "DEL")
+				changes[std::make_pair(type, mask)].clear();
 		}
-	}
+		journal.close();
 
-	bool WriteDatabase()
-	{
-		/*
-		 * We need to perform an atomic write so as not to fuck things up.
-		 * So, let's write to a temporary file, flush it, then rename the file..
-		 * Technically, that means that this can block, but I have *never* seen that.
-		 *     -- w00t
-		 */
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Opening temporary database");
-		std::string xlinenewdbpath = xlinedbpath + ".new";
-		std::ofstream stream(xlinenewdbpath.c_str());
+		std::string newdbpath = dbpath + ".new";
+		std::ofstream stream(newdbpath.c_str());
 		if (!stream.is_open())
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot create database! %s (%d)", strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot create new db: %s (%d)", strerror(errno), errno);
-			return false;
+			error = "cannot create new db: " + std::string(strerror(errno));
+			return;
 		}
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Opened. Writing..");
-
-		/*
-		 * Now, much as I hate writing semi-unportable formats, additional
-		 * xline types may not have a conf tag, so let's just write them.
-		 * In addition, let's use a file version, so we can maintain some
-		 * semblance of backwards compatibility for reading on startup..
-		 * 		-- w00t
-		 */
-		stream << "VERSION 1" << std::endl;
+		stream << "VERSION 1\n";
 
-		// Now, let's write.
-		std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
-		for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
+		// Copy the lines from the old snapshot which weren't changed since
+		std::ifstream snapshot(dbpath.c_str());
+		while (std::getline(snapshot, record))
 		{
-			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-			if (!lookup)
-				continue; // Not possible as we just obtained the list from XLineManager
-
-			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-			{
-				XLine* line = i->second;
-				stream << "LINE " << line->type << " " << line->Displayable() << " "
-					<< ServerInstance->Config->ServerName << " " << line->set_time << " "
-					<< line->duration << " " << line->reason << std::endl;
-			}
+			if (ParseRecord(record, type, mask, expiry) != "LINE")
+				continue;
+			if ((IsExpired(expiry, now)) || (changes.find(std::make_pair(type, mask)) != changes.end()))
+				continue;
+			stream << record << '\n';
 		}
+		snapshot.close();
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Finished writing XLines. Checking for error..");
+		for (RecordMap::const_iterator i = changes.begin(); i != changes.end(); ++i)
+		{
+			if (i->second.empty())
+				continue;
+			ParseRecord(i->second, type, mask, expiry);
+			if (!IsExpired(expiry, now))
+				stream << i->second << '\n';
+		}
 
+		stream.flush();
 		if (stream.fail())
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot write to new database! %s (%d)", strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to new db: %s (%d)", strerror(errno), errno);
-			return false;
+			error = "cannot write to new db: " + std::string(strerror(errno));
+			return;
 		}
 		stream.close();
 
 #ifdef _WIN32
-		if (remove(xlinedbpath.c_str()))
+		if ((remove(dbpath.c_str())) && (errno != ENOENT))
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot remove old database! %s (%d)", strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot remove old database: %s (%d)", strerror(errno), errno);
-			return false;
+			error = "cannot remove old database: " + std::string(strerror(errno));
+			return;
 		}
 #endif
 		// Use rename to move temporary to new db - this is guarenteed not to fuck up, even in case of a crash.
-		if (rename(xlinenewdbpath.c_str(), xlinedbpath.c_str()) < 0)
+		if (rename(newdbpath.c_str(), dbpath.c_str()) < 0)
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot move new to old database! %s (%d)", strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot replace old with new db: %s (%d)", strerror(errno), errno);
+			error = "cannot replace old with new db: " + std::string(strerror(errno));
+			return;
+		}
+
+		// Everything in the journal is in the snapshot now
+		remove(journalpath.c_str());
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		Compact();
+		mutex.Lock();
+		done = true;
+		mutex.Unlock();
+	}
+};
+
+class ModuleXLineDB : public Module
+{
+	/** True while the database is being read, so that loaded lines aren't journalled again */
+	bool loading;
+	std::string xlinedbpath;
+	std::string journalpath;
+	std::string compactpath;
+
+	/** Records which were not yet appended to the journal */
+	std::string pending;
+
+	/** Number of records in the journal since the last compaction */
+	unsigned long journalrecords;
+
+	/** Approximate number of lines in the database */
+	unsigned long linecount;
+
+	CompactThread* compactor;
+
+	void AddRecord(const std::string& record)
+	{
+		if (loading)
+			return;
+		pending.append(record);
+		journalrecords++;
+	}
+
+	bool FlushJournal()
+	{
+		if (pending.empty())
+			return true;
+
+		std::ofstream stream(journalpath.c_str(), std::ios::out | std::ios::app);
+		if (stream.is_open())
+		{
+			stream.write(pending.data(), pending.length());
+			stream.close();
+		}
+
+		if (stream.fail())
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot write to journal! %s (%d)", strerror(errno), errno);
+			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to journal: %s (%d)", strerror(errno), errno);
 			return false;
 		}
 
+		pending.clear();
 		return true;
 	}
 
-	bool ReadDatabase()
+	void CheckCompaction()
+	{
+		if (compactor)
+		{
+			if (!compactor->IsDone())
+				return;
+
+			compactor->join();
+			if (!compactor->error.empty())
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Compaction failed: %s", compactor->error.c_str());
+				ServerInstance->SNO->WriteToSnoMask('a', "database: %s", compactor->error.c_str());
+			}
+			delete compactor;
+			compactor = NULL;
+		}
+
+		if (journalrecords < std::max(1000UL, linecount))
+			return;
+
+		// A journal left behind by an interrupted compaction has to be merged first,
+		// the current journal stays where it is until the next compaction in that case
+		if (!FileSystem::FileExists(compactpath))
+		{
+			if (rename(journalpath.c_str(), compactpath.c_str()) < 0)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot rotate journal! %s (%d)", strerror(errno), errno);
+				return;
+			}
+			journalrecords = 0;
+		}
+
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Compacting database");
+		compactor = new CompactThread(xlinedbpath, compactpath, ServerInstance->Time());
+		ServerInstance->Threads->Start(compactor);
+	}
+
+ public:
+	ModuleXLineDB()
+		: loading(false), journalrecords(0), linecount(0), compactor(NULL)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		/* Load the configuration
+		 * Note:
+		 * 		This is on purpose not changed on a rehash. It would be non-trivial to change the database on-the-fly.
+		 * 		Imagine a scenario where the new file already exists. Merging the current XLines with the existing database is likely a bad idea
+		 * 		...and so is discarding all current in-memory XLines for the ones in the database.
+		 */
+		ConfigTag* Conf = ServerInstance->Config->ConfValue("xlinedb");
+		xlinedbpath = ServerInstance->Config->Paths.PrependData(Conf->getString("filename", "xline.db"));
+		journalpath = xlinedbpath + ".journal";
+		compactpath = xlinedbpath + ".journal.compact";
+
+		// Read the snapshot, then replay the journals in the order they were written
+		loading = true;
+		ReadDatabase(xlinedbpath);
+		journalrecords = ReadDatabase(compactpath) + ReadDatabase(journalpath);
+		loading = false;
+	}
+
+	~ModuleXLineDB()
+	{
+		FlushJournal();
+		if (compactor)
+		{
+			compactor->join();
+			delete compactor;
+		}
+	}
+
+	/** Called whenever an xline is added by a local user.
+	 * This method is triggered after the line is added.
+	 * @param source The sender of the line or NULL for local server
+	 * @param line The xline being added
+	 */
+	void OnAddLine(User* source, XLine* line) CXX11_OVERRIDE
+	{
+		linecount++;
+		AddRecord(FormatLine(line->type, line->Displayable(), line->set_time, line->duration, line->reason));
+	}
+
+	/** Called whenever an xline is deleted.
+	 * This method is triggered after the line is deleted.
+	 * @param source The user removing the line or NULL for local server
+	 * @param line the line being deleted
+	 */
+	void OnDelLine(User* source, XLine* line) CXX11_OVERRIDE
+	{
+		linecount--;
+		AddRecord("DEL " + line->type + " " + line->Displayable() + "\n");
+	}
+
+	void OnExpireLine(XLine *line) CXX11_OVERRIDE
+	{
+		linecount--;
+		AddRecord("DEL " + line->type + " " + line->Displayable() + "\n");
+	}
+
+	void OnBackgroundTimer(time_t now) CXX11_OVERRIDE
+	{
+		if (FlushJournal())
+			CheckCompaction();
+	}
+
+	/** Read a snapshot or journal and apply it
+	 * @param path The file to read
+	 * @return The number of records read
+	 */
+	unsigned long ReadDatabase(const std::string& path)
 	{
 		// If the xline database doesn't exist then we don't need to load it.
-		if (!FileSystem::FileExists(xlinedbpath))
-			return true;
+		if (!FileSystem::FileExists(path))
+			return 0;
 
-		std::ifstream stream(xlinedbpath.c_str());
+		std::ifstream stream(path.c_str());
 		if (!stream.is_open())
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot read database! %s (%d)", strerror(errno), errno);
 			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot read db: %s (%d)", strerror(errno), errno);
-			return false;
+			return 0;
 		}
-		
+
+		unsigned long records = 0;
 		std::string line;
 		while (std::getline(stream, line))
 		{
@@ -191,11 +396,13 @@ class ModuleXLineDB : public Module
 					stream.close();
 					ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "I got database version %s - I don't understand it", command_p[1].c_str());
 					ServerInstance->SNO->WriteToSnoMask('a', "database: I got a database version (%s) I don't understand", command_p[1].c_str());
-					return false;
+					return records;
 				}
 			}
 			else if (command_p[0] == "LINE")
 			{
+				records++;
+
 				// Mercilessly stolen from spanningtree
 				XLineFactory* xlf = ServerInstance->XLines->GetFactory(command_p[1]);
 
@@ -215,9 +422,74 @@ class ModuleXLineDB : public Module
 				else
 					delete xl;
 			}
+			else if (command_p[0] == "DEL")
+			{
+				records++;
+				ServerInstance->XLines->DelLine(command_p[2].c_str(), command_p[1], NULL);
+			}
 		}
 		stream.close();
-		return true;
+		return records;
+	}
+
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		const unsigned long count = 1000000;
+		const std::string benchpath = xlinedbpath + ".bench";
+		const std::string benchjournal = benchpath + ".journal";
+		std::cout << "\nm_xline_db: benchmarking with " << count << " lines\n";
+
+		// Cost of journalling a ban wave: format every record, then append them in one go
+		double start = GetTime();
+		std::string records;
+		for (unsigned long i = 0; i < count; i++)
+			records.append(FormatLine("Z", BenchMask(i), ServerInstance->Time(), 86400, "Benchmark"));
+		double formatted = GetTime();
+		{
+			std::ofstream stream(benchjournal.c_str(), std::ios::out | std::ios::trunc);
+			stream.write(records.data(), records.length());
+		}
+		double written = GetTime();
+		std::cout << "Journal: formatted in " << (formatted - start) << "s, appended in " << (written - formatted) << "s ("
+			<< ((written - start) * 1000000 / count) << "us per line)\n";
+
+		// Merge the journal into an empty snapshot, then merge deletions of a tenth of the lines
+		remove(benchpath.c_str());
+		CompactThread first(benchpath, benchjournal, ServerInstance->Time());
+		first.Compact();
+		{
+			std::ofstream stream(benchjournal.c_str(), std::ios::out | std::ios::trunc);
+			for (unsigned long i = 0; i < count; i += 10)
+				stream << "DEL Z " << BenchMask(i) << '\n';
+		}
+		start = GetTime();
+		CompactThread second(benchpath, benchjournal, ServerInstance->Time());
+		second.Compact();
+		std::cout << "Compaction: " << (GetTime() - start) << "s on the worker thread" << (second.error.empty() ? "" : ", failed: " + second.error) << "\n";
+
+		// Load the resulting snapshot like it would be on startup, then clean up again
+		loading = true;
+		start = GetTime();
+		unsigned long loaded = ReadDatabase(benchpath);
+		double load = GetTime() - start;
+		for (unsigned long i = 0; i < count; i++)
+			ServerInstance->XLines->DelLine(BenchMask(i).c_str(), "Z", NULL);
+		loading = false;
+		std::cout << "Load: " << loaded << " lines in " << load << "s\n";
+
+		remove(benchpath.c_str());
+		remove(benchjournal.c_str());
+	}
+
+	static std::string BenchMask(unsigned long i)
+	{
+		return InspIRCd::Format("10.%lu.%lu.%lu", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+	}
+
+	static double GetTime()
+	{
+		ServerInstance->UpdateTime();
+		return ServerInstance->Time() + ServerInstance->Time_ns() / 1000000000.0;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -0,0 +1,232 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "slab.h"
+#include <new>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+	/** Alignment of every object, enough for any type used in the core */
+	const size_t ALIGNMENT = 16;
+
+	/** Minimum size of a slab, slabs are always a multiple of PAGE_BYTES */
+	const size_t SLAB_BYTES = 64 * 1024;
+	const size_t PAGE_BYTES = 4096;
+
+	/** Minimum number of objects in a slab, for large objects */
+	const unsigned int SLAB_MIN_OBJECTS = 8;
+
+	inline size_t Align(size_t size)
+	{
+		return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	}
+
+	std::vector<SlabAllocator*>& GetAllocators()
+	{
+		static std::vector<SlabAllocator*> allocators;
+		return allocators;
+	}
+}
+
+/** A slab. The objects follow the header, every object is preceded by a pointer
+ * to its slab so that it can be found when the object is freed.
+ */
+struct SlabAllocator::Slab
+{
+	/** Neighbours in the partial list */
+	Slab* prev;
+	Slab* next;
+
+	/** Freed objects of this slab, linked through their first bytes */
+	void* freelist;
+
+	/** Number of objects handed out by this slab */
+	unsigned int used;
+
+	/** Number of objects taken from the never used part of the slab */
+	unsigned int carved;
+
+	/** Get the memory of an object
+	 * @param index Index of the chunk in the slab
+	 * @param chunksize Size of a chunk
+	 */
+	char* GetChunk(unsigned int index, size_t chunksize)
+	{
+		return reinterpret_cast<char*>(this) + Align(sizeof(Slab)) + index * chunksize;
+	}
+};
+
+SlabAllocator::SlabAllocator(const char* Name, size_t size)
+	: partial(NULL), spare(NULL)
+	, chunksize(ALIGNMENT + Align(size))
+	, slabbytes(std::max(SLAB_BYTES, (Align(sizeof(Slab)) + SLAB_MIN_OBJECTS * chunksize + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1)))
+	, perslab((slabbytes - Align(sizeof(Slab))) / chunksize)
+	, name(Name), objsize(size)
+	, inuse(0), peak(0), allocations(0), slabs(0)
+{
+	GetAllocators().push_back(this);
+}
+
+const std::vector<SlabAllocator*>& SlabAllocator::GetAll()
+{
+	return GetAllocators();
+}
+
+SlabAllocator::Slab* SlabAllocator::NewSlab()
+{
+	// Slabs are mapped directly instead of using the heap so that freeing a slab always gives
+	// the memory back to the system. The memory of the objects is only touched when they are
+	// handed out for the first time.
+#ifdef _WIN32
+	void* mem = VirtualAlloc(NULL, slabbytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* mem = mmap(NULL, slabbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		mem = NULL;
+#endif
+	if (!mem)
+		throw std::bad_alloc();
+
+	Slab* slab = static_cast<Slab*>(mem);
+	slab->prev = slab->next = NULL;
+	slab->freelist = NULL;
+	slab->used = 0;
+	slab->carved = 0;
+	slabs++;
+	return slab;
+}
+
+void SlabAllocator::Link(Slab* slab, bool front)
+{
+	slab->prev = NULL;
+	slab->next = NULL;
+	if (!partial)
+	{
+		partial = slab->prev = slab->next = slab;
+		return;
+	}
+
+	// The list is circular, the back of the list is partial->prev
+	slab->next = partial;
+	slab->prev = partial->prev;
+	partial->prev->next = slab;
+	partial->prev = slab;
+	if (front)
+		partial = slab;
+}
+
+void SlabAllocator::Unlink(Slab* slab)
+{
+	if (slab->next == slab)
+	{
+		partial = NULL;
+	}
+	else
+	{
+		slab->prev->next = slab->next;
+		slab->next->prev = slab->prev;
+		if (partial == slab)
+			partial = slab->next;
+	}
+	slab->prev = slab->next = NULL;
+}
+
+void* SlabAllocator::Allocate(size_t size)
+{
+	if (size != objsize)
+		return ::operator new(size);
+
+	if (!partial)
+	{
+		Slab* slab = spare;
+		spare = NULL;
+		if (!slab)
+			slab = NewSlab();
+		Link(slab, true);
+	}
+
+	Slab* slab = partial;
+	char* chunk;
+	if (slab->freelist)
+	{
+		chunk = static_cast<char*>(slab->freelist) - ALIGNMENT;
+		slab->freelist = *static_cast<void**>(slab->freelist);
+	}
+	else
+	{
+		chunk = slab->GetChunk(slab->carved++, chunksize);
+		*reinterpret_cast<Slab**>(chunk) = slab;
+	}
+
+	if (++slab->used == perslab)
+		Unlink(slab);
+
+	allocations++;
+	if (++inuse > peak)
+		peak = inuse;
+	return chunk + ALIGNMENT;
+}
+
+void SlabAllocator::Deallocate(void* ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	if (size != objsize)
+	{
+		::operator delete(ptr);
+		return;
+	}
+
+	Slab* slab = *reinterpret_cast<Slab**>(static_cast<char*>(ptr) - ALIGNMENT);
+	*static_cast<void**>(ptr) = slab->freelist;
+	slab->freelist = ptr;
+	inuse--;
+
+	// A full slab is put at the back of the list so that allocations prefer
+	// slabs which are used more, giving the others a chance to become empty
+	if (slab->used-- == perslab)
+		Link(slab, false);
+
+	if (slab->used)
+		return;
+
+	Unlink(slab);
+	if (!spare)
+	{
+		spare = slab;
+		return;
+	}
+
+#ifdef _WIN32
+	VirtualFree(slab, 0, MEM_RELEASE);
+#else
+	munmap(slab, slabbytes);
+#endif
+	slabs--;
+}
+
+size_t SlabAllocator::GetReservedBytes() const
+{
+	return slabs * slabbytes;
+}
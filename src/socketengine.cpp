@@ -37,6 +37,7 @@ void EventHandler::SetFd(int FD)
 SocketEngine::SocketEngine()
 {
 	TotalEvents = WriteEvents = ReadEvents = ErrorEvents = 0;
+	LastWaitTime = 0;
 	lastempty = ServerInstance->Time();
 	indata = outdata = 0;
 }
@@ -120,7 +121,15 @@ bool SocketEngine::BoundsCheckFd(EventHandler* eh)
 
 int SocketEngine::Accept(EventHandler* fd, sockaddr *addr, socklen_t *addrlen)
 {
-	return accept(fd->GetFd(), addr, addrlen);
+#ifdef SOCK_NONBLOCK
+	// Saves a fcntl() call for every connection
+	return accept4(fd->GetFd(), addr, addrlen, SOCK_NONBLOCK);
+#else
+	int newfd = accept(fd->GetFd(), addr, addrlen);
+	if (newfd >= 0)
+		NonBlocking(newfd);
+	return newfd;
+#endif
 }
 
 int SocketEngine::Close(EventHandler* fd)
@@ -192,8 +192,10 @@ int EPollEngine::DispatchEvents()
 {
 	socklen_t codesize = sizeof(int);
 	int errcode;
+	unsigned long long waitstart = LatencyHistogram::GetTimestamp();
 	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, 1000);
 	ServerInstance->UpdateTime();
+	LastWaitTime = LatencyHistogram::GetTimestamp() - waitstart;
 
 	TotalEvents += i;
 
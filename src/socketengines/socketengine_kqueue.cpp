@@ -215,8 +215,10 @@ int KQueueEngine::DispatchEvents()
 	ts.tv_nsec = 0;
 	ts.tv_sec = 1;
 
+	unsigned long long waitstart = LatencyHistogram::GetTimestamp();
 	int i = kevent(EngineHandle, NULL, 0, &ke_list[0], GetMaxFds(), &ts);
 	ServerInstance->UpdateTime();
+	LastWaitTime = LatencyHistogram::GetTimestamp() - waitstart;
 
 	TotalEvents += i;
 
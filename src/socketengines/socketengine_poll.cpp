@@ -209,12 +209,14 @@ void PollEngine::DelFd(EventHandler* eh)
 
 int PollEngine::DispatchEvents()
 {
+	unsigned long long waitstart = LatencyHistogram::GetTimestamp();
 	int i = poll(events, CurrentSetSize, 1000);
 	int index;
 	socklen_t codesize = sizeof(int);
 	int errcode;
 	int processed = 0;
 	ServerInstance->UpdateTime();
+	LastWaitTime = LatencyHistogram::GetTimestamp() - waitstart;
 
 	if (i > 0)
 	{
@@ -158,8 +158,10 @@ int PortsEngine::DispatchEvents()
 	poll_time.tv_nsec = 0;
 
 	unsigned int nget = 1; // used to denote a retrieve request.
+	unsigned long long waitstart = LatencyHistogram::GetTimestamp();
 	int ret = port_getn(EngineHandle, this->events, GetMaxFds() - 1, &nget, &poll_time);
 	ServerInstance->UpdateTime();
+	LastWaitTime = LatencyHistogram::GetTimestamp() - waitstart;
 
 	// first handle an error condition
 	if (ret == -1)
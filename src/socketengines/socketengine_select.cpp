@@ -134,8 +134,10 @@ int SelectEngine::DispatchEvents()
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
+	unsigned long long waitstart = LatencyHistogram::GetTimestamp();
 	int sresult = select(MaxFD + 1, &rfdset, &wfdset, &errfdset, &tval);
 	ServerInstance->UpdateTime();
+	LastWaitTime = LatencyHistogram::GetTimestamp() - waitstart;
 
 	/* Nothing to process this time around */
 	if (sresult < 1)
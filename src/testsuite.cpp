@@ -22,6 +22,8 @@
 #include "inspircd.h"
 #include "testsuite.h"
 #include "threadengine.h"
+#include "slab.h"
+#include <fstream>
 #include <iostream>
 
 class TestSuiteThread : public Thread
@@ -62,6 +64,11 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Netsplit allocation benchmark\n";
+		std::cout << "(A) Case insensitive lookup benchmark\n";
+		std::cout << "(B) Thread pool tests\n";
+		std::cout << "(C) Bulk netsplit benchmark\n";
+		std::cout << "(D) Netjoin benchmark\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -105,6 +112,21 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoNetsplitBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoLookupBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoThreadPoolTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'C':
+				std::cout << (DoBulkQuitBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'D':
+				std::cout << (DoNetjoinBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -389,6 +411,700 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+/** Get the resident set size of the process in kilobytes, 0 if it's unknown */
+static unsigned long GetRSS()
+{
+	std::ifstream statm("/proc/self/statm");
+	unsigned long size = 0;
+	unsigned long resident = 0;
+	if (!(statm >> size >> resident))
+		return 0;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double GetElapsed(const timespec& start)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+/** Introduce remote users on a server, each one joined to some of the given number of channels
+ * @param server The server the users are on
+ * @param count The number of users to create
+ * @param prefix The prefix of the channel names, the channels are created as needed
+ * @param channels The number of channels
+ * @param chans_per_user The number of channels each user joins
+ * @param users The new users are added here
+ */
+static void AddBenchUsers(Server* server, unsigned int count, const std::string& prefix, unsigned int channels, unsigned int chans_per_user, std::vector<User*>& users)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		RemoteUser* user = new RemoteUser(ServerInstance->UIDGen.GetUID(), server);
+		user->nick = user->uuid;
+		user->ident = "bench";
+		user->host = user->dhost = "netsplit.test";
+		user->registered = REG_ALL;
+		(*ServerInstance->Users->clientlist)[user->nick] = user;
+		users.push_back(user);
+
+		for (unsigned int j = 0; j < chans_per_user; j++)
+		{
+			std::string name = prefix + ConvToStr((i * 7 + j * 131) % channels);
+			Channel* chan = ServerInstance->FindChan(name);
+			if (!chan)
+				chan = new Channel(name, ServerInstance->Time());
+			chan->ForceJoin(user, NULL, true);
+		}
+	}
+}
+
+bool TestSuite::DoNetsplitBenchmark()
+{
+	// Every round a server with this many users in the given number of channels joins and splits
+	const unsigned int ROUNDS = 10;
+	const unsigned int USERS = 50000;
+	const unsigned int CHANNELS = 2000;
+	const unsigned int CHANS_PER_USER = 5;
+
+	std::cout << "\n\nNetsplit allocation benchmark: " << USERS << " users in " << CHANNELS << " channels, "
+		<< CHANS_PER_USER << " channels each\n\n";
+
+	const std::vector<SlabAllocator*>& slabs = SlabAllocator::GetAll();
+	bool passed = true;
+	unsigned long startrss = GetRSS();
+	for (unsigned int round = 0; round < ROUNDS; round++)
+	{
+		// Everything created for the round has to be gone after the split
+		std::vector<unsigned long> inuse;
+		for (std::vector<SlabAllocator*>::const_iterator i = slabs.begin(); i != slabs.end(); ++i)
+			inuse.push_back((*i)->inuse);
+		size_t users_before = ServerInstance->Users->clientlist->size();
+		size_t uuids_before = ServerInstance->Users->uuidlist->size();
+		size_t chans_before = ServerInstance->chanlist->size();
+
+		timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		std::vector<User*> users;
+		users.reserve(USERS);
+		AddBenchUsers(ServerInstance->FakeClient->server, USERS, "#bench", CHANNELS, CHANS_PER_USER, users);
+		double jointime = GetElapsed(start);
+		unsigned long joinrss = GetRSS();
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+			ServerInstance->Users->QuitUser(*i, "*.net *.split");
+		ServerInstance->GlobalCulls.Apply();
+		double splittime = GetElapsed(start);
+
+		std::cout << "Round " << (round + 1) << ": join " << jointime << "s (RSS " << joinrss << "K), split "
+			<< splittime << "s (RSS " << GetRSS() << "K)\n";
+
+		for (size_t i = 0; i < slabs.size(); i++)
+		{
+			if (slabs[i]->inuse != inuse[i])
+			{
+				std::cout << slabs[i]->name << ": " << slabs[i]->inuse << " in use after the split, " << inuse[i] << " before the join\n";
+				passed = false;
+			}
+		}
+		if ((ServerInstance->Users->clientlist->size() != users_before) || (ServerInstance->Users->uuidlist->size() != uuids_before))
+		{
+			std::cout << "The user lists have " << ServerInstance->Users->clientlist->size() << " nicks and " << ServerInstance->Users->uuidlist->size()
+				<< " uuids after the split, " << users_before << " and " << uuids_before << " before the join\n";
+			passed = false;
+		}
+		if (ServerInstance->chanlist->size() != chans_before)
+		{
+			std::cout << ServerInstance->chanlist->size() << " channels exist after the split, " << chans_before << " before the join\n";
+			passed = false;
+		}
+		if (!passed)
+			break;
+	}
+
+	std::cout << "\nRSS before " << startrss << "K, after " << GetRSS() << "K\n";
+	for (std::vector<SlabAllocator*>::const_iterator i = slabs.begin(); i != slabs.end(); ++i)
+	{
+		SlabAllocator* slab = *i;
+		std::cout << slab->name << ": " << slab->inuse << " in use, peak " << slab->peak << ", "
+			<< slab->allocations << " allocations, " << slab->slabs << " slabs\n";
+	}
+
+	return passed;
+}
+
+/** Send stdout to /dev/null, the test suite logs everything there at the debug level and
+ * writing that out would take most of the time a benchmark measures
+ * @return The saved stdout to pass to RestoreStdout()
+ */
+static int MuteStdout()
+{
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	close(null);
+	return saved;
+}
+
+static void RestoreStdout(int saved)
+{
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+/** Create registered local users, each one joined to some of the given number of channels.
+ * The users are on one end of a socket pair, what they are sent stays in their sendq.
+ * @param count The number of users to create
+ * @param prefix The prefix of the channel names, the channels are created as needed
+ * @param channels The number of channels
+ * @param chans_per_user The number of channels each user joins
+ * @param users The new users are added here
+ * @param peers The other ends of the socket pairs are added here, the caller closes them
+ */
+static void AddBenchLocals(unsigned int count, const std::string& prefix, unsigned int channels, unsigned int chans_per_user, std::vector<User*>& users, std::vector<int>& peers)
+{
+	irc::sockets::sockaddrs sa;
+	irc::sockets::aptosa("127.0.0.1", 0, sa);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		{
+			std::cout << "socketpair() failed: " << strerror(errno) << "\n";
+			break;
+		}
+		peers.push_back(fds[1]);
+
+		ServerInstance->SE->NonBlocking(fds[0]);
+		ServerInstance->Users->AddUser(fds[0], NULL, &sa, &sa);
+		LocalUser* user = ServerInstance->Users->local_users.back();
+		if (user->quitting)
+			continue;
+
+		user->registered = REG_ALL;
+		ServerInstance->Users->unregistered_count--;
+		users.push_back(user);
+		for (unsigned int j = 0; j < chans_per_user; j++)
+		{
+			std::string name = prefix + ConvToStr((i * 13 + j * 97) % channels);
+			Channel* chan = ServerInstance->FindChan(name);
+			if (!chan)
+				chan = new Channel(name, ServerInstance->Time());
+			chan->ForceJoin(user, NULL, true);
+		}
+	}
+}
+
+bool TestSuite::DoBulkQuitBenchmark()
+{
+	// A server with this many users splits while local users share channels with them
+	const unsigned int USERS = 100000;
+	const unsigned int LOCALS = 200;
+	const unsigned int CHANNELS = 2000;
+	const unsigned int CHANS_PER_USER = 5;
+
+	std::cout << "\n\nBulk netsplit benchmark: " << USERS << " users in " << CHANNELS << " channels, "
+		<< CHANS_PER_USER << " channels each, seen by " << LOCALS << " local users\n\n";
+
+	std::vector<int> peers;
+	std::vector<User*> locals;
+	AddBenchLocals(LOCALS, "#split", CHANNELS, CHANS_PER_USER, locals, peers);
+
+	bool passed = !locals.empty();
+	unsigned long sent[2];
+	for (unsigned int round = 0; round < 2; round++)
+	{
+		bool bulk = (round == 1);
+		Server* server = new Server("split.test", "Bulk netsplit benchmark");
+
+		int savedstdout = MuteStdout();
+		timespec start;
+		std::vector<User*> users;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		AddBenchUsers(server, USERS, "#split", CHANNELS, CHANS_PER_USER, users);
+		double jointime = GetElapsed(start);
+
+		unsigned long sentbefore = ServerInstance->stats->statsSent;
+		size_t chansbefore = ServerInstance->chanlist->size();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (bulk)
+		{
+			ServerInstance->Users->QuitUsers(users, "*.net *.split");
+		}
+		else
+		{
+			// What the split of a server used to do, look for its users in the whole user list and quit them one by one
+			const user_hash& clients = *ServerInstance->Users->clientlist;
+			for (user_hash::const_iterator i = clients.begin(); i != clients.end(); )
+			{
+				User* user = i->second;
+				++i;
+				if (user->server == server)
+					ServerInstance->Users->QuitUser(user, "*.net *.split");
+			}
+		}
+		double quittime = GetElapsed(start);
+		ServerInstance->GlobalCulls.Apply();
+		double splittime = GetElapsed(start);
+		RestoreStdout(savedstdout);
+		sent[round] = ServerInstance->stats->statsSent - sentbefore;
+
+		std::cout << (bulk ? "Bulk quit:     " : "One at a time: ") << "join " << jointime << "s, split " << splittime << "s (" << quittime << "s before culling), "
+			<< sent[round] << " bytes queued to local users, " << (chansbefore - ServerInstance->chanlist->size()) << " channels destroyed\n";
+
+		if (!server->users.empty())
+		{
+			std::cout << server->users.size() << " users are still on the split server\n";
+			passed = false;
+		}
+		delete server;
+	}
+
+	if (sent[0] != sent[1])
+	{
+		std::cout << "The local users were sent different quits\n";
+		passed = false;
+	}
+
+	ServerInstance->Users->QuitUsers(locals, "Benchmark finished");
+	ServerInstance->GlobalCulls.Apply();
+	for (std::vector<int>::const_iterator i = peers.begin(); i != peers.end(); ++i)
+		close(*i);
+
+	return passed;
+}
+
+bool TestSuite::DoNetjoinBenchmark()
+{
+	// A server with this many users links while local users share channels with them
+	const unsigned int USERS = 50000;
+	const unsigned int LOCALS = 200;
+	const unsigned int CHANNELS = 2000;
+	const unsigned int CHANS_PER_USER = 5;
+
+	std::cout << "\n\nNetjoin benchmark: " << USERS << " users in " << CHANNELS << " channels, "
+		<< CHANS_PER_USER << " channels each, seen by " << LOCALS << " local users\n\n";
+
+	std::vector<int> peers;
+	std::vector<User*> locals;
+	AddBenchLocals(LOCALS, "#netjoin", CHANNELS, CHANS_PER_USER, locals, peers);
+
+	// Every local user has seen the NAMES lists of its channels, they are cached and need updating as users join
+	bool passed = !locals.empty();
+	unsigned long sent[2];
+	for (unsigned int round = 0; round < 2; round++)
+	{
+		bool bulk = (round == 1);
+		Server* server = new Server("join.test", "Netjoin benchmark");
+
+		// The users are introduced first, then each channel gets its members the way an FJOIN gives them
+		std::vector<User*> users;
+		AddBenchUsers(server, USERS, "#netjoin", CHANNELS, 0, users);
+		std::map<std::string, std::vector<User*> > fjoins;
+		for (unsigned int i = 0; i < USERS; i++)
+		{
+			for (unsigned int j = 0; j < CHANS_PER_USER; j++)
+				fjoins["#netjoin" + ConvToStr((i * 7 + j * 131) % CHANNELS)].push_back(users[i]);
+		}
+
+		int savedstdout = MuteStdout();
+		unsigned long sentbefore = ServerInstance->stats->statsSent;
+		timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		{
+			// As a TreeSocket does for the lines it reads
+			WriteCoalescer coalescer;
+			for (std::map<std::string, std::vector<User*> >::const_iterator i = fjoins.begin(); i != fjoins.end(); ++i)
+			{
+				Channel* chan = ServerInstance->FindChan(i->first);
+				if (!chan)
+					chan = new Channel(i->first, ServerInstance->Time());
+
+				if (bulk)
+				{
+					chan->ForceJoinUsers(i->second, true);
+				}
+				else
+				{
+					// What an FJOIN used to do, join the users one by one
+					for (std::vector<User*>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+						chan->ForceJoin(*j, NULL, true);
+				}
+			}
+		}
+		double jointime = GetElapsed(start);
+		RestoreStdout(savedstdout);
+		sent[round] = ServerInstance->stats->statsSent - sentbefore;
+
+		std::cout << (bulk ? "Bulk join:     " : "One at a time: ") << "join " << jointime << "s, "
+			<< sent[round] << " bytes queued to local users\n";
+
+		for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+		{
+			if ((*i)->chans.size() != CHANS_PER_USER)
+			{
+				std::cout << (*i)->uuid << " is on " << (*i)->chans.size() << " channels instead of " << CHANS_PER_USER << "\n";
+				passed = false;
+				break;
+			}
+		}
+
+		savedstdout = MuteStdout();
+		ServerInstance->Users->QuitUsers(users, "*.net *.split");
+		ServerInstance->GlobalCulls.Apply();
+		RestoreStdout(savedstdout);
+		delete server;
+
+		// The sendqs are emptied so that both rounds start the same
+		for (std::vector<User*>::const_iterator i = locals.begin(); i != locals.end(); ++i)
+			IS_LOCAL(*i)->eh.DoWrite();
+		for (std::vector<int>::const_iterator i = peers.begin(); i != peers.end(); ++i)
+		{
+			char buf[65536];
+			while (recv(*i, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+				;
+		}
+	}
+
+	if (sent[0] != sent[1])
+	{
+		std::cout << "The local users were sent different joins\n";
+		passed = false;
+	}
+
+	ServerInstance->Users->QuitUsers(locals, "Benchmark finished");
+	ServerInstance->GlobalCulls.Apply();
+	for (std::vector<int>::const_iterator i = peers.begin(); i != peers.end(); ++i)
+		close(*i);
+
+	return passed;
+}
+
+/** The hash and comparison of nick and channel names before they were folded in blocks, for comparison */
+struct ByteHash
+{
+	size_t operator()(const std::string& s) const
+	{
+		size_t t = 0;
+		for (std::string::const_iterator x = s.begin(); x != s.end(); ++x)
+			t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
+		return t;
+	}
+};
+
+struct ByteComp
+{
+	bool operator()(const std::string& s1, const std::string& s2) const
+	{
+		const unsigned char* n1 = (const unsigned char*)s1.c_str();
+		const unsigned char* n2 = (const unsigned char*)s2.c_str();
+		for (; *n1 && *n2; n1++, n2++)
+			if (national_case_insensitive_map[*n1] != national_case_insensitive_map[*n2])
+				return false;
+		return (national_case_insensitive_map[*n1] == national_case_insensitive_map[*n2]);
+	}
+};
+
+/** Look up every name in a map of the stored names, in a different case
+ * @return The number of lookups per second
+ */
+template<typename Map>
+static double TimeLookups(const std::vector<std::string>& names, const std::vector<std::string>& lookups, unsigned int count, bool& passed)
+{
+	Map map;
+	for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+		map[*i] = NULL;
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned int found = 0;
+	for (unsigned int i = 0; i < count; i++)
+		found += map.count(lookups[i % lookups.size()]);
+	double elapsed = GetElapsed(start);
+
+	if (found != count)
+		passed = false;
+	return count / elapsed;
+}
+
+bool TestSuite::DoLookupBenchmark()
+{
+	const unsigned int NAMES = 100000;
+	const unsigned int LOOKUPS = 5000000;
+	const unsigned int CHECKS = 200000;
+
+	std::cout << "\n\nCase insensitive lookup benchmark: " << LOOKUPS << " lookups in maps of " << NAMES << " names\n\n";
+
+	// Nicks and channel names as they are stored, and the same names in upper case as they are looked up
+	std::vector<std::string> names;
+	std::vector<std::string> lookups;
+	for (unsigned int i = 0; i < NAMES; i++)
+	{
+		std::string name = (i % 2) ? "Guest[" + ConvToStr(i) + "]^" : "#InspIRCd-Development-" + ConvToStr(i);
+		names.push_back(name);
+		for (std::string::iterator c = name.begin(); c != name.end(); ++c)
+			if (*c >= 'a' && *c <= 'z')
+				*c -= 32;
+		lookups.push_back(name);
+	}
+
+	unsigned char custom[256];
+	memcpy(custom, rfc_case_insensitive_map, sizeof(custom));
+	const unsigned char* casemaps[] = { rfc_case_insensitive_map, ascii_case_insensitive_map, custom };
+	const char* casemapnames[] = { "rfc1459", "ascii", "custom table" };
+	const unsigned char* oldmap = national_case_insensitive_map;
+
+	bool passed = true;
+	for (unsigned int m = 0; m < 3; m++)
+	{
+		national_case_insensitive_map = casemaps[m];
+
+		// The folded comparisons and hashes must agree with folding a character at a time
+		const char charset[] = "aAzZ09[]{}\\|^~_-\xC4\xE4\xFF";
+		ByteComp bytecomp;
+		for (unsigned int i = 0; i < CHECKS; i++)
+		{
+			std::string s1(rand() % 40, 'a');
+			for (std::string::iterator c = s1.begin(); c != s1.end(); ++c)
+				*c = charset[rand() % (sizeof(charset) - 1)];
+			std::string s2 = s1;
+			if (!s2.empty() && rand() % 2)
+				s2[rand() % s2.length()] = charset[rand() % (sizeof(charset) - 1)];
+
+			bool equal = bytecomp(s1, s2);
+			bool less = false;
+			for (size_t n = 0; n < std::min(s1.length(), s2.length()) && !less; n++)
+			{
+				unsigned char c1 = national_case_insensitive_map[(unsigned char)s1[n]];
+				unsigned char c2 = national_case_insensitive_map[(unsigned char)s2[n]];
+				if (c1 != c2)
+				{
+					less = c1 < c2;
+					break;
+				}
+			}
+			if (irc::StrHashComp()(s1, s2) != equal || irc::insensitive_swo()(s1, s2) != less
+				|| (equal && irc::insensitive()(s1) != irc::insensitive()(s2)))
+			{
+				std::cout << "Mismatch for \"" << s1 << "\" and \"" << s2 << "\" with the " << casemapnames[m] << " casemap\n";
+				passed = false;
+			}
+		}
+
+		double folded = TimeLookups<user_hash>(names, lookups, LOOKUPS, passed);
+		double bytes = TimeLookups<TR1NS::unordered_map<std::string, User*, ByteHash, ByteComp> >(names, lookups, LOOKUPS, passed);
+		std::cout << casemapnames[m] << ": " << folded << " lookups/s, " << bytes << " lookups/s a character at a time\n";
+	}
+	national_case_insensitive_map = oldmap;
+
+	return passed;
+}
+
+class TestSuiteJob : public ThreadJob
+{
+	Mutex* const wait;
+	unsigned int& done;
+	unsigned long& total;
+	unsigned long value;
+
+ public:
+	volatile bool started;
+
+	TestSuiteJob(unsigned long v, unsigned int& d, unsigned long& t, Mutex* w = NULL)
+		: wait(w), done(d), total(t), value(v), started(false)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		started = true;
+		if (wait)
+		{
+			wait->Lock();
+			wait->Unlock();
+		}
+		value = value * value;
+	}
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		done++;
+		total += value;
+	}
+};
+
+/** A part of the work of a TestSuitePartsJob, passed to the main thread before the job is done */
+class TestSuitePart : public ThreadCompletion
+{
+	std::vector<int>& order;
+	const int index;
+
+ public:
+	TestSuitePart(std::vector<int>& o, int i) : order(o), index(i) { }
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		order.push_back(index);
+	}
+};
+
+class TestSuitePartsJob : public ThreadJob
+{
+	ThreadPool& pool;
+	std::vector<int>& order;
+
+ public:
+	TestSuitePartsJob(ThreadPool& p, std::vector<int>& o) : pool(p), order(o) { }
+
+	void Run() CXX11_OVERRIDE
+	{
+		for (int i = 0; i < 3; i++)
+			pool.Complete(new TestSuitePart(order, i));
+	}
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		order.push_back(-1);
+	}
+};
+
+/** Counts the calls of the per-thread hooks of a ThreadPool */
+static Mutex* hooklock;
+static unsigned int hookstarts;
+static unsigned int hookexits;
+
+static void CountThreadStart()
+{
+	hooklock->Lock();
+	hookstarts++;
+	hooklock->Unlock();
+}
+
+static void CountThreadExit()
+{
+	hooklock->Lock();
+	hookexits++;
+	hooklock->Unlock();
+}
+
+/** Deliver finished jobs until the expected number is done or a few seconds have passed */
+static bool WaitForJobs(ThreadPool& pool, unsigned int& done, unsigned int expected, unsigned int& batches)
+{
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (done < expected && GetElapsed(start) < 10)
+	{
+		unsigned int before = done;
+		pool.Deliver();
+		if (done != before)
+			batches++;
+		else
+			usleep(100);
+	}
+	return done == expected;
+}
+
+bool TestSuite::DoThreadPoolTests()
+{
+	const unsigned int JOBS = 200000;
+	const unsigned int THREADS = 4;
+
+	std::cout << "\n\nThread pool tests: " << JOBS << " jobs on " << THREADS << " threads\n\n";
+
+	bool passed = true;
+	unsigned int done = 0;
+	unsigned int batches = 0;
+	unsigned long total = 0;
+	unsigned long expected = 0;
+	{
+		ThreadPool pool(THREADS);
+		timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (unsigned long i = 0; i < JOBS; i++)
+		{
+			pool.Submit(new TestSuiteJob(i, done, total));
+			expected += i * i;
+		}
+		if (!WaitForJobs(pool, done, JOBS, batches) || total != expected)
+		{
+			std::cout << "Completed " << done << " of " << JOBS << " jobs, total " << total << " instead of " << expected << "\n";
+			passed = false;
+		}
+		std::cout << "Completed " << done << " jobs in " << GetElapsed(start) << "s, delivered in " << batches << " batches\n";
+	}
+
+	std::cout << "Cancelling queued and running jobs\n";
+	{
+		ThreadPool pool(1);
+		Mutex wait;
+		done = total = batches = 0;
+		wait.Lock();
+		TestSuiteJob* running = new TestSuiteJob(2, done, total, &wait);
+		TestSuiteJob* queued = new TestSuiteJob(3, done, total);
+		pool.Submit(running);
+		pool.Submit(queued);
+		while (!running->started)
+			usleep(100);
+
+		if (!pool.Cancel(queued) || pool.Cancel(running))
+		{
+			std::cout << "Cancel() did not take the queued job back or took the running one\n";
+			passed = false;
+		}
+		delete queued;
+		wait.Unlock();
+
+		if (!WaitForJobs(pool, done, 1, batches) || total != 4)
+		{
+			std::cout << "The running job was not completed after it was cancelled\n";
+			passed = false;
+		}
+
+		// Jobs left in the queue are deleted with the pool
+		pool.Stop();
+		pool.Submit(new TestSuiteJob(4, done, total));
+	}
+
+	std::cout << "Per-thread hooks and results passed on before the job is done\n";
+	{
+		Mutex lock;
+		hooklock = &lock;
+		hookstarts = hookexits = 0;
+		std::vector<int> order;
+		{
+			ThreadPool pool(THREADS, CountThreadStart, CountThreadExit);
+			pool.Submit(new TestSuitePartsJob(pool, order));
+			timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			while (order.size() < 4 && GetElapsed(start) < 10)
+			{
+				pool.Deliver();
+				usleep(100);
+			}
+		}
+
+		if (hookstarts != THREADS || hookexits != THREADS)
+		{
+			std::cout << hookstarts << " threads ran the start hook and " << hookexits << " the exit hook instead of " << THREADS << "\n";
+			passed = false;
+		}
+
+		const int expectedorder[] = { 0, 1, 2, -1 };
+		if (order != std::vector<int>(expectedorder, expectedorder + 4))
+		{
+			std::cout << "The parts of the job were not delivered in order before the job\n";
+			passed = false;
+		}
+	}
+
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
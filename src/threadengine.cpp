@@ -38,3 +38,188 @@ void Thread::join()
 Thread::~Thread()
 {
 }
+
+SocketThread::SocketThread()
+{
+	signal.Create(this);
+}
+
+void SocketThread::NotifyParent()
+{
+	signal.Notify();
+}
+
+ThreadCompletionQueue::ThreadCompletionQueue()
+{
+	signal.Create(this);
+}
+
+ThreadCompletionQueue::~ThreadCompletionQueue()
+{
+	ThreadCompletion* item = static_cast<ThreadCompletion*>(head.Exchange(NULL));
+	while (item)
+	{
+		ThreadCompletion* next = item->next;
+		delete item;
+		item = next;
+	}
+}
+
+void ThreadCompletionQueue::Add(ThreadCompletion* item)
+{
+	void* last;
+	do
+	{
+		last = head.Get();
+		item->next = static_cast<ThreadCompletion*>(last);
+	} while (!head.CompareExchange(last, item));
+
+	// Only the first item of a batch has to wake up the main thread, the
+	// ones added before it gets there are delivered together with it
+	if (!last)
+		signal.Notify();
+}
+
+void ThreadCompletionQueue::Deliver()
+{
+	// Take everything at once and reverse the list to get the items in
+	// the order in which they were added
+	ThreadCompletion* item = static_cast<ThreadCompletion*>(head.Exchange(NULL));
+	ThreadCompletion* first = NULL;
+	while (item)
+	{
+		ThreadCompletion* next = item->next;
+		item->next = first;
+		first = item;
+		item = next;
+	}
+
+	while (first)
+	{
+		ThreadCompletion* next = first->next;
+		first->OnComplete();
+		delete first;
+		first = next;
+	}
+}
+
+class ThreadPoolWorker : public Thread
+{
+	ThreadPool* const pool;
+
+ public:
+	ThreadPoolWorker(ThreadPool* p) : pool(p)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		if (pool->threadstart)
+			pool->threadstart();
+		while (ThreadJob* job = pool->NextJob())
+		{
+			job->Run();
+			pool->completed.Add(job);
+		}
+		if (pool->threadexit)
+			pool->threadexit();
+	}
+
+	void SetExitFlag() CXX11_OVERRIDE
+	{
+		pool->queue.Lock();
+		Thread::SetExitFlag();
+		pool->exiting = true;
+		pool->queue.Wakeup();
+		pool->queue.Unlock();
+	}
+};
+
+ThreadPool::ThreadPool(unsigned int threads, void (*onstart)(), void (*onexit)())
+	: exiting(false), threadstart(onstart), threadexit(onexit)
+{
+	if (!threads)
+		threads = 1;
+
+	try
+	{
+		for (unsigned int i = 0; i < threads; i++)
+		{
+			ThreadPoolWorker* worker = new ThreadPoolWorker(this);
+			try
+			{
+				ServerInstance->Threads->Start(worker);
+			}
+			catch (...)
+			{
+				delete worker;
+				throw;
+			}
+			workers.push_back(worker);
+		}
+	}
+	catch (...)
+	{
+		Stop();
+		throw;
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	Stop();
+	for (std::deque<ThreadJob*>::iterator i = pending.begin(); i != pending.end(); ++i)
+		delete *i;
+}
+
+ThreadJob* ThreadPool::NextJob()
+{
+	queue.Lock();
+	while (pending.empty() && !exiting)
+		queue.Wait();
+
+	ThreadJob* job = NULL;
+	if (exiting)
+	{
+		// Only one waiting thread is woken up at a time, pass the
+		// request to exit on to the next one
+		queue.Wakeup();
+	}
+	else
+	{
+		job = pending.front();
+		pending.pop_front();
+	}
+	queue.Unlock();
+	return job;
+}
+
+void ThreadPool::Submit(ThreadJob* job)
+{
+	queue.Lock();
+	pending.push_back(job);
+	queue.Wakeup();
+	queue.Unlock();
+}
+
+bool ThreadPool::Cancel(ThreadJob* job)
+{
+	queue.Lock();
+	std::deque<ThreadJob*>::iterator i = std::find(pending.begin(), pending.end(), job);
+	bool found = (i != pending.end());
+	if (found)
+		pending.erase(i);
+	queue.Unlock();
+	return found;
+}
+
+void ThreadPool::Stop()
+{
+	for (std::vector<ThreadPoolWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		ThreadPoolWorker* worker = *i;
+		worker->join();
+		delete worker;
+	}
+	workers.clear();
+}
@@ -70,9 +70,9 @@ void ThreadData::FreeThread(Thread* thread)
 
 class ThreadSignalSocket : public EventHandler
 {
-	SocketThread* parent;
+	ThreadSignalTarget* parent;
  public:
-	ThreadSignalSocket(SocketThread* p, int newfd) : parent(p)
+	ThreadSignalSocket(ThreadSignalTarget* p, int newfd) : parent(p)
 	{
 		SetFd(newfd);
 		ServerInstance->SE->AddFd(this, FD_WANT_FAST_READ | FD_WANT_NO_WRITE);
@@ -104,22 +104,21 @@ class ThreadSignalSocket : public EventHandler
 	}
 };
 
-SocketThread::SocketThread()
+void ThreadSignalData::Create(ThreadSignalTarget* target)
 {
-	signal.sock = NULL;
 	int fd = eventfd(0, EFD_NONBLOCK);
 	if (fd < 0)
 		throw new CoreException("Could not create pipe " + std::string(strerror(errno)));
-	signal.sock = new ThreadSignalSocket(this, fd);
+	sock = new ThreadSignalSocket(target, fd);
 }
 #else
 
 class ThreadSignalSocket : public EventHandler
 {
-	SocketThread* parent;
+	ThreadSignalTarget* parent;
 	int send_fd;
  public:
-	ThreadSignalSocket(SocketThread* p, int recvfd, int sendfd) :
+	ThreadSignalSocket(ThreadSignalTarget* p, int recvfd, int sendfd) :
 		parent(p), send_fd(sendfd)
 	{
 		SetFd(recvfd);
@@ -155,26 +154,25 @@ class ThreadSignalSocket : public EventHandler
 	}
 };
 
-SocketThread::SocketThread()
+void ThreadSignalData::Create(ThreadSignalTarget* target)
 {
-	signal.sock = NULL;
 	int fds[2];
 	if (pipe(fds))
 		throw new CoreException("Could not create pipe " + std::string(strerror(errno)));
-	signal.sock = new ThreadSignalSocket(this, fds[0], fds[1]);
+	sock = new ThreadSignalSocket(target, fds[0], fds[1]);
 }
 #endif
 
-void SocketThread::NotifyParent()
+void ThreadSignalData::Notify()
 {
-	signal.sock->Notify();
+	sock->Notify();
 }
 
-SocketThread::~SocketThread()
+ThreadSignalData::~ThreadSignalData()
 {
-	if (signal.sock)
+	if (sock)
 	{
-		signal.sock->cull();
-		delete signal.sock;
+		sock->cull();
+		delete sock;
 	}
 }
@@ -64,9 +64,9 @@ void ThreadData::FreeThread(Thread* thread)
 
 class ThreadSignalSocket : public BufferedSocket
 {
-	SocketThread* parent;
+	ThreadSignalTarget* parent;
  public:
-	ThreadSignalSocket(SocketThread* t, int newfd)
+	ThreadSignalSocket(ThreadSignalTarget* t, int newfd)
 		: BufferedSocket(newfd), parent(t)
 	{
 	}
@@ -83,45 +83,45 @@ class ThreadSignalSocket : public BufferedSocket
 	}
 };
 
-SocketThread::SocketThread()
+void ThreadSignalData::Create(ThreadSignalTarget* target)
 {
 	int listenFD = socket(AF_INET, SOCK_STREAM, 0);
 	if (listenFD == -1)
 		throw CoreException("Could not create ITC pipe");
-	int connFD = socket(AF_INET, SOCK_STREAM, 0);
-	if (connFD == -1)
+	int sendFD = socket(AF_INET, SOCK_STREAM, 0);
+	if (sendFD == -1)
 		throw CoreException("Could not create ITC pipe");
 
 	if (!ServerInstance->BindSocket(listenFD, 0, "127.0.0.1", true))
 		throw CoreException("Could not create ITC pipe");
-	ServerInstance->SE->NonBlocking(connFD);
+	ServerInstance->SE->NonBlocking(sendFD);
 
 	struct sockaddr_in addr;
 	socklen_t sz = sizeof(addr);
 	getsockname(listenFD, reinterpret_cast<struct sockaddr*>(&addr), &sz);
-	connect(connFD, reinterpret_cast<struct sockaddr*>(&addr), sz);
+	connect(sendFD, reinterpret_cast<struct sockaddr*>(&addr), sz);
 	ServerInstance->SE->Blocking(listenFD);
 	int nfd = accept(listenFD, reinterpret_cast<struct sockaddr*>(&addr), &sz);
 	if (nfd < 0)
 		throw CoreException("Could not create ITC pipe");
-	new ThreadSignalSocket(this, nfd);
+	new ThreadSignalSocket(target, nfd);
 	closesocket(listenFD);
 
-	ServerInstance->SE->Blocking(connFD);
-	this->signal.connFD = connFD;
+	ServerInstance->SE->Blocking(sendFD);
+	this->connFD = sendFD;
 }
 
-void SocketThread::NotifyParent()
+void ThreadSignalData::Notify()
 {
 	char dummy = '*';
-	send(signal.connFD, &dummy, 1, 0);
+	send(connFD, &dummy, 1, 0);
 }
 
-SocketThread::~SocketThread()
+ThreadSignalData::~ThreadSignalData()
 {
-	if (signal.connFD >= 0)
+	if (connFD >= 0)
 	{
-		shutdown(signal.connFD, 2);
-		closesocket(signal.connFD);
+		shutdown(connFD, 2);
+		closesocket(connFD);
 	}
 }
@@ -44,7 +44,7 @@ UserManager::~UserManager()
 }
 
 /* add a client connection to the sockets list */
-void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
+void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server, bool admitted)
 {
 	/* NOTE: Calling this one parameter constructor for User automatically
 	 * allocates a new UUID and places it in the hash_map.
@@ -123,7 +123,12 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	 */
 	New->exempt = (ServerInstance->XLines->MatchesLine("E",New) != NULL);
 
-	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->GetIPString()))
+	/*
+	 * If the listener admitted the connection it has done the ban cache lookup and the Z-line
+	 * check already, a second lookup would count another hit or miss for the same connection.
+	 */
+	BanCacheHit* b = (admitted ? NULL : ServerInstance->BanCache->GetHit(New->client_sa));
+	if (b)
 	{
 		if (!b->Type.empty() && !New->exempt)
 		{
@@ -131,7 +136,10 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Positive hit for " + New->GetIPString());
 			if (!ServerInstance->Config->XLineMessage.empty())
 				New->WriteNotice("*** " +  ServerInstance->Config->XLineMessage);
-			this->QuitUser(New, b->Reason);
+			if (ServerInstance->Config->HideBans)
+				this->QuitUser(New, b->Type + "-Lined", &b->Reason);
+			else
+				this->QuitUser(New, b->Reason);
 			return;
 		}
 		else
@@ -139,7 +147,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Negative hit for " + New->GetIPString());
 		}
 	}
-	else
+	else if (!admitted)
 	{
 		if (!New->exempt)
 		{
@@ -153,7 +161,8 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 		}
 	}
 
-	if (!ServerInstance->SE->AddFd(eh, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE))
+	// Connections without an IOHook are handled by an I/O thread if those are enabled
+	if ((!ServerInstance->IOThreads.Add(eh)) && (!ServerInstance->SE->AddFd(eh, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE)))
 	{
 		ServerInstance->Logs->Log("USERS", LOG_DEBUG, "Internal error on new connection");
 		this->QuitUser(New, "Internal error handling connection");
@@ -184,21 +193,32 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 	}
 
 	user->quitting = true;
+	user->server->users.erase(user);
+
+	/* Quitting users are left out of NAMES lists */
+	for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+		(*i)->UpdateNamesCache(user);
 
+	std::string reason;
+	if (RemoveQuittingUser(user, quitreason, operreason, reason))
+		user->WriteCommonQuit(reason, operreason ? *operreason : reason);
+}
+
+bool UserManager::RemoveQuittingUser(User* user, const std::string& quitreason, const std::string* operreason, std::string& reason)
+{
 	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "QuitUser: %s=%s '%s'", user->uuid.c_str(), user->nick.c_str(), quitreason.c_str());
 	user->Write("ERROR :Closing link: (%s@%s) [%s]", user->ident.c_str(), user->host.c_str(), operreason ? operreason->c_str() : quitreason.c_str());
 
-	std::string reason;
 	reason.assign(quitreason, 0, ServerInstance->Config->Limits.MaxQuit);
 	if (!operreason)
 		operreason = &reason;
 
 	ServerInstance->GlobalCulls.AddItem(user);
 
-	if (user->registered == REG_ALL)
+	bool registered = (user->registered == REG_ALL);
+	if (registered)
 	{
 		FOREACH_MOD(OnUserQuit, (user, reason, *operreason));
-		user->WriteCommonQuit(reason, *operreason);
 	}
 	else
 		unregistered_count--;
@@ -207,6 +227,8 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 	{
 		LocalUser* lu = IS_LOCAL(user);
 		FOREACH_MOD(OnUserDisconnect, (lu));
+		// Closing the socket sends what is in the sendq, include the lines held by a WriteCoalescer
+		lu->FlushCoalesced();
 		lu->eh.Close();
 
 		if (lu->registered == REG_ALL)
@@ -221,6 +243,143 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 		ServerInstance->Logs->Log("USERS", LOG_DEFAULT, "ERROR: Nick not found in clientlist, cannot remove: " + user->nick);
 
 	uuidlist->erase(user->uuid);
+	return registered;
+}
+
+namespace
+{
+	/** Quit messages queued for a local user by UserManager::QuitUsers() */
+	struct QuitBatch
+	{
+		std::string lines;
+		unsigned int count;
+
+		QuitBatch() : count(0) { }
+
+		void Add(const std::string& line)
+		{
+			lines.append(line, 0, ServerInstance->Config->Limits.MaxLine - 2);
+			lines.append("\r\n");
+			count++;
+		}
+	};
+
+	typedef std::map<LocalUser*, QuitBatch> QuitBatchMap;
+
+	/** A channel seen by UserManager::QuitUsers() */
+	struct QuitChannel
+	{
+		/** Users leaving the channel */
+		std::vector<User*> quitters;
+
+		/** Local members who are staying, found by walking the member list only once */
+		std::vector<LocalUser*> locals;
+		bool scanned;
+
+		QuitChannel() : scanned(false) { }
+	};
+
+	typedef std::map<Channel*, QuitChannel> QuitChannelMap;
+
+	const std::vector<LocalUser*>& GetLocalMembers(Channel* chan, QuitChannelMap& chans)
+	{
+		QuitChannel& qc = chans[chan];
+		if (!qc.scanned)
+		{
+			const UserMembList* ulist = chan->GetUsers();
+			for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); ++i)
+			{
+				LocalUser* u = IS_LOCAL(i->first);
+				if (u && !u->quitting)
+					qc.locals.push_back(u);
+			}
+			qc.scanned = true;
+		}
+		return qc.locals;
+	}
+
+	/** Queue the quit message of a user for everyone who can see it, like User::WriteCommonQuit() */
+	void QueueCommonQuit(User* user, const std::string& normal_text, const std::string& oper_text, QuitBatchMap& batches, QuitChannelMap& chans)
+	{
+		already_sent_t uniq_id = ++LocalUser::already_sent_id;
+
+		const std::string normalMessage = ":" + user->GetFullHost() + " QUIT :" + normal_text;
+		const std::string operMessage = ":" + user->GetFullHost() + " QUIT :" + oper_text;
+
+		UserChanList include_c(user->chans);
+		std::map<User*,bool> exceptions;
+
+		FOREACH_MOD(OnBuildNeighborList, (user, include_c, exceptions));
+
+		for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		{
+			LocalUser* u = IS_LOCAL(i->first);
+			if (u && !u->quitting)
+			{
+				u->already_sent = uniq_id;
+				if (i->second)
+					batches[u].Add(u->IsOper() ? operMessage : normalMessage);
+			}
+		}
+		for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+		{
+			const std::vector<LocalUser*>& locals = GetLocalMembers(*v, chans);
+			for (std::vector<LocalUser*>::const_iterator i = locals.begin(); i != locals.end(); ++i)
+			{
+				LocalUser* u = *i;
+				if (!u->quitting && (u->already_sent != uniq_id))
+				{
+					u->already_sent = uniq_id;
+					batches[u].Add(u->IsOper() ? operMessage : normalMessage);
+				}
+			}
+		}
+	}
+}
+
+void UserManager::QuitUsers(const std::vector<User*>& users, const std::string& quitreason, const std::string* operreason)
+{
+	// Mark all of them first so none of them is sent the quit of another
+	std::vector<User*> quitters;
+	quitters.reserve(users.size());
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		User* user = *i;
+		if (user->quitting || IS_SERVER(user))
+			continue;
+
+		user->quitting = true;
+		user->server->users.erase(user);
+		quitters.push_back(user);
+	}
+
+	QuitBatchMap batches;
+	QuitChannelMap chans;
+	for (std::vector<User*>::const_iterator i = quitters.begin(); i != quitters.end(); ++i)
+	{
+		User* user = *i;
+		std::string reason;
+		if (RemoveQuittingUser(user, quitreason, operreason, reason))
+			QueueCommonQuit(user, reason, operreason ? *operreason : reason, batches, chans);
+
+		for (UCListIter c = user->chans.begin(); c != user->chans.end(); ++c)
+			chans[*c].quitters.push_back(user);
+	}
+
+	for (QuitBatchMap::iterator i = batches.begin(); i != batches.end(); ++i)
+	{
+		if (!i->first->quitting)
+			i->first->WriteLines(i->second.lines, i->second.count);
+	}
+
+	// The users leave their channels now instead of one by one when they are culled
+	for (QuitChannelMap::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	{
+		if (!i->second.quitters.empty())
+			i->first->DelUsers(i->second.quitters);
+	}
+	for (std::vector<User*>::const_iterator i = quitters.begin(); i != quitters.end(); ++i)
+		(*i)->chans.clear();
 }
 
 void UserManager::AddLocalClone(User *user)
@@ -290,6 +449,26 @@ void UserManager::ServerNoticeAll(const char* text, ...)
 	}
 }
 
+unsigned int UserManager::AllocateCapBit()
+{
+	for (unsigned int bit = 0; bit < usedcapbits.size(); bit++)
+	{
+		if (!usedcapbits[bit])
+		{
+			usedcapbits.set(bit);
+			return bit;
+		}
+	}
+	throw ModuleException("Too many capabilities, the limit is " + ConvToStr(usedcapbits.size()));
+}
+
+void UserManager::FreeCapBit(unsigned int bit)
+{
+	usedcapbits.reset(bit);
+	for (LocalUserList::const_iterator i = local_users.begin(); i != local_users.end(); ++i)
+		(*i)->caps.reset(bit);
+}
+
 void UserManager::GarbageCollect()
 {
 	// Reset the already_sent IDs so we don't wrap it around and drop a message
@@ -28,6 +28,13 @@
 #include "socketengine.h"
 #include "xline.h"
 #include "bancache.h"
+#include "slab.h"
+
+namespace
+{
+	SlabAllocator localuserslab("LocalUser", sizeof(LocalUser));
+	SlabAllocator remoteuserslab("RemoteUser", sizeof(RemoteUser));
+}
 
 already_sent_t LocalUser::already_sent_id = 0;
 
@@ -82,6 +89,19 @@ User::User(const std::string& uid, Server* srv, int type)
 
 	if (!ServerInstance->Users->uuidlist->insert(std::make_pair(uuid, this)).second)
 		throw CoreException("Duplicate UUID "+std::string(uuid)+" in User constructor");
+
+	if (type != USERTYPE_SERVER)
+		server->users.push_front(this);
+}
+
+void* LocalUser::operator new(size_t size)
+{
+	return localuserslab.Allocate(size);
+}
+
+void LocalUser::operator delete(void* ptr, size_t size)
+{
+	localuserslab.Deallocate(ptr, size);
 }
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
@@ -260,11 +280,21 @@ void UserIOHandler::OnDataReady()
 	if (!user->HasPrivPermission("users/flood/no-fakelag"))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
-	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
+	// Commands are not processed while a long reply is being sent so their replies stay in order
+	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax && user->replyproducers.empty())
 	{
 		std::string line;
-		line.reserve(ServerInstance->Config->Limits.MaxLine);
 		std::string::size_type qpos = 0;
+		if (GetIOThread())
+		{
+			// The I/O thread already split the lines and replaced the bad characters
+			qpos = recvq.find('\n');
+			if (qpos == std::string::npos)
+				return;
+			line.assign(recvq, 0, qpos++);
+			goto eol_found;
+		}
+		line.reserve(ServerInstance->Config->Limits.MaxLine);
 		while (qpos < recvq.length())
 		{
 			char c = recvq[qpos++];
@@ -285,7 +315,7 @@ void UserIOHandler::OnDataReady()
 		return;
 eol_found:
 		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
+		recvq.erase(0, qpos);
 
 		// TODO should this be moved to when it was inserted in recvq?
 		ServerInstance->stats->statsRecv += qpos;
@@ -304,7 +334,7 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 {
 	if (user->quitting_sendq)
 		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
+	if (!user->quitting && user->GetSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
 		!user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		user->quitting_sendq = true;
@@ -318,6 +348,18 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 	WriteData(data);
 }
 
+void UserIOHandler::OnDataSent()
+{
+	if (user->replyproducers.empty())
+		return;
+
+	user->SendPendingReplies();
+
+	// Process the commands which arrived while the replies were being sent
+	if (user->replyproducers.empty() && !recvq.empty())
+		OnDataReady();
+}
+
 void UserIOHandler::OnError(BufferedSocketError)
 {
 	ServerInstance->Users->QuitUser(user, getError());
@@ -349,6 +391,9 @@ CullResult LocalUser::cull()
 		ServerInstance->Logs->Log("USERS", LOG_DEFAULT, "ERROR: LocalUserIter does not point to a valid entry for " + this->nick);
 
 	ClearInvites();
+	for (std::deque<ReplyProducer*>::const_iterator i = replyproducers.begin(); i != replyproducers.end(); ++i)
+		delete *i;
+	replyproducers.clear();
 	eh.cull();
 	return User::cull();
 }
@@ -613,7 +658,7 @@ void LocalUser::FullConnect()
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->GetServerPort(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString().c_str(), this->fullname.c_str());
 	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding NEGATIVE hit for " + this->GetIPString());
-	ServerInstance->BanCache->AddHit(this->GetIPString(), "", "");
+	ServerInstance->BanCache->AddHit(this->client_sa, "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
 }
@@ -625,6 +670,10 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+
+	/* NAMES entries may contain the nick and host */
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->UpdateNamesCache(this);
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -844,14 +893,105 @@ void LocalUser::Write(const std::string& text)
 
 	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	if (WriteCoalescer::Queue(this))
+	{
+		coalesced.append(text).append(wide_newline);
+	}
+	else
+	{
+		eh.AddWriteBuf(text);
+		eh.AddWriteBuf(wide_newline);
+	}
 
 	ServerInstance->stats->statsSent += text.length() + 2;
 	this->bytes_out += text.length() + 2;
 	this->cmds_out++;
 }
 
+void LocalUser::WriteLines(const std::string& lines, unsigned int count)
+{
+	if (lines.empty() || !ServerInstance->SE->BoundsCheckFd(&eh))
+		return;
+
+	// Log and crop every line like Write() does, the lines are only copied if one is too long
+	const std::string::size_type maxline = ServerInstance->Config->Limits.MaxLine - 2;
+	std::string cropped;
+	std::string::size_type copied = 0;
+	for (std::string::size_type pos = 0; pos < lines.length(); )
+	{
+		std::string::size_type eol = lines.find(wide_newline, pos);
+		if (eol == std::string::npos)
+			eol = lines.length();
+
+		std::string::size_type len = std::min(eol - pos, maxline);
+		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)len, lines.data() + pos);
+		if (len < eol - pos)
+		{
+			cropped.append(lines, copied, pos + len - copied).append(wide_newline);
+			copied = std::min(eol + 2, lines.length());
+		}
+		pos = eol + 2;
+	}
+
+	if (copied)
+		cropped.append(lines, copied, std::string::npos);
+	const std::string& out = (copied ? cropped : lines);
+
+	if (WriteCoalescer::Queue(this))
+		coalesced.append(out);
+	else
+		eh.AddWriteBuf(out);
+
+	ServerInstance->stats->statsSent += out.length();
+	this->bytes_out += out.length();
+	this->cmds_out += count;
+}
+
+void LocalUser::FlushCoalesced()
+{
+	if (coalesced.empty())
+		return;
+
+	// Release the memory of the buffer, it can be large after a netburst
+	std::string lines;
+	lines.swap(coalesced);
+	if (ServerInstance->SE->BoundsCheckFd(&eh))
+		eh.AddWriteBuf(lines);
+}
+
+WriteCoalescer* WriteCoalescer::active = NULL;
+
+WriteCoalescer::WriteCoalescer()
+{
+	if (!active)
+		active = this;
+}
+
+WriteCoalescer::~WriteCoalescer()
+{
+	if (active != this)
+		return;
+
+	active = NULL;
+	for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+		(*i)->FlushCoalesced();
+}
+
+bool WriteCoalescer::Queue(LocalUser* user)
+{
+	if (!active)
+		return false;
+
+	if (user->coalesced.empty())
+		active->users.push_back(user);
+	else if (user->coalesced.length() >= user->MyClass->GetSendqSoftMax())
+	{
+		// Let the sendq limits see the lines, the user is already in the list
+		user->FlushCoalesced();
+	}
+	return true;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -1040,6 +1180,16 @@ void LocalUser::SendText(const std::string& line)
 	Write(line);
 }
 
+void* RemoteUser::operator new(size_t size)
+{
+	return remoteuserslab.Allocate(size);
+}
+
+void RemoteUser::operator delete(void* ptr, size_t size)
+{
+	remoteuserslab.Deallocate(ptr, size);
+}
+
 void RemoteUser::SendText(const std::string& line)
 {
 	ServerInstance->PI->PushToClient(this, line);
@@ -1170,6 +1320,53 @@ void User::SendAll(const char* command, const char* text, ...)
 	}
 }
 
+void User::AddReplyProducer(ReplyProducer* producer)
+{
+	while (producer->Produce(this))
+		;
+	delete producer;
+}
+
+void LocalUser::AddReplyProducer(ReplyProducer* producer)
+{
+	replyproducers.push_back(producer);
+	SendPendingReplies();
+}
+
+void LocalUser::SendPendingReplies()
+{
+	unsigned long sendqmax = ULONG_MAX;
+	if (!HasPrivPermission("users/flood/increased-buffers"))
+		sendqmax = MyClass->GetSendqSoftMax();
+
+	// Always send something if the sendq is empty, even if the soft limit is 0
+	while (!replyproducers.empty() && !quitting && (GetSendQSize() < sendqmax || !GetSendQSize()))
+	{
+		ReplyProducer* producer = replyproducers.front();
+		if (!producer->Produce(this))
+		{
+			replyproducers.pop_front();
+			delete producer;
+		}
+	}
+}
+
+void LocalUser::FinishReplyProducers(Module* mod)
+{
+	// Complete everything up to the last reply of the module so the order of the replies is kept
+	size_t count = 0;
+	for (size_t i = 0; i < replyproducers.size(); i++)
+	{
+		if (replyproducers[i]->creator == mod)
+			count = i + 1;
+	}
+
+	std::vector<ReplyProducer*> finish(replyproducers.begin(), replyproducers.begin() + count);
+	replyproducers.erase(replyproducers.begin(), replyproducers.begin() + count);
+	for (std::vector<ReplyProducer*>::const_iterator i = finish.begin(); i != finish.end(); ++i)
+		User::AddReplyProducer(*i);
+}
+
 /*
  * Sets a user's connection class.
  * If the class name is provided, it will be used. Otherwise, the class will be guessed using host/ip/ident/etc.